@@ -1,6 +1,7 @@
 #include "http.h"
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,27 +10,38 @@
 
 #define  BUFF_SZ            1024
 #define  MAX_REOPEN_TRIES   5
+#define  REQ_SZ             512
+#define  MAX_PIPE_DEPTH     64
+#define  PIPE_BUFF_SZ       8192        //longest response header we can pipeline past
 
 char recv_buff[BUFF_SZ];
 
-char *generate_cc_request(const char *host, int port, const char *path) {
-	static char req[512] = {0};
+//formats the GET for path into req, returns its length
+int build_request(char *req, const char *host, const char *path) {
 	int offset = 0;
-	
+
     //note that all paths should start with "/" when passed in
-	offset += sprintf((char *)(req + offset),"GET %s HTTP/1.1\r\n", path);
-	offset += sprintf((char *)(req + offset),"Host: %s\r\n", host);
-	offset += sprintf((char *)(req + offset),"Connection: Keep-Alive\r\n");
-	offset += sprintf((char *)(req + offset),"\r\n");
+	offset += snprintf(req + offset, REQ_SZ - offset, "GET %s HTTP/1.1\r\n", path);
+	offset += snprintf(req + offset, REQ_SZ - offset, "Host: %s\r\n", host);
+	offset += snprintf(req + offset, REQ_SZ - offset, "Connection: Keep-Alive\r\n");
+	offset += snprintf(req + offset, REQ_SZ - offset, "\r\n");
 
 	printf("DEBUG: %s", req);
+	return offset < REQ_SZ ? offset : REQ_SZ - 1;
+}
+
+char *generate_cc_request(const char *host, int port, const char *path) {
+	static char req[REQ_SZ] = {0};
+
+	build_request(req, host, path);
 	return req;
 }
 
 
 void print_usage(char *exe_name) {
-    fprintf(stderr, "Usage: %s <hostname> <port> <path...>\n", exe_name);
+    fprintf(stderr, "Usage: %s [-p depth] <hostname> <port> <path...>\n", exe_name);
     fprintf(stderr, "Using default host %s, port %d  and path [\\]\n", DEFAULT_HOST, DEFAULT_PORT); 
+    fprintf(stderr, "  -p depth  pipelines up to depth requests at a time instead of one by one\n");
 }
 
 int reopen_socket(const char *host, uint16_t port) {
@@ -174,6 +186,151 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource) {
     return sock;
 }
 
+//--------------------------------------------------------------------------------
+// PIPELINING (-p depth)
+//
+// Instead of a send and a full response per resource, up to depth GETs go out
+// together in one sendmsg() (a writev() that cannot raise SIGPIPE), and the
+// responses are read back in the order the requests went.  Responses can now
+// share a recv(), so whatever follows the end of one body is kept in a
+// pipe_stream for the next one.  A keep-alive server may still close the
+// socket at any point, in which case the requests it did not answer are sent
+// again on a new connection.
+//--------------------------------------------------------------------------------
+typedef struct pipe_stream {
+    char    data[PIPE_BUFF_SZ];
+    int     have;                       //bytes in data not yet processed
+} pipe_stream;
+
+//sends every request in iov, picking up where a short write left off
+static int send_requests(int sock, struct iovec *iov, int cnt) {
+    struct msghdr msg = {0};
+
+    while (cnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = cnt;
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            perror("pipelined send failed");
+            return -1;
+        }
+        while (cnt > 0 && sent >= (ssize_t)iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+//recv() at most BUFF_SZ more bytes into the stream, 0 or less if the server closed the socket
+static int fill_stream(int sock, pipe_stream *ps) {
+    int room = sizeof(ps->data) - ps->have;
+
+    int bytes_recvd = recv(sock, ps->data + ps->have, room < BUFF_SZ ? room : BUFF_SZ, 0);
+    if (bytes_recvd > 0) {
+        ps->have += bytes_recvd;
+    }
+    return bytes_recvd;
+}
+
+//drops the first n bytes of the stream
+static void consume_stream(pipe_stream *ps, int n) {
+    ps->have -= n;
+    memmove(ps->data, ps->data + n, ps->have);
+}
+
+//prints the next response in the stream, returns -1 if the connection ends before all of it came
+static int read_pipelined_response(int sock, pipe_stream *ps) {
+    char *header_end;
+
+    while ((header_end = strnstr(ps->data, HTTP_HEADER_END, ps->have)) == NULL) {
+        if (ps->have == sizeof(ps->data)) {
+            fprintf(stderr, "HTTP header does not fit in %d bytes\n", PIPE_BUFF_SZ);
+            return -1;
+        }
+        if (fill_stream(sock, ps) <= 0) {
+            return -1;
+        }
+    }
+
+    int header_len = (header_end - ps->data) + strlen(HTTP_HEADER_END);
+    int content_len = get_http_content_len(ps->data, header_len);
+    int total_bytes = 0;
+
+    consume_stream(ps, header_len);
+    while (total_bytes < content_len) {
+        if (ps->have == 0 && fill_stream(sock, ps) <= 0) {
+            return -1;
+        }
+        //anything past this body is the start of the next response
+        int body = content_len - total_bytes < ps->have ? content_len - total_bytes : ps->have;
+        fprintf(stdout, "%.*s", body, ps->data);
+        total_bytes += body;
+        consume_stream(ps, body);
+    }
+
+    fprintf(stdout, "\n\nOK\n");
+    fprintf(stdout, "TOTAL BYTES: %d\n", total_bytes);
+    return 0;
+}
+
+/*
+ * Requests every resource, depth at a time, over sock.  Returns the socket
+ * still open at the end, or -1 if the server could not be reached or kept
+ * closing the connection without answering anything.
+ */
+int submit_pipelined(int sock, const char *host, uint16_t port, char **resources, int count, int depth) {
+    static char reqs[MAX_PIPE_DEPTH][REQ_SZ];
+    static pipe_stream ps;
+    struct iovec iov[MAX_PIPE_DEPTH];
+    int done = 0;
+    int fruitless = 0;
+
+    ps.have = 0;
+    if (sock < 0) {
+        sock = reopen_socket(host, port);
+    }
+    while (done < count && sock >= 0) {
+        int batch = count - done < depth ? count - done : depth;
+        for (int i = 0; i < batch; i++) {
+            iov[i].iov_base = reqs[i];
+            iov[i].iov_len = build_request(reqs[i], host, resources[done + i]);
+        }
+
+        int answered = 0;
+        if (send_requests(sock, iov, batch) == 0) {
+            while (answered < batch) {
+                fprintf(stdout, "\n\nProcessing request for %s\n\n", resources[done + answered]);
+                if (read_pipelined_response(sock, &ps) < 0) {
+                    break;
+                }
+                answered++;
+            }
+        }
+        done += answered;
+        if (answered == batch) {
+            continue;
+        }
+
+        //the server closed on us part way, whatever it did not answer goes again on a new socket
+        fruitless = answered > 0 ? 0 : fruitless + 1;
+        close(sock);
+        if (fruitless >= MAX_REOPEN_TRIES) {
+            fprintf(stderr, "Server keeps closing the connection, %d requests unanswered\n", count - done);
+            return -1;
+        }
+        fprintf(stderr, "Server closed the connection, resending %d unanswered requests\n", batch - answered);
+        ps.have = 0;
+        sock = reopen_socket(host, port);
+    }
+    return sock;
+}
+
 int real_main(int argc, char *argv[]) {
     int sock;
 
@@ -181,6 +338,22 @@ int real_main(int argc, char *argv[]) {
     uint16_t   port = DEFAULT_PORT;
     char       *resource = DEFAULT_PATH;
     int        remaining_args = 0;
+    int        depth = 0;
+    int        option;
+
+    //an optional -p depth comes before the host, the rest of the arguments stay where they were
+    while ((option = getopt(argc, argv, "+p:")) != -1) {
+        if (option == 'p' && atoi(optarg) > 0 && atoi(optarg) <= MAX_PIPE_DEPTH) {
+            depth = atoi(optarg);
+        } else {
+            fprintf(stderr, "NOTE: -p takes a pipeline depth from 1 to %d\n", MAX_PIPE_DEPTH);
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
 
     //YOU DONT NEED TO DO ANYTHING OR MODIFY ANYTHING IN MAIN().  MAKE SURE YOU UNDERSTAND
     //THE CODE HOWEVER
@@ -200,7 +373,12 @@ int real_main(int argc, char *argv[]) {
         }
         fprintf(stdout, "Running with host = %s, port = %d\n", host, port);
         remaining_args = argc-3;
-        for (int i = 0; i < remaining_args; i++) {
+        if (depth > 0) {
+            //the socket above went to the default host, the pipeline needs one to this host
+            server_disconnect(sock);
+            sock = submit_pipelined(-1, host, port, argv + 3, remaining_args, depth);
+        }
+        for (int i = 0; depth == 0 && i < remaining_args; i++) {
             resource = argv[3+i];
             fprintf(stdout, "\n\nProcessing request for %s\n\n", resource);
             sock = submit_request(sock, host, port, resource);
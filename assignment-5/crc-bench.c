@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "du-proto.h"
+#include "du-crc.h"
+
+/*
+ * Microbenchmark for the per datagram checksum.  Times dp_crc32c() over a
+ * full size dp datagram against the two costs it rides on: a bare loopback
+ * sendto() (the cheapest thing dpsendraw() can possibly do) and a full
+ * dpsenddgram() step, i.e. the send plus waiting for the peer's ACK.  Both
+ * the checksum on send and the check on receive are counted.
+ */
+#define BENCH_CRC_ITERS     2000000
+#define BENCH_SEND_ITERS    200000
+#define BENCH_ACK_ITERS     50000
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_crc(uint32_t (*fn)(const void *, size_t), const char *buff, int iters) {
+    volatile uint32_t sink = 0;
+    double start = now_ns();
+    for (int i = 0; i < iters; i++)
+        sink += fn(buff, DP_MAX_DGRAM_SZ);
+    (void)sink;
+    return (now_ns() - start) / iters;
+}
+
+static int bound_socket(struct sockaddr_in *addr) {
+    socklen_t len = sizeof(*addr);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, (struct sockaddr *)addr, sizeof(*addr)) < 0 ||
+        getsockname(sock, (struct sockaddr *)addr, &len) < 0) {
+        perror("crc-bench: socket setup failed");
+        exit(-1);
+    }
+    return sock;
+}
+
+static double time_sendto(const char *buff) {
+    struct sockaddr_in addr, txAddr;
+    int rx = bound_socket(&addr);
+    int tx = bound_socket(&txAddr);
+
+    char drain[DP_MAX_DGRAM_SZ];
+    double start = now_ns();
+    for (int i = 0; i < BENCH_SEND_ITERS; i++) {
+        sendto(tx, buff, DP_MAX_DGRAM_SZ, 0, (struct sockaddr *)&addr, sizeof(addr));
+        //keep the receive queue from filling up so every send is delivered
+        while (recv(rx, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+            ;
+    }
+    double per = (now_ns() - start) / BENCH_SEND_ITERS;
+    close(rx);
+    close(tx);
+    return per;
+}
+
+//the peer side of a stop-and-wait step: every datagram gets a dp_pdu ACK back
+static void *ack_peer(void *arg) {
+    int sock = *(int *)arg;
+    char rbuff[DP_MAX_DGRAM_SZ];
+    dp_pdu ack = {0};
+    struct sockaddr_in from;
+    socklen_t len;
+
+    ack.mtype = DP_MT_SNDACK;
+    for (int i = 0; i < BENCH_ACK_ITERS; i++) {
+        len = sizeof(from);
+        recvfrom(sock, rbuff, sizeof(rbuff), 0, (struct sockaddr *)&from, &len);
+        sendto(sock, &ack, sizeof(ack), 0, (struct sockaddr *)&from, len);
+    }
+    return NULL;
+}
+
+static double time_send_ack(const char *buff) {
+    struct sockaddr_in peerAddr, txAddr;
+    int peer = bound_socket(&peerAddr);
+    int tx = bound_socket(&txAddr);
+    dp_pdu ack;
+    pthread_t tid;
+
+    pthread_create(&tid, NULL, ack_peer, &peer);
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ACK_ITERS; i++) {
+        sendto(tx, buff, DP_MAX_DGRAM_SZ, 0, (struct sockaddr *)&peerAddr, sizeof(peerAddr));
+        recv(tx, &ack, sizeof(ack), 0);
+    }
+    double per = (now_ns() - start) / BENCH_ACK_ITERS;
+    pthread_join(tid, NULL);
+    close(peer);
+    close(tx);
+    return per;
+}
+
+int main() {
+    static char buff[DP_MAX_DGRAM_SZ];
+
+    for (int i = 0; i < sizeof(buff); i++)
+        buff[i] = rand();
+
+    //both implementations must agree, including on the standard check value
+    if (dp_crc32c("123456789", 9) != 0xE3069283 || dp_crc32c(buff, sizeof(buff)) != dp_crc32c_sw(buff, sizeof(buff))) {
+        printf("crc32c self check FAILED\n");
+        return 1;
+    }
+
+    double hw = time_crc(dp_crc32c, buff, BENCH_CRC_ITERS);
+    double sw = time_crc(dp_crc32c_sw, buff, BENCH_CRC_ITERS / 10);
+    double snd = time_sendto(buff);
+    double sndAck = time_send_ack(buff);
+
+    printf("datagram size      : %d bytes\n", (int)DP_MAX_DGRAM_SZ);
+    printf("crc32c (%s)   : %8.1f ns/dgram  %6.2f GB/s\n", dp_crc32c_hw_available() ? "sse4.2" : "table ",
+           hw, DP_MAX_DGRAM_SZ / hw);
+    printf("crc32c (table)    : %8.1f ns/dgram  %6.2f GB/s\n", sw, DP_MAX_DGRAM_SZ / sw);
+    printf("loopback sendto() : %8.1f ns/dgram\n", snd);
+    printf("send + wait ACK   : %8.1f ns/dgram\n", sndAck);
+    //one checksum when sending, one verification when receiving
+    printf("checksum share of bare sendto()    : %.3f%%\n", 100.0 * 2 * hw / (2 * hw + snd));
+    printf("checksum share of a dpsenddgram()  : %.3f%%\n", 100.0 * 2 * hw / (2 * hw + sndAck));
+    return 0;
+}
@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "du-proto.h"
+#include "du-crc.h"
+#include "dp-impair.h"
+#include "dp-sim.h"
+#include "dp-pool.h"
+
+/*
+ * Loopback benchmark for du-proto.  For every combination of message size,
+ * loss rate and window it connects a client and a server thread over
+ * 127.0.0.1, sends messages with dpsend() for about -t milliseconds (at
+ * least one), and reports:
+ *
+ *      MB/s        payload bytes delivered per second (1 MB = 10^6 bytes)
+ *      pkts/s      datagrams both ends put on the wire per second
+ *      cpu ns/B    user + system time of the whole process per payload byte
+ *      p50..p999   time from dpsend() of a message to dprecv() returning it
+ *
+ * Loss is applied with dp-impair in both directions.  With -S the two ends
+ * talk over the simulated link of dp-sim.h instead of a socket, and every
+ * time above except the CPU is virtual, so a slow, long link costs little
+ * wall time and reruns give identical numbers; -l still sets the loss.
+ * -M offers shared memory at connect time (dp-shm.h), so the loopback
+ * pair talks through the rings instead; there is no loss to apply there.
+ * -b sends a fixed volume per cell instead of sending for -t.  -B moves
+ * the messages with the byte stream calls, dp_write() and dp_flush() on
+ * one end and dp_read() on the other, through BENCH_STREAM_SZ buffers
+ * however big the messages are.  The window column is how many fragments
+ * of a message may be unacknowledged at once (dp_set_window()); 1 is stop
+ * and wait, and above it a loopback pair without loss sends each window
+ * with one GSO sendmsg().  Results are written to -o as CSV, or JSON lines
+ * with -j, one row per cell, so a protocol change can be diffed against a
+ * saved baseline.  A readable summary goes to stderr as the cells finish.
+ *
+ * -F n runs a CONNECT flood instead of the cells: a dpaccept() listener is
+ * sent n CONNECTs over -t milliseconds from a socket that never answers,
+ * while a real client dpconnect()s every BENCH_FLOOD_CLIENT_MS, and every
+ * session the listener makes is kept, as a server would until it timed
+ * out.  That runs once without and once with dp_set_cookies(), and each
+ * row has the sessions the flood got (real clients' not counted) and the
+ * pool memory held, how many real clients got in and how long their
+ * connects took.
+ */
+#define BENCH_DEF_SIZES     "64,1K,16K,256K,4M,64M"
+#define BENCH_DEF_LOSS      "0,1"
+#define BENCH_DEF_WINDOWS   "1"
+#define BENCH_DEF_MS        1000
+#define BENCH_DEF_OUT       "dp-bench.csv"
+#define BENCH_MAX_AXIS      16
+#define BENCH_LOSS_SEED     1
+#define BENCH_STREAM_SZ     (64 * 1024)     //what -B reads and writes at a time
+#define BENCH_FLOOD_TICK_MS 1               //the -F flood is sent in a burst this often
+#define BENCH_FLOOD_CLIENT_MS 5             //and a real client connects this often meanwhile
+
+static int useSim = 0;              //-S given, run over dp-sim instead of loopback
+static int useShm = 0;              //-M given, the loopback pair moves onto shared memory
+static dp_sim_cfg simCfg;
+static const char *linkName = "loopback";
+static long long volume = 0;        //-b bytes per cell, 0 to send for -t instead
+static int useStream = 0;           //-B given, dp_write()/dp_read() instead of dpsend()/dprecv()
+static long flood = 0;              //-F CONNECTs to flood a listener with, 0 for the usual cells
+
+//every message starts with this so the receiver can time it
+typedef struct bench_hdr {
+    unsigned long long  sent_ns;
+    unsigned int        last;
+    unsigned int        pad;
+} bench_hdr;
+
+typedef struct bench_cell {
+    int                 msg_sz;
+    double              loss;
+    int                 window;
+
+    //filled in by the server thread
+    long                msgs;
+    long long           bytes;
+    unsigned long long  first_ns;
+    unsigned long long  last_ns;
+    unsigned long long *lat;
+    long                lat_cap;
+    int                 failed;
+
+    //filled in once both ends are done
+    dp_stats            cli_stats;
+    dp_stats            svr_stats;
+} bench_cell;
+
+typedef struct bench_server {
+    dp_connp            dpc;
+    bench_cell         *cell;
+} bench_server;
+
+static unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned long long cpu_ns() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+//"64", "16K", "4M" or "2G", the suffixes being powers of 1024
+static long long parse_size(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    if (*end == 'K' || *end == 'k')
+        v <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        v <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        v <<= 30, end++;
+    return *end == '\0' ? v : -1;
+}
+
+//splits a comma separated list into out[], returning how many there were or -1
+static int parse_list(const char *spec, char out[][32]) {
+    char copy[256];
+    char *save, *tok;
+    int n = 0;
+
+    snprintf(copy, sizeof(copy), "%s", spec);
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if (n == BENCH_MAX_AXIS)
+            return -1;
+        snprintf(out[n++], 32, "%s", tok);
+    }
+    return n;
+}
+
+static int record_latency(bench_cell *cell, unsigned long long lat) {
+    if (cell->msgs == cell->lat_cap) {
+        long cap = cell->lat_cap ? cell->lat_cap * 2 : 1024;
+        unsigned long long *grown = realloc(cell->lat, cap * sizeof(*grown));
+        if (grown == NULL)
+            return -1;
+        cell->lat = grown;
+        cell->lat_cap = cap;
+    }
+    cell->lat[cell->msgs++] = lat;
+    return 0;
+}
+
+/*
+ *  One message of the stream, msg_sz bytes however dp_read() cuts them up.
+ *  The header may come in pieces too.  Returns msg_sz or the error.
+ */
+static int stream_recv(dp_connp dpc, char *buff, int msg_sz) {
+    int got = 0;
+
+    while (got < msg_sz) {
+        int room = BENCH_STREAM_SZ - (int)sizeof(bench_hdr);
+        int want = msg_sz - got < room ? msg_sz - got : room;
+        //the header goes to the front of buff, the rest over whatever follows it
+        int rc = dp_read(dpc, got < (int)sizeof(bench_hdr) ? buff + got : buff + sizeof(bench_hdr),
+                         got < (int)sizeof(bench_hdr) ? (int)sizeof(bench_hdr) - got : want);
+        if (rc <= 0)
+            return rc < 0 ? rc : DP_CONNECTION_CLOSED;
+        got += rc;
+    }
+    return got;
+}
+
+//and the sending end, the body coming out of a buffer of BENCH_STREAM_SZ at most
+static int stream_send(dp_connp dpc, const char *msg, int msg_sz) {
+    int rc = dp_write(dpc, msg, sizeof(bench_hdr));
+
+    for (int left = msg_sz - sizeof(bench_hdr); rc >= 0 && left > 0; ) {
+        int n = left < BENCH_STREAM_SZ - (int)sizeof(bench_hdr) ? left : BENCH_STREAM_SZ - (int)sizeof(bench_hdr);
+        rc = dp_write(dpc, msg + sizeof(bench_hdr), n);
+        left -= n;
+    }
+    return rc < 0 ? rc : dp_flush(dpc);
+}
+
+static void *bench_server_thread(void *arg) {
+    bench_server *svr = arg;
+    bench_cell *cell = svr->cell;
+    char *buff = malloc(useStream ? BENCH_STREAM_SZ : cell->msg_sz);
+    char done = 1;
+
+    if (buff == NULL || dplisten(svr->dpc) <= 0) {
+        cell->failed = 1;
+        free(buff);
+        return NULL;
+    }
+
+    while (1) {
+        int rc = useStream ? stream_recv(svr->dpc, buff, cell->msg_sz) : dprecv(svr->dpc, buff, cell->msg_sz);
+        unsigned long long now = dp_clock_ns(svr->dpc);
+        bench_hdr hdr;
+
+        if (rc < (int)sizeof(bench_hdr)) {
+            cell->failed = 1;
+            break;
+        }
+        memcpy(&hdr, buff, sizeof(hdr));
+        if (cell->msgs == 0)
+            cell->first_ns = hdr.sent_ns;
+        cell->last_ns = now;
+        cell->bytes += rc;
+        if (record_latency(cell, now - hdr.sent_ns) < 0) {
+            cell->failed = 1;
+            break;
+        }
+        if (hdr.last)
+            break;
+    }
+
+    //the reply tells the client its last message got through, then we wait for its close
+    if (!cell->failed && dpsend(svr->dpc, &done, sizeof(done)) == sizeof(done))
+        dprecv(svr->dpc, buff, sizeof(done));
+    dp_get_stats(svr->dpc, &cell->svr_stats);
+    free(buff);
+
+    //a simulated clock waits on every end that is not blocked, so ours goes as soon as we are done with it
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    dpclose(svr->dpc);
+    svr->dpc = NULL;
+    return NULL;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+//nearest rank percentile of the sorted samples, in microseconds
+static double pct_us(const unsigned long long *sorted, long n, double pct) {
+    if (n == 0)
+        return 0;
+    long rank = (long)(pct / 100.0 * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1] / 1000.0;
+}
+
+//both ends of a loopback UDP connection, the loss coming from dp-impair
+static int loopback_pair(bench_cell *cell, dp_connp *server, dp_connp *client) {
+    dp_impair_cfg impair = {0};
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    impair.drop = cell->loss;
+    impair.seed = BENCH_LOSS_SEED;
+    dp_impair_set_default(&impair);
+
+    *server = dpServerInit(0);
+    if (*server == NULL || getsockname((*server)->udp_sock, (struct sockaddr *)&addr, &len) < 0)
+        return -1;
+    *client = dpClientInit("127.0.0.1", ntohs(addr.sin_port));
+    if (*client == NULL) {
+        dpclose(*server);
+        return -1;
+    }
+    if (useShm)
+        dp_offer_shm(*client);
+    return 0;
+}
+
+static int run_cell(bench_cell *cell, char *msg, int budget_ms) {
+    bench_server svr = {0};
+    dp_sim *sim = NULL;
+    dp_connp cli;
+    pthread_t tid;
+    char done;
+
+    svr.cell = cell;
+    dp_set_window(cell->window);
+    if (useSim) {
+        dp_sim_cfg cfg = simCfg;
+        cfg.loss = cell->loss;
+        if ((sim = dp_sim_new(&cfg)) == NULL || dp_sim_pair(sim, &svr.dpc, &cli) < 0)
+            return -1;
+    } else if (loopback_pair(cell, &svr.dpc, &cli) < 0) {
+        return -1;
+    }
+
+    pthread_create(&tid, NULL, bench_server_thread, &svr);
+    if (dpconnect(cli) < 0) {
+        pthread_cancel(tid);
+        cell->failed = 1;
+    } else {
+        unsigned long long stop = dp_clock_ns(cli) + budget_ms * 1000000ull;
+        long long sent = 0;
+        bench_hdr hdr = {0};
+
+        while (!hdr.last) {
+            hdr.sent_ns = dp_clock_ns(cli);
+            sent += cell->msg_sz;
+            hdr.last = volume ? sent >= volume : hdr.sent_ns >= stop;
+            memcpy(msg, &hdr, sizeof(hdr));
+            if ((useStream ? stream_send(cli, msg, cell->msg_sz) : dpsend(cli, msg, cell->msg_sz)) < 0) {
+                //the server may be parked in dprecv() for good, do not wait on it
+                pthread_cancel(tid);
+                cell->failed = 1;
+                break;
+            }
+        }
+        if (!cell->failed && dprecv(cli, &done, sizeof(done)) == sizeof(done)) {
+            dp_get_stats(cli, &cell->cli_stats);
+            dpdisconnect(cli);      //frees cli
+            cli = NULL;
+        }
+    }
+    pthread_join(tid, NULL);
+
+    if (cli != NULL) {
+        dp_get_stats(cli, &cell->cli_stats);
+        dpclose(cli);
+    }
+    if (svr.dpc != NULL)
+        dpclose(svr.dpc);
+    if (sim != NULL)
+        dp_sim_free(sim);
+    return cell->failed ? -1 : 0;
+}
+
+static void report(FILE *out, int json, bench_cell *cell, unsigned long long cpu) {
+    double secs = (cell->last_ns - cell->first_ns) / 1e9;
+    unsigned long long pkts = cell->cli_stats.pkts_sent + cell->svr_stats.pkts_sent;
+    unsigned long long rexmit = cell->cli_stats.retransmits + cell->svr_stats.retransmits;
+    unsigned long long timeouts = cell->cli_stats.timeouts + cell->svr_stats.timeouts;
+    double mbps = 0, pps = 0, cpb = 0;
+
+    if (secs > 0) {
+        mbps = cell->bytes / secs / 1e6;
+        pps = pkts / secs;
+    }
+    if (cell->bytes > 0)
+        cpb = (double)cpu / cell->bytes;
+
+    qsort(cell->lat, cell->msgs, sizeof(*cell->lat), cmp_ull);
+    double p50 = pct_us(cell->lat, cell->msgs, 50);
+    double p99 = pct_us(cell->lat, cell->msgs, 99);
+    double p999 = pct_us(cell->lat, cell->msgs, 99.9);
+
+    if (json)
+        fprintf(out, "{\"link\":\"%s\",\"msg_size\":%d,\"loss_pct\":%g,\"window\":%d,\"ok\":%s,\"msgs\":%ld,"
+                     "\"bytes\":%lld,\"secs\":%.6f,\"mb_per_s\":%.3f,\"pkts_per_s\":%.1f,"
+                     "\"cpu_ns_per_byte\":%.3f,\"lat_p50_us\":%.1f,\"lat_p99_us\":%.1f,"
+                     "\"lat_p999_us\":%.1f,\"retransmits\":%llu,\"timeouts\":%llu}\n",
+                linkName, cell->msg_sz, cell->loss, cell->window, cell->failed ? "false" : "true", cell->msgs,
+                cell->bytes, secs, mbps, pps, cpb, p50, p99, p999, rexmit, timeouts);
+    else
+        fprintf(out, "\"%s\",%d,%g,%d,%d,%ld,%lld,%.6f,%.3f,%.1f,%.3f,%.1f,%.1f,%.1f,%llu,%llu\n",
+                linkName, cell->msg_sz, cell->loss, cell->window, !cell->failed, cell->msgs,
+                cell->bytes, secs, mbps, pps, cpb, p50, p99, p999, rexmit, timeouts);
+    fflush(out);
+
+    fprintf(stderr, "%9d B  loss %4g%%  win %2d  %s %9.2f MB/s %10.0f pkt/s %8.2f cpu ns/B"
+                    "  p50 %9.1f  p99 %9.1f  p999 %9.1f us  (%ld msgs, %llu rexmit)\n",
+            cell->msg_sz, cell->loss, cell->window, cell->failed ? "FAIL" : "  ok",
+            mbps, pps, cpb, p50, p99, p999, cell->msgs, rexmit);
+}
+
+typedef struct flood_run {
+    int                 cookies;
+    int                 budgetMs;
+    dp_connp            listener;
+    int                 port;
+    volatile int        stop;
+    long                sent;           //flood CONNECTs that left the socket
+    dp_connp           *sessions;       //every connection dpaccept() made
+    long                nSessions;
+    long                capSessions;
+    long                clients;        //real dpconnect()s tried, and those that got in
+    long                clientsOk;
+    unsigned long long *lat;
+    long                latCap;
+    dp_stats            lstats;
+    dp_pool_stats       pool;
+} flood_run;
+
+static void *flood_accept_thread(void *arg) {
+    flood_run *fr = arg;
+
+    while (!fr->stop) {
+        dp_connp dpc = dpaccept(fr->listener);
+        if (dpc == NULL)
+            continue;
+        if (fr->nSessions == fr->capSessions) {
+            long cap = fr->capSessions ? fr->capSessions * 2 : 1024;
+            dp_connp *grown = realloc(fr->sessions, cap * sizeof(*grown));
+            if (grown == NULL) {
+                dpclose(dpc);
+                continue;
+            }
+            fr->sessions = grown;
+            fr->capSessions = cap;
+        }
+        fr->sessions[fr->nSessions++] = dpc;
+    }
+    return NULL;
+}
+
+//CONNECTs that look like many clients to the listener, each its own sequence number, from a socket nobody reads
+static void *flood_send_thread(void *arg) {
+    flood_run *fr = arg;
+    struct sockaddr_in to = {0};
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    long ticks = fr->budgetMs / BENCH_FLOOD_TICK_MS;
+    dp_pdu pdu;
+
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(fr->port);
+    if (sock < 0)
+        return NULL;
+
+    unsigned long long start = now_ns();
+    for (long t = 0; t <= ticks && fr->sent < flood; t++) {
+        long due = ticks ? flood * t / ticks : flood;
+        for (; fr->sent < due; fr->sent++) {
+            memset(&pdu, 0, sizeof(pdu));
+            pdu.proto_ver = DP_PROTO_VER_1;
+            pdu.mtype = DP_MT_CONNECT;
+            pdu.seqnum = fr->sent;
+            pdu.checksum = dp_crc32c(&pdu, sizeof(pdu));
+            sendto(sock, &pdu, sizeof(pdu), 0, (struct sockaddr *)&to, sizeof(to));
+        }
+        unsigned long long next = start + (t + 1) * BENCH_FLOOD_TICK_MS * 1000000ull;
+        unsigned long long now = now_ns();
+        if (next > now)
+            nanosleep(&(struct timespec){0, next - now}, NULL);
+    }
+    close(sock);
+    return NULL;
+}
+
+static int flood_cell(flood_run *fr) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    pthread_t acceptTid, floodTid;
+
+    dp_set_cookies(fr->cookies);
+    fr->listener = dpServerInit(0);
+    dp_set_cookies(0);
+    if (fr->listener == NULL || getsockname(fr->listener->udp_sock, (struct sockaddr *)&addr, &len) < 0)
+        return -1;
+    fr->port = ntohs(addr.sin_port);
+
+    pthread_create(&acceptTid, NULL, flood_accept_thread, fr);
+    pthread_create(&floodTid, NULL, flood_send_thread, fr);
+
+    //real clients for as long as the flood lasts; their sessions stay with the listener too
+    unsigned long long stop = now_ns() + fr->budgetMs * 1000000ull;
+    do {
+        usleep(BENCH_FLOOD_CLIENT_MS * 1000);
+        dp_connp cli = dpClientInit("127.0.0.1", fr->port);
+        if (cli == NULL)
+            break;
+        unsigned long long start = now_ns();
+        fr->clients++;
+        if (dpconnect(cli) > 0) {
+            if (fr->clientsOk == fr->latCap) {
+                long cap = fr->latCap ? fr->latCap * 2 : 1024;
+                unsigned long long *grown = realloc(fr->lat, cap * sizeof(*grown));
+                if (grown == NULL) {
+                    dpclose(cli);
+                    break;
+                }
+                fr->lat = grown;
+                fr->latCap = cap;
+            }
+            fr->lat[fr->clientsOk++] = now_ns() - start;
+        }
+        dpclose(cli);
+    } while (now_ns() < stop);
+    pthread_join(floodTid, NULL);
+
+    //let the listener drain what is queued, then wake it with something that is not a CONNECT
+    usleep(200 * 1000);
+    fr->stop = 1;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(sock, "", 1, 0, (struct sockaddr *)&addr, sizeof(addr));
+    close(sock);
+    pthread_join(acceptTid, NULL);
+
+    dp_get_stats(fr->listener, &fr->lstats);
+    dp_pool_get_stats(&fr->pool);
+    for (long i = 0; i < fr->nSessions; i++)
+        dpclose(fr->sessions[i]);
+    dpclose(fr->listener);
+    free(fr->sessions);
+    return 0;
+}
+
+static void flood_report(FILE *out, int json, flood_run *fr) {
+    //connections and packet buffers out of the pool while the sessions were held, listener included
+    double poolKb = (fr->pool.conns_in_use * sizeof(dp_connection) + fr->pool.pkts_in_use * sizeof(dp_pkt)) / 1024.0;
+
+    qsort(fr->lat, fr->clientsOk, sizeof(*fr->lat), cmp_ull);
+    double p50 = pct_us(fr->lat, fr->clientsOk, 50);
+    double p99 = pct_us(fr->lat, fr->clientsOk, 99);
+
+    if (json)
+        fprintf(out, "{\"cookies\":%s,\"flood\":%ld,\"flood_sessions\":%ld,\"pool_kb\":%.0f,\"cookies_sent\":%llu,"
+                     "\"clients\":%ld,\"clients_ok\":%ld,\"connect_p50_us\":%.1f,\"connect_p99_us\":%.1f}\n",
+                fr->cookies ? "true" : "false", fr->sent, fr->nSessions - fr->clientsOk, poolKb, fr->lstats.cookies_sent,
+                fr->clients, fr->clientsOk, p50, p99);
+    else
+        fprintf(out, "%d,%ld,%ld,%.0f,%llu,%ld,%ld,%.1f,%.1f\n",
+                fr->cookies, fr->sent, fr->nSessions - fr->clientsOk, poolKb, fr->lstats.cookies_sent,
+                fr->clients, fr->clientsOk, p50, p99);
+    fflush(out);
+
+    fprintf(stderr, "cookies %-3s  flood %8ld  got in %8ld  pool %9.0f KB  clients %5ld/%-5ld"
+                    "  connect p50 %9.1f  p99 %9.1f us\n",
+            fr->cookies ? "on" : "off", fr->sent, fr->nSessions - fr->clientsOk, poolKb, fr->clientsOk, fr->clients, p50, p99);
+}
+
+//-F: the same flood against a listener without cookies and then one with them
+static int run_flood(const char *outPath, int json, int budget_ms) {
+    FILE *out = fopen(outPath, "w");
+    struct rlimit rl;
+    int failures = 0;
+
+    if (out == NULL) {
+        perror("dp-bench setup failed");
+        return 1;
+    }
+    //every session the flood gets in holds a socket
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (!json)
+        fprintf(out, "cookies,flood,flood_sessions,pool_kb,cookies_sent,clients,clients_ok,connect_p50_us,connect_p99_us\n");
+
+    for (int cookies = 0; cookies <= 1; cookies++) {
+        flood_run fr = {0};
+
+        fr.cookies = cookies;
+        fr.budgetMs = budget_ms;
+        if (flood_cell(&fr) < 0)
+            failures++;
+        flood_report(out, json, &fr);
+        free(fr.lat);
+    }
+
+    fclose(out);
+    fprintf(stderr, "results written to %s\n", outPath);
+    return failures ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    printf("USAGE: %s [-s sizes] [-l loss] [-w windows] [-t ms | -b bytes] [-S link | -M] [-B] [-F n] [-o file] [-j] [-h]\n", prog);
+    printf("  -s sizes    message sizes, e.g. 64,1K,4M (default %s)\n", BENCH_DEF_SIZES);
+    printf("  -l loss     loss rates in percent (default %s)\n", BENCH_DEF_LOSS);
+    printf("  -w windows  unacknowledged datagrams allowed (default %s)\n", BENCH_DEF_WINDOWS);
+    printf("  -t ms       time spent sending in each cell (default %d)\n", BENCH_DEF_MS);
+    printf("  -b bytes    send this much in each cell instead, e.g. 2G\n");
+    printf("  -S link     simulated link instead of loopback, e.g. bw=10M,delay=50,jitter=2,seed=7\n");
+    printf("  -M          move the loopback pair onto shared memory\n");
+    printf("  -B          stream the messages with dp_write()/dp_read() instead of dpsend()/dprecv()\n");
+    printf("  -F n        flood a listener with n CONNECTs over -t ms, without and with cookies, instead of the cells\n");
+    printf("  -o file     where the results go (default %s)\n", BENCH_DEF_OUT);
+    printf("  -j          write JSON lines instead of CSV\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *sizesSpec = BENCH_DEF_SIZES, *lossSpec = BENCH_DEF_LOSS, *winSpec = BENCH_DEF_WINDOWS;
+    const char *outPath = BENCH_DEF_OUT;
+    char sizes[BENCH_MAX_AXIS][32], losses[BENCH_MAX_AXIS][32], windows[BENCH_MAX_AXIS][32];
+    int nSizes, nLoss, nWin, budget = BENCH_DEF_MS, json = 0, failures = 0;
+    long long maxSz = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, ":s:l:w:t:b:S:MBF:o:jh")) != -1) {
+        switch (c) {
+            case 's': sizesSpec = optarg; break;
+            case 'l': lossSpec = optarg; break;
+            case 'w': winSpec = optarg; break;
+            case 't': budget = atoi(optarg); break;
+            case 'b':
+                if ((volume = parse_size(optarg)) <= 0) {
+                    printf("ERROR:  bad volume %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                if (dp_sim_parse(optarg, &simCfg) < 0)
+                    return 1;
+                useSim = 1;
+                linkName = optarg;
+                break;
+            case 'M':
+                useShm = 1;
+                linkName = "shm";
+                break;
+            case 'B': useStream = 1; break;
+            case 'F':
+                if ((flood = atol(optarg)) <= 0) {
+                    printf("ERROR:  bad flood size %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'o': outPath = optarg; break;
+            case 'j': json = 1; break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (flood > 0)
+        return run_flood(outPath, json, budget);
+
+    nSizes = parse_list(sizesSpec, sizes);
+    nLoss = parse_list(lossSpec, losses);
+    nWin = parse_list(winSpec, windows);
+    if (nSizes <= 0 || nLoss <= 0 || nWin <= 0 || budget < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i = 0; i < nSizes; i++) {
+        long long sz = parse_size(sizes[i]);
+        if (sz < (long)sizeof(bench_hdr) || sz > (1l << 30)) {
+            printf("ERROR:  message size %s must be %d bytes to 1G\n", sizes[i], (int)sizeof(bench_hdr));
+            return 1;
+        }
+        if (sz > maxSz)
+            maxSz = sz;
+    }
+    for (int i = 0; i < nWin; i++) {
+        if (atoi(windows[i]) < 1 || atoi(windows[i]) > DP_MAX_WINDOW) {
+            printf("ERROR:  window %s must be 1 to %d datagrams\n", windows[i], DP_MAX_WINDOW);
+            return 1;
+        }
+    }
+
+    //a stream never needs a whole message in memory
+    if (useStream && maxSz > BENCH_STREAM_SZ)
+        maxSz = BENCH_STREAM_SZ;
+    char *msg = malloc(maxSz);
+    FILE *out = fopen(outPath, "w");
+    if (msg == NULL || out == NULL) {
+        perror("dp-bench setup failed");
+        return 1;
+    }
+    for (long long i = 0; i < maxSz; i++)
+        msg[i] = (char)(i * 31 + 7);
+
+    if (!json)
+        fprintf(out, "link,msg_size,loss_pct,window,ok,msgs,bytes,secs,mb_per_s,pkts_per_s,"
+                     "cpu_ns_per_byte,lat_p50_us,lat_p99_us,lat_p999_us,retransmits,timeouts\n");
+
+    for (int w = 0; w < nWin; w++) {
+        for (int l = 0; l < nLoss; l++) {
+            for (int s = 0; s < nSizes; s++) {
+                bench_cell cell = {0};
+
+                cell.msg_sz = parse_size(sizes[s]);
+                cell.loss = atof(losses[l]);
+                cell.window = atoi(windows[w]);
+
+                unsigned long long cpu = cpu_ns();
+                if (run_cell(&cell, msg, budget) < 0)
+                    failures++;
+                report(out, json, &cell, cpu_ns() - cpu);
+                free(cell.lat);
+            }
+        }
+    }
+
+    fclose(out);
+    free(msg);
+    fprintf(stderr, "results written to %s\n", outPath);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dp-impair.h"
+#include "du-proto.h"
+#include "dp-pool.h"
+
+//a datagram sent twice is held twice, both times by reference to the one pooled copy
+typedef struct dp_held {
+    dp_pkt                 *pkt;
+    long long               due_ns;
+    struct sockaddr_storage to;
+    socklen_t               to_len;
+} dp_held;
+
+struct dp_impair {
+    dp_impair_cfg   cfg;
+    unsigned long long rng;
+    int             nheld;
+    dp_held         held[DP_IMPAIR_QUEUE];
+};
+
+static dp_impair_cfg _defaultCfg;
+static int _enabled = 0;
+static unsigned long long _connCount = 0;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+//xorshift64*, seeded through splitmix64 so nearby seeds still diverge
+static unsigned long long rng_next(dp_impair *im) {
+    im->rng ^= im->rng >> 12;
+    im->rng ^= im->rng << 25;
+    im->rng ^= im->rng >> 27;
+    return im->rng * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned long long splitmix64(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+//true pct percent of the time
+static int roll(dp_impair *im, double pct) {
+    if (pct <= 0)
+        return 0;
+    return (rng_next(im) >> 11) * (100.0 / 9007199254740992.0) < pct;
+}
+
+/*
+ *  Parses a comma separated list like "drop=1,dup=0.5,delay=2,seed=7" into
+ *  cfg.  Keys are drop, dup, reorder, corrupt (percentages), delay, jitter
+ *  (milliseconds) and seed.  Returns 0, or -1 naming the bad key.
+ */
+int dp_impair_parse(const char *spec, dp_impair_cfg *cfg) {
+    char copy[256];
+    char *save, *tok;
+
+    memset(cfg, 0, sizeof(dp_impair_cfg));
+    cfg->seed = 1;
+    snprintf(copy, sizeof(copy), "%s", spec);
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (val == NULL) {
+            printf("ERROR:  impairment %s needs a value\n", tok);
+            return -1;
+        }
+        *val++ = '\0';
+
+        if (strcmp(tok, "drop") == 0)
+            cfg->drop = atof(val);
+        else if (strcmp(tok, "dup") == 0)
+            cfg->dup = atof(val);
+        else if (strcmp(tok, "reorder") == 0)
+            cfg->reorder = atof(val);
+        else if (strcmp(tok, "corrupt") == 0)
+            cfg->corrupt = atof(val);
+        else if (strcmp(tok, "delay") == 0)
+            cfg->delay_ms = atoi(val);
+        else if (strcmp(tok, "jitter") == 0)
+            cfg->jitter_ms = atoi(val);
+        else if (strcmp(tok, "seed") == 0)
+            cfg->seed = strtoull(val, NULL, 0);
+        else {
+            printf("ERROR:  unknown impairment %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ *  Sets the impairment every connection created from now on gets.  Each
+ *  connection draws from its own generator, seeded from cfg->seed and the
+ *  order the connections were made in.
+ */
+void dp_impair_set_default(const dp_impair_cfg *cfg) {
+    _defaultCfg = *cfg;
+    _enabled = cfg->drop > 0 || cfg->dup > 0 || cfg->reorder > 0 || cfg->corrupt > 0 ||
+               cfg->delay_ms > 0 || cfg->jitter_ms > 0;
+}
+
+//NULL when no impairment is configured, so the send path stays a plain sendto()
+dp_impair *dp_impair_new(void) {
+    if (!_enabled)
+        return NULL;
+
+    dp_impair *im = calloc(1, sizeof(dp_impair));
+    if (im == NULL)
+        return NULL;
+    im->cfg = _defaultCfg;
+    unsigned long long n = __atomic_fetch_add(&_connCount, 1, __ATOMIC_RELAXED);
+    im->rng = splitmix64(im->cfg.seed + n * 0x9E3779B97F4A7C15ull);
+    if (im->rng == 0)
+        im->rng = 1;
+    return im;
+}
+
+void dp_impair_free(dp_impair *im) {
+    if (im == NULL)
+        return;
+    for (int i = 0; i < im->nheld; i++)
+        dp_pkt_put(im->held[i].pkt);
+    free(im);
+}
+
+static void hold(dp_impair *im, int sock, dp_pkt *pkt,
+                 const struct sockaddr *to, socklen_t to_len, long long due_ns) {
+    //nowhere to hold it, so it goes out late rather than not at all
+    if (im->nheld == DP_IMPAIR_QUEUE || to_len > sizeof(struct sockaddr_storage)) {
+        sendto(sock, pkt->data, pkt->len, 0, to, to_len);
+        return;
+    }
+    dp_held *h = &im->held[im->nheld++];
+    h->pkt = dp_pkt_ref(pkt);
+    h->due_ns = due_ns;
+    memcpy(&h->to, to, to_len);
+    h->to_len = to_len;
+}
+
+static void send_one(dp_impair *im, int sock, dp_pkt *pkt,
+                     const struct sockaddr *to, socklen_t to_len) {
+    dp_pkt *bad = NULL;
+
+    if (roll(im, im->cfg.corrupt) && pkt->len > 0 && (bad = dp_pkt_get()) != NULL) {
+        memcpy(bad->data, pkt->data, pkt->len);
+        bad->len = pkt->len;
+        unsigned long long bit = rng_next(im) % ((unsigned long long)pkt->len * 8);
+        bad->data[bit / 8] ^= 1 << (bit % 8);
+        pkt = bad;
+    }
+
+    long long delay = im->cfg.delay_ms * 1000000ll;
+    if (im->cfg.jitter_ms > 0)
+        delay += rng_next(im) % (im->cfg.jitter_ms * 1000000ull + 1);
+    if (roll(im, im->cfg.reorder))
+        delay += DP_IMPAIR_REORDER_MS * 1000000ll;
+
+    if (delay > 0)
+        hold(im, sock, pkt, to, to_len, now_ns() + delay);
+    else
+        sendto(sock, pkt->data, pkt->len, 0, to, to_len);
+    dp_pkt_put(bad);
+}
+
+/*
+ *  Stands in for sendto().  A dropped datagram still reports len bytes
+ *  sent, the way a datagram lost on the wire would.
+ */
+int dp_impair_send(dp_impair *im, int sock, const void *buff, int len,
+                   const struct sockaddr *to, socklen_t to_len) {
+    dp_impair_flush(im, sock);
+
+    if (roll(im, im->cfg.drop))
+        return len;
+
+    dp_pkt *pkt = len <= DP_MAX_DGRAM_SZ ? dp_pkt_get() : NULL;
+    if (pkt == NULL) {
+        sendto(sock, buff, len, 0, to, to_len);
+        return len;
+    }
+    memcpy(pkt->data, buff, len);
+    pkt->len = len;
+    send_one(im, sock, pkt, to, to_len);
+    if (roll(im, im->cfg.dup))
+        send_one(im, sock, pkt, to, to_len);
+    dp_pkt_put(pkt);
+    return len;
+}
+
+//sends every held datagram whose time has come, oldest deadline first
+void dp_impair_flush(dp_impair *im, int sock) {
+    long long now = now_ns();
+
+    while (im->nheld > 0) {
+        int next = 0;
+        for (int i = 1; i < im->nheld; i++) {
+            if (im->held[i].due_ns < im->held[next].due_ns)
+                next = i;
+        }
+        dp_held *h = &im->held[next];
+        if (h->due_ns > now)
+            break;
+        sendto(sock, h->pkt->data, h->pkt->len, 0, (struct sockaddr *)&h->to, h->to_len);
+        dp_pkt_put(h->pkt);
+        im->held[next] = im->held[--im->nheld];
+    }
+}
+
+//absolute CLOCK_MONOTONIC time the next held datagram is due, or -1
+long long dp_impair_next_due_ns(dp_impair *im) {
+    long long due = -1;
+    for (int i = 0; i < im->nheld; i++) {
+        if (due < 0 || im->held[i].due_ns < due)
+            due = im->held[i].due_ns;
+    }
+    return due;
+}
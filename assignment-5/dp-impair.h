@@ -0,0 +1,39 @@
+#ifndef __DP_IMPAIR_H__
+#define __DP_IMPAIR_H__
+
+#include <sys/socket.h>
+
+/*
+ * Network impairment for testing du-proto on one box.  When configured,
+ * every datagram dpsendraw() hands to the kernel first goes through
+ * dp_impair_send(), which may drop it, send it twice, flip a bit in it,
+ * or hold it back to delay or reorder it.  Held datagrams are released by
+ * dp_impair_flush(), which dprecvraw() calls while it waits.  Every
+ * decision comes from a seeded xorshift generator, so a run with the
+ * same seed and the same traffic makes the same decisions.
+ */
+#define DP_IMPAIR_QUEUE         32      //datagrams that can be held back at once
+#define DP_IMPAIR_REORDER_MS    5       //extra hold for a reordered datagram
+
+typedef struct dp_impair_cfg {
+    double              drop;           //percent of datagrams never sent
+    double              dup;            //percent sent twice
+    double              reorder;        //percent held back so later ones overtake them
+    double              corrupt;        //percent with one bit flipped
+    int                 delay_ms;       //added to every datagram
+    int                 jitter_ms;      //plus 0..jitter_ms more
+    unsigned long long  seed;
+} dp_impair_cfg;
+
+typedef struct dp_impair dp_impair;
+
+int        dp_impair_parse(const char *spec, dp_impair_cfg *cfg);
+void       dp_impair_set_default(const dp_impair_cfg *cfg);
+dp_impair *dp_impair_new(void);
+void       dp_impair_free(dp_impair *im);
+int        dp_impair_send(dp_impair *im, int sock, const void *buff, int len,
+                          const struct sockaddr *to, socklen_t to_len);
+void       dp_impair_flush(dp_impair *im, int sock);
+long long  dp_impair_next_due_ns(dp_impair *im);
+
+#endif
@@ -0,0 +1,569 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dp-mcast.h"
+#include "du-crc.h"
+#include "dp-trace.h"
+#include "dp-impair.h"
+#include "dp-sched.h"
+
+#define MC_RCVBUF       (4 << 20)       //a receiver busy writing should not lose what keeps coming
+#define MC_NS_PER_MS    1000000ull
+#define MC_PUMP_EVERY   16              //data datagrams sent between looks for NACKs
+
+typedef struct mc_dgram {
+    int                 len;            //0 for an empty window slot
+    char                data[DP_MAX_DGRAM_SZ];
+} mc_dgram;
+
+struct dp_mcast {
+    int                 sender;
+    int                 dataSock;       //receivers only, bound to port
+    int                 ctlSock;        //bound to port + 1, the sender also sends data from it
+    struct sockaddr_in  dataAddr;       //group:port
+    struct sockaddr_in  ctlAddr;        //group:port + 1
+    dp_impair          *impair;
+    dp_sched_flow      *sched;
+    dp_mcast_stats      stats;
+    unsigned int        rng;
+    int                 id;             //in err_num of our NACKs, which loop back to us too
+
+    //sender
+    mc_dgram           *hist;           //the last histCap datagrams, slot seq % histCap
+    unsigned long long *sentAt;         //when each last went out
+    unsigned int        histCap;        //grows to DP_MCAST_HISTORY, then the oldest datagram makes way
+    unsigned int        seqNum;         //datagrams sent so far
+    unsigned long long  nackedAt;       //last NACK heard
+    unsigned int        lagSeq;         //first datagram the receiver furthest behind is missing
+    int                 lagId;          //that receiver
+    unsigned long long  lagAt;          //when it last asked, 0 if nobody has
+
+    //receiver
+    mc_dgram           *win;            //slot seq % DP_MCAST_WINDOW
+    unsigned int        next;           //the next datagram to deliver
+    unsigned int        hi;             //one past the highest heard of
+    unsigned int        held;           //window slots filled
+    int                 ended;          //the CLOSE came in, hi is the datagram count
+    unsigned long long  nackAt;         //when to NACK what is missing, 0 when nothing is
+    unsigned int        nackedTo;       //hi when we last NACKed
+    int                 freshGap;       //a gap opened past nackedTo since
+    unsigned long long  heardAt;
+};
+
+static unsigned long long mc_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//xorshift, only to spread the receivers' NACK timers
+static unsigned int mc_rand(dp_mcast *mc, unsigned int bound) {
+    mc->rng ^= mc->rng << 13;
+    mc->rng ^= mc->rng >> 17;
+    mc->rng ^= mc->rng << 5;
+    return mc->rng % bound;
+}
+
+/*
+ *  A UDP socket bound to port on any address and joined to the group on
+ *  the interface with address ifaddr.  Every member of the session binds
+ *  the same ports, so the addresses have to be reusable.
+ */
+static int mc_socket(struct in_addr group, struct in_addr ifaddr, int port) {
+    struct sockaddr_in addr = {0};
+    struct ip_mreq mreq = { .imr_multiaddr = group, .imr_interface = ifaddr };
+    unsigned char loop = 1;
+    int on = 1;
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("dp_mcast_open: socket creation failed");
+        return -1;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    //receivers on the sender's own host only see its datagrams with loop on
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        perror("dp_mcast_open: could not join the group");
+        close(sock);
+        return -1;
+    }
+    int sz = MC_RCVBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &sz, sizeof(sz)) < 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    }
+    return sock;
+}
+
+/*
+ *  Joins group (a dotted quad) on the interface that has address ifaddr,
+ *  as the session's sender or as one of its receivers.
+ */
+dp_mcast *dp_mcast_open(const char *group, const char *ifaddr, int port, int sender) {
+    struct in_addr grp, ifa;
+
+    if (inet_pton(AF_INET, group, &grp) != 1 || !IN_MULTICAST(ntohl(grp.s_addr))) {
+        printf("ERROR:  %s is not an IPv4 multicast group\n", group);
+        return NULL;
+    }
+    if (inet_pton(AF_INET, ifaddr, &ifa) != 1) {
+        printf("ERROR:  %s is not an IPv4 interface address\n", ifaddr);
+        return NULL;
+    }
+
+    dp_mcast *mc = calloc(1, sizeof(dp_mcast));
+    if (mc == NULL)
+        return NULL;
+    mc->sender = sender;
+    mc->dataSock = -1;
+    mc->dataAddr.sin_family = AF_INET;
+    mc->dataAddr.sin_addr = grp;
+    mc->dataAddr.sin_port = htons(port);
+    mc->ctlAddr = mc->dataAddr;
+    mc->ctlAddr.sin_port = htons(port + 1);
+    mc->rng = (unsigned int)(mc_now() ^ getpid()) | 1;
+    mc->id = mc_rand(mc, 1 << 30) + 1;
+    mc->heardAt = mc_now();
+    mc->stats.start_ns = mc->heardAt;
+
+    mc->ctlSock = mc_socket(grp, ifa, port + 1);
+    if (mc->ctlSock < 0) {
+        free(mc);
+        return NULL;
+    }
+    if (sender) {
+        mc->sched = dp_sched_join();
+    } else {
+        mc->dataSock = mc_socket(grp, ifa, port);
+        mc->win = calloc(DP_MCAST_WINDOW, sizeof(mc_dgram));
+        if (mc->dataSock < 0 || mc->win == NULL) {
+            dp_mcast_close(mc);
+            return NULL;
+        }
+    }
+    mc->impair = dp_impair_new();
+    return mc;
+}
+
+//stamps the checksum and sends to the group on the data or the NACK port
+static int mc_sendraw(dp_mcast *mc, void *buff, int len, const struct sockaddr_in *to) {
+    dp_pdu *pdu = buff;
+    int bytes;
+
+    pdu->checksum = 0;
+    pdu->checksum = dp_crc32c(buff, len);
+    if (mc->impair != NULL)
+        bytes = dp_impair_send(mc->impair, mc->ctlSock, buff, len, (const struct sockaddr *)to, sizeof(*to));
+    else
+        bytes = sendto(mc->ctlSock, buff, len, 0, (const struct sockaddr *)to, sizeof(*to));
+    if (bytes < 0) {
+        perror("dp_mcast: sendto() failed");
+        return -1;
+    }
+    mc->stats.bytes_sent += bytes;
+    dp_trace(DP_TRACE_PDU, DP_TR_PDU_OUT, pdu, sizeof(dp_pdu));
+    return bytes;
+}
+
+//an intact datagram of ours, with a length that matches its header
+static bool mc_verify(void *buff, int len) {
+    dp_pdu *pdu = buff;
+
+    if (len < (int)sizeof(dp_pdu) || pdu->proto_ver != DP_PROTO_VER_1 ||
+        pdu->dgram_sz != len - (int)sizeof(dp_pdu))
+        return false;
+    unsigned int sentSum = pdu->checksum;
+    pdu->checksum = 0;
+    unsigned int calcSum = dp_crc32c(buff, len);
+    pdu->checksum = sentSum;
+    return sentSum == calcSum;
+}
+
+/*
+ *  Sender side of a NACK: every datagram asked for that we still have,
+ *  and have not just sent, goes to the group again.  A NACK from one
+ *  receiver is likely echoed by others a moment later, and they are all
+ *  answered by the first repair.  The first range of a NACK starts at the
+ *  receiver's first gap, and the lowest of those is what the history has
+ *  to hold on to; the receiver that set it moves it on by asking again.
+ */
+static void mc_repair(dp_mcast *mc, dp_pdu *nack) {
+    dp_mcast_range *r = (dp_mcast_range *)(nack + 1);
+    int ranges = nack->dgram_sz / sizeof(dp_mcast_range);
+    unsigned long long now = mc_now();
+
+    mc->stats.nacks_recv++;
+    mc->nackedAt = now;
+    if (ranges > 0 && (nack->err_num == mc->lagId || r[0].first <= mc->lagSeq ||
+                       now - mc->lagAt >= DP_MCAST_LINGER_MS * MC_NS_PER_MS)) {
+        mc->lagSeq = r[0].first;
+        mc->lagId = nack->err_num;
+        mc->lagAt = now;
+    }
+    for (int i = 0; i < ranges; i++) {
+        for (unsigned int seq = r[i].first; seq - r[i].first < r[i].count && seq < mc->seqNum; seq++) {
+            unsigned int at = seq % mc->histCap;
+            if (mc->seqNum - seq > mc->histCap || now - mc->sentAt[at] < DP_MCAST_REPAIR_MS * MC_NS_PER_MS)
+                continue;
+            mc->sentAt[at] = now;
+            mc->stats.repairs_sent++;
+            mc_sendraw(mc, mc->hist[at].data, mc->hist[at].len, &mc->dataAddr);
+        }
+    }
+}
+
+/*
+ *  Receiver side of a NACK from someone else.  If it asks for the first
+ *  datagram we are missing, the repair it brings is ours too, so our own
+ *  NACK waits a hold off longer.
+ */
+static void mc_overhear(dp_mcast *mc, dp_pdu *nack) {
+    dp_mcast_range *r = (dp_mcast_range *)(nack + 1);
+    int ranges = nack->dgram_sz / sizeof(dp_mcast_range);
+
+    if (mc->nackAt == 0 || nack->err_num == mc->id)
+        return;
+    for (unsigned int seq = mc->next; seq < mc->hi; seq++) {
+        if (mc->win[seq % DP_MCAST_WINDOW].len != 0)
+            continue;
+        for (int i = 0; i < ranges; i++) {
+            if (seq - r[i].first < r[i].count) {
+                mc->nackAt = mc_now() + DP_MCAST_HOLDOFF_MS * MC_NS_PER_MS;
+                mc->stats.nacks_suppressed++;
+                return;
+            }
+        }
+        return;
+    }
+}
+
+//files a data datagram or a CLOSE in the receive window
+static void mc_take(dp_mcast *mc, char *buff, int len) {
+    dp_pdu *pdu = (dp_pdu *)buff;
+    unsigned int seq = pdu->seqnum;
+
+    if (pdu->mtype == DP_MT_CLOSE) {
+        if (seq > mc->hi)
+            mc->hi = seq;
+        mc->ended = 1;
+        return;
+    }
+    if ((pdu->mtype & ~DP_MT_FRAGMENT) != DP_MT_SND) {
+        mc->stats.bad_dgrams++;
+        return;
+    }
+    if (seq + 1 > mc->hi) {
+        if (seq > mc->hi && mc->hi >= mc->nackedTo)
+            mc->freshGap = 1;
+        mc->hi = seq + 1;
+    }
+    if (seq - mc->next >= DP_MCAST_WINDOW) {
+        if ((int)(seq - mc->next) < 0)
+            mc->stats.duplicates++;
+        else
+            mc->stats.overruns++;
+        return;
+    }
+    mc_dgram *slot = &mc->win[seq % DP_MCAST_WINDOW];
+    if (slot->len != 0) {
+        mc->stats.duplicates++;
+        return;
+    }
+    memcpy(slot->data, buff, len);
+    slot->len = len;
+    mc->held++;
+    mc->stats.dgrams_recv++;
+}
+
+//NACKs what is missing between next and hi, as many ranges as fit in one datagram
+static void mc_nack(dp_mcast *mc) {
+    char buff[sizeof(dp_pdu) + DP_MCAST_NACK_RANGES * sizeof(dp_mcast_range)];
+    dp_pdu *pdu = (dp_pdu *)buff;
+    dp_mcast_range *r = (dp_mcast_range *)(pdu + 1);
+    unsigned int end = mc->hi - mc->next > DP_MCAST_WINDOW ? mc->next + DP_MCAST_WINDOW : mc->hi;
+    int ranges = 0;
+
+    for (unsigned int seq = mc->next; seq < end && ranges < DP_MCAST_NACK_RANGES; seq++) {
+        if (mc->win[seq % DP_MCAST_WINDOW].len != 0)
+            continue;
+        if (ranges > 0 && r[ranges - 1].first + r[ranges - 1].count == seq) {
+            r[ranges - 1].count++;
+        } else {
+            r[ranges].first = seq;
+            r[ranges].count = 1;
+            ranges++;
+        }
+    }
+    //beyond the window everything is missing
+    if (end < mc->hi && ranges < DP_MCAST_NACK_RANGES) {
+        r[ranges].first = end;
+        r[ranges].count = mc->hi - end;
+        ranges++;
+    }
+    if (ranges == 0)
+        return;
+
+    memset(pdu, 0, sizeof(dp_pdu));
+    pdu->proto_ver = DP_PROTO_VER_1;
+    pdu->mtype = DP_MT_NACK;
+    pdu->seqnum = r[0].first;
+    pdu->err_num = mc->id;
+    pdu->dgram_sz = ranges * sizeof(dp_mcast_range);
+    mc->stats.nacks_sent++;
+    mc_sendraw(mc, buff, sizeof(dp_pdu) + pdu->dgram_sz, &mc->ctlAddr);
+}
+
+/*
+ *  Takes in whatever has arrived, waiting for it until deadline_ns (0 is
+ *  only a look).  On a receiver this is also where the NACK timer runs.
+ *  Returns -1 only on a socket error.
+ */
+static int mc_pump(dp_mcast *mc, unsigned long long deadline_ns) {
+    char buff[DP_MAX_DGRAM_SZ + DP_MCAST_NACK_RANGES * sizeof(dp_mcast_range)];
+    struct pollfd pfd[2] = {
+        { .fd = mc->ctlSock, .events = POLLIN },
+        { .fd = mc->dataSock, .events = POLLIN },
+    };
+    int nfds = mc->sender ? 1 : 2;
+
+    while (1) {
+        unsigned long long now = mc_now();
+        if (mc->impair != NULL) {
+            dp_impair_flush(mc->impair, mc->ctlSock);
+        }
+        if (!mc->sender) {
+            if (mc->held == mc->hi - mc->next) {
+                mc->nackAt = 0;
+            } else if (mc->nackAt == 0 || mc->freshGap) {
+                unsigned long long at = now + mc_rand(mc, DP_MCAST_NACK_MS * MC_NS_PER_MS);
+                if (mc->nackAt == 0 || at < mc->nackAt)
+                    mc->nackAt = at;
+            } else if (now >= mc->nackAt) {
+                mc_nack(mc);
+                mc->nackAt = now + DP_MCAST_HOLDOFF_MS * MC_NS_PER_MS;
+                mc->nackedTo = mc->hi;
+            }
+            mc->freshGap = 0;
+        }
+
+        unsigned long long wake = deadline_ns;
+        if (mc->nackAt != 0 && (wake == 0 || mc->nackAt < wake))
+            wake = mc->nackAt;
+        if (mc->impair != NULL) {
+            long long due = dp_impair_next_due_ns(mc->impair);
+            if (due >= 0 && (wake == 0 || (unsigned long long)due < wake))
+                wake = due;
+        }
+        int ms = wake > now ? (int)((wake - now + MC_NS_PER_MS - 1) / MC_NS_PER_MS) : 0;
+
+        int ready = poll(pfd, nfds, ms);
+        if (ready < 0 && errno != EINTR) {
+            perror("dp_mcast: poll() failed");
+            return -1;
+        }
+        for (int i = 0; ready > 0 && i < nfds; i++) {
+            if (!(pfd[i].revents & POLLIN))
+                continue;
+            int len;
+            while ((len = recv(pfd[i].fd, buff, sizeof(buff), MSG_DONTWAIT)) > 0) {
+                if (!mc_verify(buff, len)) {
+                    mc->stats.bad_dgrams++;
+                    continue;
+                }
+                dp_pdu *pdu = (dp_pdu *)buff;
+                dp_trace(DP_TRACE_PDU, DP_TR_PDU_IN, pdu, sizeof(dp_pdu));
+                mc->heardAt = mc_now();
+                if (pdu->mtype != DP_MT_NACK) {
+                    if (i == 1)
+                        mc_take(mc, buff, len);
+                } else if (mc->sender) {
+                    mc_repair(mc, pdu);
+                } else {
+                    mc_overhear(mc, pdu);
+                }
+            }
+        }
+        if (ready > 0 || mc_now() >= deadline_ns)
+            return 0;
+    }
+}
+
+//whether a receiver asked for seq, or something before it, within the last DP_MCAST_LINGER_MS
+static bool mc_wanted(dp_mcast *mc, unsigned int seq) {
+    return mc->lagAt != 0 && mc->lagSeq <= seq && mc_now() - mc->lagAt < DP_MCAST_LINGER_MS * MC_NS_PER_MS;
+}
+
+/*
+ *  One more datagram in the sender's history.  It grows with the session
+ *  up to DP_MCAST_HISTORY, and after that the new datagram takes the slot
+ *  of the oldest.  While a receiver still asks for that one we keep
+ *  serving repairs instead, so a receiver that falls behind holds the
+ *  sender back rather than losing data, until it has been quiet for
+ *  DP_MCAST_LINGER_MS and is as lost as in dp_mcast_finish().
+ */
+static mc_dgram *mc_append(dp_mcast *mc) {
+    if (mc->seqNum == mc->histCap && mc->histCap < DP_MCAST_HISTORY) {
+        unsigned int cap = mc->histCap ? mc->histCap * 2 : 1024;
+        mc_dgram *hist = realloc(mc->hist, cap * sizeof(mc_dgram));
+        unsigned long long *sentAt = realloc(mc->sentAt, cap * sizeof(unsigned long long));
+        if (hist != NULL)
+            mc->hist = hist;
+        if (sentAt != NULL)
+            mc->sentAt = sentAt;
+        if (hist == NULL || sentAt == NULL) {
+            printf("ERROR:  out of memory for the multicast repair history\n");
+            return NULL;
+        }
+        mc->histCap = cap;
+    }
+    while (mc->seqNum >= mc->histCap && mc_wanted(mc, mc->seqNum - mc->histCap)) {
+        if (mc_pump(mc, mc_now() + DP_MCAST_HOLDOFF_MS * MC_NS_PER_MS) < 0)
+            return NULL;
+    }
+    return &mc->hist[mc->seqNum % mc->histCap];
+}
+
+/*
+ *  Sends one message to the group, cut into datagrams.  It returns as soon
+ *  as they are out; NACKs that came in meanwhile are served between them.
+ *  Returns len, or -1 if the history cannot grow or a send fails.
+ */
+int dp_mcast_send(dp_mcast *mc, const void *buff, int len) {
+    const char *p = buff;
+    int left = len;
+
+    do {
+        int sz = left < DP_MAX_BUFF_SZ ? left : DP_MAX_BUFF_SZ;
+        mc_dgram *d = mc_append(mc);
+        if (d == NULL)
+            return -1;
+        dp_pdu *pdu = (dp_pdu *)d->data;
+        memset(pdu, 0, sizeof(dp_pdu));
+        pdu->proto_ver = DP_PROTO_VER_1;
+        pdu->mtype = left > sz ? DP_MT_SND | DP_MT_FRAGMENT : DP_MT_SND;
+        pdu->seqnum = mc->seqNum;
+        pdu->dgram_sz = sz;
+        memcpy(pdu + 1, p, sz);
+        d->len = sizeof(dp_pdu) + sz;
+
+        dp_sched_charge(mc->sched, d->len);
+        mc->sentAt[mc->seqNum % mc->histCap] = mc_now();
+        mc->seqNum++;
+        if (mc_sendraw(mc, d->data, d->len, &mc->dataAddr) < 0)
+            return -1;
+        mc->stats.dgrams_sent++;
+        if (mc->seqNum % MC_PUMP_EVERY == 0 && mc_pump(mc, 0) < 0)
+            return -1;
+
+        p += sz;
+        left -= sz;
+    } while (left > 0);
+    return len;
+}
+
+/*
+ *  The repair phase.  Announces how many datagrams there were and repairs
+ *  for as long as receivers keep asking, then returns 0.  Receivers that
+ *  are still missing something after DP_MCAST_LINGER_MS without a NACK
+ *  are lost to us, since we never hear from receivers that are happy.
+ */
+int dp_mcast_finish(dp_mcast *mc) {
+    dp_pdu close;
+    unsigned long long start = mc_now();
+
+    while (1) {
+        unsigned long long now = mc_now();
+        unsigned long long quiet = mc->nackedAt > start ? mc->nackedAt : start;
+        if (now - quiet >= DP_MCAST_LINGER_MS * MC_NS_PER_MS)
+            return 0;
+
+        memset(&close, 0, sizeof(dp_pdu));
+        close.proto_ver = DP_PROTO_VER_1;
+        close.mtype = DP_MT_CLOSE;
+        close.seqnum = mc->seqNum;
+        if (mc_sendraw(mc, &close, sizeof(dp_pdu), &mc->dataAddr) < 0)
+            return -1;
+
+        unsigned long long until = now + DP_MCAST_CLOSE_MS * MC_NS_PER_MS;
+        while (mc_now() < until) {
+            if (mc_pump(mc, until) < 0)
+                return -1;
+        }
+    }
+}
+
+/*
+ *  The next message from the sender, in order and whole.  Returns its
+ *  size, DP_CONNECTION_CLOSED once everything announced was delivered,
+ *  DP_ERROR_IDLE when the sender went quiet for DP_MCAST_IDLE_MS in the
+ *  middle, and DP_BUFF_UNDERSIZED for a message bigger than buff.
+ */
+int dp_mcast_recv(dp_mcast *mc, void *buff, int buff_sz) {
+    int total = 0;
+
+    while (1) {
+        mc_dgram *slot = &mc->win[mc->next % DP_MCAST_WINDOW];
+        if (mc->next < mc->hi && slot->len != 0) {
+            dp_pdu *pdu = (dp_pdu *)slot->data;
+            int more = pdu->mtype & DP_MT_FRAGMENT;
+            if (total + pdu->dgram_sz > buff_sz)
+                return DP_BUFF_UNDERSIZED;
+            memcpy((char *)buff + total, pdu + 1, pdu->dgram_sz);
+            total += pdu->dgram_sz;
+            slot->len = 0;
+            mc->held--;
+            mc->next++;
+            if (!more)
+                return total;
+            continue;
+        }
+        if (mc->ended && mc->next >= mc->hi)
+            return DP_CONNECTION_CLOSED;
+
+        unsigned long long now = mc_now();
+        if (mc->hi > 0 && now - mc->heardAt >= DP_MCAST_IDLE_MS * MC_NS_PER_MS)
+            return DP_ERROR_IDLE;
+        if (mc_pump(mc, now + DP_MCAST_HOLDOFF_MS * MC_NS_PER_MS) < 0)
+            return DP_ERROR_GENERAL;
+    }
+}
+
+void dp_mcast_get_stats(dp_mcast *mc, dp_mcast_stats *out) {
+    *out = mc->stats;
+    out->elapsed_ns = mc_now() - mc->stats.start_ns;
+}
+
+void dp_mcast_close(dp_mcast *mc) {
+    if (mc == NULL)
+        return;
+    if (mc->impair != NULL) {
+        dp_impair_flush(mc->impair, mc->ctlSock);
+        dp_impair_free(mc->impair);
+    }
+    if (mc->ctlSock >= 0)
+        close(mc->ctlSock);
+    if (mc->dataSock >= 0)
+        close(mc->dataSock);
+    dp_sched_leave(mc->sched);
+    free(mc->hist);
+    free(mc->sentAt);
+    free(mc->win);
+    free(mc);
+}
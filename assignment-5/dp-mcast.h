@@ -0,0 +1,68 @@
+#ifndef __DP_MCAST_H__
+#define __DP_MCAST_H__
+
+#include "du-proto.h"
+
+/*
+ * One sender, any number of receivers, over an IPv4 multicast group.  The
+ * sender sends every data datagram once, to the group, and never waits for
+ * an ACK, so what it puts on the wire does not grow with the number of
+ * receivers.  Datagrams carry the usual dp_pdu, numbered one per datagram,
+ * with DP_MT_FRAGMENT on all but the last of a message.  Data goes to the
+ * group on port, and NACKs on port + 1, where the sender and every other
+ * receiver hear them.
+ *
+ * A receiver that sees a gap waits a random 0..DP_MCAST_NACK_MS and then
+ * NACKs the missing ranges.  If another receiver's NACK for the same
+ * datagrams comes by first it keeps quiet for DP_MCAST_HOLDOFF_MS, since
+ * the repair will reach everyone; when loss is shared, one NACK stands for
+ * all of them.  After its own NACK it also waits a hold off before asking
+ * again, unless a new gap opens past what it asked for.  The sender
+ * resends what is asked for to the whole group, no more than once every
+ * DP_MCAST_REPAIR_MS per datagram.  Once all data is out,
+ * dp_mcast_finish() is the repair phase: the sender announces the
+ * datagram count with a CLOSE every DP_MCAST_CLOSE_MS, so receivers can
+ * NACK a lost tail, and repairs until DP_MCAST_LINGER_MS pass without a
+ * NACK.  The sender keeps the last DP_MCAST_HISTORY datagrams for repairs,
+ * and does not let go of one while a receiver's NACKs still ask for it.
+ */
+#define DP_MCAST_WINDOW         4096            //datagrams a receiver holds ahead of delivery, a power of 2
+#define DP_MCAST_HISTORY        8192            //datagrams the sender keeps for repairs, a power of 2 and at least 1024
+#define DP_MCAST_NACK_MS        10
+#define DP_MCAST_HOLDOFF_MS     30
+#define DP_MCAST_REPAIR_MS      15
+#define DP_MCAST_CLOSE_MS       25
+#define DP_MCAST_LINGER_MS      300
+#define DP_MCAST_IDLE_MS        30000           //a receiver gives up on a sender quiet this long
+#define DP_MCAST_NACK_RANGES    128             //missing ranges one NACK can carry
+
+typedef struct dp_mcast_range {
+    unsigned int        first;
+    unsigned int        count;
+} dp_mcast_range;
+
+typedef struct dp_mcast_stats {
+    unsigned long long  dgrams_sent;    //data datagrams, the first time
+    unsigned long long  repairs_sent;   //data datagrams again, for a NACK
+    unsigned long long  bytes_sent;     //on the wire, CLOSEs and NACKs included
+    unsigned long long  dgrams_recv;    //data datagrams taken in
+    unsigned long long  duplicates;
+    unsigned long long  overruns;       //beyond the receive window, they come back as repairs
+    unsigned long long  bad_dgrams;
+    unsigned long long  nacks_sent;
+    unsigned long long  nacks_recv;
+    unsigned long long  nacks_suppressed;       //held back because another receiver asked first
+    unsigned long long  start_ns;
+    unsigned long long  elapsed_ns;     //filled in by dp_mcast_get_stats()
+} dp_mcast_stats;
+
+typedef struct dp_mcast dp_mcast;
+
+dp_mcast *dp_mcast_open(const char *group, const char *ifaddr, int port, int sender);
+int       dp_mcast_send(dp_mcast *mc, const void *buff, int len);
+int       dp_mcast_finish(dp_mcast *mc);
+int       dp_mcast_recv(dp_mcast *mc, void *buff, int buff_sz);
+void      dp_mcast_get_stats(dp_mcast *mc, dp_mcast_stats *out);
+void      dp_mcast_close(dp_mcast *mc);
+
+#endif
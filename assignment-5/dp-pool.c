@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dp-pool.h"
+
+//a free connection's memory holds the free list link
+typedef union dp_conn_slot {
+    dp_connection       conn;
+    union dp_conn_slot *next;
+} dp_conn_slot;
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static dp_conn_slot *_freeConns;
+static dp_pkt *_freePkts;
+static dp_pool_stats _stats;
+
+//zeroed, like the calloc() it stands in for, up to the buffers the last connection in the slot left for this one
+dp_connp dp_conn_alloc(void) {
+    pthread_mutex_lock(&_lock);
+    if (_freeConns == NULL) {
+        dp_conn_slot *slab = calloc(DP_POOL_CONN_SLAB, sizeof(dp_conn_slot));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&_lock);
+            return NULL;
+        }
+        for (int i = 0; i < DP_POOL_CONN_SLAB; i++) {
+            slab[i].next = _freeConns;
+            _freeConns = &slab[i];
+        }
+        _stats.conn_slabs++;
+    }
+    dp_conn_slot *slot = _freeConns;
+    _freeConns = slot->next;
+    _stats.conns_in_use++;
+    pthread_mutex_unlock(&_lock);
+
+    memset(&slot->conn, 0, offsetof(dp_connection, burst));
+    return &slot->conn;
+}
+
+void dp_conn_free(dp_connp dp) {
+    dp_conn_slot *slot = (dp_conn_slot *)dp;
+
+    pthread_mutex_lock(&_lock);
+    slot->next = _freeConns;
+    _freeConns = slot;
+    _stats.conns_in_use--;
+    pthread_mutex_unlock(&_lock);
+}
+
+//one reference, held by the caller; the data is not cleared
+dp_pkt *dp_pkt_get(void) {
+    pthread_mutex_lock(&_lock);
+    if (_freePkts == NULL) {
+        dp_pkt *slab = malloc(DP_POOL_PKT_SLAB * sizeof(dp_pkt));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&_lock);
+            return NULL;
+        }
+        for (int i = 0; i < DP_POOL_PKT_SLAB; i++) {
+            slab[i].next = _freePkts;
+            _freePkts = &slab[i];
+        }
+        _stats.pkt_slabs++;
+    }
+    dp_pkt *pkt = _freePkts;
+    _freePkts = pkt->next;
+    _stats.pkts_in_use++;
+    pthread_mutex_unlock(&_lock);
+
+    pkt->refs = 1;
+    pkt->len = 0;
+    pkt->next = NULL;
+    return pkt;
+}
+
+dp_pkt *dp_pkt_ref(dp_pkt *pkt) {
+    __atomic_add_fetch(&pkt->refs, 1, __ATOMIC_RELAXED);
+    return pkt;
+}
+
+void dp_pkt_put(dp_pkt *pkt) {
+    if (pkt == NULL || __atomic_sub_fetch(&pkt->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    pthread_mutex_lock(&_lock);
+    pkt->next = _freePkts;
+    _freePkts = pkt;
+    _stats.pkts_in_use--;
+    pthread_mutex_unlock(&_lock);
+}
+
+void dp_pool_get_stats(dp_pool_stats *out) {
+    pthread_mutex_lock(&_lock);
+    *out = _stats;
+    pthread_mutex_unlock(&_lock);
+}
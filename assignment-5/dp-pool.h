@@ -0,0 +1,43 @@
+#ifndef __DP_POOL_H__
+#define __DP_POOL_H__
+
+#include "du-proto.h"
+
+/*
+ * Allocation off the heap for the per-session and per-datagram paths.
+ * Connections come from slabs of DP_POOL_CONN_SLAB and packet buffers
+ * from slabs of DP_POOL_PKT_SLAB.  A freed one goes on its free list for
+ * the next taker and slabs are never handed back, so once a server has
+ * been through its busiest moment, sessions come and go without touching
+ * malloc().  The buffers a connection allocates on first use (the window,
+ * GRO and byte stream ones) stay with its slot when it is freed, and the
+ * next connection in the slot takes them over.  A packet buffer is reference
+ * counted: every pointer kept to it holds a reference, dp_pkt_ref() adds
+ * one for a second keeper (the impairment layer sending the same datagram
+ * twice, say) and the last dp_pkt_put() gives it back to the pool.
+ */
+#define DP_POOL_CONN_SLAB       16
+#define DP_POOL_PKT_SLAB        64
+
+typedef struct dp_pkt {
+    int                 refs;
+    int                 len;
+    struct dp_pkt      *next;           //free list link
+    char                data[DP_MAX_DGRAM_SZ];
+} dp_pkt;
+
+typedef struct dp_pool_stats {
+    unsigned long long  conn_slabs;     //slabs taken from the heap so far
+    unsigned long long  conns_in_use;
+    unsigned long long  pkt_slabs;
+    unsigned long long  pkts_in_use;
+} dp_pool_stats;
+
+dp_connp dp_conn_alloc(void);
+void     dp_conn_free(dp_connp dp);
+dp_pkt  *dp_pkt_get(void);
+dp_pkt  *dp_pkt_ref(dp_pkt *pkt);
+void     dp_pkt_put(dp_pkt *pkt);
+void     dp_pool_get_stats(dp_pool_stats *out);
+
+#endif
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dp-sched.h"
+
+typedef struct dp_bucket {
+    double              rate;           //bytes per second, 0 never runs dry
+    double              burst;
+    double              tokens;
+    unsigned long long  last_ns;
+} dp_bucket;
+
+struct dp_sched_flow {
+    dp_bucket           bucket;
+    int                 deficit;
+    int                 need;           //size of the datagram waiting to go
+    int                 granted;
+    struct dp_sched_flow *next;         //in the round robin queue while waiting
+};
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _turn;
+static dp_sched_cfg _cfg;
+static int _enabled = 0;
+static dp_bucket _total;
+static dp_sched_flow *_head, *_tail;
+static int _waiting;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bucket_init(dp_bucket *b, double rate, unsigned long long now) {
+    b->rate = rate;
+    b->burst = rate * DP_SCHED_BURST_MS / 1000.0;
+    if (b->burst < DP_SCHED_MIN_BURST)
+        b->burst = DP_SCHED_MIN_BURST;
+    b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+static void bucket_refill(dp_bucket *b, unsigned long long now) {
+    if (now > b->last_ns) {
+        b->tokens += b->rate * (now - b->last_ns) / 1e9;
+        if (b->tokens > b->burst)
+            b->tokens = b->burst;
+    }
+    b->last_ns = now;
+}
+
+//how long until b holds need tokens, 0 if it does now
+static unsigned long long bucket_wait(const dp_bucket *b, int need) {
+    if (b->rate <= 0 || b->tokens >= need)
+        return 0;
+    return (unsigned long long)((need - b->tokens) / b->rate * 1e9) + 1;
+}
+
+static void bucket_take(dp_bucket *b, int need) {
+    if (b->rate > 0)
+        b->tokens -= need;
+}
+
+/*
+ *  Parses a rate in bytes per second, taking K, M or G (powers of 1000)
+ *  after the number.  Returns -1 if it is not one.
+ */
+double dp_sched_parse_rate(const char *spec) {
+    char *unit;
+    double rate = strtod(spec, &unit);
+
+    if (unit == spec || rate < 0)
+        return -1;
+    if (*unit == 'K' || *unit == 'k')
+        rate *= 1e3;
+    else if (*unit == 'M' || *unit == 'm')
+        rate *= 1e6;
+    else if (*unit == 'G' || *unit == 'g')
+        rate *= 1e9;
+    else if (*unit != '\0')
+        return -1;
+    return rate;
+}
+
+//limits for connections made from now on; call before starting any
+void dp_sched_set(const dp_sched_cfg *cfg) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_turn, &attr);
+    pthread_condattr_destroy(&attr);
+
+    _cfg = *cfg;
+    _enabled = cfg->flow_rate > 0 || cfg->total_rate > 0;
+    bucket_init(&_total, cfg->total_rate, now_ns());
+}
+
+//NULL when no limit is set, which dp_sched_charge() takes as unlimited
+dp_sched_flow *dp_sched_join(void) {
+    if (!_enabled)
+        return NULL;
+
+    dp_sched_flow *fl = calloc(1, sizeof(dp_sched_flow));
+    if (fl == NULL)
+        return NULL;
+    bucket_init(&fl->bucket, _cfg.flow_rate, now_ns());
+    return fl;
+}
+
+void dp_sched_leave(dp_sched_flow *fl) {
+    free(fl);
+}
+
+static void rotate(void) {
+    dp_sched_flow *fl = _head;
+
+    if (fl == _tail)
+        return;
+    _head = fl->next;
+    fl->next = NULL;
+    _tail->next = fl;
+    _tail = fl;
+}
+
+/*
+ *  Called with the lock held by any waiting thread.  Goes round the queue
+ *  granting every flow whose own bucket, credit and the shared bucket all
+ *  cover its datagram.  A flow held up by its own rate steps aside for the
+ *  others, one short of credit gets a quantum and goes to the back, and
+ *  one the shared bucket cannot cover stops the round so nobody overtakes
+ *  it.  Returns how long until it is worth looking again.
+ */
+static unsigned long long dispatch(unsigned long long now) {
+    unsigned long long wait = 100000000ull;
+    int passes = 0, granted = 0;
+
+    bucket_refill(&_total, now);
+    while (_head != NULL && passes <= 2 * _waiting) {
+        dp_sched_flow *fl = _head;
+        bucket_refill(&fl->bucket, now);
+
+        unsigned long long own = bucket_wait(&fl->bucket, fl->need);
+        if (own > 0) {
+            if (own < wait)
+                wait = own;
+            rotate();
+            passes++;
+            continue;
+        }
+        if (fl->deficit < fl->need) {
+            fl->deficit += DP_SCHED_QUANTUM;
+            rotate();
+            passes++;
+            continue;
+        }
+        unsigned long long shared = bucket_wait(&_total, fl->need);
+        if (shared > 0) {
+            if (shared < wait)
+                wait = shared;
+            break;
+        }
+
+        bucket_take(&fl->bucket, fl->need);
+        bucket_take(&_total, fl->need);
+        fl->deficit -= fl->need;
+        fl->granted = 1;
+        _head = fl->next;
+        if (_head == NULL)
+            _tail = NULL;
+        fl->next = NULL;
+        _waiting--;
+        granted++;
+        passes = 0;
+    }
+    if (granted > 0)
+        pthread_cond_broadcast(&_turn);
+    return wait;
+}
+
+/*
+ *  Blocks until fl may move a datagram of bytes, and returns how long that
+ *  took in nanoseconds.
+ */
+unsigned long long dp_sched_charge(dp_sched_flow *fl, int bytes) {
+    if (fl == NULL)
+        return 0;
+
+    unsigned long long start = now_ns();
+    pthread_mutex_lock(&_lock);
+    fl->need = bytes;
+    fl->granted = 0;
+    fl->next = NULL;
+    if (_tail != NULL)
+        _tail->next = fl;
+    else
+        _head = fl;
+    _tail = fl;
+    _waiting++;
+
+    while (1) {
+        unsigned long long now = now_ns();
+        unsigned long long wake = now + dispatch(now);
+        if (fl->granted)
+            break;
+        struct timespec at = { .tv_sec = wake / 1000000000ull, .tv_nsec = wake % 1000000000ull };
+        pthread_cond_timedwait(&_turn, &_lock, &at);
+        if (fl->granted)
+            break;
+    }
+    pthread_mutex_unlock(&_lock);
+    return now_ns() - start;
+}
@@ -0,0 +1,35 @@
+#ifndef __DP_SCHED_H__
+#define __DP_SCHED_H__
+
+/*
+ * Bandwidth limits and fair sharing for a server running many transfers.
+ * Once a limit is set, every connection made joins the scheduler, and
+ * du-proto charges it for each data datagram before sending it, and for
+ * each one it takes in before ACKing it.  A stop-and-wait sender goes no
+ * faster than its ACKs come back, so holding the ACK back throttles an
+ * upload the same way holding the datagram back throttles a download.  A
+ * charge waits for tokens in the connection's own bucket (the per-transfer
+ * rate) and in the bucket all connections share (the global rate).  While
+ * the shared bucket is what holds them up, waiting connections are served
+ * by deficit round robin: every round each one gets DP_SCHED_QUANTUM more
+ * bytes of credit and goes when its credit covers its datagram, so busy
+ * transfers get equal shares of bytes however quick their clients are.
+ */
+#define DP_SCHED_QUANTUM        1500            //bytes of credit per round, more than any one datagram
+#define DP_SCHED_BURST_MS       20              //a bucket holds this long at its rate...
+#define DP_SCHED_MIN_BURST      4096            //...but never less than a few datagrams
+
+typedef struct dp_sched_cfg {
+    double              flow_rate;      //bytes per second for each connection, 0 is unlimited
+    double              total_rate;     //bytes per second for all of them together, 0 is unlimited
+} dp_sched_cfg;
+
+typedef struct dp_sched_flow dp_sched_flow;
+
+double             dp_sched_parse_rate(const char *spec);
+void               dp_sched_set(const dp_sched_cfg *cfg);
+dp_sched_flow     *dp_sched_join(void);
+void               dp_sched_leave(dp_sched_flow *fl);
+unsigned long long dp_sched_charge(dp_sched_flow *fl, int bytes);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE     //memfd_create()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "dp-shm.h"
+
+#define SHM_CLIENT      0
+#define SHM_SERVER      1
+#define SHM_NAP_NS      1000000000ull   //longest futex sleep before checking the peer is still alive
+
+/*
+ * One direction.  head is only written by the producer and tail only by
+ * the consumer; both count bytes forever and are masked into data.  Each
+ * record is a 4 byte length followed by the datagram, and may wrap.
+ */
+typedef struct dp_shm_ring {
+    unsigned long long  head __attribute__((aligned(64)));
+    unsigned long long  tail __attribute__((aligned(64)));
+    int                 dataSeq __attribute__((aligned(64)));  //bumped to wake a waiting consumer
+    int                 dataWait;
+    int                 spaceSeq;       //bumped to wake a producer waiting for room
+    int                 spaceWait;
+    char                data[DP_SHM_RING_SZ] __attribute__((aligned(64)));
+} dp_shm_ring;
+
+typedef struct dp_shm_region {
+    unsigned int        magic;
+    int                 pid[2];         //client, server
+    int                 closed[2];
+    dp_shm_ring         ring[2];        //client to server, server to client
+} dp_shm_region;
+
+struct dp_shm {
+    dp_shm_region      *reg;
+    int                 fd;             //the memfd, kept open by the client only
+    int                 side;
+};
+
+static unsigned long long shm_now(dp_connp dp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//sleeps while *word == val, until the absolute CLOCK_MONOTONIC time wake_ns at the latest
+static void futex_wait(int *word, int val, unsigned long long wake_ns) {
+    struct timespec at = { .tv_sec = wake_ns / 1000000000ull, .tv_nsec = wake_ns % 1000000000ull };
+    syscall(SYS_futex, word, FUTEX_WAIT_BITSET, val, &at, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void futex_wake(int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int peer_gone(dp_shm *shm) {
+    int peer = 1 - shm->side;
+    int pid = __atomic_load_n(&shm->reg->pid[peer], __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&shm->reg->closed[peer], __ATOMIC_ACQUIRE))
+        return 1;
+    return pid != 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ *  Waits for the other side of ring r to move, the way both ends do: note
+ *  the sequence number, say we are waiting, check the condition once more
+ *  and only then sleep.  The other side changes head or tail before it
+ *  looks at the waiting flag, so either we see its change or it sees our
+ *  flag and bumps the sequence number, and the futex cannot miss it.
+ */
+static void shm_wait(int *seq, int *waiting, const unsigned long long *pos, unsigned long long seen,
+                     unsigned long long deadline_ns) {
+    unsigned long long now = shm_now(NULL);
+    unsigned long long wake = now + SHM_NAP_NS;
+    int val = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    if (deadline_ns != 0 && deadline_ns < wake)
+        wake = deadline_ns;
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen)
+        futex_wait(seq, val, wake);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void shm_kick(int *seq, int *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(seq);
+    }
+}
+
+static void ring_put(dp_shm_ring *r, unsigned long long pos, const void *src, unsigned int len) {
+    unsigned int off = pos & (DP_SHM_RING_SZ - 1);
+    unsigned int first = len < DP_SHM_RING_SZ - off ? len : DP_SHM_RING_SZ - off;
+
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const char *)src + first, len - first);
+}
+
+static void ring_get(dp_shm_ring *r, unsigned long long pos, void *dst, unsigned int len) {
+    unsigned int off = pos & (DP_SHM_RING_SZ - 1);
+    unsigned int first = len < DP_SHM_RING_SZ - off ? len : DP_SHM_RING_SZ - off;
+
+    memcpy(dst, r->data + off, first);
+    memcpy((char *)dst + first, r->data, len - first);
+}
+
+static int shm_send(dp_connp dp, const void *buff, int len) {
+    dp_shm *shm = dp->tpCtx;
+    dp_shm_ring *r = &shm->reg->ring[shm->side];
+    unsigned int rec = len;
+    unsigned long long need = sizeof(rec) + len;
+    unsigned long long head = r->head;
+
+    if (need > DP_SHM_RING_SZ)
+        return -1;
+    while (1) {
+        unsigned long long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (DP_SHM_RING_SZ - (head - tail) >= need)
+            break;
+        if (peer_gone(shm))
+            return -1;
+        shm_wait(&r->spaceSeq, &r->spaceWait, &r->tail, tail, 0);
+    }
+
+    ring_put(r, head, &rec, sizeof(rec));
+    ring_put(r, head + sizeof(rec), buff, len);
+    __atomic_store_n(&r->head, head + need, __ATOMIC_SEQ_CST);
+    shm_kick(&r->dataSeq, &r->dataWait);
+    return len;
+}
+
+static int shm_recv(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns) {
+    dp_shm *shm = dp->tpCtx;
+    dp_shm_ring *r = &shm->reg->ring[1 - shm->side];
+    unsigned long long tail = r->tail;
+    unsigned int rec;
+
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail) {
+        if (peer_gone(shm))
+            return -1;
+        if (deadline_ns != 0 && shm_now(dp) >= deadline_ns)
+            return DP_ERROR_TIMEOUT;
+        shm_wait(&r->dataSeq, &r->dataWait, &r->head, tail, deadline_ns);
+    }
+
+    ring_get(r, tail, &rec, sizeof(rec));
+    ring_get(r, tail + sizeof(rec), buff, rec < (unsigned int)buff_sz ? rec : (unsigned int)buff_sz);
+    __atomic_store_n(&r->tail, tail + sizeof(rec) + rec, __ATOMIC_SEQ_CST);
+    shm_kick(&r->spaceSeq, &r->spaceWait);
+    return rec < (unsigned int)buff_sz ? (int)rec : buff_sz;
+}
+
+//tells the peer we are gone, waking it if it sleeps on either ring
+static void shm_close(dp_connp dp) {
+    dp_shm *shm = dp->tpCtx;
+
+    __atomic_store_n(&shm->reg->closed[shm->side], 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < 2; i++) {
+        __atomic_add_fetch(&shm->reg->ring[i].dataSeq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&shm->reg->ring[i].dataSeq);
+        __atomic_add_fetch(&shm->reg->ring[i].spaceSeq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&shm->reg->ring[i].spaceSeq);
+    }
+    dp_shm_release(shm);
+}
+
+static const dp_transport dp_shm_transport = {
+    .send     = shm_send,
+    .recv     = shm_recv,
+    .now_ns   = shm_now,
+    .close    = shm_close,
+    .reliable = 1,
+};
+
+//client side: a fresh region, described in offer for the CONNECT
+dp_shm *dp_shm_create(dp_shm_offer *offer) {
+    dp_shm *shm = calloc(1, sizeof(dp_shm));
+    if (shm == NULL)
+        return NULL;
+
+    shm->side = SHM_CLIENT;
+    shm->fd = memfd_create("du-proto", MFD_CLOEXEC);
+    if (shm->fd < 0 || ftruncate(shm->fd, sizeof(dp_shm_region)) < 0) {
+        perror("dp-shm: cannot create the shared region");
+        if (shm->fd >= 0)
+            close(shm->fd);
+        free(shm);
+        return NULL;
+    }
+    shm->reg = mmap(NULL, sizeof(dp_shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (shm->reg == MAP_FAILED) {
+        perror("dp-shm: cannot map the shared region");
+        close(shm->fd);
+        free(shm);
+        return NULL;
+    }
+    shm->reg->magic = DP_SHM_MAGIC;
+    shm->reg->pid[SHM_CLIENT] = getpid();
+
+    offer->magic = DP_SHM_MAGIC;
+    offer->pid = getpid();
+    offer->fd = shm->fd;
+    offer->size = sizeof(dp_shm_region);
+    return shm;
+}
+
+//server side: maps the region a local client offered, or NULL if we cannot
+dp_shm *dp_shm_open(const dp_shm_offer *offer) {
+    char path[64];
+    struct stat st;
+
+    if (offer->magic != DP_SHM_MAGIC || offer->size != sizeof(dp_shm_region))
+        return NULL;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", offer->pid, offer->fd);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size != (off_t)sizeof(dp_shm_region)) {
+        close(fd);
+        return NULL;
+    }
+
+    dp_shm *shm = calloc(1, sizeof(dp_shm));
+    if (shm == NULL) {
+        close(fd);
+        return NULL;
+    }
+    shm->side = SHM_SERVER;
+    shm->fd = -1;
+    shm->reg = mmap(NULL, sizeof(dp_shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->reg == MAP_FAILED || shm->reg->magic != DP_SHM_MAGIC) {
+        if (shm->reg != MAP_FAILED)
+            munmap(shm->reg, sizeof(dp_shm_region));
+        free(shm);
+        return NULL;
+    }
+    __atomic_store_n(&shm->reg->pid[SHM_SERVER], getpid(), __ATOMIC_RELEASE);
+    return shm;
+}
+
+void dp_shm_release(dp_shm *shm) {
+    munmap(shm->reg, sizeof(dp_shm_region));
+    if (shm->fd >= 0)
+        close(shm->fd);
+    free(shm);
+}
+
+//moves dp off its UDP socket and onto the rings; dpclose() gives the region back
+void dp_shm_use(dp_connp dp, dp_shm *shm) {
+    dp->tp = &dp_shm_transport;
+    dp->tpCtx = shm;
+}
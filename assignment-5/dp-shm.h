@@ -0,0 +1,35 @@
+#ifndef __DP_SHM_H__
+#define __DP_SHM_H__
+
+#include "du-proto.h"
+
+/*
+ * Shared memory transport for a client and server on the same host.  The
+ * client makes a memfd holding two single producer, single consumer byte
+ * rings, one per direction, and describes it in a dp_shm_offer carried by
+ * its CONNECT.  A server that sees the CONNECT come from a loopback address
+ * maps the same memfd through /proc/<pid>/fd/<fd> and echoes the offer in
+ * its CNTACK; from then on both ends move datagrams through the rings
+ * instead of the UDP socket.  A reader with nothing to read sleeps on a
+ * futex in the ring, and the writer only makes the wake up call when the
+ * reader says it is sleeping.  The rings never lose or reorder a datagram,
+ * so the transport is marked reliable and du-proto sends no ACKs over it.
+ */
+#define DP_SHM_MAGIC        0x44505348      //"DPSH"
+#define DP_SHM_RING_SZ      (1 << 20)       //bytes per direction, a power of 2
+
+typedef struct dp_shm_offer {
+    unsigned int        magic;
+    int                 pid;            //the client, whose fd table holds the memfd
+    int                 fd;
+    unsigned int        size;
+} dp_shm_offer;
+
+typedef struct dp_shm dp_shm;
+
+dp_shm *dp_shm_create(dp_shm_offer *offer);
+dp_shm *dp_shm_open(const dp_shm_offer *offer);
+void    dp_shm_release(dp_shm *shm);
+void    dp_shm_use(dp_connp dp, dp_shm *shm);
+
+#endif
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dp-sim.h"
+
+#define SIM_START_NS    1000000000ull   //virtual time starts here so no timestamp is ever 0
+
+typedef struct dp_sim_pkt {
+    struct dp_sim_pkt  *next;
+    unsigned long long  due_ns;
+    int                 len;
+    char                data[];
+} dp_sim_pkt;
+
+typedef struct dp_sim_end {
+    struct dp_sim      *sim;
+    struct dp_sim_end  *peer;
+    int                 attached;
+    int                 blocked;        //waiting in sim_recv() for time to move
+    int                 stuck;          //woken because nothing could ever arrive
+    unsigned long long  deadline_ns;
+    pthread_cond_t      wake;
+    dp_sim_pkt         *inbox;          //in flight to this end, by arrival time
+    unsigned long long  link_free_ns;   //when our direction of the link is idle again
+    unsigned long long  rng;
+} dp_sim_end;
+
+struct dp_sim {
+    dp_sim_cfg          cfg;
+    pthread_mutex_t     lock;
+    unsigned long long  now_ns;
+    int                 running;        //attached ends not blocked in sim_recv()
+    int                 paired;
+    dp_sim_end          end[2];         //server, client
+};
+
+//same generator as dp-impair: xorshift64* seeded through splitmix64
+static unsigned long long rng_next(dp_sim_end *e) {
+    e->rng ^= e->rng >> 12;
+    e->rng ^= e->rng << 25;
+    e->rng ^= e->rng >> 27;
+    return e->rng * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned long long splitmix64(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+/*
+ *  Parses a comma separated list like "bw=10M,delay=50,loss=1" into cfg.
+ *  bw is bits per second and takes K, M or G; delay and jitter are
+ *  milliseconds; loss is a percentage.  Returns 0, or -1 naming the bad key.
+ */
+int dp_sim_parse(const char *spec, dp_sim_cfg *cfg) {
+    char copy[256];
+    char *save, *tok;
+
+    memset(cfg, 0, sizeof(dp_sim_cfg));
+    cfg->seed = 1;
+    snprintf(copy, sizeof(copy), "%s", spec);
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (val == NULL) {
+            printf("ERROR:  simulated link setting %s needs a value\n", tok);
+            return -1;
+        }
+        *val++ = '\0';
+
+        if (strcmp(tok, "bw") == 0) {
+            char *unit;
+            cfg->bandwidth = strtod(val, &unit);
+            if (*unit == 'K' || *unit == 'k')
+                cfg->bandwidth *= 1e3;
+            else if (*unit == 'M' || *unit == 'm')
+                cfg->bandwidth *= 1e6;
+            else if (*unit == 'G' || *unit == 'g')
+                cfg->bandwidth *= 1e9;
+        } else if (strcmp(tok, "delay") == 0)
+            cfg->delay_ms = atof(val);
+        else if (strcmp(tok, "jitter") == 0)
+            cfg->jitter_ms = atof(val);
+        else if (strcmp(tok, "loss") == 0)
+            cfg->loss = atof(val);
+        else if (strcmp(tok, "seed") == 0)
+            cfg->seed = strtoull(val, NULL, 0);
+        else {
+            printf("ERROR:  unknown simulated link setting %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+dp_sim *dp_sim_new(const dp_sim_cfg *cfg) {
+    dp_sim *sim = calloc(1, sizeof(dp_sim));
+    if (sim == NULL)
+        return NULL;
+
+    sim->cfg = *cfg;
+    sim->now_ns = SIM_START_NS;
+    pthread_mutex_init(&sim->lock, NULL);
+    for (int i = 0; i < 2; i++) {
+        dp_sim_end *e = &sim->end[i];
+        e->sim = sim;
+        e->peer = &sim->end[1 - i];
+        e->rng = splitmix64(cfg->seed + i * 0x9E3779B97F4A7C15ull);
+        if (e->rng == 0)
+            e->rng = 1;
+        pthread_cond_init(&e->wake, NULL);
+    }
+    return sim;
+}
+
+//only once both ends have been through dpclose()
+void dp_sim_free(dp_sim *sim) {
+    for (int i = 0; i < 2; i++)
+        pthread_cond_destroy(&sim->end[i].wake);
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+static void wake_end(dp_sim *sim, dp_sim_end *e) {
+    e->blocked = 0;
+    sim->running++;
+    pthread_cond_signal(&e->wake);
+}
+
+/*
+ *  Called with the lock held once no end is running.  Moves the clock to
+ *  the earliest arrival or deadline any blocked end is waiting for and
+ *  wakes every end that has something to do at that instant.  If nothing
+ *  is in flight and nobody has a deadline, the ends are waiting on each
+ *  other (or on a peer that closed) and would sleep forever, so they are
+ *  woken stuck instead.
+ */
+static void sim_advance(dp_sim *sim) {
+    unsigned long long next = 0;
+
+    for (int i = 0; i < 2; i++) {
+        dp_sim_end *e = &sim->end[i];
+        if (!e->attached || !e->blocked)
+            continue;
+        if (e->inbox != NULL && (next == 0 || e->inbox->due_ns < next))
+            next = e->inbox->due_ns;
+        if (e->deadline_ns != 0 && (next == 0 || e->deadline_ns < next))
+            next = e->deadline_ns;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        dp_sim_end *e = &sim->end[i];
+        if (!e->attached || !e->blocked)
+            continue;
+        if (next == 0) {
+            e->stuck = 1;
+            wake_end(sim, e);
+        }
+    }
+    if (next == 0)
+        return;
+
+    if (next > sim->now_ns)
+        sim->now_ns = next;
+    for (int i = 0; i < 2; i++) {
+        dp_sim_end *e = &sim->end[i];
+        if (!e->attached || !e->blocked)
+            continue;
+        if ((e->inbox != NULL && e->inbox->due_ns <= sim->now_ns) ||
+            (e->deadline_ns != 0 && e->deadline_ns <= sim->now_ns))
+            wake_end(sim, e);
+    }
+}
+
+static int sim_send(dp_connp dp, const void *buff, int len) {
+    dp_sim_end *e = dp->tpCtx;
+    dp_sim *sim = e->sim;
+    const dp_sim_cfg *cfg = &sim->cfg;
+
+    pthread_mutex_lock(&sim->lock);
+
+    //the datagram holds our side of the link for its serialization time whether or not it survives
+    unsigned long long start = e->link_free_ns > sim->now_ns ? e->link_free_ns : sim->now_ns;
+    unsigned long long txNs = cfg->bandwidth > 0 ? (unsigned long long)(len * 8e9 / cfg->bandwidth) : 0;
+    e->link_free_ns = start + txNs;
+
+    int lost = cfg->loss > 0 && (rng_next(e) >> 11) * (100.0 / 9007199254740992.0) < cfg->loss;
+    if (lost || !e->peer->attached) {
+        pthread_mutex_unlock(&sim->lock);
+        return len;
+    }
+
+    unsigned long long due = e->link_free_ns + (unsigned long long)(cfg->delay_ms * 1e6);
+    if (cfg->jitter_ms > 0)
+        due += rng_next(e) % ((unsigned long long)(cfg->jitter_ms * 1e6) + 1);
+
+    dp_sim_pkt *pkt = malloc(sizeof(dp_sim_pkt) + len);
+    if (pkt == NULL) {
+        pthread_mutex_unlock(&sim->lock);
+        return -1;
+    }
+    pkt->due_ns = due;
+    pkt->len = len;
+    memcpy(pkt->data, buff, len);
+
+    //after everything due at the same time or earlier, so ties keep the order they were sent in
+    dp_sim_pkt **at = &e->peer->inbox;
+    while (*at != NULL && (*at)->due_ns <= due)
+        at = &(*at)->next;
+    pkt->next = *at;
+    *at = pkt;
+
+    pthread_mutex_unlock(&sim->lock);
+    return len;
+}
+
+static void sim_unlock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+static int sim_recv(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns) {
+    dp_sim_end *e = dp->tpCtx;
+    dp_sim *sim = e->sim;
+    int rc;
+
+    pthread_mutex_lock(&sim->lock);
+    pthread_cleanup_push(sim_unlock, &sim->lock);
+    while (1) {
+        dp_sim_pkt *pkt = e->inbox;
+        if (pkt != NULL && pkt->due_ns <= sim->now_ns) {
+            e->inbox = pkt->next;
+            rc = pkt->len < buff_sz ? pkt->len : buff_sz;
+            memcpy(buff, pkt->data, rc);
+            free(pkt);
+            break;
+        }
+        if (deadline_ns != 0 && sim->now_ns >= deadline_ns) {
+            rc = DP_ERROR_TIMEOUT;
+            break;
+        }
+
+        e->blocked = 1;
+        e->deadline_ns = deadline_ns;
+        if (--sim->running == 0)
+            sim_advance(sim);
+        while (e->blocked)
+            pthread_cond_wait(&e->wake, &sim->lock);
+        if (e->stuck) {
+            e->stuck = 0;
+            printf("dp-sim: nothing in flight and no timeout left to wait for\n");
+            rc = -1;
+            break;
+        }
+    }
+    pthread_cleanup_pop(1);
+    return rc;
+}
+
+static unsigned long long sim_now(dp_connp dp) {
+    dp_sim_end *e = dp->tpCtx;
+    pthread_mutex_lock(&e->sim->lock);
+    unsigned long long now = e->sim->now_ns;
+    pthread_mutex_unlock(&e->sim->lock);
+    return now;
+}
+
+//the end stops counting towards the clock, and whatever was still in flight to it is lost
+static void sim_close(dp_connp dp) {
+    dp_sim_end *e = dp->tpCtx;
+    dp_sim *sim = e->sim;
+
+    pthread_mutex_lock(&sim->lock);
+    if (!e->blocked)
+        sim->running--;
+    e->attached = 0;
+    e->blocked = 0;
+    while (e->inbox != NULL) {
+        dp_sim_pkt *pkt = e->inbox;
+        e->inbox = pkt->next;
+        free(pkt);
+    }
+    if (sim->running == 0)
+        sim_advance(sim);
+    pthread_mutex_unlock(&sim->lock);
+}
+
+static const dp_transport dp_sim_transport = {
+    .send   = sim_send,
+    .recv   = sim_recv,
+    .now_ns = sim_now,
+    .close  = sim_close,
+};
+
+/*
+ *  Makes the two ends of the link.  The server end is used with dplisten()
+ *  and the client end with dpconnect(), each from its own thread.  A sim
+ *  has exactly one link, so this works once.
+ */
+int dp_sim_pair(dp_sim *sim, dp_connp *server, dp_connp *client) {
+    if (sim->paired)
+        return -1;
+
+    *server = dpTransportInit(&dp_sim_transport, &sim->end[0]);
+    *client = dpTransportInit(&dp_sim_transport, &sim->end[1]);
+    if (*server == NULL || *client == NULL)
+        return -1;
+
+    pthread_mutex_lock(&sim->lock);
+    sim->paired = 1;
+    sim->end[0].attached = 1;
+    sim->end[1].attached = 1;
+    sim->running = 2;
+    pthread_mutex_unlock(&sim->lock);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __DP_SIM_H__
+#define __DP_SIM_H__
+
+#include "du-proto.h"
+
+/*
+ * A simulated network for du-proto.  dp_sim_pair() makes the two ends of
+ * one link as ordinary dp connections, each meant to be driven by its own
+ * thread in the same process.  Datagrams never touch a socket: a send is
+ * queued for the peer with the time it will arrive, after waiting for the
+ * link (bandwidth), the propagation delay and a random jitter, unless the
+ * loss roll drops it.  Time is virtual.  It stands still while either end
+ * is running and jumps straight to the next arrival or timeout once both
+ * are blocked receiving, so a 100 ms link costs no wall time at all and
+ * the same seed always gives the same run, down to the RTT samples.
+ */
+typedef struct dp_sim_cfg {
+    double              bandwidth;      //bits per second each way, 0 is unlimited
+    double              delay_ms;       //one way propagation delay
+    double              jitter_ms;      //plus 0..jitter_ms more on each datagram
+    double              loss;           //percent of datagrams dropped
+    unsigned long long  seed;
+} dp_sim_cfg;
+
+typedef struct dp_sim dp_sim;
+
+int     dp_sim_parse(const char *spec, dp_sim_cfg *cfg);
+dp_sim *dp_sim_new(const dp_sim_cfg *cfg);
+void    dp_sim_free(dp_sim *sim);
+int     dp_sim_pair(dp_sim *sim, dp_connp *server, dp_connp *client);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "dp-trace.h"
+#include "du-proto.h"
+
+int dp_trace_level = DP_TRACE_OFF;
+
+/*
+ * Each thread owns one ring and is its only writer, so emitting needs no
+ * lock: fill the slot, then publish it by bumping head.  Rings are never
+ * freed.  When a thread exits its ring is handed to the next thread that
+ * traces, which keeps memory bounded by the number of live threads in the
+ * -m server while the old records stay dumpable until overwritten.
+ */
+typedef struct dp_trace_ring {
+    uint64_t                head;
+    uint32_t                tid;
+    int                     owned;
+    struct dp_trace_ring    *next;
+    dp_trace_rec            recs[DP_TRACE_RING_SZ];
+} dp_trace_ring;
+
+static dp_trace_ring *_rings;
+static pthread_mutex_t _ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t _ringKey;
+static __thread dp_trace_ring *_myRing;
+
+static void ring_release(void *arg) {
+    dp_trace_ring *r = arg;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&_ringKey, ring_release);
+}
+
+static dp_trace_ring *ring_attach(void) {
+    dp_trace_ring *r;
+
+    pthread_once(&_keyOnce, ring_key_init);
+    pthread_mutex_lock(&_ringsLock);
+    for (r = _rings; r != NULL; r = r->next) {
+        if (!r->owned)
+            break;
+    }
+    if (r == NULL && (r = calloc(1, sizeof(dp_trace_ring))) != NULL) {
+        r->next = _rings;
+        //published last so a dump walking the list never sees a half built ring
+        __atomic_store_n(&_rings, r, __ATOMIC_RELEASE);
+    }
+    if (r != NULL) {
+        r->owned = 1;
+        r->tid = syscall(SYS_gettid);
+        pthread_setspecific(_ringKey, r);
+    }
+    pthread_mutex_unlock(&_ringsLock);
+    _myRing = r;
+    return r;
+}
+
+void dp_trace_set_level(int level) {
+    dp_trace_level = level < DP_TRACE_OFF ? DP_TRACE_OFF : level;
+}
+
+void dp_trace_emit(int kind, const void *body, int len) {
+    dp_trace_ring *r = _myRing != NULL ? _myRing : ring_attach();
+    struct timespec ts;
+
+    if (r == NULL)
+        return;
+    if (len > DP_TRACE_BODY_SZ)
+        len = DP_TRACE_BODY_SZ;
+
+    uint64_t h = r->head;
+    dp_trace_rec *rec = &r->recs[h & (DP_TRACE_RING_SZ - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->tid = r->tid;
+    rec->kind = kind;
+    rec->len = len;
+    memcpy(rec->body, body, len);
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *buff, size_t len) {
+    const char *p = buff;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ *  Writes the retained records of every ring to path.  Only open/write are
+ *  used and the ring list is walked without its lock, so this may be called
+ *  from a SIGINT handler.  Returns the number of records written or -1.
+ */
+int dp_trace_dump(const char *path) {
+    dp_trace_file_hdr hdr = { DP_TRACE_MAGIC, DP_TRACE_VERSION, sizeof(dp_trace_rec), 0 };
+    int count = 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    if (write_all(fd, &hdr, sizeof(hdr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    for (dp_trace_ring *r = __atomic_load_n(&_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > DP_TRACE_RING_SZ ? head - DP_TRACE_RING_SZ : 0;
+
+        //the retained window may wrap around the end of the array
+        uint64_t start = first & (DP_TRACE_RING_SZ - 1);
+        uint64_t n = head - first;
+        uint64_t tail = n < DP_TRACE_RING_SZ - start ? n : DP_TRACE_RING_SZ - start;
+        if (write_all(fd, &r->recs[start], tail * sizeof(dp_trace_rec)) < 0 ||
+            write_all(fd, &r->recs[0], (n - tail) * sizeof(dp_trace_rec)) < 0) {
+            close(fd);
+            return -1;
+        }
+        count += n;
+    }
+    close(fd);
+    return count;
+}
+
+//the DP_MT_FRAGMENT bit is left for the caller to show
+const char *dp_trace_mtype_name(int mtype) {
+    switch (mtype & ~DP_MT_FRAGMENT) {
+        case DP_MT_ACK:         return "ACK";
+        case DP_MT_SND:         return "SEND";
+        case DP_MT_CONNECT:     return "CONNECT";
+        case DP_MT_CLOSE:       return "CLOSE";
+        case DP_MT_NACK:        return "NACK";
+        case DP_MT_SNDACK:      return "SEND/ACK";
+        case DP_MT_CNTACK:      return "CONNECT/ACK";
+        case DP_MT_CLOSEACK:    return "CLOSE/ACK";
+        case DP_MT_KEEPALIVE:   return "KEEPALIVE";
+        case DP_MT_KEEPACK:     return "KEEPALIVE/ACK";
+        default:                return "***UNKNOWN***";
+    }
+}
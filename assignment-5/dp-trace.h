@@ -0,0 +1,67 @@
+#ifndef __DP_TRACE_H__
+#define __DP_TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Level gated tracing for du-proto and du-ftp.  A trace point that is off
+ * costs one predicted-not-taken branch on dp_trace_level; one above
+ * DP_TRACE_MAX_LEVEL is compiled out entirely (build with
+ * -DDP_TRACE_MAX_LEVEL=0 to drop them all).  A trace point that is on
+ * copies a fixed size binary record into the calling thread's ring, so
+ * nothing is formatted or written while the transfer runs.  The rings are
+ * written to a file by dp_trace_dump() and turned back into text offline
+ * by trace-decode.
+ */
+#define DP_TRACE_OFF        0
+#define DP_TRACE_MSG        1       //du-ftp messages
+#define DP_TRACE_PDU        2       //plus every du-proto datagram header
+#define DP_TRACE_DATA       3       //plus the first bytes of every payload
+
+#ifndef DP_TRACE_MAX_LEVEL
+#define DP_TRACE_MAX_LEVEL  DP_TRACE_DATA
+#endif
+
+//record kinds
+#define DP_TR_PDU_IN        1       //body is the dp_pdu
+#define DP_TR_PDU_OUT       2
+#define DP_TR_FTP_IN        3       //body is an ftp_trace_body, see ftp-debug.h
+#define DP_TR_FTP_OUT       4
+#define DP_TR_DATA          5       //body is a payload prefix
+
+#define DP_TRACE_BODY_SZ    48
+#define DP_TRACE_RING_SZ    4096    //records per thread, must be a power of 2
+
+typedef struct dp_trace_rec {
+    uint64_t        ts_ns;          //CLOCK_MONOTONIC
+    uint32_t        tid;
+    uint16_t        kind;
+    uint16_t        len;            //body bytes in use
+    unsigned char   body[DP_TRACE_BODY_SZ];
+} dp_trace_rec;
+
+//dump file: one header followed by records, oldest first per thread
+#define DP_TRACE_MAGIC      0x52545044  //"DPTR"
+#define DP_TRACE_VERSION    1
+
+typedef struct dp_trace_file_hdr {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    rec_size;
+    uint32_t    pad;
+} dp_trace_file_hdr;
+
+extern int dp_trace_level;
+
+#define DP_TRACE_ON(lvl) \
+    ((lvl) <= DP_TRACE_MAX_LEVEL && __builtin_expect(dp_trace_level >= (lvl), 0))
+
+#define dp_trace(lvl, kind, body, len) \
+    do { if (DP_TRACE_ON(lvl)) dp_trace_emit((kind), (body), (len)); } while (0)
+
+void dp_trace_set_level(int level);
+void dp_trace_emit(int kind, const void *body, int len);
+int  dp_trace_dump(const char *path);
+const char *dp_trace_mtype_name(int mtype);
+
+#endif
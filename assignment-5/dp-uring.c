@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <linux/io_uring.h>
+
+#include "dp-uring.h"
+
+#define UR_BGID         0
+#define UR_RBUF_SZ      (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + DP_MAX_DGRAM_SZ)
+#define UR_NO_BUF       0xffff          //a receive queue entry that is an error, not a datagram
+
+//what a completion is for, in the top half of its user_data
+#define UR_RECV         1
+#define UR_SEND         2
+#define UR_WRITE        3
+#define UR_CANCEL       4
+#define UR_TAG(kind, i) ((unsigned long long)(kind) << 32 | (unsigned)(i))
+
+#define WB_FREE         0
+#define WB_LENT         1               //with the application
+#define WB_WRITING      2
+
+typedef struct ur_send {
+    struct msghdr       msg;
+    struct iovec        iov;
+    struct sockaddr_in  to;
+    int                 busy;
+    char                data[DP_MAX_DGRAM_SZ];
+} ur_send;
+
+typedef struct dp_uring {
+    int                 fd;
+    int                 sock;
+    unsigned           *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned           *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void               *sqRing, *cqRing;
+    size_t              sqRingSz, cqRingSz, sqesSz;
+    unsigned            sqEntries;
+    unsigned            sqLocal;        //our tail, published to the kernel on enter
+    unsigned            pending;        //queued and not yet submitted
+
+    struct io_uring_buf_ring *br;
+    unsigned short      brTail;
+    char               *rbufs;
+    struct msghdr       rmsg;           //what the multishot receive lays out in each buffer
+    int                 recvArmed;
+    unsigned short      rqBid[2 * DP_URING_RBUFS];      //received and not yet taken, in order
+    int                 rqRes[2 * DP_URING_RBUFS];
+    unsigned            rqHead, rqCount;
+
+    ur_send             sends[DP_URING_SENDS];
+    unsigned            nextSend;
+    int                 sendsBusy;
+
+    char               *wbufs;
+    int                 wstate[DP_URING_WBUFS];
+    int                 wlen[DP_URING_WBUFS];
+    int                 writing;
+    int                 writeErr;
+} dp_uring;
+
+static int ur_recv(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns);
+static int ur_send_dgram(dp_connp dp, const void *buff, int len);
+static unsigned long long ur_now(dp_connp dp);
+static void ur_close(dp_connp dp);
+
+static const dp_transport dp_uring_transport = {
+    .send   = ur_send_dgram,
+    .recv   = ur_recv,
+    .now_ns = ur_now,
+    .close  = ur_close,
+};
+
+static unsigned long long ur_now(dp_connp dp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *  Submits whatever is queued and, if wait is set, sleeps for at least one
+ *  completion or until timeout_ns (0 is forever) passes.  Returns what
+ *  io_uring_enter() did, or -errno.
+ */
+static int ur_enter(dp_uring *ur, int wait, unsigned long long timeout_ns) {
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    int rc;
+
+    __atomic_store_n(ur->sqTail, ur->sqLocal, __ATOMIC_RELEASE);
+    if (wait && timeout_ns > 0) {
+        ts.tv_sec = timeout_ns / 1000000000ull;
+        ts.tv_nsec = timeout_ns % 1000000000ull;
+        arg.ts = (unsigned long long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    rc = syscall(__NR_io_uring_enter, ur->fd, ur->pending, wait ? 1 : 0, flags,
+                 flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    if (rc < 0)
+        return -errno;
+    ur->pending -= rc;
+    return rc;
+}
+
+//the next free submission entry, cleared; full means submitting what is there first
+static struct io_uring_sqe *ur_sqe(dp_uring *ur) {
+    while (ur->sqLocal - __atomic_load_n(ur->sqHead, __ATOMIC_ACQUIRE) >= ur->sqEntries)
+        ur_enter(ur, 0, 0);
+
+    unsigned idx = ur->sqLocal & *ur->sqMask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sqArray[idx] = idx;
+    ur->sqLocal++;
+    ur->pending++;
+    return sqe;
+}
+
+static void ur_give_rbuf(dp_uring *ur, unsigned short bid) {
+    struct io_uring_buf *b = &ur->br->bufs[ur->brTail & (DP_URING_RBUFS - 1)];
+
+    b->addr = (unsigned long long)(ur->rbufs + bid * UR_RBUF_SZ);
+    b->len = UR_RBUF_SZ;
+    b->bid = bid;
+    ur->brTail++;
+    __atomic_store_n(&ur->br->tail, ur->brTail, __ATOMIC_RELEASE);
+}
+
+static void ur_arm_recv(dp_uring *ur) {
+    struct io_uring_sqe *sqe = ur_sqe(ur);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ur->sock;
+    sqe->addr = (unsigned long long)&ur->rmsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->user_data = UR_TAG(UR_RECV, 0);
+    ur->recvArmed = 1;
+}
+
+static void ur_queue_recv(dp_uring *ur, unsigned short bid, int res) {
+    unsigned at = (ur->rqHead + ur->rqCount) % (2 * DP_URING_RBUFS);
+    ur->rqBid[at] = bid;
+    ur->rqRes[at] = res;
+    ur->rqCount++;
+}
+
+/*
+ *  Goes through the completion queue.  Datagrams are queued for ur_recv()
+ *  in the order they came in.  The multishot receive stops when it runs out
+ *  of buffers (everything is waiting in our queue) or the socket is shut
+ *  down; the next ur_recv() posts it again.
+ */
+static void ur_reap(dp_uring *ur) {
+    unsigned head = *ur->cqHead;
+    unsigned tail = __atomic_load_n(ur->cqTail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cqMask];
+        unsigned kind = cqe->user_data >> 32;
+        unsigned i = (unsigned)cqe->user_data;
+
+        switch (kind) {
+            case UR_RECV:
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    ur->recvArmed = 0;
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                    ur_queue_recv(ur, cqe->flags >> IORING_CQE_BUFFER_SHIFT, cqe->res);
+                else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+                    ur_queue_recv(ur, UR_NO_BUF, cqe->res);
+                break;
+            case UR_SEND:
+                ur->sends[i].busy = 0;
+                ur->sendsBusy--;
+                break;
+            case UR_WRITE:
+                if (cqe->res != ur->wlen[i])
+                    ur->writeErr = 1;
+                ur->wstate[i] = WB_FREE;
+                ur->writing--;
+                break;
+        }
+    }
+    __atomic_store_n(ur->cqHead, head, __ATOMIC_RELEASE);
+}
+
+static int ur_recv(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns) {
+    dp_uring *ur = dp->tpCtx;
+
+    while (ur->rqCount == 0) {
+        unsigned long long wait = 0;
+
+        if (!ur->recvArmed)
+            ur_arm_recv(ur);
+        if (deadline_ns != 0) {
+            unsigned long long now = ur_now(dp);
+            if (now >= deadline_ns) {
+                //our ACK may be queued behind the deadline, it still has to go
+                if (ur->pending > 0)
+                    ur_enter(ur, 0, 0);
+                return DP_ERROR_TIMEOUT;
+            }
+            wait = deadline_ns - now;
+        }
+        //the reaper's shutdown() does not reach a receive posted on the ring, so look in on it every tick
+        if (dp->idleMs > 0) {
+            if (__atomic_load_n(&dp->idleExpired, __ATOMIC_ACQUIRE))
+                return -1;
+            if (wait == 0 || wait > DP_WHEEL_TICK_MS * 1000000ull)
+                wait = DP_WHEEL_TICK_MS * 1000000ull;
+        }
+        int rc = ur_enter(ur, 1, wait);
+        if (rc < 0 && rc != -ETIME && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+            errno = -rc;
+            perror("dp-uring: io_uring_enter");
+            return -1;
+        }
+        ur_reap(ur);
+    }
+    //a datagram was already in, but whatever we queued since still has to be sent
+    if (ur->pending > 0) {
+        ur_enter(ur, 0, 0);
+        ur_reap(ur);
+    }
+
+    unsigned short bid = ur->rqBid[ur->rqHead];
+    int res = ur->rqRes[ur->rqHead];
+    ur->rqHead = (ur->rqHead + 1) % (2 * DP_URING_RBUFS);
+    ur->rqCount--;
+    if (bid == UR_NO_BUF)
+        return res < 0 ? -1 : 0;
+
+    //[recvmsg_out][sender's address][datagram]; the sender is recorded the way recvfrom() does it
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)(ur->rbufs + bid * UR_RBUF_SZ);
+    char *name = (char *)(out + 1);
+    char *payload = name + ur->rmsg.msg_namelen;
+    int len = out->payloadlen < (unsigned)buff_sz ? (int)out->payloadlen : buff_sz;
+
+    if (out->namelen >= sizeof(struct sockaddr_in)) {
+        memcpy(&dp->outSockAddr.addr, name, sizeof(struct sockaddr_in));
+        dp->outSockAddr.len = sizeof(struct sockaddr_in);
+        dp->outSockAddr.isAddrInit = true;
+    }
+    if (len > UR_RBUF_SZ - (int)(payload - (char *)out))
+        len = UR_RBUF_SZ - (int)(payload - (char *)out);
+    memcpy(buff, payload, len);
+    ur_give_rbuf(ur, bid);
+    return len;
+}
+
+//queued, not sent; the next ur_enter() takes it to the kernel along with whatever else is waiting
+static int ur_send_dgram(dp_connp dp, const void *buff, int len) {
+    dp_uring *ur = dp->tpCtx;
+
+    if (len > DP_MAX_DGRAM_SZ)
+        return -1;
+    while (ur->sends[ur->nextSend].busy) {
+        if (ur->sendsBusy < DP_URING_SENDS) {
+            ur->nextSend = (ur->nextSend + 1) % DP_URING_SENDS;
+            continue;
+        }
+        ur_enter(ur, 1, 0);
+        ur_reap(ur);
+    }
+
+    unsigned i = ur->nextSend;
+    ur_send *s = &ur->sends[i];
+    ur->nextSend = (i + 1) % DP_URING_SENDS;
+    memcpy(s->data, buff, len);
+    s->iov.iov_base = s->data;
+    s->iov.iov_len = len;
+    s->to = dp->outSockAddr.addr;
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_name = &s->to;
+    s->msg.msg_namelen = dp->outSockAddr.len;
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    s->busy = 1;
+    ur->sendsBusy++;
+
+    struct io_uring_sqe *sqe = ur_sqe(ur);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = ur->sock;
+    sqe->addr = (unsigned long long)&s->msg;
+    sqe->len = 1;
+    sqe->user_data = UR_TAG(UR_SEND, i);
+    return len;
+}
+
+static void ur_free(dp_uring *ur) {
+    if (ur->fd >= 0)
+        close(ur->fd);
+    if (ur->sqes != NULL && ur->sqes != MAP_FAILED)
+        munmap(ur->sqes, ur->sqesSz);
+    if (ur->cqRing != NULL && ur->cqRing != MAP_FAILED && ur->cqRing != ur->sqRing)
+        munmap(ur->cqRing, ur->cqRingSz);
+    if (ur->sqRing != NULL && ur->sqRing != MAP_FAILED)
+        munmap(ur->sqRing, ur->sqRingSz);
+    if (ur->br != NULL && ur->br != MAP_FAILED)
+        munmap(ur->br, DP_URING_RBUFS * sizeof(struct io_uring_buf));
+    free(ur->rbufs);
+    free(ur->wbufs);
+    free(ur);
+}
+
+//every send and write done and the receive cancelled, so nothing touches our buffers once they are freed
+static void ur_close(dp_connp dp) {
+    dp_uring *ur = dp->tpCtx;
+
+    while (ur->pending > 0 || ur->sendsBusy > 0 || ur->writing > 0) {
+        int rc = ur_enter(ur, ur->sendsBusy > 0 || ur->writing > 0, 0);
+        if (rc < 0 && rc != -EINTR && rc != -ETIME)
+            break;
+        ur_reap(ur);
+    }
+    if (ur->recvArmed) {
+        struct io_uring_sqe *sqe = ur_sqe(ur);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UR_TAG(UR_RECV, 0);
+        sqe->user_data = UR_TAG(UR_CANCEL, 0);
+        while (ur->recvArmed) {
+            int rc = ur_enter(ur, 1, 0);
+            if (rc < 0 && rc != -EINTR && rc != -ETIME)
+                break;
+            ur_reap(ur);
+        }
+    }
+    ur_free(ur);
+    dp->tpCtx = NULL;
+}
+
+static dp_uring *ur_setup(int sock) {
+    struct io_uring_params p;
+    dp_uring *ur = calloc(1, sizeof(dp_uring));
+    if (ur == NULL)
+        return NULL;
+    ur->sock = sock;
+
+    //completions only when we ask for them, which we always do when we wait; older kernels get the plain ring
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    ur->fd = syscall(__NR_io_uring_setup, DP_URING_ENTRIES, &p);
+    if (ur->fd < 0) {
+        memset(&p, 0, sizeof(p));
+        ur->fd = syscall(__NR_io_uring_setup, DP_URING_ENTRIES, &p);
+    }
+    if (ur->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+        ur_free(ur);
+        return NULL;
+    }
+
+    ur->sqEntries = p.sq_entries;
+    ur->sqRingSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cqRingSz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cqRingSz > ur->sqRingSz)
+            ur->sqRingSz = ur->cqRingSz;
+        ur->cqRingSz = ur->sqRingSz;
+    }
+    ur->sqRing = mmap(NULL, ur->sqRingSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sqRing == MAP_FAILED) {
+        ur_free(ur);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ur->cqRing = ur->sqRing;
+    else
+        ur->cqRing = mmap(NULL, ur->cqRingSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    ur->sqesSz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqesSz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->cqRing == MAP_FAILED || ur->sqes == MAP_FAILED) {
+        ur_free(ur);
+        return NULL;
+    }
+    ur->sqHead = (unsigned *)((char *)ur->sqRing + p.sq_off.head);
+    ur->sqTail = (unsigned *)((char *)ur->sqRing + p.sq_off.tail);
+    ur->sqMask = (unsigned *)((char *)ur->sqRing + p.sq_off.ring_mask);
+    ur->sqArray = (unsigned *)((char *)ur->sqRing + p.sq_off.array);
+    ur->cqHead = (unsigned *)((char *)ur->cqRing + p.cq_off.head);
+    ur->cqTail = (unsigned *)((char *)ur->cqRing + p.cq_off.tail);
+    ur->cqMask = (unsigned *)((char *)ur->cqRing + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)((char *)ur->cqRing + p.cq_off.cqes);
+    ur->sqLocal = *ur->sqTail;
+
+    //the receive buffers, handed to the kernel through a registered ring
+    ur->br = mmap(NULL, DP_URING_RBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ur->rbufs = malloc(DP_URING_RBUFS * UR_RBUF_SZ);
+    ur->wbufs = aligned_alloc(DP_URING_WBUF_SZ, DP_URING_WBUFS * DP_URING_WBUF_SZ);
+    if (ur->br == MAP_FAILED || ur->rbufs == NULL || ur->wbufs == NULL) {
+        ur_free(ur);
+        return NULL;
+    }
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (unsigned long long)ur->br,
+        .ring_entries = DP_URING_RBUFS,
+        .bgid = UR_BGID,
+    };
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        ur_free(ur);
+        return NULL;
+    }
+    for (int i = 0; i < DP_URING_RBUFS; i++)
+        ur_give_rbuf(ur, i);
+    ur->rmsg.msg_namelen = sizeof(struct sockaddr_in);
+    return ur;
+}
+
+/*
+ *  Moves a connection's UDP socket onto a ring of its own; call it from the
+ *  thread that will run the connection.  Returns 0, or -1 leaving the
+ *  connection as it was when it is not a plain UDP one (a simulated link,
+ *  shared memory now or once the CNTACK goes out, or one under impairment,
+ *  whose sends dp-impair makes itself) or the kernel has no io_uring for us.
+ */
+int dp_uring_use(dp_connp dp) {
+    if (dp->udp_sock < 0 || dp->tpCtx != NULL || dp->tp->reliable || dp->impair != NULL || dp->shmPending != NULL)
+        return -1;
+
+    dp_uring *ur = ur_setup(dp->udp_sock);
+    if (ur == NULL)
+        return -1;
+    //the provided buffers hold one datagram, so a coalesced run from UDP_GRO would not fit
+    if (dp->groOn && setsockopt(dp->udp_sock, SOL_UDP, UDP_GRO, &(int){0}, sizeof(int)) == 0)
+        dp->groOn = false;
+    if (dp->groOn) {
+        ur_free(ur);
+        return -1;
+    }
+    dp->tp = &dp_uring_transport;
+    dp->tpCtx = ur;
+    return 0;
+}
+
+//a buffer of DP_URING_WBUF_SZ bytes, waiting for a write to finish if all are busy; NULL off the ring
+char *dp_uring_wbuf(dp_connp dp) {
+    if (dp->tp != &dp_uring_transport)
+        return NULL;
+    dp_uring *ur = dp->tpCtx;
+
+    while (1) {
+        for (int i = 0; i < DP_URING_WBUFS; i++) {
+            if (ur->wstate[i] == WB_FREE) {
+                ur->wstate[i] = WB_LENT;
+                return ur->wbufs + i * DP_URING_WBUF_SZ;
+            }
+        }
+        if (ur->writing == 0)
+            return NULL;
+        ur_enter(ur, 1, 0);
+        ur_reap(ur);
+    }
+}
+
+void dp_uring_wbuf_put(dp_connp dp, char *buf) {
+    if (buf == NULL || dp->tp != &dp_uring_transport)
+        return;
+    dp_uring *ur = dp->tpCtx;
+    ur->wstate[(buf - ur->wbufs) / DP_URING_WBUF_SZ] = WB_FREE;
+}
+
+/*
+ *  Queues a write of len bytes at data, which lies in a buffer from
+ *  dp_uring_wbuf(), to fd at offset off.  The buffer is the write's until
+ *  it completes and then goes back to the pool.  Returns 0, or -1 if dp is
+ *  not on the ring.
+ */
+int dp_uring_write(dp_connp dp, int fd, const char *data, int len, long long off) {
+    if (dp->tp != &dp_uring_transport)
+        return -1;
+    dp_uring *ur = dp->tpCtx;
+    int i = (data - ur->wbufs) / DP_URING_WBUF_SZ;
+
+    ur->wstate[i] = WB_WRITING;
+    ur->wlen[i] = len;
+    ur->writing++;
+
+    struct io_uring_sqe *sqe = ur_sqe(ur);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)data;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = UR_TAG(UR_WRITE, i);
+    return 0;
+}
+
+//0 once every queued write is done, -1 if any since the last drain failed or came up short
+int dp_uring_drain(dp_connp dp) {
+    if (dp->tp != &dp_uring_transport)
+        return 0;
+    dp_uring *ur = dp->tpCtx;
+
+    while (ur->writing > 0) {
+        int rc = ur_enter(ur, 1, 0);
+        if (rc < 0 && rc != -EINTR && rc != -ETIME)
+            break;
+        ur_reap(ur);
+    }
+    int rc = ur->writeErr || ur->writing > 0 ? -1 : 0;
+    ur->writeErr = 0;
+    return rc;
+}
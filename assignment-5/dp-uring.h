@@ -0,0 +1,36 @@
+#ifndef __DP_URING_H__
+#define __DP_URING_H__
+
+#include "du-proto.h"
+
+/*
+ * io_uring transport for a connection's UDP socket, through the raw
+ * syscalls so there is nothing to link.  A multishot receive stays posted
+ * on the socket and the kernel fills buffers from a ring we provide, so a
+ * datagram that is already in costs no syscall to pick up.  Sends (ACKs,
+ * mostly) are only queued, and go to the kernel in the same io_uring_enter
+ * that waits for the next datagram, so a stop-and-wait round trip is one
+ * syscall instead of a sendto() and a recvfrom().
+ *
+ * The same ring writes files.  dp_uring_wbuf() lends out a buffer from the
+ * connection's pool; receive or decode into it and dp_uring_write() queues
+ * a positioned write straight from it, after which the buffer belongs to
+ * the write until it completes.  The write goes out with the next
+ * datagram, so the disk works while we wait on the network.
+ * dp_uring_drain() waits for every write and reports whether any failed.
+ * All of it goes away with dpclose(), which first waits out what is still
+ * in flight.
+ */
+#define DP_URING_ENTRIES        256
+#define DP_URING_RBUFS          64              //provided receive buffers, a power of 2
+#define DP_URING_SENDS          32              //queued or in flight sends
+#define DP_URING_WBUFS          16
+#define DP_URING_WBUF_SZ        4096
+
+int   dp_uring_use(dp_connp dp);
+char *dp_uring_wbuf(dp_connp dp);
+void  dp_uring_wbuf_put(dp_connp dp, char *buf);
+int   dp_uring_write(dp_connp dp, int fd, const char *data, int len, long long off);
+int   dp_uring_drain(dp_connp dp);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dp-wheel.h"
+
+#define TICK_NS         (DP_WHEEL_TICK_MS * 1000000ull)
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  _wake = PTHREAD_COND_INITIALIZER;
+static dp_timer       *_slot[DP_WHEEL_SLOTS];
+static unsigned long long _tick;        //the last tick the reaper has been through
+static unsigned long long _baseNs;      //when tick 0 was
+static unsigned long long _armed;
+static int             _started;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void push(dp_timer *t, dp_timer **head) {
+    t->next = *head;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    _armed++;
+}
+
+//counted from now rather than from the last tick, so a timer never fires early
+static void link_timer(dp_timer *t, unsigned long long delay_ms) {
+    unsigned long long due = (now_ns() + delay_ms * 1000000ull - _baseNs + TICK_NS - 1) / TICK_NS;
+    unsigned long long ticks = due > _tick ? due - _tick : 1;
+
+    t->rounds = (ticks - 1) / DP_WHEEL_SLOTS;
+    push(t, &_slot[(_tick + ticks) & (DP_WHEEL_SLOTS - 1)]);
+}
+
+static void unlink_timer(dp_timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    _armed--;
+}
+
+/*
+ *  Everything in the slot comes off first, since a timer fired again a
+ *  whole number of turns later belongs in this same slot.  Timers with
+ *  turns to go just go back with one turn fewer.
+ */
+static void run_slot(dp_timer **head) {
+    dp_timer *t = *head;
+
+    *head = NULL;
+    while (t != NULL) {
+        dp_timer *next = t->next;
+        t->next = NULL;
+        t->pprev = NULL;
+        _armed--;
+        if (t->rounds > 0) {
+            t->rounds--;
+            push(t, head);
+        } else {
+            unsigned long long again = t->fire(t);
+            if (again > 0)
+                link_timer(t, again);
+        }
+        t = next;
+    }
+}
+
+static void *reaper(void *arg) {
+    pthread_mutex_lock(&_lock);
+    while (1) {
+        while (_armed == 0)
+            pthread_cond_wait(&_wake, &_lock);
+
+        unsigned long long next = _baseNs + (_tick + 1) * TICK_NS;
+        struct timespec at = { .tv_sec = next / 1000000000ull, .tv_nsec = next % 1000000000ull };
+        pthread_mutex_unlock(&_lock);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+            ;
+        pthread_mutex_lock(&_lock);
+
+        //a late wake up catches up on every tick it slept through
+        unsigned long long now = now_ns();
+        while (_baseNs + (_tick + 1) * TICK_NS <= now) {
+            _tick++;
+            run_slot(&_slot[_tick & (DP_WHEEL_SLOTS - 1)]);
+        }
+    }
+    return NULL;
+}
+
+//0, or -1 if the reaper thread could not be started
+int dp_timer_arm(dp_timer *t, unsigned long long delay_ms, unsigned long long (*fire)(dp_timer *t)) {
+    pthread_mutex_lock(&_lock);
+    if (!_started) {
+        pthread_t tid;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, reaper, NULL) != 0) {
+            pthread_mutex_unlock(&_lock);
+            perror("dp-wheel: cannot start the reaper thread");
+            return -1;
+        }
+        _started = 1;
+        _baseNs = now_ns();
+    }
+    if (t->pprev != NULL)
+        unlink_timer(t);
+    //nothing was armed, so the ticks the reaper slept through had nothing in them
+    if (_armed == 0)
+        _tick = (now_ns() - _baseNs) / TICK_NS;
+
+    t->fire = fire;
+    link_timer(t, delay_ms);
+    if (_armed == 1)
+        pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_lock);
+    return 0;
+}
+
+void dp_timer_cancel(dp_timer *t) {
+    pthread_mutex_lock(&_lock);
+    if (t->pprev != NULL)
+        unlink_timer(t);
+    pthread_mutex_unlock(&_lock);
+}
@@ -0,0 +1,30 @@
+#ifndef __DP_WHEEL_H__
+#define __DP_WHEEL_H__
+
+/*
+ * A hashed timing wheel, turned by one reaper thread, for timers that
+ * thousands of connections each keep running at once.  The wheel has
+ * DP_WHEEL_SLOTS slots of DP_WHEEL_TICK_MS each; a timer is linked into
+ * the slot its expiry falls in, with the number of whole turns still to
+ * go, so arming and cancelling are O(1) and a tick only looks at the one
+ * slot that is due.  The timer lives inside whatever it belongs to, so
+ * nothing is allocated.  fire runs on the reaper thread with the wheel
+ * locked and returns how many milliseconds later to fire again, or 0 to
+ * stop; once dp_timer_cancel() returns the timer is not firing and will
+ * not fire, so its owner can be freed.  The reaper starts with the first
+ * timer armed and sleeps whenever none are.
+ */
+#define DP_WHEEL_SLOTS          512             //a power of 2
+#define DP_WHEEL_TICK_MS        100
+
+typedef struct dp_timer {
+    struct dp_timer    *next;
+    struct dp_timer   **pprev;          //the link pointing at us, NULL when not armed
+    unsigned long long  rounds;         //whole turns of the wheel before we are due
+    unsigned long long (*fire)(struct dp_timer *t);
+} dp_timer;
+
+int  dp_timer_arm(dp_timer *t, unsigned long long delay_ms, unsigned long long (*fire)(dp_timer *t));
+void dp_timer_cancel(dp_timer *t);
+
+#endif
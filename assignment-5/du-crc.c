@@ -0,0 +1,152 @@
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define DP_CRC_HAVE_SSE42 1
+#endif
+
+#include "du-crc.h"
+
+#define CRC32C_POLY 0x82F63B78          //reflected Castagnoli polynomial
+
+//slice-by-8 tables, _crcTable[0] is the classic byte at a time table
+static uint32_t _crcTable[8][256];
+
+typedef uint32_t (*crc_fn)(uint32_t crc, const unsigned char *p, size_t len);
+static crc_fn   _crcImpl = NULL;
+static pthread_once_t _crcOnce = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        _crcTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            _crcTable[k][i] = (_crcTable[k - 1][i] >> 8) ^ _crcTable[0][_crcTable[k - 1][i] & 0xff];
+}
+
+/*
+ *  Portable path, 8 bytes per step using the slice-by-8 tables (assumes a
+ *  little endian host like the rest of the wire format).
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = _crcTable[7][lo & 0xff] ^ _crcTable[6][(lo >> 8) & 0xff] ^
+              _crcTable[5][(lo >> 16) & 0xff] ^ _crcTable[4][lo >> 24] ^
+              _crcTable[3][hi & 0xff] ^ _crcTable[2][(hi >> 8) & 0xff] ^
+              _crcTable[1][(hi >> 16) & 0xff] ^ _crcTable[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = _crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef DP_CRC_HAVE_SSE42
+/*
+ *  crc32 has a 3 cycle latency but issues every cycle, so one dependency
+ *  chain leaves two thirds of the unit idle.  Long buffers are split into
+ *  three lanes of CRC_LANE_SZ bytes that run interleaved; because the CRC
+ *  is linear the lanes are stitched back together by "shifting" a lane's
+ *  value over CRC_LANE_SZ zero bytes, which _crcShift does in 4 lookups.
+ */
+#define CRC_LANE_SZ     336             //3 lanes cover a 1 KB payload plus header
+
+static uint32_t _crcShift[4][256];
+
+static void crc32c_init_shift() {
+    static const unsigned char zeros[CRC_LANE_SZ];
+
+    for (int k = 0; k < 4; k++)
+        for (uint32_t b = 0; b < 256; b++)
+            _crcShift[k][b] = crc32c_table(b << (8 * k), zeros, CRC_LANE_SZ);
+}
+
+static inline uint32_t crc32c_shift(uint32_t crc) {
+    return _crcShift[0][crc & 0xff] ^ _crcShift[1][(crc >> 8) & 0xff] ^
+           _crcShift[2][(crc >> 16) & 0xff] ^ _crcShift[3][crc >> 24];
+}
+
+/*
+ *  Hardware path.  Compiled for SSE4.2 on its own so the rest of the
+ *  program does not require it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+#if defined(__x86_64__)
+    while (len >= 3 * CRC_LANE_SZ) {
+        uint64_t crcA = crc, crcB = 0, crcC = 0;
+        for (int i = 0; i < CRC_LANE_SZ; i += 8) {
+            uint64_t a, b, c;
+            memcpy(&a, p + i, 8);
+            memcpy(&b, p + CRC_LANE_SZ + i, 8);
+            memcpy(&c, p + 2 * CRC_LANE_SZ + i, 8);
+            crcA = _mm_crc32_u64(crcA, a);
+            crcB = _mm_crc32_u64(crcB, b);
+            crcC = _mm_crc32_u64(crcC, c);
+        }
+        crc = crc32c_shift(crc32c_shift((uint32_t)crcA) ^ (uint32_t)crcB) ^ (uint32_t)crcC;
+        p += 3 * CRC_LANE_SZ;
+        len -= 3 * CRC_LANE_SZ;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+        p += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/*
+ *  Builds the tables and picks the implementation the first time a
+ *  checksum is needed.  Session threads can get here together, and
+ *  pthread_once() makes sure every one of them sees the finished tables.
+ */
+static void crc32c_select() {
+    crc32c_init_table();
+#ifdef DP_CRC_HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_init_shift();
+        _crcImpl = crc32c_sse42;
+        return;
+    }
+#endif
+    _crcImpl = crc32c_table;
+}
+
+uint32_t dp_crc32c(const void *buff, size_t len) {
+    pthread_once(&_crcOnce, crc32c_select);
+    return ~_crcImpl(~0u, buff, len);
+}
+
+uint32_t dp_crc32c_sw(const void *buff, size_t len) {
+    pthread_once(&_crcOnce, crc32c_select);
+    return ~crc32c_table(~0u, buff, len);
+}
+
+int dp_crc32c_hw_available() {
+    pthread_once(&_crcOnce, crc32c_select);
+    return _crcImpl != crc32c_table;
+}
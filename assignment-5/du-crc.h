@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) used as the per datagram checksum in dp_pdu.  Uses the
+ * SSE4.2 crc32 instruction when the CPU has it and a table otherwise; both
+ * produce the same value so mixed peers interoperate.
+ */
+uint32_t dp_crc32c(const void *buff, size_t len);
+uint32_t dp_crc32c_sw(const void *buff, size_t len);
+int      dp_crc32c_hw_available();
@@ -4,16 +4,36 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
 #include "utilities.h"
 #include "ftp-debug.h"
+#include "ftp-compress.h"
+#include "ftp-pipe.h"
+#include "ftp-hash.h"
+#include "ftp-batch.h"
+#include "ftp-cdc.h"
+#include "ftp-mapcache.h"
+#include "dp-impair.h"
+#include "dp-sched.h"
+#include "dp-uring.h"
+#include "dp-mcast.h"
 
 #define BUFF_SZ (3 * DP_MAX_DGRAM_SZ)
 static char sbuffer[BUFF_SZ];
 static char rbuffer[BUFF_SZ];
 static char full_file_path[FNAME_SZ];
+static char trace_path[FNAME_SZ];
+static int stats_interval = -1;
+static bool use_uring;
+static bool use_store;
+static bool use_discard;
+
+//a chunk is received, and may be decoded, straight into a ring write buffer
+_Static_assert(BUFF_SZ <= DP_URING_WBUF_SZ && FTP_CHUNK_SZ <= DP_URING_WBUF_SZ, "chunks must fit a ring buffer");
 
 /*
  *  Helper function that processes the command line arguements.  Highlights
@@ -27,6 +47,8 @@ static char full_file_path[FNAME_SZ];
  */
 static int initParams(int argc, char *argv[], prog_config *cfg) {
     int option;
+    dp_impair_cfg impair;
+    dp_sched_cfg sched = {0};
     //setup defaults if no arguements are passed
     static char cmdBuffer[64] = {0};
 
@@ -35,8 +57,21 @@ static int initParams(int argc, char *argv[], prog_config *cfg) {
     cfg->port_number = DEF_PORT_NO;
     strcpy(cfg->file_name, PROG_DEF_FNAME);
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR);
+    cfg->codec = FTP_CODEC_STORED;
+    cfg->batch = 0;
+    cfg->get = 0;
+    cfg->multi = 0;
+    cfg->shm = 0;
+    cfg->uring = 0;
+    cfg->store = 0;
+    cfg->synth_size = 0;
+    cfg->discard = 0;
+    cfg->mcast_group[0] = '\0';
+    cfg->trace_level = DP_TRACE_OFF;
+    cfg->stats_interval = -1;
+    strcpy(cfg->trace_path, PROG_DEF_TRACE);
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1) {
+    while ((option = getopt(argc, argv, ":p:f:d:g:a:v:t:S:L:r:R:k:w:G:n:cszmMUCNh")) != -1) {
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -45,6 +80,82 @@ static int initParams(int argc, char *argv[], prog_config *cfg) {
             case 'f':
                 strncpy(cfg->file_name, optarg, sizeof(cfg->file_name));
                 break;
+            case 'd':
+                strncpy(cfg->file_name, optarg, sizeof(cfg->file_name));
+                cfg->batch = 1;
+                break;
+            case 'g':
+                strncpy(cfg->file_name, optarg, sizeof(cfg->file_name));
+                cfg->get = 1;
+                break;
+            case 'm':
+                cfg->multi = 1;
+                break;
+            case 'M':
+                cfg->shm = 1;
+                break;
+            case 'U':
+                cfg->uring = 1;
+                break;
+            case 'C':
+                cfg->store = 1;
+                break;
+            case 'n':
+                cfg->synth_size = dp_sched_parse_rate(optarg);
+                if (cfg->synth_size <= 0) {
+                    printf("ERROR:  bad size %s, expected bytes like 500K or 2G\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'N':
+                cfg->discard = 1;
+                break;
+            case 'v':
+                cfg->trace_level = atoi(optarg);
+                break;
+            case 't':
+                strncpy(cfg->trace_path, optarg, sizeof(cfg->trace_path) - 1);
+                break;
+            case 'S':
+                cfg->stats_interval = atoi(optarg);
+                break;
+            case 'L':
+                if (dp_impair_parse(optarg, &impair) < 0) {
+                    exit(-1);
+                }
+                dp_impair_set_default(&impair);
+                break;
+            case 'r':
+                sched.flow_rate = dp_sched_parse_rate(optarg);
+                if (sched.flow_rate <= 0) {
+                    printf("ERROR:  bad rate %s, expected bytes per second like 500K or 2M\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'R':
+                sched.total_rate = dp_sched_parse_rate(optarg);
+                if (sched.total_rate <= 0) {
+                    printf("ERROR:  bad rate %s, expected bytes per second like 500K or 2M\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'k':
+                if (atoi(optarg) <= 0) {
+                    printf("ERROR:  bad idle timeout %s, expected seconds\n", optarg);
+                    exit(-1);
+                }
+                dp_set_keepalive(atoi(optarg) * 1000, 0);
+                break;
+            case 'w':
+                if (atoi(optarg) < 1 || atoi(optarg) > DP_MAX_WINDOW) {
+                    printf("ERROR:  bad window %s, expected 1 to %d datagrams\n", optarg, DP_MAX_WINDOW);
+                    exit(-1);
+                }
+                dp_set_window(atoi(optarg));
+                break;
+            case 'G':
+                strncpy(cfg->mcast_group, optarg, sizeof(cfg->mcast_group) - 1);
+                break;
             case 'a':
                 strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr));
                 break;
@@ -54,12 +165,33 @@ static int initParams(int argc, char *argv[], prog_config *cfg) {
             case 's':
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
+            case 'z':
+                cfg->codec = FTP_CODEC_LZ;
+                break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-d dir] [-g fname] [-a svr_addr] [-v level] [-t trace] [-S secs] [-L impair] [-r rate] [-R rate] [-k secs] [-w dgrams] [-G group] [-n bytes] [-s] [-c] [-z] [-m] [-M] [-U] [-C] [-N] [-h]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
                 printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-d dir] sends every file under the directory in one session instead of -f\n");
+                printf("\t[-g fname] downloads the server's ./infile/fname into ./outfile instead of -f\n");
+                printf("\t[-m] server keeps accepting clients and serves each on its own thread, once they bring back its cookie\n");
+                printf("\t[-M] client uses shared memory instead of UDP when the server is on this host\n");
+                printf("\t[-U] server receives and writes uploads through io_uring\n");
+                printf("\t[-C] server keeps uploads in ./infile/.chunks, deduplicated, and clients skip the chunks it has\n");
+                printf("\t[-n bytes] client uploads bytes of made up data as -f instead of reading the file, e.g. 512M\n");
+                printf("\t[-N] hashes what is received and throws it away instead of writing ./infile or ./outfile\n");
+                printf("\t[-v level] records a binary trace: 1 = ftp messages, 2 = +datagrams, 3 = +payloads; DEFAULT = 0\n");
+                printf("\t[-t trace] file the trace is dumped to at exit, read it with trace-decode; DEFAULT = %s\n", cfg->trace_path);
+                printf("\t[-S secs] prints transport stats as JSON after every transfer and every secs during it (0 = end only)\n");
+                printf("\t[-L impair] impairs our outgoing datagrams, e.g. drop=1,dup=0.5,reorder=1,corrupt=0.1,delay=2,jitter=1,seed=7\n");
+                printf("\t[-r rate] limits every transfer to rate bytes per second, e.g. 500K or 2M\n");
+                printf("\t[-R rate] limits all transfers together to rate bytes per second, shared out fairly between them\n");
+                printf("\t[-k secs] gives up on a peer not heard from for secs, probing it with keepalives meanwhile\n");
+                printf("\t[-w dgrams] sends up to dgrams datagrams of a chunk before the first is ACKed, as one GSO burst; DEFAULT = 1\n");
+                printf("\t[-G group] client sends -f once to every server joined to the multicast group, with -a as the interface address\n");
+                printf("\t[-z] asks the server to accept LZ compressed data chunks; DEFAULT = stored\n");
                 printf("\t[-p] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -71,70 +203,490 @@ static int initParams(int argc, char *argv[], prog_config *cfg) {
                 exit(-1);
         }
     }
+    if (sched.flow_rate > 0 || sched.total_rate > 0) {
+        dp_sched_set(&sched);
+    }
     return cfg->prog_mode;
 }
 
+/*
+ *  Prints the transport stats of dpc as one line of JSON, tagged with event
+ *  ("progress" during a transfer, "transfer" at the end of one).  RTTs are
+ *  in microseconds, percentiles are histogram bucket upper bounds.
+ */
+static void print_stats_json(dp_connp dpc, const char *event) {
+    dp_stats st;
+
+    if (stats_interval < 0) {
+        return;
+    }
+    dp_get_stats(dpc, &st);
+    double secs = st.elapsed_ns / 1e9;
+    double goodput = secs > 0 ? (st.payload_sent + st.payload_recv) / secs / 1e6 : 0;
+
+    printf("{\"event\":\"%s\",\"elapsed_s\":%.3f,\"pkts_sent\":%llu,\"pkts_recv\":%llu,"
+           "\"bytes_sent\":%llu,\"bytes_recv\":%llu,\"payload_sent\":%llu,\"payload_recv\":%llu,"
+           "\"goodput_MBps\":%.3f,\"retransmits\":%llu,\"timeouts\":%llu,\"nacks_sent\":%llu,\"nacks_recv\":%llu,"
+           "\"bad_dgrams\":%llu,\"duplicates\":%llu,\"sched_wait_s\":%.3f,\"keepalives_sent\":%llu,"
+           "\"gso_sends\":%llu,\"gro_recvs\":%llu,",
+           event, secs, st.pkts_sent, st.pkts_recv, st.bytes_sent, st.bytes_recv,
+           st.payload_sent, st.payload_recv, goodput, st.retransmits, st.timeouts, st.nacks_sent, st.nacks_recv,
+           st.bad_dgrams, st.duplicates, st.sched_wait_ns / 1e9, st.keepalives_sent,
+           st.gso_sends, st.gro_recvs);
+    printf("\"rtt_us\":{\"samples\":%llu,\"min\":%.1f,\"avg\":%.1f,\"max\":%.1f,\"p50\":%llu,\"p99\":%llu,\"hist\":[",
+           st.rtt_samples, st.rtt_min_ns / 1e3,
+           st.rtt_samples ? st.rtt_sum_ns / 1e3 / st.rtt_samples : 0.0, st.rtt_max_ns / 1e3,
+           dp_stats_rtt_percentile(&st, 50), dp_stats_rtt_percentile(&st, 99));
+    for (int i = 0; i < DP_RTT_BUCKETS; i++) {
+        printf(i ? ",%llu" : "%llu", st.rtt_hist[i]);
+    }
+    printf("]}}\n");
+    fflush(stdout);
+}
+
+/*
+ *  Prints where one side of a transfer spent its time.  With -n on the
+ *  client and -N on the server there is no disk left in it, so comparing
+ *  against a run with files shows what the disk costs.
+ */
+static void print_phases(const ftp_phases *ph, const char *role) {
+    double secs = (ftp_phase_ns() - ph->start_ns) / 1e9;
+
+    printf("Phases (%s, %ld bytes in %.3fs, %.1f MB/s): read %.3fs, code %.3fs, stall %.3fs, "
+           "send %.3fs, wait %.3fs, write %.3fs\n",
+           role, ph->bytes, secs, secs > 0 ? ph->bytes / secs / 1e6 : 0.0, ph->read_ns / 1e9, ph->code_ns / 1e9,
+           ph->stall_ns / 1e9, ph->send_ns / 1e9, ph->wait_ns / 1e9, ph->write_ns / 1e9);
+}
+
+//called once per chunk; prints a progress line every -S seconds
+static void stats_tick(dp_connp dpc, unsigned long long *next_ns) {
+    if (stats_interval <= 0) {
+        return;
+    }
+    unsigned long long period = stats_interval * 1000000000ull;
+    dp_stats st;
+
+    dp_get_stats(dpc, &st);
+    if (*next_ns == 0) {
+        *next_ns = period;
+    }
+    if (st.elapsed_ns >= *next_ns) {
+        print_stats_json(dpc, "progress");
+        while (*next_ns <= st.elapsed_ns) {
+            *next_ns += period;
+        }
+    }
+}
+
+/*
+ *  Streams a file from the server's ./infile back to the client for a
+ *  MSG_FILE_GET.  Chunks are encoded straight out of a shared read-only
+ *  mapping of the file, so concurrent downloads of the same file share its
+ *  page cache pages and its precomputed hash.  The exchange mirrors an
+ *  upload with the roles swapped: MSG_FILE_OK with the size, MSG_DATA
+ *  answered by MSG_DATA_OK, and MSG_DATA_END answered by MSG_CLOSE carrying
+ *  the client's hash of what it wrote.
+ */
+static int serve_download(dp_connp dpc, ftp_pdu *req, const char *path, char *sBuff, char *rBuff, int rbuff_sz) {
+    ftp_pdu pdu;
+    ftp_pdu *recvPdu;
+    ftp_chunk *chunk = (ftp_chunk *)sBuff;
+    char name[sizeof(req->file_name)];
+    int codec = ftp_codec_supported(req->codec) ? req->codec : FTP_CODEC_STORED;
+
+    memcpy(name, req->file_name, sizeof(name));
+    ftp_map *map = ftp_map_open(path);
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    pdu.msg_type = map != NULL ? MSG_FILE_OK : MSG_FILE_ERR;
+    pdu.file_size = map != NULL ? map->size : 0;
+    pdu.codec = codec;
+    memcpy(&pdu.file_name, name, sizeof(name));
+    if (map == NULL) {
+        printf("ERROR:  Cannot open file %s\n", path);
+    }
+
+    memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+    ftp_trace_out(&pdu);
+    dpsend(dpc, sBuff, sizeof(ftp_pdu));
+    if (map == NULL) {
+        return DP_NO_ERROR;
+    }
+
+    long off = 0;
+    int rc = DP_NO_ERROR;
+    unsigned long long nextStats = 0;
+    while (off < map->size) {
+        stats_tick(dpc, &nextStats);
+        int raw = map->size - off > FTP_CHUNK_SZ ? FTP_CHUNK_SZ : map->size - off;
+
+        memset(&chunk->pdu, 0, sizeof(ftp_pdu));
+        chunk->pdu.msg_type = MSG_DATA;
+        chunk->pdu.file_size = map->size;
+        memcpy(&chunk->pdu.file_name, name, sizeof(name));
+        chunk->pdu.byte_number = off;
+        chunk->pdu.raw_size = raw;
+        chunk->pdu.payload_size = ftp_chunk_encode(codec, map->data + off, raw, chunk->payload, &chunk->pdu.codec);
+
+        ftp_trace_out(&chunk->pdu);
+        dpsend(dpc, chunk, sizeof(ftp_pdu) + chunk->pdu.payload_size);
+
+        rc = dprecv(dpc, rBuff, rbuff_sz);
+        if (rc == DP_CONNECTION_CLOSED || rc == DP_ERROR_IDLE) {
+            printf("Client disconnected during download\n");
+            ftp_map_close(map);
+            return rc;
+        }
+        recvPdu = (ftp_pdu *) rBuff;
+        ftp_trace_in(recvPdu);
+        if (rc < (int)sizeof(ftp_pdu) || recvPdu->msg_type != MSG_DATA_OK) {
+            printf("Client could not write %s, stopping download\n", name);
+            ftp_map_close(map);
+            return DP_NO_ERROR;
+        }
+        off += raw;
+    }
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    pdu.msg_type = MSG_DATA_END;
+    pdu.file_size = map->size;
+    memcpy(&pdu.file_name, name, sizeof(name));
+    pdu.byte_number = off;
+    pdu.file_hash = map->digest;
+    memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+    ftp_trace_out(&pdu);
+    dpsend(dpc, sBuff, sizeof(ftp_pdu));
+
+    rc = dprecv(dpc, rBuff, rbuff_sz);
+    recvPdu = (ftp_pdu *) rBuff;
+    if (rc >= (int)sizeof(ftp_pdu) && recvPdu->msg_type == MSG_CLOSE && recvPdu->file_hash == map->digest) {
+        ftp_trace_in(recvPdu);
+        printf("Download of %s complete, hash %016llx verified\n", name, map->digest);
+    } else {
+        printf("Download of %s was not confirmed by the client\n", name);
+    }
+    print_stats_json(dpc, "transfer");
+    ftp_map_close(map);
+    return rc == DP_CONNECTION_CLOSED || rc == DP_ERROR_IDLE ? rc : DP_NO_ERROR;
+}
+
+/*
+ *  A -C server keeps uploads as recipes, so a download of one is rebuilt
+ *  from the chunk store into a scratch file and served from that.  Without
+ *  a recipe it is an ordinary download, which reports a missing file.
+ */
+static int serve_stored(dp_connp dpc, ftp_pdu *req, const char *path, char *sBuff, char *rBuff, int rbuff_sz) {
+    char recipe[FNAME_SZ + sizeof(FTP_CDC_RECIPE)];
+    char tmp[] = FTP_CDC_STORE "/get.XXXXXX";
+
+    snprintf(recipe, sizeof(recipe), "%s%s", path, FTP_CDC_RECIPE);
+    int fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    long size = f != NULL ? ftp_cdc_restore(FTP_CDC_STORE, recipe, f) : -1;
+    if (f != NULL && fclose(f) != 0) {
+        size = -1;
+    }
+    if (size < 0) {
+        if (fd >= 0) {
+            unlink(tmp);
+        }
+        return serve_download(dpc, req, path, sBuff, rBuff, rbuff_sz);
+    }
+
+    int rc = serve_download(dpc, req, tmp, sBuff, rBuff, rbuff_sz);
+    unlink(tmp);
+    return rc;
+}
+
+/*
+ *  The name in a request comes off the wire, so it has to be a relative
+ *  path that stays inside ./infile, the rule a batch manifest follows too.
+ *  With -C no part of it may name the chunk store either.
+ */
+static bool request_name_ok(const ftp_pdu *pdu) {
+    const char *name = pdu->file_name;
+
+    if (memchr(name, '\0', sizeof(pdu->file_name)) == NULL || !ftp_batch_name_ok(name)) {
+        return false;
+    }
+    while (use_store) {
+        size_t len = strcspn(name, "/");
+        if (len == strlen(FTP_CDC_DIR) && strncmp(name, FTP_CDC_DIR, len) == 0) {
+            return false;
+        }
+        if (name[len] == '\0') {
+            break;
+        }
+        name += len + 1;
+    }
+    return true;
+}
+
+/*
+ *  A file that ends in a hole only gets its last bytes by being told how
+ *  long it is, seeking past the end of a file does not grow it.
+ */
+static int set_file_size(FILE *f, long size) {
+    if (fflush(f) != 0 || ftruncate(fileno(f), size) < 0) {
+        perror("set_file_size");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Serves one client until its transfer is done or the connection goes.
+ *  Returns DP_NO_ERROR, the dprecv() error that ended the session, or
+ *  DP_ERROR_PROTOCOL after answering a bad request with MSG_ERROR.  What
+ *  to do then is up to the caller, so one client cannot end a -m server.
+ */
 int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz) {
     int rcvSz;
     ftp_pdu* recvPdu;
     ftp_pdu sendPdu;
     FILE* f = NULL;
+    char in_path[FNAME_SZ] = {0};
+    char tmp_path[FNAME_SZ + 8] = {0};     //the upload is written here and renamed to in_path when complete
+    ftp_hash hash;
+    ftp_batch batch;
+    bool inBatch = false;
+    char dbuffer[FTP_CHUNK_SZ];
+    unsigned long long nextStats = 0;
+    char *ringBuf = NULL;
+    ftp_sink *sink = NULL;
+    bool sparse = false;
+    long wrOff = 0;                         //where the next chunk goes in the file, counted here and not taken from the client
+    ftp_cdc cdc;
+    bool inStore = false;
+    ftp_phases ph = {0};
 
     if (dpc->isConnected == false) {
         perror("Expecting the protocol to be in connect state, but its not");
-        exit(-1);
+        return DP_ERROR_GENERAL;
+    }
+
+    // on the ring every chunk lands in a buffer the ring can write the file from
+    bool onRing = use_uring && dp_uring_use(dpc) == 0;
+    if (use_uring && !onRing) {
+        printf("io_uring is not available for this session, using plain UDP\n");
     }
 
     // Loop until a disconnect is received, or error happens
     while (1) {
         memset(&sendPdu, 0, sizeof(ftp_pdu));
+        if (onRing && ringBuf == NULL) {
+            ringBuf = dp_uring_wbuf(dpc);
+        }
+        char *in = ringBuf != NULL ? ringBuf : rBuff;
 
         // receive request from client
-        rcvSz = dprecv(dpc, rBuff, rbuff_sz);
-        if (rcvSz == DP_CONNECTION_CLOSED){
-            if (f != NULL) {
-                fclose(f);
+        unsigned long long start = ftp_phase_ns();
+        rcvSz = dprecv(dpc, in, ringBuf != NULL ? DP_URING_WBUF_SZ : rbuff_sz);
+        ph.wait_ns += ftp_phase_ns() - start;
+        if (rcvSz == DP_CONNECTION_CLOSED || rcvSz == DP_ERROR_IDLE){
+            if (rcvSz == DP_ERROR_IDLE) {
+                printf("Client went quiet, dropping its session\n");
+            } else {
+                printf("Client closed connection\n");
             }
-            printf("Client closed connection\n");
-            return DP_CONNECTION_CLOSED;
+            break;
         }
 
+        stats_tick(dpc, &nextStats);
+
         // get our pdu
-        recvPdu = (ftp_pdu*) rBuff;
-        print_in_ftp_pdu(recvPdu);
+        recvPdu = (ftp_pdu*) in;
+        ftp_trace_in(recvPdu);
 
         // event handling
         switch (recvPdu->msg_type) {
             case MSG_FILE_REQUEST:
                 printf("Received request to start new transfer!\n");
-                char tmp[128] = {"./infile/"};
-                f = fopen(strcat(tmp, recvPdu->file_name), "wb+");
-                if (f == NULL) {
-                    printf("ERROR:  Cannot open file %s\n", full_file_path);
+                snprintf(in_path, sizeof(in_path), "./infile/%.*s", (int)sizeof(recvPdu->file_name), recvPdu->file_name);
+                ftp_hash_init(&hash);
+                memset(&ph, 0, sizeof(ph));
+                ph.start_ns = ftp_phase_ns();
+                wrOff = recvPdu->payload_size;
+                if (!request_name_ok(recvPdu)) {
+                    printf("ERROR:  Refusing to write %s, it is not a name under ./infile\n", in_path);
+                    sendPdu.msg_type = MSG_FILE_ERR;
+                } else if (use_discard) {
+                    // nothing reaches the disk, the hash still tells whether it all arrived
+                    ftp_hash_update(&hash, in + sizeof(ftp_pdu), recvPdu->payload_size);
+                    sendPdu.msg_type = MSG_FILE_OK;
+                } else if (use_store && recvPdu->dedup && recvPdu->payload_size == 0) {
+                    // the chunks go to the store and the file becomes a recipe, the list of them comes next
+                    ftp_cdc_init(&cdc, FTP_CDC_STORE);
+                    inStore = true;
+                    sendPdu.msg_type = MSG_FILE_OK;
+                    sendPdu.dedup = 1;
+                } else if ((f = open_temp_beside(in_path, tmp_path, sizeof(tmp_path))) == NULL) {
+                    printf("ERROR:  Cannot open file %s\n", in_path);
+                    sendPdu.msg_type = MSG_FILE_ERR;
+                } else if (fwrite(in + sizeof(ftp_pdu), 1, recvPdu->payload_size, f) != recvPdu->payload_size) {
+                    // a small file comes whole, stored, inside the request
+                    printf("ERROR:  Cannot write file %s\n", in_path);
                     sendPdu.msg_type = MSG_FILE_ERR;
                 } else {
+                    ftp_hash_update(&hash, in + sizeof(ftp_pdu), recvPdu->payload_size);
                     sendPdu.msg_type = MSG_FILE_OK;
+                    // off the ring a writer thread keeps the disk behind the network, and hashes it too
+                    if (!onRing) {
+                        sink = ftp_sink_start(f, &hash);
+                    }
                 }
 
+                // agree to the client's codec if we know it, otherwise fall back to stored
+                sendPdu.codec = ftp_codec_supported(recvPdu->codec) ? recvPdu->codec : FTP_CODEC_STORED;
                 sendPdu.file_size = 0;
                 memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
                 sendPdu.byte_number = 0;
                 sendPdu.payload_size = 0;
                 break;
+            case MSG_BATCH_REQUEST:
+                printf("Received request to start new batch transfer!\n");
+                ftp_batch_init(&batch, "./infile");
+                ftp_hash_init(&hash);
+                inBatch = true;
+
+                sendPdu.msg_type = MSG_FILE_OK;
+                sendPdu.codec = ftp_codec_supported(recvPdu->codec) ? recvPdu->codec : FTP_CODEC_STORED;
+                memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
+                break;
+            case MSG_MANIFEST:
+                // the file list arrives in bulk before any data
+                if (!inBatch || ftp_batch_unpack(&batch, in + sizeof(ftp_pdu), recvPdu->payload_size,
+                                                 recvPdu->byte_number) < 0) {
+                    printf("ERROR:  Bad batch manifest\n");
+                    sendPdu.msg_type = MSG_ERROR;
+                } else {
+                    sendPdu.msg_type = MSG_DATA_OK;
+                }
+                memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
+                sendPdu.byte_number = recvPdu->byte_number;
+                break;
+            case MSG_CHUNK_LIST:
+                // the names of the file's chunks come before any data, we answer with the ones to send
+                int needSz = inStore ? ftp_cdc_unpack(&cdc, in + sizeof(ftp_pdu), recvPdu->payload_size,
+                                                      recvPdu->byte_number, (unsigned char *)sBuff + sizeof(ftp_pdu))
+                                     : -1;
+                if (needSz < 0) {
+                    printf("ERROR:  Bad chunk list\n");
+                    sendPdu.msg_type = MSG_ERROR;
+                } else {
+                    sendPdu.msg_type = MSG_CHUNK_NEED;
+                    sendPdu.payload_size = needSz;
+                }
+                memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
+                sendPdu.byte_number = recvPdu->byte_number;
+                break;
+            case MSG_FILE_GET:
+                snprintf(in_path, sizeof(in_path), "./infile/%.*s", (int)sizeof(recvPdu->file_name), recvPdu->file_name);
+                printf("Received request to download %s!\n", in_path);
+                if (!request_name_ok(recvPdu)) {
+                    // refused the way a missing file is, before anything is opened
+                    printf("ERROR:  Refusing to send %s, it is not a name under ./infile\n", in_path);
+                    sendPdu.msg_type = MSG_FILE_ERR;
+                    memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
+                    break;
+                }
+                if (use_store && access(in_path, F_OK) != 0) {
+                    return serve_stored(dpc, recvPdu, in_path, sBuff, rBuff, rbuff_sz);
+                }
+                return serve_download(dpc, recvPdu, in_path, sBuff, rBuff, rbuff_sz);
             case MSG_DATA:
-                char* payload = rBuff + sizeof(ftp_pdu);
-                int payload_size = recvPdu->payload_size;
-                int bytesWritten = fwrite(payload, 1, payload_size, f);
+                char* payload;
+                unsigned long long stallStart = ftp_phase_ns();
+                char* out = ringBuf != NULL && !inBatch && f != NULL ? dp_uring_wbuf(dpc) : NULL;
+                char* sinkBuf = sink != NULL && !inBatch ? ftp_sink_buf(sink) : NULL;
+                unsigned long long codeStart = ftp_phase_ns();
+                ph.stall_ns += codeStart - stallStart;
 
-                if (bytesWritten != recvPdu->payload_size) {
+                // chunks that did not compress arrive stored, the rest need decoding first
+                int payload_size = ftp_chunk_decode(recvPdu->codec, in + sizeof(ftp_pdu), recvPdu->payload_size,
+                                                    recvPdu->raw_size, out != NULL ? out : sinkBuf != NULL ? sinkBuf : dbuffer,
+                                                    FTP_CHUNK_SZ, &payload);
+
+                int bytesWritten = -1;
+                if (payload_size >= 0) {
+                    if (sinkBuf == NULL) {
+                        ftp_hash_update(&hash, payload, payload_size);
+                    }
+                    unsigned long long writeStart = ftp_phase_ns();
+                    ph.code_ns += writeStart - codeStart;
+                    if (inBatch) {
+                        // one chunk may finish several small files
+                        bytesWritten = ftp_batch_write(&batch, payload, payload_size) == 0 ? payload_size : -1;
+                    } else if (inStore) {
+                        // and one may finish several store chunks, or only add to one
+                        bytesWritten = ftp_cdc_write(&cdc, payload, payload_size) == 0 ? payload_size : -1;
+                    } else if (out != NULL) {
+                        // the write goes out with our ACK and owns its buffer until it is done, errors show up at the end
+                        fflush(f);
+                        dp_uring_write(dpc, fileno(f), payload, payload_size, wrOff);
+                        if (payload == out) {
+                            out = NULL;
+                        } else {
+                            ringBuf = NULL;
+                        }
+                        bytesWritten = payload_size;
+                    } else if (sinkBuf != NULL) {
+                        // same for the writer thread, a stored chunk still sits in the receive buffer
+                        if (payload != sinkBuf) {
+                            memcpy(sinkBuf, payload, payload_size);
+                        }
+                        ftp_sink_write(sink, sinkBuf, payload_size);
+                        sinkBuf = NULL;
+                        bytesWritten = payload_size;
+                    } else if (f != NULL) {
+                        bytesWritten = fwrite(payload, 1, payload_size, f);
+                    } else if (use_discard) {
+                        bytesWritten = payload_size;
+                    }
+                    // the sink thread's writes are added at the end, this is the rest
+                    ph.write_ns += ftp_phase_ns() - writeStart;
+                }
+                dp_uring_wbuf_put(dpc, out);
+                if (sinkBuf != NULL) {
+                    ftp_sink_write(sink, sinkBuf, 0);
+                }
+
+                if (bytesWritten != recvPdu->raw_size) {
                     sendPdu.msg_type = MSG_ERROR;
                 } else {
                     sendPdu.msg_type = MSG_DATA_OK;
+                    wrOff += bytesWritten;
                 }
 
-                int toPrint = payload_size > 50 ? 50 : payload_size;
+                if (payload_size > 0) {
+                    dp_trace(DP_TRACE_DATA, DP_TR_DATA, payload, payload_size);
+                }
 
-                printf("========================> \n%.*s\n========================> \n", toPrint, payload);
+                sendPdu.file_size = recvPdu->file_size;
+                memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
+                sendPdu.byte_number = recvPdu->byte_number;
+                sendPdu.payload_size = 0;
+                break;
+            case MSG_DATA_HOLE:
+                // zeros the client did not send, leave a hole where they go and hash them all the same
+                sendPdu.msg_type = MSG_DATA_OK;
+                if (inBatch || (f == NULL && !use_discard) || recvPdu->raw_size < 0) {
+                    sendPdu.msg_type = MSG_ERROR;
+                } else if (f == NULL) {
+                    // discarded like the rest
+                } else if (sink != NULL) {
+                    ftp_sink_skip(sink, recvPdu->raw_size);
+                } else if (!onRing && fseeko(f, recvPdu->raw_size, SEEK_CUR) != 0) {
+                    // ring writes carry their own offsets, there is nothing to move
+                    sendPdu.msg_type = MSG_ERROR;
+                }
+                if (sendPdu.msg_type == MSG_DATA_OK) {
+                    if (sink == NULL) {
+                        ftp_hash_zeros(&hash, recvPdu->raw_size);
+                    }
+                    wrOff += recvPdu->raw_size;
+                    sparse = true;
+                }
 
                 sendPdu.file_size = recvPdu->file_size;
                 memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
@@ -144,75 +696,301 @@ int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_
             case MSG_DATA_END:
                 printf("Client ended transfer! Quitting...\n");
 
-                sendPdu.msg_type = MSG_CLOSE;
+                // what we wrote has to hash the same as what the client read, the sink is done with it now
+                int sinkRc = ftp_sink_finish(sink, &ph);
+                sink = NULL;
+                sendPdu.file_hash = ftp_hash_digest(&hash);
+                if (inBatch) {
+                    int done = batch.cur;
+                    if (ftp_batch_finish(&batch) < 0 || sendPdu.file_hash != recvPdu->file_hash) {
+                        printf("ERROR:  batch %s failed after %d of %d files\n", recvPdu->file_name, done, batch.count);
+                        sendPdu.msg_type = MSG_ERROR;
+                    } else {
+                        printf("Received %d files, %ld bytes\n", batch.count, batch.total_size);
+                        sendPdu.msg_type = MSG_CLOSE;
+                    }
+                    ftp_batch_free(&batch);
+                    inBatch = false;
+                } else if (inStore) {
+                    // the file is only as good as what the store gives back, which is what we hash
+                    char recipe[FNAME_SZ + sizeof(FTP_CDC_RECIPE)];
+                    snprintf(recipe, sizeof(recipe), "%s%s", in_path, FTP_CDC_RECIPE);
+                    if (ftp_cdc_finish(&cdc, &sendPdu.file_hash) < 0 || sendPdu.file_hash != recvPdu->file_hash ||
+                        ftp_cdc_save(&cdc, recipe) < 0) {
+                        printf("ERROR:  Cannot store %s\n", in_path);
+                        sendPdu.msg_type = MSG_ERROR;
+                    } else {
+                        // a copy kept whole before would hide the new one from downloads
+                        remove(in_path);
+                        printf("Stored %s as %d chunks, %d new (%ld of %ld bytes)\n",
+                               in_path, cdc.count, cdc.new_chunks, cdc.new_bytes, cdc.total_size);
+                        sendPdu.msg_type = MSG_CLOSE;
+                    }
+                    ftp_cdc_free(&cdc);
+                    inStore = false;
+                } else if (sinkRc < 0 || dp_uring_drain(dpc) < 0 ||
+                           (sparse && f != NULL && (wrOff != recvPdu->file_size || set_file_size(f, wrOff) < 0))) {
+                    printf("ERROR:  Cannot write file %s, removing it\n", in_path);
+                    sendPdu.msg_type = MSG_ERROR;
+                    if (f != NULL) {
+                        fclose(f);
+                        f = NULL;
+                        remove(tmp_path);
+                    }
+                } else if (sendPdu.file_hash != recvPdu->file_hash) {
+                    printf("ERROR:  %s hash mismatch (client %016llx, server %016llx), removing it\n",
+                           in_path, recvPdu->file_hash, sendPdu.file_hash);
+                    sendPdu.msg_type = MSG_ERROR;
+                    if (f != NULL) {
+                        fclose(f);
+                        f = NULL;
+                        remove(tmp_path);
+                    }
+                } else if (f != NULL && (fflush(f) != 0 || rename(tmp_path, in_path) != 0)) {
+                    // downloads that have the old file mapped keep it, new ones get this one
+                    printf("ERROR:  Cannot put %s in place\n", in_path);
+                    sendPdu.msg_type = MSG_ERROR;
+                    fclose(f);
+                    f = NULL;
+                    remove(tmp_path);
+                } else {
+                    sendPdu.msg_type = MSG_CLOSE;
+                }
                 sendPdu.file_size = recvPdu->file_size;
                 memcpy(&sendPdu.file_name, recvPdu->file_name, sizeof(recvPdu->file_name));
                 sendPdu.byte_number = recvPdu->byte_number;
                 sendPdu.payload_size = 0;
 
                 memcpy(sBuff, &sendPdu, sizeof(ftp_pdu));
-                print_out_ftp_pdu(&sendPdu);
+                ftp_trace_out(&sendPdu);
                 dpsend(dpc, sBuff, sizeof(ftp_pdu));
+                print_stats_json(dpc, "transfer");
+                ph.bytes = recvPdu->byte_number;
+                print_phases(&ph, "receive");
 
                 if (f != NULL) {
                     fclose(f);
                 }
 
-                return DP_CONNECTION_CLOSED;
+                // the transfer is over but the connection is still ours to close
+                return DP_NO_ERROR;
             default:
                 printf("Received unknown message type. Ignoring...\n");
                 break;
         }
 
-        // send pdu back to client
+        // send pdu back to client, a MSG_CHUNK_NEED has its bitmap behind it already
         memcpy(sBuff, &sendPdu, sizeof(ftp_pdu));
-        print_out_ftp_pdu(&sendPdu);
-        dpsend(dpc, sBuff, sizeof(ftp_pdu));
+        ftp_trace_out(&sendPdu);
+        start = ftp_phase_ns();
+        dpsend(dpc, sBuff, sizeof(ftp_pdu) + sendPdu.payload_size);
+        ph.send_ns += ftp_phase_ns() - start;
         if (sendPdu.msg_type == MSG_ERROR) {
-            exit(-1);
+            // the session is over, but in -m mode the others carry on
+            printf("Ending the session after an error\n");
+            rcvSz = DP_ERROR_PROTOCOL;
+            break;
         }
     }
 
+    if (f != NULL) {
+        // an unfinished upload never replaces the file
+        ftp_sink_finish(sink, NULL);
+        dp_uring_drain(dpc);
+        fclose(f);
+        remove(tmp_path);
+    }
+    if (inBatch) {
+        ftp_batch_free(&batch);
+    }
+    if (inStore) {
+        ftp_cdc_free(&cdc);
+    }
+    return rcvSz;
 }
 
 
-void start_client(dp_connp dpc, prog_config* cfg) {
-    static char sBuff[BUFF_SZ];
+/*
+ *  Connects with the request in sBuff riding in the CONNECT and leaves the
+ *  server's answer in rbuffer, so the request costs no round trip of its
+ *  own.  A server that does not take it early gets it again once we are
+ *  connected.
+ */
+static int connect_with_request(dp_connp dpc, char *sBuff, int req_sz) {
+    int rc = dpconnect_early(dpc, sBuff, req_sz, rbuffer, sizeof(rbuffer));
 
+    if (rc == DP_EARLY_REFUSED) {
+        rc = dpsend(dpc, sBuff, req_sz);
+    }
+    if (rc >= 0 && rc < (int)sizeof(ftp_pdu)) {
+        rc = dprecv(dpc, rbuffer, sizeof(rbuffer));
+    }
+    if (rc < (int)sizeof(ftp_pdu)) {
+        perror("Error establishing connection");
+        exit(-1);
+    }
+    return rc;
+}
 
-    if (!dpc->isConnected) {
-        printf("Client not connected\n");
-        return;
+/*
+ *  Sends the batch file list as MSG_MANIFEST messages, each one packed with
+ *  as many entries as fit in a chunk, and waits for the server to accept
+ *  each of them.
+ */
+static void send_manifests(dp_connp dpc, ftp_batch *batch, prog_config *cfg, char *sBuff, int sbuff_sz) {
+    ftp_pdu pdu;
+    int next = 0;
+
+    while (next < batch->count) {
+        int first = next;
+        int used = ftp_batch_pack(batch, &next, sBuff + sizeof(ftp_pdu), sbuff_sz - sizeof(ftp_pdu));
+        if (next == first) {
+            printf("ERROR:  %s does not fit in a manifest\n", batch->entries[first].name);
+            exit(-1);
+        }
+
+        memset(&pdu, 0, sizeof(ftp_pdu));
+        pdu.msg_type = MSG_MANIFEST;
+        pdu.file_size = batch->total_size;
+        memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+        pdu.byte_number = next - first;
+        pdu.payload_size = used;
+
+        memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+        ftp_trace_out(&pdu);
+        dpsend(dpc, sBuff, sizeof(ftp_pdu) + used);
+
+        int bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
+        ftp_pdu *recvPdu = (ftp_pdu *) rbuffer;
+        if (bytesRecv < (int)sizeof(ftp_pdu) || recvPdu->msg_type != MSG_DATA_OK) {
+            printf("Server rejected the batch manifest. Quitting...\n");
+            exit(-1);
+        }
+        ftp_trace_in(recvPdu);
     }
+}
+
+/*
+ *  Sends the names of the file's chunks as MSG_CHUNK_LIST messages, the same
+ *  way as a batch manifest, and marks the chunks each MSG_CHUNK_NEED answer
+ *  asks for.  Returns the bytes of the file the server already has.
+ */
+static long send_chunk_lists(dp_connp dpc, ftp_cdc *cdc, prog_config *cfg, char *sBuff, int sbuff_sz) {
+    ftp_pdu pdu;
+    int next = 0;
+    long skipped = 0;
+
+    while (next < cdc->count) {
+        int first = next;
+        int used = ftp_cdc_pack(cdc, &next, sBuff + sizeof(ftp_pdu), sbuff_sz - sizeof(ftp_pdu));
+
+        memset(&pdu, 0, sizeof(ftp_pdu));
+        pdu.msg_type = MSG_CHUNK_LIST;
+        pdu.file_size = cdc->total_size;
+        memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+        pdu.byte_number = next - first;
+        pdu.payload_size = used;
+
+        memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+        ftp_trace_out(&pdu);
+        dpsend(dpc, sBuff, sizeof(ftp_pdu) + used);
+
+        int bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
+        ftp_pdu *recvPdu = (ftp_pdu *) rbuffer;
+        if (bytesRecv < (int)sizeof(ftp_pdu) || recvPdu->msg_type != MSG_CHUNK_NEED ||
+            bytesRecv - (int)sizeof(ftp_pdu) < (next - first + 7) / 8 ||
+            ftp_cdc_mark(cdc, first, next - first, (unsigned char *)rbuffer + sizeof(ftp_pdu)) < 0) {
+            printf("Server rejected the chunk list. Quitting...\n");
+            exit(-1);
+        }
+        ftp_trace_in(recvPdu);
+    }
+
+    for (int i = 0; i < cdc->count; i++) {
+        if (!cdc->refs[i].need) {
+            skipped += cdc->refs[i].len;
+        }
+    }
+    return skipped;
+}
+
+void start_client(dp_connp dpc, prog_config* cfg) {
+    static char sBuff[BUFF_SZ];
 
     // Start of du-ftp handshake
 
     // populate our pdu
     ftp_pdu pdu;
-    long fileSz = get_file_size(full_file_path);
-    if (fileSz < 0) {
-        perror("get_file_size: general error getting file size");
-        return;
+    ftp_batch batch;
+    ftp_cdc cdc;
+    ftp_synth synth;
+    ftp_phases ph = {0};
+    long fileSz;
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    if (cfg->batch) {
+        // a batch announces the whole tree up front, the sizes come with the manifest
+        ftp_batch_init(&batch, "./outfile");
+        if (ftp_batch_scan(&batch, cfg->file_name) < 0) {
+            return;
+        }
+        fileSz = batch.total_size;
+        pdu.msg_type = MSG_BATCH_REQUEST;
+        printf("Sending %d files, %ld bytes\n", batch.count, fileSz);
+    } else if (cfg->synth_size > 0) {
+        // made up data under the -f name, the server side cannot tell the difference
+        ftp_synth_init(&synth, cfg->synth_size);
+        fileSz = cfg->synth_size;
+        pdu.msg_type = MSG_FILE_REQUEST;
+        printf("Sending %ld bytes of synthetic data\n", fileSz);
+    } else {
+        fileSz = get_file_size(full_file_path);
+        if (fileSz < 0) {
+            perror("get_file_size: general error getting file size");
+            return;
+        }
+        pdu.msg_type = MSG_FILE_REQUEST;
     }
 
-    pdu.msg_type = MSG_FILE_REQUEST;
     pdu.file_size = fileSz;
     memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
     pdu.byte_number = 0;
     pdu.payload_size = 0;
+    pdu.codec = cfg->codec;
+    pdu.raw_size = 0;
+
+    // a file small enough goes whole in the request, which then rides in the CONNECT
+    FILE *f = NULL;
+    bool inlined = false;
+    unsigned long long file_hash = 0;
+    bool synthetic = !cfg->batch && cfg->synth_size > 0;
+    if (!cfg->batch && !synthetic && fileSz <= DP_MAX_EARLY_SZ - (long)sizeof(ftp_pdu)) {
+        f = fopen(full_file_path, "rb");
+        if (f == NULL || fread(sBuff + sizeof(ftp_pdu), 1, fileSz, f) != fileSz) {
+            printf("ERROR:  Cannot read file %s\n", full_file_path);
+            exit(-1);
+        }
+        ftp_hash hash;
+        ftp_hash_init(&hash);
+        ftp_hash_update(&hash, sBuff + sizeof(ftp_pdu), fileSz);
+        file_hash = ftp_hash_digest(&hash);
+        pdu.payload_size = fileSz;
+        pdu.raw_size = fileSz;
+        inlined = true;
+    }
+    // offer a -C server the chunk names, it then asks only for what it has not seen
+    pdu.dedup = !cfg->batch && !inlined && !synthetic;
 
     // send and receive back from server
 
     // copy pdu into send buffer
     memcpy(sBuff, &pdu, sizeof(ftp_pdu));
-    print_out_ftp_pdu(&pdu);
-    dpsend(dpc, sBuff, sizeof(ftp_pdu));
-
+    ftp_trace_out(&pdu);
 
     // receive server response pdu
-    int bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
+    int bytesRecv = connect_with_request(dpc, sBuff, sizeof(ftp_pdu) + pdu.payload_size);
     ftp_pdu* recvPdu = (ftp_pdu*) rbuffer;
-    print_in_ftp_pdu(recvPdu);
+    ftp_trace_in(recvPdu);
 
     // see server's response
     if (recvPdu->msg_type == MSG_FILE_ERR) {
@@ -222,54 +1000,108 @@ void start_client(dp_connp dpc, prog_config* cfg) {
     } else {
         printf("Server ready to receive file data!\n");
     }
+    int codec = recvPdu->codec;
+    bool dedup = pdu.dedup && recvPdu->dedup;
 
-    // we are ready to send file data in chunks; open file
-    FILE *f = fopen(full_file_path, "rb");
-    if (f == NULL) {
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
-        exit(-1);
+    if (cfg->batch) {
+        // ship the file list in as few manifests as will hold it
+        send_manifests(dpc, &batch, cfg, sBuff, sizeof(sBuff));
+    } else if (!inlined && !synthetic) {
+        // we are ready to send file data in chunks; open file
+        f = fopen(full_file_path, "rb");
+        if (f == NULL) {
+            printf("ERROR:  Cannot open file %s\n", full_file_path);
+            exit(-1);
+        }
+    }
+    long skipped = 0;
+    if (dedup) {
+        // the whole file is read once to cut and name it, then only the chunks the server lacks
+        ftp_cdc_init(&cdc, FTP_CDC_STORE);
+        if (ftp_cdc_scan(&cdc, f, &file_hash) < 0) {
+            printf("ERROR:  Cannot read file %s\n", full_file_path);
+            exit(-1);
+        }
+        skipped = send_chunk_lists(dpc, &cdc, cfg, sBuff, sizeof(sBuff));
     }
     if (dpc->isConnected == false) {
         perror("Expecting the protocol to be in connect state, but its not");
         exit(-1);
     }
 
-    int bytes = 0;
-    int byte_number = 0;
-    // copy file bytes into send array, leaving gap for pdu to fill in later
-    while ((bytes = fread(sBuff+sizeof(ftp_pdu), 1, sizeof(sBuff)-sizeof(ftp_pdu), f )) > 0) {
+    long byte_number = inlined ? fileSz : 0;
+    long wire_bytes = inlined ? fileSz : 0;
 
-        // set up new pdu
-        memset(&pdu, 0, sizeof(ftp_pdu));
-        pdu.msg_type = MSG_DATA;
-        pdu.file_size = fileSz;
-        memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
-        pdu.byte_number = byte_number;
-        pdu.payload_size = bytes;
-        byte_number += bytes; // increment our byte number from our current number to what was sent
-        
-        // fill in pdu to sBuff
-        memcpy(sBuff, &pdu, sizeof(ftp_pdu));
-        print_out_ftp_pdu(&pdu);
-        // send that thang yo
-        dpsend(dpc, sBuff, sizeof(ftp_pdu)+bytes);
+    // the pipe reads (and compresses) the next chunks while we are sending this one
+    ftp_pipe *fpipe = NULL;
+    ph.start_ns = ftp_phase_ns();
+    if (inlined) {
+        // nothing left to send
+    } else if ((fpipe = cfg->batch ? ftp_pipe_start(ftp_batch_read, &batch, codec)
+                       : dedup     ? ftp_pipe_start(ftp_cdc_read, &cdc, codec)
+                       : synthetic ? ftp_pipe_start(ftp_pipe_read_synth, &synth, codec)
+                                   : ftp_pipe_start(ftp_pipe_read_file, f, codec)) == NULL) {
+        exit(-1);
+    }
+
+    ftp_chunk *chunk;
+    unsigned long long nextStats = 0;
+    unsigned long long start = ftp_phase_ns();
+    while (fpipe != NULL && (chunk = ftp_pipe_next(fpipe)) != NULL) {
+        unsigned long long sendStart = ftp_phase_ns();
+        ph.stall_ns += sendStart - start;
+        stats_tick(dpc, &nextStats);
+
+        // the pipe fills in the data fields, we add the transfer details
+        chunk->pdu.file_size = fileSz;
+        memcpy(&chunk->pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+        byte_number = chunk->pdu.byte_number + chunk->pdu.raw_size;
+        wire_bytes += chunk->pdu.payload_size;
+
+        ftp_trace_out(&chunk->pdu);
+        // send that thang yo, the chunk is already laid out as [pdu][payload]
+        dpsend(dpc, chunk, sizeof(ftp_pdu) + chunk->pdu.payload_size);
+        ftp_pipe_release(fpipe, chunk);
 
         // check for writing error on server side
         memset(rbuffer, 0, sizeof(rbuffer));
+        unsigned long long waitStart = ftp_phase_ns();
+        ph.send_ns += waitStart - sendStart;
         bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
-        if (bytesRecv == DP_CONNECTION_CLOSED) {
+        start = ftp_phase_ns();
+        ph.wait_ns += start - waitStart;
+        if (bytesRecv == DP_CONNECTION_CLOSED || bytesRecv == DP_ERROR_IDLE) {
             printf("Server disconnected early!\n");
+            ftp_pipe_stop(fpipe);
             return;
         }
 
         ftp_pdu* recvPdu = (ftp_pdu*) rbuffer;
-        print_in_ftp_pdu(recvPdu);
+        ftp_trace_in(recvPdu);
         if (recvPdu->msg_type == MSG_ERROR) {
             printf("Server had error writing file. Quitting...\n");
             exit(-1);
         }
 
     }
+    if (fpipe != NULL) {
+        // a dedup upload sent only part of the file, its hash came from the scan
+        if (!dedup) {
+            file_hash = ftp_pipe_digest(fpipe);
+        }
+        ftp_pipe_phases(fpipe, &ph);
+        ftp_pipe_stop(fpipe);
+    }
+    printf("Sent %ld file bytes as %ld payload bytes\n", byte_number, wire_bytes);
+    if (byte_number + (dedup ? skipped : 0) != fileSz) {
+        // the pipe stops early on a read error, a short file must not look finished to the server
+        printf("ERROR:  Read %ld of %ld file bytes. Quitting...\n", byte_number + (dedup ? skipped : 0), fileSz);
+        exit(-1);
+    }
+    if (dedup) {
+        printf("Server already had the other %ld of %ld bytes\n", skipped, fileSz);
+        byte_number = fileSz;
+    }
 
     // set up final close-pdu
     memset(&pdu, 0, sizeof(ftp_pdu));
@@ -278,39 +1110,410 @@ void start_client(dp_connp dpc, prog_config* cfg) {
     memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
     pdu.byte_number = byte_number;
     pdu.payload_size = 0;
+    pdu.file_hash = file_hash;
 
     // copy pdu into send buffer again
     memcpy(sBuff, &pdu, sizeof(ftp_pdu));
-    print_out_ftp_pdu(&pdu);
+    ftp_trace_out(&pdu);
     // send pdu
     dpsend(dpc, sBuff, sizeof(ftp_pdu));
 
     // receive server response
     bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
     recvPdu = (ftp_pdu*) rbuffer;
-    print_in_ftp_pdu(recvPdu);
+    ftp_trace_in(recvPdu);
+    print_stats_json(dpc, "transfer");
+    ph.bytes = byte_number;
+    print_phases(&ph, "send");
 
     // event handling
+    if (f != NULL) {
+        fclose(f);
+    }
+    if (cfg->batch) {
+        ftp_batch_free(&batch);
+    }
+    if (dedup) {
+        ftp_cdc_free(&cdc);
+    }
     switch (recvPdu->msg_type) {
         case MSG_ERROR:
             printf("Server responded with error trying to end transfer. Quitting...\n");
-            break;
+            exit(-1);
         case MSG_CLOSE:
-            printf("Server successfully ended transfer! Quitting...\n");
+            if (recvPdu->file_hash != file_hash) {
+                printf("Server copy does not match (hash %016llx, expected %016llx). Quitting...\n",
+                       recvPdu->file_hash, file_hash);
+                exit(-1);
+            }
+            printf("Server successfully ended transfer, hash %016llx verified! Quitting...\n", file_hash);
             break;
         default:
             printf("Unknown response. Quitting...\n");
             break;
     }
-    fclose(f);
     // dpdisconnect(dpc);
     return;
 }
 
+/*
+ *  Client side of MSG_FILE_GET: asks for the server's ./infile/<name> and
+ *  writes what comes back to ./outfile/<name>, answering every chunk the
+ *  way the server answers ours on an upload.
+ */
+void start_download(dp_connp dpc, prog_config* cfg) {
+    static char sBuff[BUFF_SZ];
+    char dbuffer[FTP_CHUNK_SZ];
+    ftp_pdu pdu;
+    ftp_pdu *recvPdu;
+    ftp_hash hash;
+    ftp_phases ph = {0};
+    long received = 0;
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    pdu.msg_type = MSG_FILE_GET;
+    memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+    pdu.codec = cfg->codec;
+    memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+    ftp_trace_out(&pdu);
+
+    int bytesRecv = connect_with_request(dpc, sBuff, sizeof(ftp_pdu));
+    recvPdu = (ftp_pdu*) rbuffer;
+    if (bytesRecv < (int)sizeof(ftp_pdu) || recvPdu->msg_type != MSG_FILE_OK) {
+        printf("Server cannot send %s. Quitting...\n", cfg->file_name);
+        exit(-1);
+    }
+    ftp_trace_in(recvPdu);
+    printf("Server sending %s, %ld bytes\n", cfg->file_name, recvPdu->file_size);
+
+    FILE *f = NULL;
+    if (!use_discard && (f = fopen(full_file_path, "wb")) == NULL) {
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    ftp_hash_init(&hash);
+    ph.start_ns = ftp_phase_ns();
+
+    unsigned long long nextStats = 0;
+    while (1) {
+        stats_tick(dpc, &nextStats);
+        unsigned long long start = ftp_phase_ns();
+        bytesRecv = dprecv(dpc, rbuffer, sizeof(rbuffer));
+        ph.wait_ns += ftp_phase_ns() - start;
+        if (bytesRecv == DP_CONNECTION_CLOSED || bytesRecv < (int)sizeof(ftp_pdu)) {
+            printf("Server disconnected early!\n");
+            exit(-1);
+        }
+        recvPdu = (ftp_pdu*) rbuffer;
+        ftp_trace_in(recvPdu);
+
+        memset(&pdu, 0, sizeof(ftp_pdu));
+        memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+        pdu.byte_number = recvPdu->byte_number;
+
+        if (recvPdu->msg_type == MSG_DATA_END) {
+            pdu.file_hash = ftp_hash_digest(&hash);
+            pdu.msg_type = pdu.file_hash == recvPdu->file_hash ? MSG_CLOSE : MSG_ERROR;
+            memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+            ftp_trace_out(&pdu);
+            dpsend(dpc, sBuff, sizeof(ftp_pdu));
+            print_stats_json(dpc, "transfer");
+            ph.bytes = received;
+            print_phases(&ph, "receive");
+            if (f != NULL) {
+                fclose(f);
+            }
+            if (pdu.msg_type == MSG_ERROR) {
+                printf("Downloaded copy does not match (hash %016llx, expected %016llx). Quitting...\n",
+                       pdu.file_hash, recvPdu->file_hash);
+                if (f != NULL) {
+                    remove(full_file_path);
+                }
+                exit(-1);
+            }
+            printf("Received %ld bytes, hash %016llx verified! Quitting...\n", received, pdu.file_hash);
+            return;
+        }
+
+        char *payload;
+        int payload_size = -1;
+        unsigned long long codeStart = ftp_phase_ns();
+        if (recvPdu->msg_type == MSG_DATA) {
+            payload_size = ftp_chunk_decode(recvPdu->codec, rbuffer + sizeof(ftp_pdu), recvPdu->payload_size,
+                                            recvPdu->raw_size, dbuffer, sizeof(dbuffer), &payload);
+        }
+        unsigned long long writeStart = ftp_phase_ns();
+        ph.code_ns += writeStart - codeStart;
+        if (payload_size >= 0 && (f == NULL || fwrite(payload, 1, payload_size, f) == payload_size)) {
+            unsigned long long hashStart = ftp_phase_ns();
+            ph.write_ns += hashStart - writeStart;
+            ftp_hash_update(&hash, payload, payload_size);
+            ph.code_ns += ftp_phase_ns() - hashStart;
+            received += payload_size;
+            pdu.msg_type = MSG_DATA_OK;
+        } else {
+            pdu.msg_type = MSG_ERROR;
+        }
+
+        memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+        ftp_trace_out(&pdu);
+        start = ftp_phase_ns();
+        dpsend(dpc, sBuff, sizeof(ftp_pdu));
+        ph.send_ns += ftp_phase_ns() - start;
+        if (pdu.msg_type == MSG_ERROR) {
+            printf("Error writing %s. Quitting...\n", full_file_path);
+            exit(-1);
+        }
+    }
+}
+
+//-S for a multicast session, which has no dp_connection to take dp_stats from
+static void print_mcast_stats_json(dp_mcast *mc) {
+    dp_mcast_stats st;
+
+    if (stats_interval < 0) {
+        return;
+    }
+    dp_mcast_get_stats(mc, &st);
+    printf("{\"event\":\"multicast\",\"elapsed_s\":%.3f,\"dgrams_sent\":%llu,\"repairs_sent\":%llu,"
+           "\"bytes_sent\":%llu,\"dgrams_recv\":%llu,\"duplicates\":%llu,\"overruns\":%llu,\"bad_dgrams\":%llu,"
+           "\"nacks_sent\":%llu,\"nacks_recv\":%llu,\"nacks_suppressed\":%llu}\n",
+           st.elapsed_ns / 1e9, st.dgrams_sent, st.repairs_sent, st.bytes_sent, st.dgrams_recv,
+           st.duplicates, st.overruns, st.bad_dgrams, st.nacks_sent, st.nacks_recv, st.nacks_suppressed);
+    fflush(stdout);
+}
+
+/*
+ *  -G on the client.  The upload conversation without the answers: the
+ *  request, the chunks and MSG_DATA_END with the hash go to the group
+ *  once, then dp_mcast_finish() repairs whatever receivers NACK.  Nobody
+ *  can agree to a codec, so -z is taken as given.
+ */
+void start_mcast_client(prog_config *cfg) {
+    static char sBuff[BUFF_SZ];
+    ftp_pdu pdu;
+
+    long fileSz = get_file_size(full_file_path);
+    FILE *f = fopen(full_file_path, "rb");
+    if (fileSz < 0 || f == NULL) {
+        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        exit(-1);
+    }
+    dp_mcast *mc = dp_mcast_open(cfg->mcast_group, cfg->svr_ip_addr, cfg->port_number, 1);
+    if (mc == NULL) {
+        exit(-1);
+    }
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    pdu.msg_type = MSG_FILE_REQUEST;
+    pdu.file_size = fileSz;
+    memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+    pdu.codec = cfg->codec;
+    memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+    ftp_trace_out(&pdu);
+    if (dp_mcast_send(mc, sBuff, sizeof(ftp_pdu)) < 0) {
+        exit(-1);
+    }
+
+    ftp_pipe *fpipe = ftp_pipe_start(ftp_pipe_read_file, f, cfg->codec);
+    if (fpipe == NULL) {
+        exit(-1);
+    }
+    ftp_chunk *chunk;
+    long byte_number = 0;
+    long wire_bytes = 0;
+    while ((chunk = ftp_pipe_next(fpipe)) != NULL) {
+        chunk->pdu.file_size = fileSz;
+        memcpy(&chunk->pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+        byte_number = chunk->pdu.byte_number + chunk->pdu.raw_size;
+        wire_bytes += chunk->pdu.payload_size;
+
+        ftp_trace_out(&chunk->pdu);
+        int rc = dp_mcast_send(mc, chunk, sizeof(ftp_pdu) + chunk->pdu.payload_size);
+        ftp_pipe_release(fpipe, chunk);
+        if (rc < 0) {
+            exit(-1);
+        }
+    }
+    unsigned long long file_hash = ftp_pipe_digest(fpipe);
+    ftp_pipe_stop(fpipe);
+    fclose(f);
+    if (byte_number != fileSz) {
+        printf("ERROR:  Read %ld of %ld file bytes. Quitting...\n", byte_number, fileSz);
+        exit(-1);
+    }
+
+    memset(&pdu, 0, sizeof(ftp_pdu));
+    pdu.msg_type = MSG_DATA_END;
+    pdu.file_size = fileSz;
+    memcpy(&pdu.file_name, cfg->file_name, sizeof(cfg->file_name));
+    pdu.byte_number = byte_number;
+    pdu.file_hash = file_hash;
+    memcpy(sBuff, &pdu, sizeof(ftp_pdu));
+    ftp_trace_out(&pdu);
+    if (dp_mcast_send(mc, sBuff, sizeof(ftp_pdu)) < 0 || dp_mcast_finish(mc) < 0) {
+        exit(-1);
+    }
+    printf("Sent %ld file bytes as %ld payload bytes to %s\n", byte_number, wire_bytes, cfg->mcast_group);
+    print_mcast_stats_json(mc);
+    dp_mcast_close(mc);
+}
+
+/*
+ *  -G on the server: joins the group, takes in one file from whoever sends
+ *  to it and checks it against the sender's hash.  Returns 0 when the file
+ *  arrived whole, -1 otherwise.
+ */
+int start_mcast_server(prog_config *cfg) {
+    char in_path[FNAME_SZ] = {0};
+    FILE *f = NULL;
+    ftp_sink *sink = NULL;
+    ftp_hash hash;
+    bool sparse = false;
+    long wrOff = 0;                         //end of what has reached the sink
+    int rc = -1;
+
+    dp_mcast *mc = dp_mcast_open(cfg->mcast_group, cfg->svr_ip_addr, cfg->port_number, 0);
+    if (mc == NULL) {
+        return -1;
+    }
+    printf("Waiting for a file on %s port %d\n", cfg->mcast_group, cfg->port_number);
+
+    while (1) {
+        int rcvSz = dp_mcast_recv(mc, rbuffer, sizeof(rbuffer));
+        if (rcvSz < (int)sizeof(ftp_pdu)) {
+            printf("ERROR:  %s, the transfer did not finish\n",
+                   rcvSz == DP_ERROR_IDLE ? "sender went quiet" : "session ended");
+            break;
+        }
+        ftp_pdu *recvPdu = (ftp_pdu *)rbuffer;
+        ftp_trace_in(recvPdu);
+
+        if (recvPdu->msg_type == MSG_FILE_REQUEST && f == NULL) {
+            snprintf(in_path, sizeof(in_path), "./infile/%s", recvPdu->file_name);
+            printf("Receiving %s, %ld bytes\n", in_path, recvPdu->file_size);
+            f = fopen(in_path, "wb+");
+            ftp_hash_init(&hash);
+            if (f == NULL || (sink = ftp_sink_start(f, &hash)) == NULL) {
+                printf("ERROR:  Cannot open file %s\n", in_path);
+                break;
+            }
+        } else if (f == NULL) {
+            // joined after the request went by, nothing to put it in
+            printf("ERROR:  the transfer started before we joined\n");
+            break;
+        } else if (recvPdu->msg_type == MSG_DATA) {
+            char *out = ftp_sink_buf(sink);
+            char *payload;
+            int payload_size = ftp_chunk_decode(recvPdu->codec, rbuffer + sizeof(ftp_pdu), recvPdu->payload_size,
+                                                recvPdu->raw_size, out, FTP_CHUNK_SZ, &payload);
+            if (payload_size < 0) {
+                ftp_sink_write(sink, out, 0);
+                printf("ERROR:  Cannot decode chunk at %ld\n", recvPdu->byte_number);
+                break;
+            }
+            if (payload != out) {
+                memcpy(out, payload, payload_size);
+            }
+            ftp_sink_write(sink, out, payload_size);
+            wrOff += payload_size;
+        } else if (recvPdu->msg_type == MSG_DATA_HOLE) {
+            ftp_sink_skip(sink, recvPdu->raw_size);
+            wrOff += recvPdu->raw_size;
+            sparse = true;
+        } else if (recvPdu->msg_type == MSG_DATA_END) {
+            int sinkRc = ftp_sink_finish(sink, NULL);
+            sink = NULL;
+            unsigned long long file_hash = ftp_hash_digest(&hash);
+            if (sinkRc < 0 || (sparse && (wrOff != recvPdu->file_size || set_file_size(f, wrOff) < 0))) {
+                printf("ERROR:  Cannot write file %s\n", in_path);
+            } else if (file_hash != recvPdu->file_hash) {
+                printf("ERROR:  %s hash mismatch (sender %016llx, us %016llx)\n",
+                       in_path, recvPdu->file_hash, file_hash);
+            } else {
+                printf("Received %ld bytes, hash %016llx verified!\n", wrOff, file_hash);
+                rc = 0;
+            }
+            break;
+        }
+    }
+
+    ftp_sink_finish(sink, NULL);
+    if (f != NULL) {
+        fclose(f);
+        if (rc < 0) {
+            remove(in_path);
+        }
+    }
+    print_mcast_stats_json(mc);
+    dp_mcast_close(mc);
+    return rc;
+}
+
 void start_server(dp_connp dpc){
-    server_loop(dpc, sbuffer, rbuffer, sizeof(sbuffer), sizeof(rbuffer));
+    // with one session there is nobody else to keep serving
+    int rc = server_loop(dpc, sbuffer, rbuffer, sizeof(sbuffer), sizeof(rbuffer));
+    if (rc == DP_ERROR_GENERAL || rc == DP_ERROR_PROTOCOL) {
+        exit(-1);
+    }
+}
+
+/*
+ *  Thread body for one accepted session in -m mode.  Each session has its
+ *  own buffers on its own stack, and the connection is released here
+ *  however the session ended, an error included.
+ */
+static void *session_thread(void *arg) {
+    dp_connp dpc = arg;
+    char sBuff[BUFF_SZ];
+    char rBuff[BUFF_SZ];
+
+    server_loop(dpc, sBuff, rBuff, BUFF_SZ, BUFF_SZ);
+    dpclose(dpc);
+    return NULL;
+}
+
+/*
+ *  -m mode: the listener stays on the well known port and every client gets
+ *  its own session socket and thread, so downloads and uploads run side by
+ *  side.  The listener hands out cookies (dp_set_cookies()), so a flood of
+ *  CONNECTs from addresses that never answer costs no sessions.
+ */
+void start_multi_server(dp_connp listener) {
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    printf("Waiting for connections...\n");
+    while (1) {
+        dp_connp dpc = dpaccept(listener);
+        if (dpc == NULL) {
+            continue;
+        }
+
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, session_thread, dpc) != 0) {
+            perror("Could not start session thread");
+            dpclose(dpc);
+        }
+    }
 }
 
+static void dump_trace(void) {
+    int n = dp_trace_dump(trace_path);
+    if (n < 0) {
+        perror("Could not write trace");
+    } else {
+        printf("Wrote %d trace records to %s\n", n, trace_path);
+    }
+}
+
+//the -m server only stops on a signal, so the trace is dumped from here too
+static void dump_trace_on_signal(int sig) {
+    dp_trace_dump(trace_path);
+    _exit(128 + sig);
+}
 
 int main(int argc, char *argv[]) {
     prog_config cfg;
@@ -323,6 +1526,19 @@ int main(int argc, char *argv[]) {
     //in the cs472-pproto.c file
     cmd = initParams(argc, argv, &cfg);
 
+    stats_interval = cfg.stats_interval;
+    use_uring = cfg.uring;
+    use_store = cfg.store;
+    use_discard = cfg.discard;
+    if (cfg.trace_level > DP_TRACE_OFF) {
+        dp_trace_set_level(cfg.trace_level);
+        //atexit handlers run after main's frame is gone, keep our own copy
+        memcpy(trace_path, cfg.trace_path, sizeof(trace_path));
+        atexit(dump_trace);
+        signal(SIGINT, dump_trace_on_signal);
+        signal(SIGTERM, dump_trace_on_signal);
+    }
+
     printf("MODE %d\n", cfg.prog_mode);
     printf("PORT %d\n", cfg.port_number);
 
@@ -336,19 +1552,39 @@ int main(int argc, char *argv[]) {
         case PROG_MD_CLI:
             //by default client will look for files in the ./outfile directory
             snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
+            if (cfg.mcast_group[0] != '\0') {
+                start_mcast_client(&cfg);
+                exit(0);
+            }
             dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number);
-            rc = dpconnect(dpc);
-            if (rc < 0) {
-                perror("Error establishing connection");
-                exit(-1);
+            if (cfg.shm) {
+                dp_offer_shm(dpc);
             }
 
-            start_client(dpc, &cfg);
+            // the first request connects us, see connect_with_request()
+            if (cfg.get) {
+                start_download(dpc, &cfg);
+            } else {
+                start_client(dpc, &cfg);
+            }
             exit(0);
             break;
 
         case PROG_MD_SVR:
+            if (cfg.mcast_group[0] != '\0') {
+                exit(start_mcast_server(&cfg) < 0 ? -1 : 0);
+            }
+            if (cfg.multi) {
+                dp_set_cookies(1);
+            }
             dpc = dpServerInit(cfg.port_number);
+            if (dpc == NULL) {
+                exit(-1);
+            }
+            if (cfg.multi) {
+                start_multi_server(dpc);
+                break;
+            }
             rc = dplisten(dpc);
             if (rc < 0) {
                 perror("Error establishing connection");
@@ -356,6 +1592,7 @@ int main(int argc, char *argv[]) {
             }
 
             start_server(dpc);
+            dpclose(dpc);
             break;
         default:
             printf("ERROR: Unknown Program Mode.  Mode set is %d\n", cmd);
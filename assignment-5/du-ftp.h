@@ -6,6 +6,7 @@
 #define FNAME_SZ        150
 #define PROG_DEF_FNAME  ""
 #define PROG_DEF_SVR_ADDR   "127.0.0.1"
+#define PROG_DEF_TRACE  "du-ftp.trace"
 
 #define MSG_FILE_REQUEST    10
 #define MSG_FILE_OK         20
@@ -15,18 +16,41 @@
 #define MSG_DATA_END        60
 #define MSG_ERROR           70
 #define MSG_CLOSE           80
+#define MSG_BATCH_REQUEST   90      //like MSG_FILE_REQUEST, for a whole directory tree
+#define MSG_MANIFEST        100     //byte_number entries of the batch file list in the payload
+#define MSG_FILE_GET        110     //ask the server to send file_name back to us
+#define MSG_DATA_HOLE       120     //raw_size zero bytes at byte_number, no payload
+#define MSG_CHUNK_LIST      130     //byte_number chunk names of the file in the payload, see ftp-cdc.h
+#define MSG_CHUNK_NEED      140     //bitmap of the listed chunks the server wants sent
 
 typedef struct prog_config{
     int     prog_mode;
     int     port_number;
     char    svr_ip_addr[16];
     char    file_name[128];
+    int     codec;
+    int     batch;
+    int     get;
+    int     multi;
+    int     shm;
+    int     uring;
+    int     store;                  //-C, keep uploads in the deduplicating chunk store
+    long    synth_size;             //-n, upload this many made up bytes instead of the file
+    int     discard;                //-N, hash what we receive but do not write it
+    char    mcast_group[16];        //-G, empty unless sending or receiving by multicast
+    int     trace_level;
+    int     stats_interval;
+    char    trace_path[FNAME_SZ];
 } prog_config;
 
 typedef struct ftp_pdu {
     int         msg_type;
     long        file_size;
     char        file_name[128];
-    int         byte_number;
+    long        byte_number;
     int         payload_size;
+    int         codec;
+    int         raw_size;
+    int         dedup;              //MSG_FILE_REQUEST: we can send chunk lists, MSG_FILE_OK: send them
+    unsigned long long file_hash;   //XXH64 of the whole file, sent with MSG_DATA_END/MSG_CLOSE
 } ftp_pdu;
\ No newline at end of file
@@ -1,55 +1,346 @@
+#define _GNU_SOURCE     //ppoll()
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <errno.h>
 #include <time.h>
+#include <sys/random.h>
 
 #include "du-proto.h"
+#include "du-crc.h"
+#include "dp-trace.h"
+#include "dp-impair.h"
+#include "dp-shm.h"
+#include "dp-sched.h"
+#include "dp-pool.h"
 
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
-static int  _debugMode = 0;
+//a CONNECT carries the offer, the early message and the cookie side by side in one datagram
+_Static_assert(DP_MAX_EARLY_SZ + sizeof(dp_shm_offer) + DP_COOKIE_SZ <= DP_MAX_BUFF_SZ,
+               "early data, shm offer and cookie must fit a CONNECT");
+
+/*
+* The UDP socket backend every connection starts on, see dp_transport in du-proto.h. dp_udp_send() hands the datagram to
+* the impairment layer when one is configured and straight to sendto() otherwise. dp_udp_recv() waits on the socket with
+* ppoll() until a datagram arrives or the deadline passes; while it waits it also releases any datagrams the impairment
+* layer is holding back, waking up whenever one of them comes due. With no deadline and no impairment we go straight to
+* recvfrom(), which records the sender's address in outSockAddr so a server learns who to answer. On a socket with UDP_GRO on
+* (dp_set_window()) a read can bring up a whole run of coalesced datagrams; dp_udp_recv_gro() keeps the run and hands it out
+* one datagram per call, so du-proto above never sees a datagram bigger than DP_MAX_DGRAM_SZ. dp_udp_send_gso() is the other
+* half, used by dpsendwindow() to put a run of equal sized datagrams down in one sendmsg().
+*/
+static unsigned long long dp_udp_now(dp_connp dp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int dp_udp_send(dp_connp dp, const void *sbuff, int sbuff_sz) {
+    if (dp->impair != NULL)
+        return dp_impair_send(dp->impair, dp->udp_sock, sbuff, sbuff_sz,
+                        (const struct sockaddr *) &(dp->outSockAddr.addr), dp->outSockAddr.len);
+    return sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
+            0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
+                dp->outSockAddr.len); 
+}
+
+//n datagrams of seg_sz bytes back to back in buff, the last possibly shorter; -1 if the kernel will not segment them for us
+static int dp_udp_send_gso(dp_connp dp, const void *buff, int len, int seg_sz) {
+    char ctl[CMSG_SPACE(sizeof(unsigned short))] = {0};
+    struct iovec iov = { .iov_base = (void *)buff, .iov_len = len };
+    struct msghdr msg = {
+        .msg_name = &dp->outSockAddr.addr, .msg_namelen = dp->outSockAddr.len,
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl, .msg_controllen = sizeof(ctl),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+    *(unsigned short *)CMSG_DATA(cm) = seg_sz;
+    return sendmsg(dp->udp_sock, &msg, 0);
+}
+
+//the next datagram of the last UDP_GRO read, reading again once it is used up
+static int dp_udp_recv_gro(dp_connp dp, void *buff, int buff_sz) {
+    if (dp->groOff >= dp->groLen) {
+        char ctl[CMSG_SPACE(sizeof(int))];
+        struct iovec iov;
+        struct msghdr msg = {
+            .msg_name = &dp->outSockAddr.addr, .msg_namelen = sizeof(dp->outSockAddr.addr),
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = ctl, .msg_controllen = sizeof(ctl),
+        };
+
+        if (dp->gro == NULL && (dp->gro = malloc(DP_GRO_BUFF_SZ)) == NULL) {
+            perror("dprecv: no memory for GRO reads");
+            return -1;
+        }
+        iov.iov_base = dp->gro;
+        iov.iov_len = DP_GRO_BUFF_SZ;
+        int bytes = recvmsg(dp->udp_sock, &msg, 0);
+        if (bytes < 0) {
+            perror("dprecv: received error from recvmsg()");
+            return -1;
+        }
+        dp->outSockAddr.len = msg.msg_namelen;
+        dp->outSockAddr.isAddrInit = true;
+
+        //no UDP_GRO message means a single datagram
+        dp->groSeg = bytes;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                dp->groSeg = *(int *)CMSG_DATA(cm);
+        }
+        if (dp->groSeg <= 0 || dp->groSeg > bytes)
+            dp->groSeg = bytes;
+        else if (dp->groSeg < bytes)
+            dp->stats.gro_recvs++;
+        dp->groOff = 0;
+        dp->groLen = bytes;
+    }
+
+    char *dgram = dp->gro + dp->groOff;
+    int len = dp->groLen - dp->groOff < dp->groSeg ? dp->groLen - dp->groOff : dp->groSeg;
+    dp->groOff += len;
+    if (len > buff_sz)
+        len = buff_sz;
+    memcpy(buff, dgram, len);
+    return len;
+}
+
+static int dp_udp_recv(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns) {
+    int bytes;
+
+    //what is left of a GRO read is already here
+    if (dp->groOff < dp->groLen)
+        return dp_udp_recv_gro(dp, buff, buff_sz);
+
+    while (deadline_ns != 0 || dp->impair != NULL) {
+        long long wake = deadline_ns ? (long long)deadline_ns : -1;
+        if (dp->impair != NULL) {
+            dp_impair_flush(dp->impair, dp->udp_sock);
+            long long due = dp_impair_next_due_ns(dp->impair);
+            if (due >= 0 && (wake < 0 || due < wake))
+                wake = due;
+        }
+
+        //ppoll() rather than poll() so held datagrams are not released up to a millisecond late
+        struct timespec left, *waitFor = NULL;
+        if (wake >= 0) {
+            long long ns = wake - (long long)dp_udp_now(dp);
+            if (ns < 0)
+                ns = 0;
+            left.tv_sec = ns / 1000000000ll;
+            left.tv_nsec = ns % 1000000000ll;
+            waitFor = &left;
+        }
+        struct pollfd pfd = { .fd = dp->udp_sock, .events = POLLIN };
+        int ready = ppoll(&pfd, 1, waitFor, NULL);
+        if (ready > 0)
+            break;
+        if (ready < 0 && errno != EINTR) {
+            perror("dprecv: received error from ppoll()");
+            return -1;
+        }
+        if (deadline_ns != 0 && dp_udp_now(dp) >= deadline_ns)
+            return DP_ERROR_TIMEOUT;
+    }
+
+    if (dp->groOn)
+        return dp_udp_recv_gro(dp, buff, buff_sz);
+
+    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
+                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
+                &(dp->outSockAddr.len)); 
+
+    if (bytes < 0) {
+        perror("dprecv: received error from recvfrom()");
+        return -1;
+    }
+    dp->outSockAddr.isAddrInit = true;
+    return bytes;
+}
+
+static const dp_transport dp_udp_transport = {
+    .send   = dp_udp_send,
+    .recv   = dp_udp_recv,
+    .now_ns = dp_udp_now,
+};
 
 /*
 * static dp_connp dpinit() is a static function that exists only in the context of this file (du-proto.c). 
 * The goal of the function is to create a new instance of a dp_connection struct and initialize the values
 * from random memory to useful starting values or zeroes. We start by declaring a variable 'dpsession' that is of
-* type dp_connp which is typdef'd to represent a pointer to a dp_connection. This memory is pulled from the heap
-* (however many bytes one dp_connection struct takes, denoted by sizseof(dp_connection)) and we save the pointer to this
-* chunk of memory. We then initialize all bytes to the value of zero using bzero) and passing our pointer. Then for
-* all fields we do the following:
+* type dp_connp which is typdef'd to represent a pointer to a dp_connection. This memory comes zeroed from the connection
+* slab in dp-pool.h, which only goes to the heap when every connection it has is in use, and we save the pointer to it. Only
+* the buffers at the end of it are not zeroed: those are whatever the slot's last connection allocated, ready for reuse.
+* Then for all fields we do the following:
 *       dpsession->outSockAddr.isAddrInit = false [to say we have not intialized the address]
 *       dpsession->inSockAddr.isAddrInit = false [to say we have not intialized the address]
 *       dpsession->outSockAddr.len = sizeof(struct sockaddr_in) [to keep track of how big our 'outSock' address is]
 *       dpsession->inSockAddr.len = sizeof(struct sockaddr_in) [to keep track of how big our 'inSock' address is]
 *       dpsession->seqNum = 0 [to start our intial sequence number at zero when transmitting and receiving data]
+*       dpsession->udp_sock = -1 [no socket yet, so dpclose() knows there is nothing to close]
 *       dpsession->dbgMode = true [to set our debug mode to true]
+*       dpsession->rto_ns = DP_RTO_INIT_MS [how long to wait for the first ACK before resending]
+*       dpsession->impair = dp_impair_new() [NULL unless an impairment profile was configured, see dp-impair.h]
+*       dpsession->sched = dp_sched_join() [NULL unless a bandwidth limit was configured, see dp-sched.h]
+*       dpsession->tp = &dp_udp_transport [datagrams go over the UDP socket unless dpTransportInit() says otherwise]
+*       dpsession->idleMs, probeMs [the idle timeout and keepalive interval from dp_set_keepalive(), 0 if none was set]
+*       dpsession->window = _window [fragments dpsend() may have unACKed, 1 unless dp_set_window() says otherwise]
+*       dpsession->sndStreamSz, rcvStreamSz [dp_write()/dp_read() buffer sizes from dp_set_stream_buffers()]
+*       dpsession->cookies = _cookies [whether a listener wants its cookie back before it takes a CONNECT, see dp_set_cookies()]
 *
 * then we return this pointer so we can keep track of it and use it in other parts of our program with all of these fields 
 * ready to use in a neutral state.
 */
+static unsigned int _idleMs;
+static unsigned int _probeMs;
+static int _window = 1;
+static int _sndStreamSz = DP_STREAM_SND_SZ;
+static int _rcvStreamSz = DP_STREAM_RCV_SZ;
+static _Bool _cookies;
+
 static dp_connp dpinit(){
-    dp_connp dpsession = malloc(sizeof(dp_connection));
-    bzero(dpsession, sizeof(dp_connection));
+    dp_connp dpsession = dp_conn_alloc();
+    if (dpsession == NULL)
+        return NULL;
     dpsession->outSockAddr.isAddrInit = false;
     dpsession->inSockAddr.isAddrInit = false;
     dpsession->outSockAddr.len = sizeof(struct sockaddr_in);
     dpsession->inSockAddr.len = sizeof(struct sockaddr_in);
     dpsession->seqNum = 0;
+    dpsession->udp_sock = -1;
     dpsession->isConnected = false;
     dpsession->dbgMode = true;
+    dpsession->rto_ns = DP_RTO_INIT_MS * 1000000ull;
+    dpsession->impair = dp_impair_new();
+    dpsession->sched = dp_sched_join();
+    dpsession->tp = &dp_udp_transport;
+    dpsession->idleMs = _idleMs;
+    dpsession->probeMs = _probeMs;
+    dpsession->window = _window;
+    dpsession->sndStreamSz = _sndStreamSz;
+    dpsession->rcvStreamSz = _rcvStreamSz;
+    dpsession->cookies = _cookies;
     return dpsession;
 }
 
+//every timestamp the protocol takes comes from the connection's transport, so a simulated one can run on virtual time
+static unsigned long long dp_now_ns(dp_connp dp) {
+    return dp->tp->now_ns(dp);
+}
+
+unsigned long long dp_clock_ns(dp_connp dp) {
+    return dp_now_ns(dp);
+}
+
+static void dp_stats_rtt(dp_stats *st, unsigned long long rtt_ns) {
+    unsigned long long us = rtt_ns / 1000;
+    int bucket = 0;
+
+    while (us > 1 && bucket < DP_RTT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    st->rtt_hist[bucket]++;
+    if (st->rtt_samples == 0 || rtt_ns < st->rtt_min_ns)
+        st->rtt_min_ns = rtt_ns;
+    if (rtt_ns > st->rtt_max_ns)
+        st->rtt_max_ns = rtt_ns;
+    st->rtt_samples++;
+    st->rtt_sum_ns += rtt_ns;
+}
+
 /*
-* void dpclose(dp_connp dpsession) simply takes an instance of dp_connp which is a pointer to a struct 'dp_connection'.
-* This function then takes that pointer and frees the memory used to hold all fields and returns the memory to the heap
-* so there are no memory leaks or resource problems in the program.
+* static void dp_update_rto(dp_connp dp, unsigned long long rtt_ns) folds a clean RTT sample into the smoothed RTT and its
+* variance and recomputes the retransmission timeout from them the way RFC 6298 does, clamped to [DP_RTO_MIN_MS, DP_RTO_MAX_MS].
+*/
+static void dp_update_rto(dp_connp dp, unsigned long long rtt_ns) {
+    if (dp->srtt_ns == 0) {
+        dp->srtt_ns = rtt_ns;
+        dp->rttvar_ns = rtt_ns / 2;
+    } else {
+        unsigned long long err = rtt_ns > dp->srtt_ns ? rtt_ns - dp->srtt_ns : dp->srtt_ns - rtt_ns;
+        dp->rttvar_ns = (3 * dp->rttvar_ns + err) / 4;
+        dp->srtt_ns = (7 * dp->srtt_ns + rtt_ns) / 8;
+    }
+    dp->rto_ns = dp->srtt_ns + 4 * dp->rttvar_ns;
+    if (dp->rto_ns < DP_RTO_MIN_MS * 1000000ull)
+        dp->rto_ns = DP_RTO_MIN_MS * 1000000ull;
+    if (dp->rto_ns > DP_RTO_MAX_MS * 1000000ull)
+        dp->rto_ns = DP_RTO_MAX_MS * 1000000ull;
+}
+
+//a timeout doubles the RTO until a clean sample brings it back down
+static void dp_backoff_rto(dp_connp dp) {
+    dp->rto_ns *= 2;
+    if (dp->rto_ns > DP_RTO_MAX_MS * 1000000ull)
+        dp->rto_ns = DP_RTO_MAX_MS * 1000000ull;
+}
+
+/*
+* void dp_get_stats(dp_connp dp, dp_stats *out) copies the connection's counters into out and stamps how long the
+* connection has been up, so callers can work out rates without reaching into the dp_connection.
+*/
+void dp_get_stats(dp_connp dp, dp_stats *out) {
+    memcpy(out, &dp->stats, sizeof(dp_stats));
+    out->elapsed_ns = out->start_ns ? dp_now_ns(dp) - out->start_ns : 0;
+}
+
+/*
+* unsigned long long dp_stats_rtt_percentile(const dp_stats *st, double pct) walks the RTT histogram and returns the
+* upper edge, in microseconds, of the bucket holding the pct'th percentile sample, or 0 if nothing was measured yet.
+*/
+unsigned long long dp_stats_rtt_percentile(const dp_stats *st, double pct) {
+    unsigned long long want = (unsigned long long)(st->rtt_samples * pct / 100.0);
+    unsigned long long seen = 0;
+
+    if (st->rtt_samples == 0)
+        return 0;
+    if (want >= st->rtt_samples)
+        want = st->rtt_samples - 1;
+    for (int i = 0; i < DP_RTT_BUCKETS; i++) {
+        seen += st->rtt_hist[i];
+        if (seen > want)
+            return 2ull << i;
+    }
+    return 2ull << (DP_RTT_BUCKETS - 1);
+}
+
+/*
+* void dpclose(dp_connp dpsession) simply takes an instance of dp_connp which is a pointer to a struct 'dp_connection'. This
+* function then has the transport let go of whatever it holds for the connection (a simulated link, an io_uring, or a shared
+* memory region, or one a server mapped but never moved onto because it closed before the CNTACK went out), closes the
+* connection's UDP socket, gives back any pooled packets it still holds and returns the connection to its slab (dp-pool.h) so
+* there are no memory leaks or resource problems in the program. Closing the socket matters for servers that hand every session
+* its own socket with dpaccept(). The idle timer is cancelled first, which also waits out a reaper thread that is in the middle
+* of firing it. The window, GRO and byte stream buffers, if the connection ever needed them, are not freed but stay with its slot
+* for the next connection, so sessions that come and go do not allocate them again. This is the only place a connection is freed: one
+* whose peer sent a CLOSE is only marked peerClosed, and dpdisconnect() ends by calling us.
 */
 void dpclose(dp_connp dpsession) {
-    free(dpsession);
+    dp_timer_cancel(&dpsession->idleTimer);
+    if (dpsession->tp->close != NULL)
+        dpsession->tp->close(dpsession);
+    if (dpsession->shmPending != NULL)
+        dp_shm_release(dpsession->shmPending);
+    if (dpsession->udp_sock >= 0)
+        close(dpsession->udp_sock);
+    dp_impair_free(dpsession->impair);
+    dp_sched_leave(dpsession->sched);
+    dp_pkt_put(dpsession->pend);
+    dp_pkt_put(dpsession->early);
+    dp_pkt_put(dpsession->cntack);
+    dp_conn_free(dpsession);
 }
 
 /*
@@ -122,6 +413,7 @@ dp_connp dpServerInit(int port) {
         close (*sock);
         return NULL;
     } 
+    dpgro(dpc);
 
     dpc->inSockAddr.isAddrInit = true;
     dpc->outSockAddr.len = sizeof(struct sockaddr_in);
@@ -171,43 +463,83 @@ dp_connp dpClientInit(char *addr, int port) {
 
     // The inbound address is the same as the outbound address
     memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+    dpgro(dpc);
+
+    return dpc;
+}
 
+/*
+* dp_connp dpTransportInit(const dp_transport *tp, void *tpCtx) builds a connection that moves its datagrams over tp instead of
+* a UDP socket, with tpCtx kept in the connection for the backend's own use. There are no socket addresses on such a link, so
+* both are marked initialized to get past the checks in dplisten(), dpconnect() and friends; the backend knows who the peer is.
+* From here on the connection is used exactly like one from dpServerInit() or dpClientInit(), and dpclose() hands it back to
+* the backend through tp->close.
+*/
+dp_connp dpTransportInit(const dp_transport *tp, void *tpCtx) {
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        perror("drexel protocol create failure");
+        return NULL;
+    }
+
+    dp_impair_free(dpc->impair);
+    dpc->impair = NULL;
+    dpc->tp = tp;
+    dpc->tpCtx = tpCtx;
+    dpc->inSockAddr.isAddrInit = true;
+    dpc->outSockAddr.isAddrInit = true;
     return dpc;
 }
 
 /*
-* int dprecv(dp_connp dp, void *buff, int buff_sz) takes a pointer to a dp_connection, a pointer to a buffer
-* and a size of that buffer. The function starts by declaring a new pointer to a dp_pdu and then serves as a
-* wrapper for calling dprecvdgram(). We pass our pointer to our dp_connection, our global buffer for writing 
-* data '_dpBuffer' and the size of that buffer. This returns the number of bytes we received. If we received
-* DP_CONNECTION_CLOSED as a result of dprecvdgram() then we return the same code. If this is not the case then
-* we set the pointer to our dp_pdu to the beginning of our _dpBuffer which we wrote to. This points inPdu to the beginning
-* of the received dp_pdu. If our receive size is larger than the size of our pdu, then we know that we have a payload on the
-* other side of the pdu so we write that to our buffer that we pass in to our function. Finally, we return the 
-* full datagram size.
+* int dprecv(dp_connp dp, void *buff, int buff_sz) takes a pointer to a dp_connection, a pointer to a buffer and a size of
+* that buffer. The function starts by declaring a new pointer to a dp_pdu and then serves as a wrapper for calling
+* dprecvdgram(). We pass our pointer to our dp_connection, the connection's buffer for writing data 'dp->dgramBuff' and
+* the size of that buffer. This returns the number of bytes we received. If we received DP_CONNECTION_CLOSED (or
+* DP_ERROR_IDLE, the peer went quiet) as a result of dprecvdgram() then we return the same code. If this is not the case
+* then we set the pointer to our dp_pdu to the beginning of our dp->dgramBuff which we wrote to. This points inPdu to the
+* beginning of the received dp_pdu. If our receive size is larger than the size of our pdu, then we know that we have a
+* payload on the other side of the pdu so we write that to our buffer that we pass in to our function. Finally, we return
+* the full datagram size. Once the peer has closed, every call returns DP_CONNECTION_CLOSED. On a server whose client sent
+* its first message inside the CONNECT, the first call just hands that message back; a call after that with the CNTACK
+* still owed sends it bare, so the client stops waiting to connect and can send us what we are about to wait for.
 */
 int dprecv(dp_connp dp, void *buff, int buff_sz) {
 
     int bytes_received = 0;
 
+    if (dp->peerClosed)
+        return DP_CONNECTION_CLOSED;
+    if (dp->early != NULL) {
+        if (dp->early->len > buff_sz)
+            return DP_BUFF_OVERSIZED;
+        bytes_received = dp->early->len;
+        memcpy(buff, dp->early->data, bytes_received);
+        dp_pkt_put(dp->early);
+        dp->early = NULL;
+        return bytes_received;
+    }
+    if (dp->cntackOwed && dpsendcntack(dp, NULL, 0) < 0)
+        return DP_ERROR_PROTOCOL;
+
     while (1) {
 
-        int rcvLen = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
-        if (rcvLen == DP_CONNECTION_CLOSED) {
-            return DP_CONNECTION_CLOSED;
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, sizeof(dp->dgramBuff));
+        if (rcvLen == DP_CONNECTION_CLOSED || rcvLen == DP_ERROR_IDLE) {
+            return rcvLen;
         }
         if (rcvLen < sizeof(dp_pdu)) {
             return DP_ERROR_BAD_DGRAM;
         }
 
-        dp_pdu *inPdu = (dp_pdu *)_dpBuffer;
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
         int chunk_sz = inPdu->dgram_sz;
 
         if (bytes_received + chunk_sz > buff_sz) {
             return DP_BUFF_OVERSIZED;
         }
 
-        memcpy((char*)buff + bytes_received, _dpBuffer + sizeof(dp_pdu), chunk_sz);
+        memcpy((char*)buff + bytes_received, dp->dgramBuff + sizeof(dp_pdu), chunk_sz);
 
         bytes_received += chunk_sz;
 
@@ -230,7 +562,18 @@ int dprecv(dp_connp dp, void *buff, int buff_sz) {
 * and our error code. The function then checks to make sure the buffer size is not greater than the max size
 * of our buffer (defined by a 'magic number' constant 'DP_BUFF_OVERSIZED'); if it is, we set the error code
 * to inform the caller that the buffer we are writing to is oversized. Then we call the dprecvraw() function
-* to receive the raw data and write it to the buffer we have, returning the number of bytes received; we error
+* to receive the raw data and write it to the buffer we have, returning the number of bytes received. Every datagram
+* is checked against its CRC32C with dpverify(), and its dgram_sz against its length with dpsized(); one that fails either is
+* treated as lost, so we answer it with a DP_MT_NACK carrying our unchanged sequence number and go back to receiving until a
+* good copy shows up. Stray ACKs are skipped,
+* and a datagram whose sequence number we have already passed is a resend after a lost ACK, so it gets its ACK again
+* from dpreack() and is not delivered twice. That includes a repeated CONNECT, whose CNTACK went missing. Data numbered past
+* what we wait for can only come from a sender's window (dpsendwindow()) after a loss, so it is dropped, and the first such
+* datagram since the last one we took is NACKed with our sequence number so the sender goes back to the gap. A KEEPALIVE is
+* answered with dpkeepack() and a KEEPACK is skipped like any other ACK; neither uses a sequence number. If the reaper thread
+* gives up on a quiet peer while we wait, we return DP_ERROR_IDLE. A server that has
+* not heard from its client since sending the CNTACK only waits an RTO at a time, resending the CNTACK in between, since on a
+* dpaccept() session the client's repeated CONNECTs go to the listener and never reach us. We then error
 * check and set the error code if applicable. Then we declare a new dp_pdu and copy the first part of the recv_buff
 * (we only copy however many bytes are in a dp_pdu); we check for an error again and set the error code appropriately.
 * Next we prepare the sequence number and our ACK. If we have an error, we simply increment the seq number by 1 and we are 
@@ -238,7 +581,11 @@ int dprecv(dp_connp dp, void *buff, int buff_sz) {
 * by one. If we don't error and its not a control message (just the pdu), we increment the sequence number by what is contained in
 * inPdu.dgram_sz. After this, if we error'd on the previous step, we are going to send that error msg type and the ACK.
 * If there is an error sending this, then we RETURN an error with the protocol. Then in the last section, if we have a send message
-* type or a close message type, we simply send the appropriate messages and ACK's back to the sender rather than continue on. We 
+* type or a close message type, we simply send the appropriate messages and ACK's back to the sender rather than continue on;
+* a CLOSE marks the connection peerClosed, and it stays the caller's to free with dpclose(),
+* except that data on a reliable transport is not ACKed because its sender is not waiting for one, and neither is a fragment
+* with more of its GRO read still to come, since ACKs are cumulative and the one for the last datagram of the read covers it. With a bandwidth limit set
+* (dp-sched.h) the data is charged to the connection first, which may hold back the ACK and so pace the sender. We 
 * then return the number of bytes we received in again.
 */
 static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
@@ -248,7 +595,81 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     if(buff_sz > DP_MAX_DGRAM_SZ)
         return DP_BUFF_OVERSIZED;
 
-    bytesIn = dprecvraw(dp, buff, buff_sz);
+    while (1) {
+        if (dp->pend != NULL) {
+            //already checked by dpsenddgram(), which stashed it while waiting for an ACK
+            bytesIn = dp->pend->len;
+            memcpy(buff, dp->pend->data, bytesIn);
+            dp_pkt_put(dp->pend);
+            dp->pend = NULL;
+            if (dpsized(buff, bytesIn))
+                break;
+            //its sender gets no ACK for it and sends it again
+            dp->stats.bad_dgrams++;
+            continue;
+        }
+        //until the client's first datagram shows our CNTACK got through, we keep resending it
+        bytesIn = dprecvraw_wait(dp, buff, buff_sz, dp->cntackTries > 0 ? dp_now_ns(dp) + dp->rto_ns : 0);
+        if (bytesIn == DP_ERROR_TIMEOUT) {
+            dp->stats.timeouts++;
+            dp->stats.retransmits++;
+            dp_backoff_rto(dp);
+            dp->cntackTries--;
+            dpsendraw(dp, dp->cntack->data, dp->cntack->len);
+            continue;
+        }
+        if (bytesIn == DP_ERROR_IDLE)
+            return DP_ERROR_IDLE;
+        if (bytesIn < 0)
+            break;
+
+        //a datagram that fails its checksum, or whose header does not match its length, is treated
+        //as lost, NACK it so the sender retransmits and wait for the next one
+        if (!dpverify(buff, bytesIn) || !dpsized(buff, bytesIn)) {
+            dp->stats.bad_dgrams++;
+            dp->stats.nacks_sent++;
+            dp_pdu nackPdu = {0};
+            nackPdu.proto_ver = DP_PROTO_VER_1;
+            nackPdu.mtype = DP_MT_NACK;
+            nackPdu.seqnum = dp->seqNum;
+            nackPdu.err_num = DP_ERROR_BAD_DGRAM;
+            if (dpsendraw(dp, &nackPdu, sizeof(dp_pdu)) != sizeof(dp_pdu))
+                return DP_ERROR_PROTOCOL;
+            continue;
+        }
+        dpheard(dp);
+
+        dp_pdu *peek = buff;
+        if (peek->mtype == DP_MT_KEEPALIVE) {
+            dpkeepack(dp);
+            continue;
+        }
+        //late or duplicated ACKs for datagrams we sent earlier carry nothing new
+        if (peek->mtype & (DP_MT_ACK | DP_MT_NACK))
+            continue;
+        //a resend of something already delivered: its ACK was lost, answer it again
+        if ((int)(peek->seqnum - dp->seqNum) < 0) {
+            dp->stats.duplicates++;
+            dpreack(dp, peek);
+            continue;
+        }
+        //a fragment ahead of the one we wait for: the one before it went missing from a window, and the sender goes back to it
+        if ((int)(peek->seqnum - dp->seqNum) > 0 && (peek->mtype & ~DP_MT_FRAGMENT) == DP_MT_SND) {
+            if (!dp->gapNacked) {
+                dp->stats.nacks_sent++;
+                dp_pdu nackPdu = {0};
+                nackPdu.proto_ver = DP_PROTO_VER_1;
+                nackPdu.mtype = DP_MT_NACK;
+                nackPdu.seqnum = dp->seqNum;
+                if (dpsendraw(dp, &nackPdu, sizeof(dp_pdu)) != sizeof(dp_pdu))
+                    return DP_ERROR_PROTOCOL;
+                dp->gapNacked = true;
+            }
+            continue;
+        }
+        dp->gapNacked = false;
+        break;
+    }
 
     //check for some sort of error and just return it
     if (bytesIn < sizeof(dp_pdu))
@@ -259,8 +680,13 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
     if (inPdu.dgram_sz > buff_sz)
         errCode = DP_BUFF_UNDERSIZED;
 
+    if (errCode != DP_NO_ERROR)
+        dp->stats.bad_dgrams++;
+    else
+        dp->stats.payload_recv += inPdu.dgram_sz;
+
     //Copy buffer back
-    // memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu.dgram_sz);
+    // memcpy(buff, (dp->dgramBuff+sizeof(dp_pdu)), inPdu.dgram_sz);
     
     
     //UDPATE SEQ NUMBER AND PREPARE ACK
@@ -294,6 +720,13 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
 
     switch (inPdu.mtype & ~DP_MT_FRAGMENT) {
         case DP_MT_SND:
+            //holding back the ACK is what slows the sender down to its share
+            dp->stats.sched_wait_ns += dp_sched_charge(dp->sched, bytesIn);
+            if (dp->tp->reliable)
+                break;
+            //the rest of a GRO read is the same burst, and the ACK for the end of it covers this fragment too
+            if ((inPdu.mtype & DP_MT_FRAGMENT) && dp->groOff < dp->groLen)
+                break;
             outPdu.mtype = DP_MT_SNDACK;
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
@@ -304,7 +737,8 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
             actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
             if (actSndSz != sizeof(dp_pdu))
                 return DP_ERROR_PROTOCOL;
-            dpclose(dp);
+            //the connection is still the caller's, to free with dpclose()
+            dp->peerClosed = true;
             return DP_CONNECTION_CLOSED;
         default:
         {
@@ -321,16 +755,25 @@ static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
 * a pointer to a buffer and the size of that buffer. We first declare an integer to keep track of how
 * many bytes we have received total. Then we see if our receive address or 'inSockAddr' is initialized,
 * if not, we error out and return. After this, we are clear to start receiving bytes, so we make the call to
-* recvfrom() where we use our binded socket address and our buffer and buffer size to receive data. We use
-* recvfrom() and not recv() because this is a connectionless communication. We want to accept the message if and
+* the transport's recv, which on a UDP socket is recvfrom(), where we use our binded socket address and our buffer and buffer size
+* to receive data. We use recvfrom() and not recv() because this is a connectionless communication. We want to accept the message if and
 * only if the address matches our outSockAddr (which we also specify). This returns to use the number of bytes
 * we received and we update our integer 'bytes'. We also set outSockAddr.isAddrInit state to true because if it
 * is null, then we fill that address space with that number of bytes (outSockAddr.len bytes) of the sender's address.
-* We then have some debugging code which is hardcoded to be 'off' right now, but if we set our conditional to true
-* then we will get a character pointer to our payload and then print the payload contents. Regardless of if this
-* debugging code executes, we then print the incoming pdu contents. We finally return how many bytes we received.
+* At DP_TRACE_PDU and above the incoming header is recorded in this thread's trace ring (see dp-trace.h); below
+* that the trace point costs a single branch. We finally return how many bytes we received.
 */
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
+    return dprecvraw_wait(dp, buff, buff_sz, 0);
+}
+
+/*
+* static int dprecvraw_wait(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns) is dprecvraw() with a
+* deadline on the connection's transport clock, where 0 means wait forever. If nothing arrives before the deadline it returns
+* DP_ERROR_TIMEOUT so the caller can resend. The waiting itself is up to the transport; see dp_udp_recv() for the socket. Once
+* the reaper thread has given up on the peer every call returns DP_ERROR_IDLE.
+*/
+static int dprecvraw_wait(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns){
     int bytes = 0;
 
     if(!dp->inSockAddr.isAddrInit) {
@@ -338,43 +781,99 @@ static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
         return -1;
     }
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
+    bytes = dp->tp->recv(dp, buff, buff_sz, deadline_ns);
+    //the reaper shut the socket down to wake us, see dpidlefire()
+    if (__atomic_load_n(&dp->idleExpired, __ATOMIC_ACQUIRE))
+        return DP_ERROR_IDLE;
+    if (bytes < 0)
+        return bytes;
+    dp->stats.pkts_recv++;
+    dp->stats.bytes_recv += bytes;
 
-    if (bytes < 0) {
-        perror("dprecv: received error from recvfrom()");
-        return -1;
-    }
-    dp->outSockAddr.isAddrInit = true;
-
-    //some helper code if you want to do debugging
-    if (bytes > sizeof(dp_pdu)){
-        if(false) {                         //just diabling for now
-            dp_pdu *inPdu = buff;
-            char * payload = (char *)buff + sizeof(dp_pdu);
-            printf("DATA : %.*s\n", inPdu->dgram_sz , payload); 
-        }
-    }
-
-    dp_pdu *inPdu = buff;
-    print_in_pdu(inPdu);
+    dp_trace(DP_TRACE_PDU, DP_TR_PDU_IN, buff, sizeof(dp_pdu));
 
     //return the number of bytes received 
     return bytes;
 }
 
+/*
+* static bool dpverify(void *buff, int buff_sz) checks the CRC32C stamped into an inbound datagram by
+* dpsendraw(). The checksum was computed with the checksum field itself set to zero, so we save the value
+* that arrived, zero the field, recompute over the whole datagram and put the original value back before
+* comparing. Anything too short to even hold a dp_pdu fails the check.
+*/
+static bool dpverify(void *buff, int buff_sz) {
+    if (buff_sz < (int)sizeof(dp_pdu))
+        return false;
+
+    dp_pdu *pdu = buff;
+    unsigned int sentSum = pdu->checksum;
+    pdu->checksum = 0;
+    unsigned int calcSum = dp_crc32c(buff, buff_sz);
+    pdu->checksum = sentSum;
+
+    return sentSum == calcSum;
+}
+
+/*
+* static bool dpsized(void *buff, int buff_sz) checks that the payload size in a datagram's header is what came in after it
+* and no more than one datagram holds. The CRC32C only catches damage on the way, not a datagram built to lie about its size,
+* and everything that copies a payload out trusts dgram_sz.
+*/
+static bool dpsized(void *buff, int buff_sz) {
+    dp_pdu *pdu = buff;
+
+    return buff_sz >= (int)sizeof(dp_pdu) && pdu->dgram_sz >= 0 && pdu->dgram_sz <= DP_MAX_BUFF_SZ &&
+           pdu->dgram_sz == buff_sz - (int)sizeof(dp_pdu);
+}
+
+/*
+* static int dpreack(dp_connp dp, dp_pdu *inPdu) answers a datagram we already delivered once. Its first ACK must have been
+* lost, since the peer sent it again, so we send the same ACK back (the sequence number just past it, with the ACK bit set on
+* its message type) without delivering the datagram a second time. A repeated CONNECT gets the very CNTACK we sent, since
+* that may carry the shared memory echo and our answer to the early message.
+*/
+static int dpreack(dp_connp dp, dp_pdu *inPdu) {
+    dp_pdu ack = {0};
+
+    if (inPdu->mtype == DP_MT_CONNECT && dp->cntack != NULL)
+        return dpsendraw(dp, dp->cntack->data, dp->cntack->len);
+
+    ack.proto_ver = DP_PROTO_VER_1;
+    ack.mtype = (inPdu->mtype & ~DP_MT_FRAGMENT) | DP_MT_ACK;
+    ack.seqnum = inPdu->seqnum + (inPdu->dgram_sz == 0 ? 1 : inPdu->dgram_sz);
+    return dpsendraw(dp, &ack, sizeof(dp_pdu));
+}
+
 /*
 * int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) takes a pointer to a dp_connection, a pointer to a 
 * send buffer and the size of that buffer. The function starts by checking to see if our buffer size is bigger
 * than the max datagram size; if this is the case, we return an appropriate error code. Otherwise we use this
-* function as a wrapper to call dpsenddgram() and we return the number of bytes this subcall returns.
+* function as a wrapper to call dpsenddgram() and we return the number of bytes this subcall returns. A server that still
+* owes the CNTACK for an early message sends its first message inside the CNTACK when it fits in DP_MAX_EARLY_SZ, which
+* saves the round trip the early message was for; a bigger one goes out the normal way after a bare CNTACK. A message of several
+* fragments on a connection with a window (dp_set_window()) goes to dpsendwindow() instead of a fragment at a time.
 */
 int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) {
 
     int sndSz;
     int remaining_to_send = sbuff_sz;
     int isFragment = 0;
+
+    if (dp->peerClosed)
+        return DP_CONNECTION_CLOSED;
+    if (dp->cntackOwed) {
+        if (sbuff_sz <= DP_MAX_EARLY_SZ) {
+            if (dpsendcntack(dp, sbuff, sbuff_sz) < 0)
+                return DP_ERROR_GENERAL;
+            dp->stats.payload_sent += sbuff_sz;
+            return sbuff_sz;
+        }
+        if (dpsendcntack(dp, NULL, 0) < 0)
+            return DP_ERROR_GENERAL;
+    }
+    if (dp->window > 1 && sbuff_sz > DP_MAX_BUFF_SZ && !dp->tp->reliable)
+        return dpsendwindow(dp, sbuff, sbuff_sz);
     while (remaining_to_send > 0) {
         int chunk = 0;
         if (remaining_to_send > DP_MAX_BUFF_SZ) {
@@ -403,15 +902,23 @@ int dpsend(dp_connp dp, void *sbuff, int sbuff_sz) {
 * and return an error code. If we do not have an error with the address, then we check to see if the semd buffer
 * size is greater than the maximum buffer size we can send; if yes, we return an error code for a general error.
 * If we get past our error checks, we start building the pdu and the buffer. We declare a new dp_pdu and point
-* it to the start of the global buffer, _dpBuffer. We also set our send size equal to the buffer we passed in as an
+* it to the start of the connection's datagram buffer, dp->dgramBuff. We also set our send size equal to the buffer we passed in as an
 * argument to the function. We then set the message type to a general send and then the dgram_sz equal to our send size.
 * We also make sure to update this pdu's sequence to the most recently updated sequence number stored in our dp_connection.
-* Then the function will copy the send buffer to our global _dpBuffer starting after the pdu and will copy the length of
+* Then the function will copy the send buffer to the connection's dp->dgramBuff starting after the pdu and will copy the length of
 * the send size (denoted 'sndSz'). To start an error check, we calculate the 'totalSendSz' by adding the datagram size with the 
 * size of the pdu. We then use this function as a wrapper to the dpsendraw() call; this will return how many bytes are sent. If
-* the 'bytesOut' does not equal 'totalSendSz' then we have an error message, but we continue onward in our code. We then set the values
-* of our pdu to zero so we can receive an ACK message. If we receive too few bytes to populate a pdu and our message type is not
-* a message acknowledgement we write a new error message. Then we return how many bytes we sent out, minus how many bytes our pdu took. 
+* the 'bytesOut' does not equal 'totalSendSz' then we have an error message, but we continue onward in our code. We then wait for
+* the ACK message. If the receiver answers with a DP_MT_NACK (our datagram failed its checksum) we send the same datagram again,
+* up to DP_MAX_RETRIES times before giving up with DP_ERROR_TIMEOUT. A missing ACK is handled the same way: if none arrives
+* within the connection's RTO (adapted from measured RTTs, doubled on every timeout) we resend. While waiting, a damaged
+* datagram or a stale ACK is dropped, and a datagram from the peer that we had already delivered is answered again with
+* dpreack() since our first ACK for it was lost, and a KEEPALIVE gets its KEEPACK. The peer's next datagram can also overtake
+* our ACK; it counts as the ACK and is parked in a pooled packet, dp->pend, for dprecvdgram(). Only once the datagram is
+* acknowledged do we advance the sequence number, so a resend carries the same one. A reliable transport (shared memory) cannot
+* lose the datagram, so there we send it once and move on without waiting for anything. Under a bandwidth limit (dp-sched.h) the
+* datagram first waits for the connection's turn and tokens, once however often it is resent. Round trips that needed no resend
+* are timed into the RTT histogram in dp->stats. Then we return how many bytes we sent out, minus how many bytes our pdu took.
 */
 static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, int isFragment) {
     int bytesOut = 0;
@@ -425,7 +932,7 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, int isFragment) {
         return DP_ERROR_GENERAL;
 
     //Build the PDU and out buffer
-    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
+    dp_pdu *outPdu = (dp_pdu *)dp->dgramBuff;
     int    sndSz = sbuff_sz;
     outPdu->proto_ver = DP_PROTO_VER_1;
     if (isFragment) {
@@ -436,40 +943,311 @@ static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, int isFragment) {
     outPdu->dgram_sz = sndSz;
     outPdu->seqnum = dp->seqNum;
 
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, sndSz);
+    memcpy((dp->dgramBuff + sizeof(dp_pdu)), sbuff, sndSz);
 
     int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu);
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+    unsigned int ackSeq = dp->seqNum + (sndSz == 0 ? 1 : sndSz);
+
+    //our share of the bandwidth, once per datagram however often it has to be resent
+    dp->stats.sched_wait_ns += dp_sched_charge(dp->sched, totalSendSz);
+
+    //nothing goes missing on a reliable transport, so there is no ACK to wait for
+    if (dp->tp->reliable) {
+        bytesOut = dpsendraw(dp, dp->dgramBuff, totalSendSz);
+        if (bytesOut != totalSendSz)
+            return DP_ERROR_GENERAL;
+        dp->stats.payload_sent += sndSz;
+        dp->seqNum = ackSeq;
+        return bytesOut - sizeof(dp_pdu);
+    }
 
-    if(bytesOut != totalSendSz){
-        printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
+    char inBuff[DP_MAX_DGRAM_SZ];
+    dp_pdu *inPdu = (dp_pdu *)inBuff;
+    unsigned long long sentAt = 0;
+    int tries = 0;
+    bool acked = false;
+    bool implicit = false;
+
+    while (!acked) {
+        if (tries > DP_MAX_RETRIES) {
+            printf("Datagram not acknowledged after %d resends\n", DP_MAX_RETRIES);
+            return DP_ERROR_TIMEOUT;
+        }
+        if (tries > 0)
+            dp->stats.retransmits++;
+        //no word from the client since our CNTACK either, so that may be what it is missing
+        if (tries > 0 && dp->cntackTries > 0) {
+            dp->cntackTries--;
+            dpsendraw(dp, dp->cntack->data, dp->cntack->len);
+        }
+
+        sentAt = dp_now_ns(dp);
+        bytesOut = dpsendraw(dp, dp->dgramBuff, totalSendSz);
+        if(bytesOut != totalSendSz){
+            printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
+        }
+
+        //wait for our ACK; anything else that turns up in the meantime is handled and we keep waiting
+        unsigned long long deadline = sentAt + dp->rto_ns;
+        while (1) {
+            int bytesIn = dprecvraw_wait(dp, inBuff, sizeof(inBuff), deadline);
+            if (bytesIn == DP_ERROR_TIMEOUT) {
+                dp->stats.timeouts++;
+                dp_backoff_rto(dp);
+                break;
+            }
+            if (bytesIn == DP_ERROR_IDLE)
+                return DP_ERROR_IDLE;
+            if (bytesIn < (int)sizeof(dp_pdu) || !dpverify(inBuff, bytesIn)) {
+                //a corrupted ACK is as good as a lost one, the timeout resends
+                dp->stats.bad_dgrams++;
+                continue;
+            }
+            dpheard(dp);
+            if (inPdu->mtype == DP_MT_KEEPALIVE) {
+                dpkeepack(dp);
+                continue;
+            }
+            if (inPdu->mtype == DP_MT_NACK && inPdu->seqnum == dp->seqNum) {
+                dp->stats.nacks_recv++;
+                break;
+            }
+            if (inPdu->mtype == DP_MT_SNDACK && inPdu->seqnum == ackSeq) {
+                acked = true;
+                break;
+            }
+            //the peer only numbers a datagram past ours once it has taken ours, so its next datagram
+            //overtaking our ACK acknowledges us too; keep it for the next dprecv() instead of dropping it
+            if (!(inPdu->mtype & (DP_MT_ACK | DP_MT_NACK)) && inPdu->seqnum == ackSeq) {
+                if ((dp->pend = dp_pkt_get()) != NULL) {
+                    memcpy(dp->pend->data, inBuff, bytesIn);
+                    dp->pend->len = bytesIn;
+                }
+                acked = true;
+                implicit = true;
+                break;
+            }
+            //the peer resending something we already took means our ACK got lost
+            if (!(inPdu->mtype & (DP_MT_ACK | DP_MT_NACK)) && (int)(inPdu->seqnum - dp->seqNum) < 0) {
+                dp->stats.duplicates++;
+                dpreack(dp, inPdu);
+            }
+            //stale ACKs and early datagrams are dropped, the peer resends the latter
+        }
+        if (!acked)
+            tries++;
+    }
+
+    //a resent datagram's ACK could answer any of its copies, so only clean round trips are timed
+    if (tries == 0 && !implicit) {
+        dp_stats_rtt(&dp->stats, dp_now_ns(dp) - sentAt);
+        dp_update_rto(dp, dp_now_ns(dp) - sentAt);
     }
+    dp->stats.payload_sent += sndSz;
 
-    //update seq number after send
+    //update seq number once the datagram is acknowledged
     if(outPdu->dgram_sz == 0)
         dp->seqNum++;
     else
         dp->seqNum += outPdu->dgram_sz;
 
-    //need to get an ack
-    dp_pdu inPdu = {0};
-    int bytesIn = dprecvraw(dp, &inPdu, sizeof(dp_pdu));
-    if ((bytesIn < sizeof(dp_pdu)) && (inPdu.mtype != DP_MT_SNDACK)){
-        printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
+    return bytesOut - sizeof(dp_pdu);
+}
+
+/*
+* static int dpsendwindow(dp_connp dp, char *sbuff, int sbuff_sz) is dpsend() for a message of several fragments on a connection
+* whose window is above 1. The fragments are cut and numbered exactly as dpsenddgram() would send them one by one, so nothing is
+* new on the wire, but up to dp->window of them go out before the first is ACKed, built and sent together by dpsendburst(). ACKs
+* are cumulative, since the receiver takes fragments strictly in order, so one for any fragment slides the window past it and
+* the room it frees is filled at once. A timeout, or a NACK for the fragment the receiver is stuck on (a damaged one, or a gap
+* it saw), goes back to the first fragment not ACKed and sends the window from there again: go-back-N, because the receiver
+* drops everything past a gap. DP_MAX_RETRIES timeouts or NACKs in a row without the window moving give up with
+* DP_ERROR_TIMEOUT. Everything else that turns up while we wait is handled as in dpsenddgram(), including the peer's next
+* datagram overtaking the last ACK. Only fragments that were sent once are timed for the RTT. Like dpsend() we return the size
+* of the last fragment.
+*/
+static int dpsendwindow(dp_connp dp, char *sbuff, int sbuff_sz) {
+    int n = (sbuff_sz + DP_MAX_BUFF_SZ - 1) / DP_MAX_BUFF_SZ;
+    unsigned int start = dp->seqNum;
+    unsigned long long sentAt[DP_MAX_WINDOW];
+    bool resent[DP_MAX_WINDOW];
+    char inBuff[DP_MAX_DGRAM_SZ];
+    dp_pdu *inPdu = (dp_pdu *)inBuff;
+    int base = 0;           //first fragment not ACKed
+    int next = 0;           //next fragment to send
+    int high = 0;           //fragments sent at least once
+    int tries = 0;
+
+    if(!dp->outSockAddr.isAddrInit) {
+        perror("dpsend:dp connection not setup properly");
+        return DP_ERROR_GENERAL;
+    }
+    if (dp->burst == NULL && (dp->burst = malloc(DP_MAX_WINDOW * DP_MAX_DGRAM_SZ)) == NULL) {
+        perror("dpsend: no memory for the window");
+        return DP_ERROR_GENERAL;
     }
 
-    return bytesOut - sizeof(dp_pdu);
+    while (base < n) {
+        int upto = base + dp->window < n ? base + dp->window : n;
+        if (next < upto) {
+            //our share of the bandwidth, once per fragment however often it has to be resent; a fragment at a time,
+            //since a whole window can be more than a bucket ever holds
+            for (int i = high; i < upto; i++) {
+                int bytes = sizeof(dp_pdu) + (i == n - 1 ? sbuff_sz - i * DP_MAX_BUFF_SZ : DP_MAX_BUFF_SZ);
+                dp->stats.sched_wait_ns += dp_sched_charge(dp->sched, bytes);
+            }
+            dpsendburst(dp, sbuff, sbuff_sz, start, next, upto);
+            unsigned long long now = dp_now_ns(dp);
+            for (int i = next; i < upto; i++) {
+                sentAt[i % DP_MAX_WINDOW] = now;
+                resent[i % DP_MAX_WINDOW] = i < high;
+                if (i < high)
+                    dp->stats.retransmits++;
+            }
+            if (upto > high)
+                high = upto;
+            next = upto;
+        }
+
+        int bytesIn = dprecvraw_wait(dp, inBuff, sizeof(inBuff), sentAt[base % DP_MAX_WINDOW] + dp->rto_ns);
+        if (bytesIn == DP_ERROR_TIMEOUT) {
+            dp->stats.timeouts++;
+            dp_backoff_rto(dp);
+            if (++tries > DP_MAX_RETRIES) {
+                printf("Datagram not acknowledged after %d resends\n", DP_MAX_RETRIES);
+                return DP_ERROR_TIMEOUT;
+            }
+            //no word from the client since our CNTACK either, so that may be what it is missing
+            if (dp->cntackTries > 0) {
+                dp->cntackTries--;
+                dpsendraw(dp, dp->cntack->data, dp->cntack->len);
+            }
+            next = base;
+            continue;
+        }
+        if (bytesIn == DP_ERROR_IDLE)
+            return DP_ERROR_IDLE;
+        if (bytesIn < (int)sizeof(dp_pdu) || !dpverify(inBuff, bytesIn)) {
+            dp->stats.bad_dgrams++;
+            continue;
+        }
+        dpheard(dp);
+        if (inPdu->mtype == DP_MT_KEEPALIVE) {
+            dpkeepack(dp);
+            continue;
+        }
+        if (inPdu->mtype == DP_MT_SNDACK || inPdu->mtype == DP_MT_NACK) {
+            int acked = dpwinacked(start, sbuff_sz, inPdu->seqnum);
+            if (acked > base) {
+                int last = (acked - 1) % DP_MAX_WINDOW;
+                if (!resent[last]) {
+                    dp_stats_rtt(&dp->stats, dp_now_ns(dp) - sentAt[last]);
+                    dp_update_rto(dp, dp_now_ns(dp) - sentAt[last]);
+                }
+                base = acked;
+                tries = 0;
+                if (next < base)
+                    next = base;
+            }
+            //the receiver is stuck on base, everything we sent past it was dropped; like a timeout this is a try,
+            //so a peer that NACKs base every time cannot keep us resending it forever
+            if (inPdu->mtype == DP_MT_NACK && acked == base) {
+                dp->stats.nacks_recv++;
+                if (++tries > DP_MAX_RETRIES) {
+                    printf("Datagram not acknowledged after %d resends\n", DP_MAX_RETRIES);
+                    return DP_ERROR_TIMEOUT;
+                }
+                next = base;
+            }
+            continue;
+        }
+        //the peer's next datagram overtaking our last ACK, see dpsenddgram()
+        if (!(inPdu->mtype & (DP_MT_ACK | DP_MT_NACK)) && inPdu->seqnum == start + sbuff_sz) {
+            if ((dp->pend = dp_pkt_get()) != NULL) {
+                memcpy(dp->pend->data, inBuff, bytesIn);
+                dp->pend->len = bytesIn;
+            }
+            break;
+        }
+        if (!(inPdu->mtype & (DP_MT_ACK | DP_MT_NACK)) && (int)(inPdu->seqnum - start) < 0) {
+            dp->stats.duplicates++;
+            dpreack(dp, inPdu);
+        }
+    }
+
+    dp->stats.payload_sent += sbuff_sz;
+    dp->seqNum = start + sbuff_sz;
+    return sbuff_sz - (n - 1) * DP_MAX_BUFF_SZ;
+}
+
+//how many fragments of a window that started at start an ACK or NACK for seq says arrived, -1 if it is not about this message
+static int dpwinacked(unsigned int start, int sbuff_sz, unsigned int seq) {
+    int off = (int)(seq - start);
+
+    if (off < 0 || off > sbuff_sz)
+        return -1;
+    if (off == sbuff_sz)
+        return (sbuff_sz + DP_MAX_BUFF_SZ - 1) / DP_MAX_BUFF_SZ;
+    return off % DP_MAX_BUFF_SZ == 0 ? off / DP_MAX_BUFF_SZ : -1;
+}
+
+/*
+* static void dpsendburst(dp_connp dp, char *sbuff, int sbuff_sz, unsigned int start, int from, int to) lays fragments from
+* to to - 1 of a message out back to back in dp->burst, each with the header and checksum dpsenddgram() and dpsendraw() would
+* give it, and sends them. On a plain UDP socket they go down in one sendmsg() with UDP_SEGMENT (dp_udp_send_gso()); every
+* fragment but the last of a message is DP_MAX_DGRAM_SZ, which is just the equal sized run GSO wants. The impairment layer
+* and the other transports get them one at a time, and so does a kernel that refuses to segment, from then on.
+*/
+static void dpsendburst(dp_connp dp, char *sbuff, int sbuff_sz, unsigned int start, int from, int to) {
+    char *at = dp->burst;
+
+    for (int i = from; i < to; i++) {
+        int off = i * DP_MAX_BUFF_SZ;
+        int sz = sbuff_sz - off < DP_MAX_BUFF_SZ ? sbuff_sz - off : DP_MAX_BUFF_SZ;
+        dp_pdu *pdu = (dp_pdu *)at;
+
+        pdu->proto_ver = DP_PROTO_VER_1;
+        pdu->mtype = off + sz < sbuff_sz ? DP_MT_SND | DP_MT_FRAGMENT : DP_MT_SND;
+        pdu->seqnum = start + off;
+        pdu->dgram_sz = sz;
+        pdu->err_num = 0;
+        memcpy(at + sizeof(dp_pdu), sbuff + off, sz);
+        pdu->checksum = 0;
+        pdu->checksum = dp_crc32c(at, sizeof(dp_pdu) + sz);
+        dp_trace(DP_TRACE_PDU, DP_TR_PDU_OUT, pdu, sizeof(dp_pdu));
+        at += sizeof(dp_pdu) + sz;
+    }
+
+    int len = at - dp->burst;
+    if (to - from > 1 && dp->tp == &dp_udp_transport && dp->impair == NULL && !dp->gsoOff) {
+        if (dp_udp_send_gso(dp, dp->burst, len, DP_MAX_DGRAM_SZ) == len) {
+            dp->stats.gso_sends++;
+            dp->stats.pkts_sent += to - from;
+            dp->stats.bytes_sent += len;
+            return;
+        }
+        //a full socket buffer is worth another try next time, a kernel or route without GSO is not
+        if (errno != EAGAIN && errno != ENOBUFS)
+            dp->gsoOff = true;
+    }
+    for (at = dp->burst; at < dp->burst + len; at += sizeof(dp_pdu) + ((dp_pdu *)at)->dgram_sz) {
+        int bytesOut = dp->tp->send(dp, at, sizeof(dp_pdu) + ((dp_pdu *)at)->dgram_sz);
+        if (bytesOut > 0) {
+            dp->stats.pkts_sent++;
+            dp->stats.bytes_sent += bytesOut;
+        }
+    }
 }
 
 /*
-* static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz) takes a pointer to a dp_connection, 
-* a pointer to our send buffer and the size of that buffer. The function starts by declaring an integer
-* to hold how many bytes we've sent. Then we check to see if the outgoing address, denoted by 'outSockAddr.isAddrInit',
-* is initialized; if not, we error our and return an error code. If we are all good to go with the address, then we declare
-* a new dp_pdu pointer and set the pointer equal to the beginning of our outgoing send buffer. We then pass our socket address
-* to sendto() because we need the local address and the outgoing address since this is a connectionless communication protocol.
-* We also pass the buffer with our pdu + payload in it and send it, storing the number of bytes sent in 'bytesOut'. We then
-* print our outgoing pdu and return the number of bytes sent.
+* static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz) takes a pointer to a dp_connection, a pointer to our send
+* buffer and the size of that buffer. The function starts by declaring an integer to hold how many bytes we've sent. Then we
+* check to see if the outgoing address, denoted by 'outSockAddr.isAddrInit', is initialized; if not, we error our and return
+* an error code. If we are all good to go with the address, then we declare a new dp_pdu pointer and set the pointer equal to
+* the beginning of our outgoing send buffer. We then hand it to the transport, which for a UDP socket passes our socket
+* address to sendto() because we need the local address and the outgoing address since this is a connectionless communication
+* protocol. We also pass the buffer with our pdu + payload in it and send it, storing the number of bytes sent in 'bytesOut'.
+* We then trace our outgoing pdu header and return the number of bytes sent.
 */
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
     int bytesOut = 0;
@@ -480,109 +1258,620 @@ static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
         return -1;
     }
 
+    //stamp the checksum over the header (with the field zeroed) and payload
     dp_pdu *outPdu = sbuff;
-    bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
-        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
-            dp->outSockAddr.len); 
+    outPdu->checksum = 0;
+    outPdu->checksum = dp_crc32c(sbuff, sbuff_sz);
 
-    
-    print_out_pdu(outPdu);
+    bytesOut = dp->tp->send(dp, sbuff, sbuff_sz);
+    if (bytesOut > 0) {
+        dp->stats.pkts_sent++;
+        dp->stats.bytes_sent += bytesOut;
+    }
+
+
+    dp_trace(DP_TRACE_PDU, DP_TR_PDU_OUT, outPdu, sizeof(dp_pdu));
 
     return bytesOut;
 }
 
 /*
-* int dplisten(dp_connp dp) takes a pointer to a dp_connection. We declare some values for our send size and our 
-* receive size. We also then check to see if our in-address is initialized; if not, we error and return a general
-* error. Then we declare a new dp_pdu and then set all values equal to zero. We print a message indicating we are
-* trying to connect and we call dprecvraw to see if any connection is trying to be made. If we are trying to set up a 
-* 'connection' then we should only receive the number of bytes needed for a dp_pdu. If the bytes received do not equal
-* this then we error and return an error code. If we did receieve a connection pdu, then we denote this in our dp_connection
-* field 'isConnected'. We then write a message saying we are connected and then we return 'true'.
+* static bool dpisconnect(void *msg, int rcvSz) checks that what dplisten() or dpaccept() received is an intact CONNECT. The
+* flags in err_num say what its payload holds: a dp_shm_offer with DP_CONN_SHM, then the client's first message with
+* DP_CONN_EARLY, then a cookie with DP_CONN_COOKIE, and together they have to account for exactly dgram_sz bytes.
+*/
+static bool dpisconnect(void *msg, int rcvSz) {
+    dp_pdu *pdu = msg;
+
+    if (rcvSz < (int)sizeof(dp_pdu) || !dpverify(msg, rcvSz) || pdu->mtype != DP_MT_CONNECT)
+        return false;
+    if (pdu->dgram_sz < 0 || rcvSz != (int)sizeof(dp_pdu) + pdu->dgram_sz)
+        return false;
+
+    int earlySz = pdu->dgram_sz - ((pdu->err_num & DP_CONN_SHM) ? (int)sizeof(dp_shm_offer) : 0) -
+                  ((pdu->err_num & DP_CONN_COOKIE) ? DP_COOKIE_SZ : 0);
+    if (pdu->err_num & DP_CONN_EARLY)
+        return earlySz >= 0 && earlySz <= DP_MAX_EARLY_SZ;
+    return earlySz == 0;
+}
+
+/*
+* static int dpsetup(dp_connp dp, const struct sockaddr_in *from, void *msg) finishes the server side of the handshake for
+* dplisten() and dpaccept() once dpisconnect() has passed the CONNECT in msg. A shared memory offer is taken up if the CONNECT
+* came from a loopback address, since a pid and fd from another host would name some unrelated local process, and echoing the
+* offer back in the CNTACK tells the client we mapped its region. The CNTACK is built in a pooled packet, dp->cntack, and kept
+* until we hear from the client so a repeated CONNECT gets exactly the same answer. A CONNECT carrying early data leaves it in
+* dp->early for the first dprecv() and does not answer yet: the CNTACK is owed until the application's first dpsend(), which it
+* then carries, so the client learns the outcome of its first request in the same round trip that connects it. Returns 0, or
+* DP_ERROR_GENERAL if the CNTACK could not be sent.
+*/
+static int dpsetup(dp_connp dp, const struct sockaddr_in *from, void *msg) {
+    dp_pdu *inPdu = msg;
+    if ((dp->cntack = dp_pkt_get()) == NULL)
+        return DP_ERROR_GENERAL;
+    dp_pdu *ack = (dp_pdu *)dp->cntack->data;
+    int offerSz = (inPdu->err_num & DP_CONN_SHM) ? sizeof(dp_shm_offer) : 0;
+    dp_shm *shm = NULL;
+
+    if (offerSz > 0 && (ntohl(from->sin_addr.s_addr) >> 24) == 127)
+        shm = dp_shm_open((dp_shm_offer *)(inPdu + 1));
+
+    memset(ack, 0, sizeof(dp_pdu));
+    ack->proto_ver = DP_PROTO_VER_1;
+    ack->mtype = DP_MT_CNTACK;
+    dp->seqNum = inPdu->seqnum + 1;
+    ack->seqnum = dp->seqNum;
+    dp->cntack->len = sizeof(dp_pdu);
+    if (shm != NULL) {
+        ack->err_num = DP_CONN_SHM;
+        ack->dgram_sz = sizeof(dp_shm_offer);
+        memcpy(ack + 1, inPdu + 1, sizeof(dp_shm_offer));
+        dp->cntack->len += sizeof(dp_shm_offer);
+    }
+    dp->shmPending = shm;
+    dp->isConnected = true;
+    //For non data transmissions, ACK of just control data increase seq # by one
+    dp->stats.start_ns = dp_now_ns(dp);
+    dpidlearm(dp);
+
+    if (inPdu->err_num & DP_CONN_EARLY) {
+        if ((dp->early = dp_pkt_get()) == NULL)
+            return DP_ERROR_GENERAL;
+        dp->early->len = inPdu->dgram_sz - offerSz;
+        memcpy(dp->early->data, (char *)(inPdu + 1) + offerSz, dp->early->len);
+        dp->stats.payload_recv += dp->early->len;
+        dp->cntackOwed = true;
+        return 0;
+    }
+    return dpsendcntack(dp, NULL, 0);
+}
+
+/*
+* static int dpsendcntack(dp_connp dp, void *reply, int reply_sz) sends the CNTACK dpsetup() built. If it was owed for an early
+* message it gets DP_CONN_EARLY, saying the message was taken, and reply (the server's first message, up to DP_MAX_EARLY_SZ
+* bytes) goes after the shared memory echo; with no reply the client reads our answer with dprecv() as usual. A region
+* dpsetup() mapped is only moved onto once the CNTACK is out over UDP, which is where the client is waiting for it.
+*/
+static int dpsendcntack(dp_connp dp, void *reply, int reply_sz) {
+    dp_pdu *ack = (dp_pdu *)dp->cntack->data;
+
+    if (dp->cntackOwed) {
+        ack->err_num |= DP_CONN_EARLY;
+        memcpy(dp->cntack->data + dp->cntack->len, reply, reply_sz);
+        ack->dgram_sz += reply_sz;
+        dp->cntack->len += reply_sz;
+        dp->cntackOwed = false;
+    }
+
+    int sndSz = dpsendraw(dp, dp->cntack->data, dp->cntack->len);
+    if (sndSz != dp->cntack->len) {
+        perror("dpsendcntack:The wrong number of bytes were sent");
+        return DP_ERROR_GENERAL;
+    }
+    if (dp->shmPending != NULL) {
+        //a live peer process is the shared memory transport's own business
+        dp_timer_cancel(&dp->idleTimer);
+        dp_shm_use(dp, dp->shmPending);
+        dp->shmPending = NULL;
+    }
+    //over UDP it is resent until the client is heard from, see dprecvdgram() and dpsenddgram()
+    dp->cntackTries = DP_MAX_RETRIES;
+    if (dp->tp->reliable)
+        dpheard(dp);
+    return 0;
+}
+
+/*
+* static void dpheard(dp_connp dp) notes that a datagram from the peer got through, so a CNTACK we sent has arrived and need
+* not be kept for resending any more, and the peer is alive as far as the idle timer goes. That is one store per datagram;
+* the timer is not touched here but looks at heardAt when it fires, see dpidlefire().
+*/
+static void dpheard(dp_connp dp) {
+    if (dp->idleMs > 0)
+        __atomic_store_n(&dp->heardAt, dp_now_ns(dp), __ATOMIC_RELAXED);
+    dp->cntackTries = 0;
+    if (dp->cntack != NULL) {
+        dp_pkt_put(dp->cntack);
+        dp->cntack = NULL;
+    }
+}
+
+/*
+* void dp_set_keepalive(unsigned int idle_ms, unsigned int probe_ms) sets the idle timeout for every connection made after it:
+* a peer we hear nothing from for idle_ms is given up on, which turns whatever du-proto call we are blocked in (or make next)
+* into DP_ERROR_IDLE, so a server gets its thread, socket and open files back from a client that vanished without a CLOSE.
+* Every probe_ms of quiet before that the peer is sent a KEEPALIVE, which it answers with a KEEPACK from inside any du-proto
+* call it is waiting in; probe_ms of 0 means idle_ms / DP_KEEPALIVE_DIV. A peer that is busy outside du-proto for longer than
+* idle_ms looks dead too, so idle_ms wants to be generous. idle_ms of 0, the default, turns all of this off.
+*/
+void dp_set_keepalive(unsigned int idle_ms, unsigned int probe_ms) {
+    _idleMs = idle_ms;
+    _probeMs = probe_ms > 0 ? probe_ms : idle_ms / DP_KEEPALIVE_DIV;
+}
+
+/*
+* void dp_set_window(int dgrams) lets every connection made after it have up to dgrams fragments of a message out before the
+* first is ACKed (at most DP_MAX_WINDOW), see dpsendwindow(); 1, the default, is plain stop and wait. Above 1 its UDP sockets
+* also ask for UDP_GRO, so a burst the peer sent with one sendmsg() comes up in one read too. The wire format is the same either
+* way, and a receiver handles a window whatever its own setting is; it just reads a sender's bursts a datagram at a time.
+*/
+void dp_set_window(int dgrams) {
+    _window = dgrams < 1 ? 1 : dgrams > DP_MAX_WINDOW ? DP_MAX_WINDOW : dgrams;
+}
+
+/*
+* void dp_set_cookies(int on) makes every listener set up after it (dpServerInit()) stateless until a client proves it can hear
+* us. A CONNECT that does not bring back a cookie is answered with a CNTACK flagged DP_CONN_COOKIE holding one, a MAC over the
+* client's address and port, its sequence number, its CONNECT flags and the time, keyed with a secret only the listener has
+* (dpcookieok()). Nothing is kept for it, so CONNECTs from spoofed addresses, or from clients that never come back, cost a
+* SipHash and a small datagram each and never a connection, a socket or a thread. The client sends its CONNECT again with the
+* cookie at the end of it, and only then do dplisten() and dpaccept() go on to build the connection, so every client pays one
+* more round trip to connect. A cookie is good for DP_COOKIE_LIFE_MS. Clients of this version handle the cookie whatever their
+* own setting; older ones would take the cookie for a CNTACK, so it is off by default.
+*/
+void dp_set_cookies(int on) {
+    _cookies = on != 0;
+}
+
+/*
+* static unsigned long long dpsiphash(const unsigned long long key[2], const void *data, int len) is SipHash-2-4 of len bytes,
+* the keyed hash the cookies are made from. It is short input, keyed, and hard to forge without the key, which is the job.
+*/
+static inline void dpsipround(unsigned long long v[4]) {
+    v[0] += v[1]; v[1] = (v[1] << 13) | (v[1] >> 51); v[1] ^= v[0]; v[0] = (v[0] << 32) | (v[0] >> 32);
+    v[2] += v[3]; v[3] = (v[3] << 16) | (v[3] >> 48); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = (v[3] << 21) | (v[3] >> 43); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = (v[1] << 17) | (v[1] >> 47); v[1] ^= v[2]; v[2] = (v[2] << 32) | (v[2] >> 32);
+}
+
+static unsigned long long dpsiphash(const unsigned long long key[2], const void *data, int len) {
+    const unsigned char *in = data;
+    unsigned long long v[4] = {
+        0x736f6d6570736575ull ^ key[0], 0x646f72616e646f6dull ^ key[1],
+        0x6c7967656e657261ull ^ key[0], 0x7465646279746573ull ^ key[1],
+    };
+    unsigned long long m;
+    int i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&m, in + i, 8);
+        v[3] ^= m;
+        dpsipround(v);
+        dpsipround(v);
+        v[0] ^= m;
+    }
+    m = (unsigned long long)len << 56;
+    for (int j = 0; i + j < len; j++)
+        m |= (unsigned long long)in[i + j] << (8 * j);
+    v[3] ^= m;
+    dpsipround(v);
+    dpsipround(v);
+    v[0] ^= m;
+    v[2] ^= 0xff;
+    for (int r = 0; r < 4; r++)
+        dpsipround(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+//the MAC a cookie issued at issued_ms carries for the CONNECT in pdu, from the address it just came from
+static unsigned long long dpcookiemac(dp_connp listener, const dp_pdu *pdu, unsigned int issued_ms) {
+    const struct sockaddr_in *from = &listener->outSockAddr.addr;
+    unsigned int in[5] = {from->sin_addr.s_addr, from->sin_port, pdu->seqnum, pdu->err_num & ~DP_CONN_COOKIE, issued_ms};
+
+    return dpsiphash(listener->cookieKey, in, sizeof(in));
+}
+
+/*
+* static bool dpcookieok(dp_connp listener, void *msg) is the check dplisten() and dpaccept() make on a CONNECT that passed
+* dpisconnect(), when dp_set_cookies() is on. A CONNECT bringing back a cookie this listener issued to the same address, for
+* the same sequence number and flags, no more than DP_COOKIE_LIFE_MS ago, has it taken off the end and its checksum stamped
+* again, so the rest of the handshake sees the CONNECT the client first sent and a resend of it still matches the one
+* dpaccept() took. Anything else gets a fresh cookie back and no state. The key is drawn when the first cookie is needed; if
+* there is no randomness to be had we let CONNECTs through rather than lock every client out. Returns whether to go on.
+*/
+static bool dpcookieok(dp_connp listener, void *msg) {
+    dp_pdu *pdu = msg;
+
+    if (!listener->cookies)
+        return true;
+    if (listener->cookieKey[0] == 0 && listener->cookieKey[1] == 0 &&
+        getrandom(listener->cookieKey, sizeof(listener->cookieKey), 0) != sizeof(listener->cookieKey)) {
+        perror("dpcookieok: no key for the cookies, taking CONNECTs without them");
+        listener->cookies = false;
+        return true;
+    }
+
+    unsigned int now = dp_now_ns(listener) / 1000000ull;
+    unsigned int issued;
+    unsigned long long mac;
+    if (pdu->err_num & DP_CONN_COOKIE) {
+        char *cookie = (char *)(pdu + 1) + pdu->dgram_sz - DP_COOKIE_SZ;
+        memcpy(&issued, cookie, sizeof(issued));
+        memcpy(&mac, cookie + sizeof(issued), sizeof(mac));
+        if (now - issued <= DP_COOKIE_LIFE_MS && mac == dpcookiemac(listener, pdu, issued)) {
+            pdu->err_num &= ~DP_CONN_COOKIE;
+            pdu->dgram_sz -= DP_COOKIE_SZ;
+            pdu->checksum = 0;
+            pdu->checksum = dp_crc32c(msg, sizeof(dp_pdu) + pdu->dgram_sz);
+            return true;
+        }
+    }
+
+    char reply[sizeof(dp_pdu) + DP_COOKIE_SZ];
+    dp_pdu *ack = (dp_pdu *)reply;
+    memset(ack, 0, sizeof(dp_pdu));
+    ack->proto_ver = DP_PROTO_VER_1;
+    ack->mtype = DP_MT_CNTACK;
+    ack->seqnum = pdu->seqnum;
+    ack->err_num = DP_CONN_COOKIE;
+    ack->dgram_sz = DP_COOKIE_SZ;
+    mac = dpcookiemac(listener, pdu, now);
+    memcpy(reply + sizeof(dp_pdu), &now, sizeof(now));
+    memcpy(reply + sizeof(dp_pdu) + sizeof(now), &mac, sizeof(mac));
+    if (dpsendraw(listener, reply, sizeof(reply)) == (int)sizeof(reply))
+        listener->stats.cookies_sent++;
+    return false;
+}
+
+/*
+* static void dpgro(dp_connp dp) turns UDP_GRO on for a new connection's socket when its window is above 1. A kernel without it
+* just says no, and the socket is read a datagram at a time as before.
+*/
+static void dpgro(dp_connp dp) {
+    if (dp->window > 1 && setsockopt(dp->udp_sock, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int)) == 0)
+        dp->groOn = true;
+}
+
+/*
+* static void dpidlearm(dp_connp dp) starts the idle timer of a connection that just came up, if an idle timeout is set and the
+* connection is on a UDP socket. A simulated link runs on its own clock, and shared memory notices a dead peer process by
+* itself. The timer sits in the reaper thread's timing wheel (dp-wheel.h), so however many sessions a server has, arming,
+* firing and cancelling one costs the same.
+*/
+static void dpidlearm(dp_connp dp) {
+    if (dp->idleMs == 0 || dp->tp != &dp_udp_transport)
+        return;
+    dp->heardAt = dp_now_ns(dp);
+    dp_timer_arm(&dp->idleTimer, dp->probeMs < dp->idleMs ? dp->probeMs : dp->idleMs, dpidlefire);
+}
+
+/*
+* static unsigned long long dpidlefire(dp_timer *t) runs on the reaper thread whenever a connection's idle timer comes due. The
+* datapath never moves the timer, it only records heardAt, so most of the time the peer has been heard from since and we just
+* come back when its next probe would be due. A peer quiet for probeMs is sent a KEEPALIVE. We build it ourselves and send it
+* straight to the socket, since dpsendraw() and the impairment layer belong to the connection's own thread; only the counter
+* is shared, and it is bumped atomically. A peer quiet for idleMs is given up on: idleExpired is set and the socket is shut
+* down for reading, which on Linux wakes a thread blocked on it in recvfrom() or ppoll() even for an unconnected UDP socket.
+* Returns the milliseconds until the timer should fire again, or 0 when it is done.
+*/
+static unsigned long long dpidlefire(dp_timer *t) {
+    dp_connp dp = (dp_connp)((char *)t - offsetof(dp_connection, idleTimer));
+    unsigned long long idleNs = dp->idleMs * 1000000ull;
+    unsigned long long probeNs = dp->probeMs * 1000000ull;
+    unsigned long long quiet = dp_udp_now(dp) - __atomic_load_n(&dp->heardAt, __ATOMIC_RELAXED);
+    unsigned long long next;
+
+    if (__atomic_load_n(&dp->peerClosed, __ATOMIC_RELAXED))
+        return 0;
+    if (quiet >= idleNs) {
+        __atomic_store_n(&dp->idleExpired, true, __ATOMIC_RELEASE);
+        shutdown(dp->udp_sock, SHUT_RD);
+        return 0;
+    }
+
+    if (quiet >= probeNs) {
+        dp_pdu probe = {0};
+        probe.proto_ver = DP_PROTO_VER_1;
+        probe.mtype = DP_MT_KEEPALIVE;
+        probe.checksum = dp_crc32c(&probe, sizeof(probe));
+        sendto(dp->udp_sock, &probe, sizeof(probe), 0,
+               (const struct sockaddr *)&dp->outSockAddr.addr, dp->outSockAddr.len);
+        __atomic_add_fetch(&dp->stats.keepalives_sent, 1, __ATOMIC_RELAXED);
+        next = probeNs;
+    } else {
+        next = probeNs - quiet;
+    }
+    if (next > idleNs - quiet)
+        next = idleNs - quiet;
+    return next / 1000000ull + 1;
+}
+
+/*
+* static int dpkeepack(dp_connp dp) answers a KEEPALIVE from the peer's reaper thread. It is sent like an ACK but carries no
+* sequence number, since a probe can turn up at any point in the exchange. Returns what dpsendraw() does.
+*/
+static int dpkeepack(dp_connp dp) {
+    dp_pdu ack = {0};
+
+    ack.proto_ver = DP_PROTO_VER_1;
+    ack.mtype = DP_MT_KEEPACK;
+    return dpsendraw(dp, &ack, sizeof(dp_pdu));
+}
+
+/*
+* int dplisten(dp_connp dp) takes a pointer to a dp_connection. We declare some values for our receive size. We also then
+* check to see if our in-address is initialized; if not, we error and return a general error. We print a message indicating
+* we are trying to connect and we call dprecvraw to see if any connection is trying to be made, skipping anything that is
+* not an intact CONNECT or, with dp_set_cookies() on, does not bring back our cookie (dpcookieok() sends it one). The rest
+* of the handshake (shared memory, early data and the CNTACK) is up to dpsetup(). If we did receive a connection pdu, then
+* we denote this in our dp_connection field 'isConnected' and we return 'true'.
 */
 int dplisten(dp_connp dp) {
-    int sndSz, rcvSz;
+    int rcvSz;
 
     if(!dp->inSockAddr.isAddrInit) {
         perror("dplisten:dp connection not setup properly - cli struct not init");
         return DP_ERROR_GENERAL;
     }
 
-    dp_pdu pdu = {0};
+    char msg[DP_MAX_DGRAM_SZ];
 
     printf("Waiting for a connection...\n");
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(pdu)) {
-        perror("dplisten:The wrong number of bytes were received");
+    do {
+        rcvSz = dprecvraw(dp, msg, sizeof(msg));
+        if (rcvSz < 0) {
+            perror("dplisten:The wrong number of bytes were received");
+            return DP_ERROR_GENERAL;
+        }
+    } while (!dpisconnect(msg, rcvSz) || !dpcookieok(dp, msg));
+
+    if (dpsetup(dp, &dp->outSockAddr.addr, msg) < 0)
         return DP_ERROR_GENERAL;
+    printf("Connection established OK%s!\n",
+           dp->shmPending != NULL || dp->tp->reliable ? " (shared memory)" : "");
+
+    return true;
+}
+
+/*
+* dp_connp dpaccept(dp_connp listener) is the multi-client version of dplisten(). It blocks on the listener's well known
+* port until a CONNECT pdu arrives, but instead of turning the listener itself into the connection it builds a brand new
+* dp_connection with its own UDP socket bound to an ephemeral port. The socket is connect()ed to the client so the kernel
+* only hands it that client's datagrams. The CNTACK goes out from the new socket, and since the client's dprecvraw() records
+* the sender's address, every later datagram of the session flows to the new port. That leaves the listener free to accept
+* the next client while the session runs on its own thread. A local client's shared memory offer and early data are taken up
+* by dpsetup() the same way as in dplisten(). A client whose CNTACK is slow (early data is only answered at the session's
+* first dpsend()) or lost sends its CONNECT to the listener again, but the session resends the CNTACK itself until the
+* client is heard from, so the listener drops copies of the CONNECT it took last rather than start the same session twice.
+* With dp_set_cookies() on, a CONNECT is only taken once it brings back the cookie dpcookieok() sent it, so the listener
+* allocates nothing for a client until it has heard back from it. Returns the new connection, or NULL if the datagram was
+* not a valid new CONNECT or the socket could not be set up.
+*/
+dp_connp dpaccept(dp_connp listener) {
+    char msg[DP_MAX_DGRAM_SZ];
+    dp_pdu *inPdu = (dp_pdu *)msg;
+    int rcvSz;
+
+    if(!listener->inSockAddr.isAddrInit) {
+        perror("dpaccept:dp connection not setup properly - cli struct not init");
+        return NULL;
     }
 
-    pdu.mtype = DP_MT_CNTACK;
-    dp->seqNum = pdu.seqnum + 1;
-    pdu.seqnum = dp->seqNum;
-    
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    
-    if (sndSz != sizeof(pdu)) {
-        perror("dplisten:The wrong number of bytes were sent");
-        return DP_ERROR_GENERAL;
+    rcvSz = dprecvraw(listener, msg, sizeof(msg));
+    if (!dpisconnect(msg, rcvSz)) {
+        printf("dpaccept: ignoring datagram that is not a CONNECT\n");
+        return NULL;
     }
-    dp->isConnected = true; 
-    //For non data transmissions, ACK of just control data increase seq # by one
-    printf("Connection established OK!\n");
+    if (!dpcookieok(listener, msg))
+        return NULL;
 
-    return true;
+    //a client resends its CONNECT at most DP_RTO_MAX_MS apart, so a longer gap means a new client on a reused port
+    struct sockaddr_in *from = &listener->outSockAddr.addr;
+    unsigned long long now = dp_now_ns(listener);
+    bool repeat = inPdu->checksum == listener->acceptedSum &&
+                  from->sin_addr.s_addr == listener->acceptedFrom.sin_addr.s_addr &&
+                  from->sin_port == listener->acceptedFrom.sin_port &&
+                  now - listener->acceptedAt < 2ull * DP_RTO_MAX_MS * 1000000ull;
+    listener->acceptedFrom = *from;
+    listener->acceptedSum = inPdu->checksum;
+    listener->acceptedAt = now;
+    if (repeat)
+        return NULL;
+
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        perror("drexel protocol create failure");
+        return NULL;
+    }
+
+    //the session gets its own socket on an ephemeral port, tied to this client
+    struct sockaddr_in *addr = &(dpc->inSockAddr.addr);
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = INADDR_ANY;
+    addr->sin_port = 0;
+    if ((dpc->udp_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(dpc->udp_sock, (const struct sockaddr *)addr, dpc->inSockAddr.len) < 0 ||
+        connect(dpc->udp_sock, (const struct sockaddr *)from, listener->outSockAddr.len) < 0) {
+        perror("dpaccept: session socket setup failed");
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->inSockAddr.isAddrInit = true;
+    memcpy(&dpc->outSockAddr, &listener->outSockAddr, sizeof(struct dp_sock));
+    dpgro(dpc);
+
+    if (dpsetup(dpc, from, msg) < 0) {
+        dpclose(dpc);
+        return NULL;
+    }
+
+    return dpc;
 }
 
 /*
-* int dpconnect(dp_connp dp) takes a pointer to a dp_connection. The function begins with declaring some integers
-* to hold our send size and receive size. We then check to see if our outgoing address 'outSockAddr' is initialized. 
-* If we are not initialized we error and return an error code. If we make it past this check then we declare a new 
-* dp_pdu and set all the values to zero. We set the message type to connection and we set the current pdu sequence number
-* equal to the most recent sequence number stored in our dp_connection. We then call dpsendraw() with our connection pdu
-* and store how many bytes we sent in 'sndSz'. If our sent bytes don't equal the size of our dp_pdu, we know there was a problem
-* so we error and return an error code. After this, we are expecting an ACK of sorts, so we call dprecvraw with our pdu to store
-* the returning message. If we received anything other than the size of our pdu, we error and return an error code. Then we also 
-* check to see if the message type was a connection acknowledgment; if it is not, we error and return an error code. If we connected
-* successfully then we increment our sequence number by one to denote a control transmission and then mark our dp_connection as
-* connected. We then return 'true'.
+* static int dphandshake(dp_connp dp, void *early, int early_sz, void *reply, int reply_sz) is the client side of the handshake
+* behind dpconnect() and dpconnect_early(). The function begins with declaring some integers to hold our send size and receive
+* size. We then check to see if our outgoing address 'outSockAddr' is initialized. If we are not initialized we error and
+* return an error code. If we make it past this check then we build the CONNECT pdu. We set the message type to connection
+* and we set the current pdu sequence number equal to the most recent sequence number stored in our dp_connection. If
+* dp_offer_shm() was called the CONNECT carries a dp_shm_offer (flagged DP_CONN_SHM), and any early message follows it
+* (flagged DP_CONN_EARLY). We then call dpsendraw() with our connection pdu and store how many bytes we sent in 'sndSz'. If our
+* sent bytes don't match, we know there was a problem so we error and return an error code. After this, we are expecting an ACK
+* of sorts, so we call dprecvraw_wait() to store the returning message. If nothing comes back within the RTO (or what comes back
+* is damaged) we back off and send the CONNECT again, giving up after DP_MAX_RETRIES. Then we also check to see if the message
+* type was a connection acknowledgment; if it is not, we error and return an error code. A CNTACK with DP_CONN_COOKIE is a
+* listener asking us to prove we heard it, so its cookie goes on the end of the CONNECT and we send that straight back. A
+* CNTACK with DP_CONN_SHM carries our offer back, meaning the server mapped the region, so the connection moves onto it. If we
+* connected successfully then we increment our sequence number by one to denote a control transmission and then mark our
+* dp_connection as connected. We then return the length of the reply that came in the CNTACK, DP_EARLY_REFUSED if the server
+* did not take the early message.
 */
-int dpconnect(dp_connp dp) {
+static int dphandshake(dp_connp dp, void *early, int early_sz, void *reply, int reply_sz) {
 
-    int sndSz, rcvSz;
+    int sndSz, rcvSz = 0;
+    dp_shm *shm = NULL;
 
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpconnect:dp connection not setup properly - svr struct not init");
         return DP_ERROR_GENERAL;
     }
 
-    dp_pdu pdu = {0};
-    pdu.mtype = DP_MT_CONNECT;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
-
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data sent");
-        return -1;
+    char msg[DP_MAX_DGRAM_SZ];
+    dp_pdu *pdu = (dp_pdu *)msg;
+    int msgSz = sizeof(dp_pdu);
+    memset(pdu, 0, sizeof(dp_pdu));
+    pdu->mtype = DP_MT_CONNECT;
+    pdu->seqnum = dp->seqNum;
+    if (dp->shmWanted && (shm = dp_shm_create((dp_shm_offer *)(pdu + 1))) != NULL) {
+        pdu->err_num |= DP_CONN_SHM;
+        msgSz += sizeof(dp_shm_offer);
     }
-    
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data received");
-        return -1;
+    if (early_sz > 0) {
+        pdu->err_num |= DP_CONN_EARLY;
+        memcpy(msg + msgSz, early, early_sz);
+        msgSz += early_sz;
     }
-    if (pdu.mtype != DP_MT_CNTACK) {
-        perror("dpconnect:Expected CNTACT Message but didnt get it");
-        return -1;
+    pdu->dgram_sz = msgSz - sizeof(dp_pdu);
+
+    //a lost CONNECT or CNTACK just means asking again after the RTO
+    char in[DP_MAX_DGRAM_SZ];
+    dp_pdu *ack = (dp_pdu *)in;
+    int offerSz = 0;
+    for (int tries = 0; ; tries++) {
+        if (tries > DP_MAX_RETRIES) {
+            printf("dpconnect: no answer from the server after %d tries\n", tries);
+            break;
+        }
+        sndSz = dpsendraw(dp, msg, msgSz);
+        if (sndSz != msgSz) {
+            perror("dpconnect:Wrong about of connection data sent");
+            break;
+        }
+
+        rcvSz = dprecvraw_wait(dp, in, sizeof(in), dp_now_ns(dp) + dp->rto_ns);
+        if (rcvSz == DP_ERROR_TIMEOUT) {
+            dp->stats.timeouts++;
+            dp_backoff_rto(dp);
+            continue;
+        }
+        offerSz = (rcvSz >= (int)sizeof(dp_pdu) && (ack->err_num & DP_CONN_SHM)) ? sizeof(dp_shm_offer) : 0;
+        if (rcvSz < (int)sizeof(dp_pdu) || !dpverify(in, rcvSz) ||
+            rcvSz != (int)sizeof(dp_pdu) + ack->dgram_sz || ack->dgram_sz < offerSz) {
+            perror("dpconnect:Wrong about of connection data received");
+            continue;
+        }
+        if (ack->mtype == DP_MT_CNTACK && (ack->err_num & DP_CONN_COOKIE)) {
+            //the first cookie is not a failed try, later ones (ours went stale) are
+            if (ack->dgram_sz == DP_COOKIE_SZ) {
+                if (!(pdu->err_num & DP_CONN_COOKIE)) {
+                    pdu->err_num |= DP_CONN_COOKIE;
+                    pdu->dgram_sz += DP_COOKIE_SZ;
+                    msgSz += DP_COOKIE_SZ;
+                    tries--;
+                }
+                memcpy(msg + msgSz - DP_COOKIE_SZ, ack + 1, DP_COOKIE_SZ);
+            }
+            continue;
+        }
+        //the server's next datagram can overtake a lost CNTACK, which the server resends
+        if (ack->mtype != DP_MT_CNTACK)
+            continue;
+        dp->isConnected = true;
+        break;
     }
 
+    //the server sends our offer back if it mapped the region, otherwise we stay on UDP
+    bool onShm = dp->isConnected && shm != NULL && offerSz > 0;
+    if (onShm)
+        dp_shm_use(dp, shm);
+    else if (shm != NULL)
+        dp_shm_release(shm);
+    if (!dp->isConnected)
+        return -1;
+
     //For non data transmissions, ACK of just control data increase seq # by one
     dp->seqNum++;
-    dp->isConnected = true;
-    printf("Connection established OK!\n");
+    dp->stats.start_ns = dp_now_ns(dp);
+    dpidlearm(dp);
+    printf("Connection established OK%s!\n", onShm ? " (shared memory)" : "");
 
-    return true;
+    if (early_sz == 0)
+        return 0;
+    if (!(ack->err_num & DP_CONN_EARLY))
+        return DP_EARLY_REFUSED;
+    dp->stats.payload_sent += early_sz;
+
+    int replySz = ack->dgram_sz - offerSz;
+    if (replySz > reply_sz)
+        return DP_BUFF_UNDERSIZED;
+    memcpy(reply, in + sizeof(dp_pdu) + offerSz, replySz);
+    dp->stats.payload_recv += replySz;
+    return replySz;
+}
+
+/*
+* int dpconnect(dp_connp dp) connects to the server with a plain CONNECT, see dphandshake(). Returns true once connected.
+*/
+int dpconnect(dp_connp dp) {
+    int rc = dphandshake(dp, NULL, 0, NULL, 0);
+    return rc < 0 ? rc : true;
+}
+
+/*
+* int dpconnect_early(dp_connp dp, void *early, int early_sz, void *reply, int reply_sz) connects the way dpconnect() does but
+* sends the first early_sz bytes the application has for the server inside the CONNECT itself (0-RTT). The server's
+* dprecv() hands them over as its first message, and if its first dpsend() fits the CNTACK it comes back in reply_sz bytes of
+* reply, so a request and its answer cost the one round trip the handshake needed anyway. Returns the length of that reply,
+* 0 when the server took the message but answers with an ordinary datagram for dprecv(), DP_EARLY_REFUSED when the connection
+* is up but the message was not taken (it is bigger than DP_MAX_EARLY_SZ, or the server predates early data) and has to go out
+* again with dpsend(), or another error code if there is no connection. The early message is sent as often as the CONNECT is,
+* so it must be safe for the server to see again: servers answer a repeat with their saved CNTACK and do not deliver it twice.
+*/
+int dpconnect_early(dp_connp dp, void *early, int early_sz, void *reply, int reply_sz) {
+    if (early_sz > DP_MAX_EARLY_SZ) {
+        int rc = dphandshake(dp, NULL, 0, NULL, 0);
+        return rc < 0 ? rc : DP_EARLY_REFUSED;
+    }
+    return dphandshake(dp, early, early_sz, reply, reply_sz);
+}
+
+/*
+* void dp_offer_shm(dp_connp dp) asks for the next dpconnect() to offer the server a shared memory region, which a server on
+* this host takes up so every datagram after the handshake moves through memory instead of the UDP socket. A server that
+* is remote, cannot map the region or predates the offer simply answers with a plain CNTACK and nothing changes.
+*/
+void dp_offer_shm(dp_connp dp) {
+    dp->shmWanted = true;
 }
 
 /*
@@ -592,36 +1881,50 @@ int dpconnect(dp_connp dp) {
 * dp_connection. We also say the dgram size is 0 since this is just a control transmission (pdu only, no payload). 
 * We then call dpsendraw() to send our pdu and store how many bytes were sent in 'sndSz'. If 'sndSz' does not match
 * the size of out dp_pdu then we know that we did not send the full pdu and so we error and return an error code.
-* Once we know we've sent the full pdu, we then are looking for an ACK, so we switch to receive dprecvraw() with our
-* current dp_connection and our pdu. If the 'rcvSz' does not equal the size of our pdu then we know we did not receive a proper
-* acknowledgement to our close request so we error and then return an error code (same deal if the message type is not a close
-* connection acknowledgement). We then call dpclose() with our current dp_connection to free our memory. We then return an appropriate
-* return code to signify that the connection is closed.
+* Once we know we've sent the full pdu, we then are looking for an ACK, so we switch to receive dprecvraw() with our current
+* dp_connection and our pdu, waiting at most one RTO. If no close connection acknowledgement arrives we send the CLOSE
+* again, up to DP_MAX_RETRIES times; a peer that got our CLOSE has stopped answering, so once the retries run out we stop
+* waiting for it, and one the reaper thread already gave up on (DP_ERROR_IDLE) is not waited for at all. We then call
+* dpclose() with our current dp_connection to free our memory. We then return an appropriate return code to signify that the
+* connection is closed.
 */
 int dpdisconnect(dp_connp dp) {
 
     int sndSz, rcvSz;
 
+    //what dp_write() still holds goes out before the CLOSE
+    if (dp->sndStreamLen > 0 && !dp->peerClosed)
+        dp_flush(dp);
+
     dp_pdu pdu = {0};
     pdu.proto_ver = DP_PROTO_VER_1;
     pdu.mtype = DP_MT_CLOSE;
     pdu.seqnum = dp->seqNum;
     pdu.dgram_sz = 0;
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
-        perror("dpdisconnect:Wrong about of connection data sent");
-        return DP_ERROR_GENERAL;
-    }
-    
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(dp_pdu)) {
-        perror("dpdisconnect:Wrong about of connection data received");
-        return DP_ERROR_GENERAL;
-    }
-    if (pdu.mtype != DP_MT_CLOSEACK) {
-        perror("dpdisconnect:Expected CNTACT Message but didnt get it"); 
-        return DP_ERROR_GENERAL;
+    //if the CLOSEACK is lost the peer is already gone, so after the retries we close anyway
+    for (int tries = 0; tries <= DP_MAX_RETRIES; tries++) {
+        dp_pdu reply = {0};
+
+        sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
+        if (sndSz != sizeof(dp_pdu)) {
+            perror("dpdisconnect:Wrong about of connection data sent");
+            return DP_ERROR_GENERAL;
+        }
+
+        rcvSz = dprecvraw_wait(dp, &reply, sizeof(reply), dp_now_ns(dp) + dp->rto_ns);
+        if (rcvSz == DP_ERROR_TIMEOUT) {
+            dp_backoff_rto(dp);
+            continue;
+        }
+        if (rcvSz == DP_ERROR_IDLE)
+            break;
+        if (rcvSz != sizeof(dp_pdu) || !dpverify(&reply, rcvSz)) {
+            perror("dpdisconnect:Wrong about of connection data received");
+            continue;
+        }
+        if (reply.mtype == DP_MT_CLOSEACK)
+            break;
     }
     //For non data transmissions, ACK of just control data increase seq # by one
     dpclose(dp);
@@ -630,119 +1933,189 @@ int dpdisconnect(dp_connp dp) {
 }
 
 /*
-* void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) takes a pointer to a populated dp_pdu struct,
-* a pointer to our buffer and the size of the buffer. The function starts by checking to see if the buffer size if smaller
-* than the size of a pdu and if it is, then we cannot populate the buffer so we error. After this we zero-out the buffer by
-* using bzero() to turn the contents of buff for the length of our dp_pdu starting at the buff pointer. Then we copy over the 
-* contents contained in our pdu by passing the pointer of our destination (our buffer), the source (our pdu) and how much to copy
-* over (the dp_pdu size). This then returns the pointer to the buffer, plus the length of the pdu. This now means when we write to the 
-* buffer next, we will have a populated pdu prepended to the data. This pointer also tells us where to start writing.
+* void dp_set_stream_buffers(int snd_sz, int rcv_sz) sizes the buffers behind dp_write() and dp_read() for every connection made
+* after it. The send buffer is as much as goes out in one dpsend(), so a bigger one means fewer, longer messages, which a window
+* (dp_set_window()) can keep on the wire; the receive buffer is how far dp_read() may read ahead of its caller, and is never
+* smaller than one datagram. Either may be 0 to keep its default. Memory stays at these two sizes however much is streamed.
 */
-void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
-    if (buff_sz < sizeof(dp_pdu)) {
-        perror("Expected CNTACT Message but didnt get it");
-        return NULL;
-    }
-    bzero(buff, buff_sz);
-    memcpy(buff, pdu_ptr, sizeof(dp_pdu));
-
-    return buff + sizeof(dp_pdu);
+void dp_set_stream_buffers(int snd_sz, int rcv_sz) {
+    if (snd_sz > 0)
+        _sndStreamSz = snd_sz;
+    if (rcv_sz > 0)
+        _rcvStreamSz = rcv_sz < DP_MAX_BUFF_SZ ? DP_MAX_BUFF_SZ : rcv_sz;
 }
 
-
-//// MISC HELPERS
+/*
+* static int dpstreambuf(char **buf, int *cap, int sz) makes sure a stream buffer holds at least sz bytes. The buffer may be
+* one an earlier connection in the same slot left behind (see dp_conn_alloc()), so it is only allocated again when it is
+* missing or smaller than dp_set_stream_buffers() now asks for. Returns 0, or DP_ERROR_GENERAL with no buffer if out of memory.
+*/
+static int dpstreambuf(char **buf, int *cap, int sz) {
+    if (*cap >= sz)
+        return 0;
+    free(*buf);
+    *cap = 0;
+    if ((*buf = malloc(sz)) == NULL)
+        return DP_ERROR_GENERAL;
+    *cap = sz;
+    return 0;
+}
 
 /*
-* void print_out_pdu(dp_pdu *pdu) uses a pointer to our populated pdu and checks to see if we have debug mode on. If we do not have it on, we return right away.
-* Otherwise we print our header to signify we are SENDING a pdu and then call print_pdu_details to print the fields.
+* int dp_write(dp_connp dp, const void *buff, int len) is the byte stream way to send. The bytes are copied into the connection's
+* send buffer, and each time it fills it goes to the peer as one message with dpsend(), so dp_write() only blocks while a full
+* buffer is being delivered: that is the back pressure, a writer can never get further ahead of its reader than one buffer. When
+* the buffer is empty and there is at least a buffer's worth left to write, it goes out straight from the caller's memory without
+* the copy. Nothing is sent for a partial buffer until dp_flush() or dpdisconnect(). Returns len, or the dpsend() error if
+* delivery fails. A dpsend() that fails may still have got some of its fragments to the peer, and its reader may have taken
+* them, so there is no telling which bytes arrived and writing any of them again could deliver them twice. The stream is broken
+* from then on: what is buffered is dropped, and every later dp_write() and dp_flush() returns the same error.
 */
-void print_out_pdu(dp_pdu *pdu) {
-    if (_debugMode != 1)
-        return;
-    printf("PDU DETAILS ===>  [OUT]\n");
-    print_pdu_details(pdu);
+int dp_write(dp_connp dp, const void *buff, int len) {
+    const char *p = buff;
+    int done = 0;
+
+    if (dp->sndStreamErr != 0)
+        return dp->sndStreamErr;
+    if (dpstreambuf(&dp->sndStream, &dp->sndStreamCap, dp->sndStreamSz) < 0)
+        return DP_ERROR_GENERAL;
+
+    while (done < len) {
+        int left = len - done;
+        if (dp->sndStreamLen == 0 && left >= dp->sndStreamSz) {
+            int rc = dpsend(dp, (void *)(p + done), dp->sndStreamSz);
+            if (rc < 0) {
+                dp->sndStreamErr = rc;
+                return rc;
+            }
+            done += dp->sndStreamSz;
+            continue;
+        }
+
+        int n = dp->sndStreamSz - dp->sndStreamLen;
+        if (n > left)
+            n = left;
+        memcpy(dp->sndStream + dp->sndStreamLen, p + done, n);
+        dp->sndStreamLen += n;
+        done += n;
+        if (dp->sndStreamLen == dp->sndStreamSz) {
+            int rc = dp_flush(dp);
+            if (rc < 0)
+                return rc;
+        }
+    }
+    return done;
 }
 
 /*
-* void print_in_pdu(dp_pdu *pdu) uses a pointer to our populated pdu and checks to see if we have debug mode on. If we do not have it on, we return right away.
-* Otherwise we print our header to signify we are RECEIVING a pdu and then call print_pdu_details to print the fields.
+* int dp_flush(dp_connp dp) sends whatever dp_write() is holding as one message and returns once the peer has it (or right away
+* if there was nothing). Returns the bytes sent, or the dpsend() error, after which the stream is broken as dp_write() describes.
 */
-void print_in_pdu(dp_pdu *pdu) {
-    if (_debugMode != 1)
-        return;
-    printf("===> PDU DETAILS  [IN]\n");
-    print_pdu_details(pdu);
+int dp_flush(dp_connp dp) {
+    if (dp->sndStreamErr != 0)
+        return dp->sndStreamErr;
+    if (dp->sndStreamLen == 0)
+        return 0;
+
+    int rc = dpsend(dp, dp->sndStream, dp->sndStreamLen);
+    if (rc < 0) {
+        dp->sndStreamErr = rc;
+        dp->sndStreamLen = 0;
+        return rc;
+    }
+    rc = dp->sndStreamLen;
+    dp->sndStreamLen = 0;
+    return rc;
 }
 
 /*
-* static void print_pdu_details(dp_pdu *pdu) takes a pointer to a populated pdu and simply prints out the fields with proper headings or labels.
-* This is so we can see what each pdu contains since the details remain the same whether the pdu is being received or sent out. print_pdu_details()
-* uses pdu_msg_to_string to print the 'Msg Type' field.
+* static int dpstreamfill(dp_connp dp, int want) takes datagrams into the receive buffer of an empty dp_read(). It blocks for the
+* first datagram only: after that it keeps reading while the datagram it just took was a fragment (the rest of that message is on
+* its way already), the caller wants more than is buffered and there is room for another datagram. Message boundaries mean
+* nothing to a stream, so a message bigger than the buffer is simply read in pieces. The early message of a CONNECT counts as
+* the first datagram, and an owed CNTACK goes out first, as in dprecv(). Returns the bytes buffered or a dprecv() style error.
 */
-static void print_pdu_details(dp_pdu *pdu){
-    
-    printf("\tVersion:  %d\n", pdu->proto_ver);
-    printf("\tMsg Type: %s\n", pdu_msg_to_string(pdu));
-    printf("\tMsg Size: %d\n", pdu->dgram_sz);
-    printf("\tSeq Numb: %d\n", pdu->seqnum);
-    printf("\n");
+static int dpstreamfill(dp_connp dp, int want) {
+    dp->rcvStreamOff = 0;
+    dp->rcvStreamLen = 0;
+
+    if (dp->peerClosed)
+        return DP_CONNECTION_CLOSED;
+    if (dp->early != NULL) {
+        memcpy(dp->rcvStream, dp->early->data, dp->early->len);
+        dp->rcvStreamLen = dp->early->len;
+        dp_pkt_put(dp->early);
+        dp->early = NULL;
+        return dp->rcvStreamLen;
+    }
+    if (dp->cntackOwed && dpsendcntack(dp, NULL, 0) < 0)
+        return DP_ERROR_PROTOCOL;
+
+    while (1) {
+        int rcvLen = dprecvdgram(dp, dp->dgramBuff, sizeof(dp->dgramBuff));
+        if (rcvLen == DP_CONNECTION_CLOSED || rcvLen == DP_ERROR_IDLE)
+            return dp->rcvStreamLen > 0 ? dp->rcvStreamLen : rcvLen;
+        if (rcvLen < (int)sizeof(dp_pdu))
+            return dp->rcvStreamLen > 0 ? dp->rcvStreamLen : DP_ERROR_BAD_DGRAM;
+
+        dp_pdu *inPdu = (dp_pdu *)dp->dgramBuff;
+        if (inPdu->dgram_sz > dp->rcvStreamSz - dp->rcvStreamLen)
+            return dp->rcvStreamLen > 0 ? dp->rcvStreamLen : DP_BUFF_OVERSIZED;
+        memcpy(dp->rcvStream + dp->rcvStreamLen, dp->dgramBuff + sizeof(dp_pdu), inPdu->dgram_sz);
+        dp->rcvStreamLen += inPdu->dgram_sz;
+
+        if ((inPdu->mtype & DP_MT_FRAGMENT) == 0 || dp->rcvStreamLen >= want ||
+            dp->rcvStreamSz - dp->rcvStreamLen < DP_MAX_BUFF_SZ)
+            return dp->rcvStreamLen;
+    }
 }
 
 /*
-* static char * pdu_msg_to_string(dp_pdu *pdu) simply takes in a pointer to our populated pdu and looks at the field
-* called 'mtype' which is short for message type. These are growing powers of two so that each message type has exactly
-* one bit on with the rest off in the byte that makes up mtype. We feed it into a switch statement using defined 'magic-
-* numbers' in our du-proto.h file and then return string of what the message really is in human-readable english.
+* int dp_read(dp_connp dp, void *buff, int len) is the byte stream way to receive, and works like read() on a socket: it returns
+* as soon as it has anything, up to len bytes, whatever the message boundaries were on the sending side. Bytes left over from
+* the last datagrams taken in are handed out first, without touching the network. Since du-proto only ACKs what it takes in,
+* a reader that stops reading stops its writer, at most one receive buffer later. Returns the bytes read, 0 once the peer has
+* closed and everything it sent was read, or a dprecv() error. A connection should be read with dp_read() or dprecv(), not
+* both, since dprecv() does not know about the bytes dp_read() holds.
 */
-static char * pdu_msg_to_string(dp_pdu *pdu) {
-    switch(pdu->mtype){
-        case DP_MT_ACK:
-            return "ACK";     
-        case DP_MT_SND:
-            return "SEND";      
-        case DP_MT_CONNECT:
-            return "CONNECT";   
-        case DP_MT_CLOSE:
-            return "CLOSE";     
-        case DP_MT_NACK:
-            return "NACK";      
-        case DP_MT_SNDACK:
-            return "SEND/ACK";    
-        case DP_MT_CNTACK:
-            return "CONNECT/ACK";    
-        case DP_MT_CLOSEACK:
-            return "CLOSE/ACK";
-        default:
-            return "***UNKNOWN***";  
+int dp_read(dp_connp dp, void *buff, int len) {
+    if (len <= 0)
+        return 0;
+    if (dpstreambuf(&dp->rcvStream, &dp->rcvStreamCap, dp->rcvStreamSz) < 0)
+        return DP_ERROR_GENERAL;
+
+    if (dp->rcvStreamOff == dp->rcvStreamLen) {
+        int rc = dpstreamfill(dp, len);
+        if (rc == DP_CONNECTION_CLOSED)
+            return 0;
+        if (rc < 0)
+            return rc;
     }
+
+    int n = dp->rcvStreamLen - dp->rcvStreamOff;
+    if (n > len)
+        n = len;
+    memcpy(buff, dp->rcvStream + dp->rcvStreamOff, n);
+    dp->rcvStreamOff += n;
+    return n;
 }
 
 /*
- *  This is a helper for testing if you want to inject random errors from
- *  time to time. It take a threshold number as a paramter and behaves as
- *  follows:
- *      if threshold is < 1 it always returns FALSE or zero
- *      if threshold is > 99 it always returns TRUE or 1
- *      if (1 <= threshold <= 99) it generates a random number between
- *          1..100 and if the random number is less than the threshold
- *          it returns TRUE, else it returns false
- * 
- *  Example: dprand(50) is a coin flip
- *              dprand(25) will return true 25% of the time
- *              dprand(99) will return true 99% of the time
- */
-int dprand(int threshold){
+* void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) takes a pointer to a populated dp_pdu struct,
+* a pointer to our buffer and the size of the buffer. The function starts by checking to see if the buffer size if smaller
+* than the size of a pdu and if it is, then we cannot populate the buffer so we error. After this we zero-out the buffer by
+* using bzero() to turn the contents of buff for the length of our dp_pdu starting at the buff pointer. Then we copy over the 
+* contents contained in our pdu by passing the pointer of our destination (our buffer), the source (our pdu) and how much to copy
+* over (the dp_pdu size). This then returns the pointer to the buffer, plus the length of the pdu. This now means when we write to the 
+* buffer next, we will have a populated pdu prepended to the data. This pointer also tells us where to start writing.
+*/
+void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
+    if (buff_sz < sizeof(dp_pdu)) {
+        perror("Expected CNTACT Message but didnt get it");
+        return NULL;
+    }
+    bzero(buff, buff_sz);
+    memcpy(buff, pdu_ptr, sizeof(dp_pdu));
 
-    if (threshold < 1)
-        return 0;
-    if (threshold > 99)
-        return 1;
-    //initialize randome number seed
-    srand(time(0));
-
-    int rndInRange = (rand() % (100-1+1)) + 1;
-    if (threshold < rndInRange)
-        return 1;
-    else
-        return 0;
+    return buff + sizeof(dp_pdu);
 }
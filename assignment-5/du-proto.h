@@ -3,6 +3,8 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include "dp-wheel.h"
+
 
 struct dp_sock{
     socklen_t          len;
@@ -10,17 +12,6 @@ struct dp_sock{
     struct sockaddr_in addr;
 };
 
-typedef struct dp_connection{
-    unsigned int       seqNum;
-    int                udp_sock;
-    _Bool              isConnected;
-    struct dp_sock     outSockAddr;
-    struct dp_sock     inSockAddr;
-    int                dbgMode;
-} dp_connection;
-
-typedef struct dp_connection *dp_connp;
-
 
 /*
  * Drexel Protocol (dp) PDU
@@ -29,14 +20,18 @@ typedef struct dp_connection *dp_connp;
 
 //THIS IS HOW YOU DO A BIT FIELD
 //
-//   64  32  16  8   4   2   1
-// |---+---+---+---+---+---+---|
-//   E   F   N   C   C   S   A
-//   R   R   A   L   O   E   C
-//   R   A   C   O   N   N   K
-//   O   G   K   S   C   D
-//   R           E   T
-//-------------------------------
+//   128 64  32  16  8   4   2   1
+// |---+---+---+---+---+---+---+---|
+//   K   E   F   N   C   C   S   A
+//   E   R   R   A   L   O   E   C
+//   E   R   A   C   O   N   N   K
+//   P   O   G   K   S   C   D
+//   A   R           E   T
+//   L
+//   I
+//   V
+//   E
+//-----------------------------------
 #define DP_MT_ACK        1              //ACK MSG
 #define DP_MT_SND        2              //SND MSG
 #define DP_MT_CONNECT    4              //Connect MSG
@@ -44,18 +39,21 @@ typedef struct dp_connection *dp_connp;
 #define DP_MT_NACK       16             //NEG ACK
 #define DP_MT_FRAGMENT   32             //DGRAM IS A FRAGMENT
 #define DP_MT_ERROR      64             //SIMULATE ERROR
+#define DP_MT_KEEPALIVE  128            //ARE YOU STILL THERE, no seq # used
 
 //Message ACKS, ACK OR'ed with Message Type
 #define DP_MT_SNDACK    (DP_MT_SND     | DP_MT_ACK)
 #define DP_MT_CNTACK    (DP_MT_CONNECT | DP_MT_ACK)
 #define DP_MT_CLOSEACK  (DP_MT_CLOSE   | DP_MT_ACK)
+#define DP_MT_KEEPACK   (DP_MT_KEEPALIVE | DP_MT_ACK)
 
 typedef struct dp_pdu {
     int     proto_ver;
     int     mtype;
     int     seqnum;
     int     dgram_sz;
-    int     err_num;
+    int     err_num;            //on CONNECT/CNTACK, the DP_CONN_ flags for what rides in the payload
+    unsigned int checksum;      //CRC32C over the pdu (this field zeroed) and payload
 } dp_pdu;
 
 #define     DP_MAX_BUFF_SZ          1024
@@ -68,28 +66,202 @@ typedef struct dp_pdu {
 #define     DP_BUFF_OVERSIZED       -8
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
+#define     DP_ERROR_TIMEOUT        -64
+#define     DP_EARLY_REFUSED        -128    //connected, but the server did not take the early message
+#define     DP_ERROR_IDLE           -256    //nothing heard from the peer for the idle timeout, see dp_set_keepalive()
+
+#define     DP_MAX_RETRIES          10      //resends of one datagram after a NACK or a timeout
+
+//a CONNECT payload is a dp_shm_offer if DP_CONN_SHM is set, then the early message if DP_CONN_EARLY is, then
+//the server's cookie if DP_CONN_COOKIE is; the CNTACK echoes the offer if the server mapped it and carries the
+//server's first message as its reply, or with DP_CONN_COOKIE is only a cookie to come back with, see dp_set_cookies()
+#define     DP_CONN_SHM             1
+#define     DP_CONN_EARLY           2
+#define     DP_CONN_COOKIE          4
+#define     DP_COOKIE_SZ            12          //when it was issued and a 64 bit MAC
+#define     DP_COOKIE_LIFE_MS       10000
+#define     DP_MAX_EARLY_SZ         (DP_MAX_BUFF_SZ - 16 - DP_COOKIE_SZ)        //room left for the dp_shm_offer and a cookie
+
+//retransmission timeout, adapted from the measured RTT as in RFC 6298
+#define     DP_RTO_INIT_MS          100
+#define     DP_RTO_MIN_MS           10
+#define     DP_RTO_MAX_MS           2000
+
+//with an idle timeout set, a peer quiet for DP_KEEPALIVE_DIV of it is sent a KEEPALIVE
+#define     DP_KEEPALIVE_DIV        4
+
+//fragments of one message dpsend() may have out before the first is ACKed, see dp_set_window(); a
+//window of them goes out in one UDP_SEGMENT sendmsg(), which the kernel caps at 64 segments and 64 KB
+#define     DP_MAX_WINDOW           32
+#define     DP_GRO_BUFF_SZ          65536       //one UDP_GRO read, the most a coalesced datagram can be
+
+//dp_write()/dp_read() buffers unless dp_set_stream_buffers() says otherwise; a full send buffer goes out as one
+//message, and a receive buffer is never smaller than a datagram
+#define     DP_STREAM_SND_SZ        (64 * 1024)
+#define     DP_STREAM_RCV_SZ        (64 * 1024)
+
+/*
+ * Transport counters kept per connection.  They are only touched by the
+ * thread running the connection; dp_get_stats() hands out a snapshot.
+ * RTTs are measured from a datagram's send to its ACK, skipping datagrams
+ * that had to be resent, and binned by powers of two: bucket i holds
+ * samples of [2^i, 2^(i+1)) microseconds, bucket 0 also holds anything
+ * under 1us and the last bucket anything slower.
+ */
+#define     DP_RTT_BUCKETS          24
+
+typedef struct dp_stats {
+    unsigned long long pkts_sent;       //every datagram sent, ACKs included
+    unsigned long long pkts_recv;
+    unsigned long long bytes_sent;      //on the wire, headers included
+    unsigned long long bytes_recv;
+    unsigned long long payload_sent;    //acknowledged payload bytes
+    unsigned long long payload_recv;    //payload bytes delivered
+    unsigned long long retransmits;
+    unsigned long long timeouts;        //ACK waits that ran out
+    unsigned long long nacks_sent;
+    unsigned long long nacks_recv;
+    unsigned long long bad_dgrams;      //failed checksum or malformed
+    unsigned long long duplicates;      //arrived with a sequence number we already passed
+    unsigned long long sched_wait_ns;   //held back by the bandwidth scheduler, see dp-sched.h
+    unsigned long long keepalives_sent; //probes of a quiet peer, sent from the reaper thread
+    unsigned long long gso_sends;       //runs of datagrams that went down in one sendmsg()
+    unsigned long long gro_recvs;       //reads that brought up more than one coalesced datagram
+    unsigned long long cookies_sent;    //CONNECTs a listener answered with a cookie instead of a connection
+    unsigned long long rtt_samples;
+    unsigned long long rtt_sum_ns;
+    unsigned long long rtt_min_ns;
+    unsigned long long rtt_max_ns;
+    unsigned long long rtt_hist[DP_RTT_BUCKETS];
+    unsigned long long start_ns;        //when the connection came up
+    unsigned long long elapsed_ns;      //filled in by dp_get_stats()
+} dp_stats;
+
+/*
+ * How a connection moves datagrams and tells the time.  Every connection
+ * starts on the UDP socket backend in du-proto.c; dpTransportInit() builds
+ * one on another backend such as the simulated network in dp-sim.h, and a
+ * local peer can move a connection onto shared memory (dp-shm.h).  recv
+ * waits until deadline_ns on the backend's own clock (0 is forever) and
+ * returns DP_ERROR_TIMEOUT when it passes.  close, when there is one,
+ * releases whatever the backend holds for the connection; the socket and
+ * the connection itself are dpclose()'s.  A reliable backend never loses,
+ * damages or reorders a datagram, so nothing sent over it is ACKed.
+ */
+struct dp_connection;
+typedef struct dp_transport {
+    int                (*send)(struct dp_connection *dp, const void *buff, int len);
+    int                (*recv)(struct dp_connection *dp, void *buff, int buff_sz, unsigned long long deadline_ns);
+    unsigned long long (*now_ns)(struct dp_connection *dp);
+    void               (*close)(struct dp_connection *dp);
+    int                reliable;
+} dp_transport;
+
+typedef struct dp_connection{
+    unsigned int       seqNum;
+    int                udp_sock;
+    _Bool              isConnected;
+    _Bool              peerClosed;      //a CLOSE came in, only dpclose() is left to do
+    struct dp_sock     outSockAddr;
+    struct dp_sock     inSockAddr;
+    int                dbgMode;
+    dp_stats           stats;
+    unsigned long long srtt_ns;
+    unsigned long long rttvar_ns;
+    unsigned long long rto_ns;
+    struct dp_impair   *impair;         //NULL unless testing under impairment, see dp-impair.h
+    struct dp_sched_flow *sched;        //NULL unless a bandwidth limit is set, see dp-sched.h
+    const dp_transport *tp;             //the UDP socket unless built by dpTransportInit()
+    void               *tpCtx;          //backend state for tp
+    _Bool              shmWanted;       //dpconnect() offers shared memory, see dp_offer_shm()
+    char               dgramBuff[DP_MAX_DGRAM_SZ];     //per connection so sessions can run on their own threads
+    struct dp_pkt      *pend;           //peer datagram that overtook our ACK, see dpsenddgram()
+    struct dp_pkt      *early;          //message that came in the CONNECT, for the first dprecv()
+    _Bool              cntackOwed;      //CONNECT had early data, the CNTACK goes out with our first dpsend()
+    struct dp_pkt      *cntack;         //the CNTACK we sent, again for every repeated CONNECT
+    int                cntackTries;     //resends of the CNTACK left until we hear from the client
+    struct dp_shm      *shmPending;     //region to move onto once the owed CNTACK is out
+    struct sockaddr_in acceptedFrom;    //last CONNECT dpaccept() took, so its resends are dropped
+    unsigned int       acceptedSum;
+    unsigned long long acceptedAt;
+    _Bool              cookies;         //a listener only takes CONNECTs that bring back its cookie, see dp_set_cookies()
+    unsigned long long cookieKey[2];    //the listener's SipHash key, drawn at its first cookie
+    unsigned int       idleMs;          //give up on a peer quiet this long, 0 never; see dp_set_keepalive()
+    unsigned int       probeMs;         //and send it a KEEPALIVE after this long
+    unsigned long long heardAt;         //when a datagram from the peer last got through
+    _Bool              idleExpired;     //set by the reaper thread, which also wakes us out of recvfrom()
+    dp_timer           idleTimer;
+    int                window;          //fragments dpsend() may have unACKed, 1 is stop and wait; see dp_set_window()
+    _Bool              gapNacked;       //a fragment came in ahead of the one we wait for and the gap was NACKed
+    _Bool              gsoOff;          //the kernel refused UDP_SEGMENT once, send one datagram at a time
+    _Bool              groOn;           //the socket has UDP_GRO on, so reads may hold several datagrams
+    int                groOff;
+    int                groLen;
+    int                groSeg;          //size of every coalesced datagram in it but the last
+    int                sndStreamSz;     //dp_write() buffer size, see dp_set_stream_buffers()
+    int                rcvStreamSz;
+    int                sndStreamLen;
+    int                sndStreamErr;    //the dpsend() error that broke the stream, 0 while it works
+    int                rcvStreamOff;    //bytes of rcvStream already read
+    int                rcvStreamLen;
+    //from here on the connection's slot keeps across dpclose() for the next connection, see dp_conn_alloc()
+    char              *burst;           //a window of datagrams laid out for one send, allocated on first use
+    char              *gro;             //the last UDP_GRO read, handed out a datagram at a time
+    char              *sndStream;       //allocated by the first dp_write() that finds it too small
+    int                sndStreamCap;
+    char              *rcvStream;       //allocated by the first dp_read() that finds it too small
+    int                rcvStreamCap;
+} dp_connection;
+
+typedef struct dp_connection *dp_connp;
 
 //PROTOTYPES - INTERNAL HELPERS
 static dp_connp dpinit();
 
 dp_connp dpServerInit(int port);
 dp_connp dpClientInit(char *addr, int port);
-static char * pdu_msg_to_string(dp_pdu *pdu);
+dp_connp dpTransportInit(const dp_transport *tp, void *tpCtx);
 
 //API Interface
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz);
 int dprecv(dp_connp dp, void *buff, int buff_sz);
 int dpsend(dp_connp dp, void *sbuff, int sbuff_sz);
 int dplisten(dp_connp dp);
+dp_connp dpaccept(dp_connp listener);
 int dpconnect(dp_connp dp);
+int dpconnect_early(dp_connp dp, void *early, int early_sz, void *reply, int reply_sz);
+void dp_offer_shm(dp_connp dp);
+void dp_set_keepalive(unsigned int idle_ms, unsigned int probe_ms);
+void dp_set_window(int dgrams);
+void dp_set_cookies(int on);
+void dp_set_stream_buffers(int snd_sz, int rcv_sz);
+int dp_write(dp_connp dp, const void *buff, int len);
+int dp_flush(dp_connp dp);
+int dp_read(dp_connp dp, void *buff, int len);
 int dpdisconnect(dp_connp dp);
 
 void dpclose(dp_connp dpsession);
-void print_out_pdu(dp_pdu *pdu);
-void print_in_pdu(dp_pdu *pdu);
 int  dpmaxdgram();
-static void print_pdu_details(dp_pdu *pdu);
+unsigned long long dp_clock_ns(dp_connp dp);
+void dp_get_stats(dp_connp dp, dp_stats *out);
+unsigned long long dp_stats_rtt_percentile(const dp_stats *st, double pct);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
 static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
+static int dprecvraw_wait(dp_connp dp, void *buff, int buff_sz, unsigned long long deadline_ns);
+static int dpreack(dp_connp dp, dp_pdu *inPdu);
+static int dpsendcntack(dp_connp dp, void *reply, int reply_sz);
+static void dpheard(dp_connp dp);
+static void dpidlearm(dp_connp dp);
+static void dpgro(dp_connp dp);
+static unsigned long long dpsiphash(const unsigned long long key[2], const void *data, int len);
+static _Bool dpcookieok(dp_connp listener, void *msg);
+static int dpkeepack(dp_connp dp);
+static unsigned long long dpidlefire(dp_timer *t);
 static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, int isFragment);
\ No newline at end of file
+static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz, int isFragment);
+static int dpsendwindow(dp_connp dp, char *sbuff, int sbuff_sz);
+static int dpwinacked(unsigned int start, int sbuff_sz, unsigned int seq);
+static void dpsendburst(dp_connp dp, char *sbuff, int sbuff_sz, unsigned int start, int from, int to);
+static _Bool dpverify(void *buff, int buff_sz);
+static _Bool dpsized(void *buff, int buff_sz);
+static int dpstreamfill(dp_connp dp, int want);
\ No newline at end of file
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ftp-batch.h"
+#include "utilities.h"
+
+//manifest entry on the wire: [int64 size][uint16 name length][name bytes]
+#define ENTRY_HDR_SZ    (sizeof(int64_t) + sizeof(uint16_t))
+
+void ftp_batch_init(ftp_batch *b, const char *root) {
+    memset(b, 0, sizeof(ftp_batch));
+    snprintf(b->root, sizeof(b->root), "%s", root);
+}
+
+static int batch_add(ftp_batch *b, const char *name, long size) {
+    if (b->count == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 64;
+        ftp_batch_entry *grown = realloc(b->entries, cap * sizeof(ftp_batch_entry));
+        if (grown == NULL)
+            return -1;
+        b->entries = grown;
+        b->cap = cap;
+    }
+    b->entries[b->count].name = strdup(name);
+    if (b->entries[b->count].name == NULL)
+        return -1;
+    b->entries[b->count].size = size;
+    b->count++;
+    b->total_size += size;
+    return 0;
+}
+
+/*
+ *  Recursively collects the regular files under root/rel.  Names are kept
+ *  relative to the root so they can be replayed under the receiver's root.
+ */
+static int batch_walk(ftp_batch *b, const char *rel) {
+    char path[FTP_BATCH_NAME_MAX * 2];
+    char child[FTP_BATCH_NAME_MAX];
+    struct dirent *de;
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", b->root, rel);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        perror("ftp_batch_scan: cannot open directory");
+        return -1;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (snprintf(child, sizeof(child), "%s/%s", rel, de->d_name) >= (int)sizeof(child))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", b->root, child);
+        if (stat(path, &st) != 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (batch_walk(b, child) < 0) {
+                closedir(d);
+                return -1;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            if (batch_add(b, child, st.st_size) < 0) {
+                closedir(d);
+                return -1;
+            }
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+/*
+ *  Builds the file list for everything under root/dir.  Returns the number
+ *  of files found or -1 on error.
+ */
+int ftp_batch_scan(ftp_batch *b, const char *dir) {
+    if (batch_walk(b, dir) < 0)
+        return -1;
+    return b->count;
+}
+
+/*
+ *  Packs as many manifest entries as fit in buff, starting at *next, and
+ *  advances *next past them.  Returns the number of bytes used.
+ */
+int ftp_batch_pack(ftp_batch *b, int *next, char *buff, int buff_sz) {
+    int used = 0;
+
+    while (*next < b->count) {
+        ftp_batch_entry *e = &b->entries[*next];
+        uint16_t nameLen = strlen(e->name);
+        int64_t size = e->size;
+
+        if (used + ENTRY_HDR_SZ + nameLen > buff_sz)
+            break;
+        memcpy(buff + used, &size, sizeof(size));
+        memcpy(buff + used + sizeof(size), &nameLen, sizeof(nameLen));
+        memcpy(buff + used + ENTRY_HDR_SZ, e->name, nameLen);
+        used += ENTRY_HDR_SZ + nameLen;
+        (*next)++;
+    }
+    return used;
+}
+
+//the names come off the wire, so they must stay under the receiver's root
+int ftp_batch_name_ok(const char *name) {
+    if (name[0] == '\0' || name[0] == '/')
+        return 0;
+    if (strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 ||
+        strstr(name, "/../") != NULL)
+        return 0;
+    size_t len = strlen(name);
+    return !(len >= 3 && strcmp(name + len - 3, "/..") == 0);
+}
+
+/*
+ *  Appends count entries from a received manifest.  Returns 0, or -1 if the
+ *  manifest is malformed or names a path outside the root.
+ */
+int ftp_batch_unpack(ftp_batch *b, const char *buff, int buff_sz, int count) {
+    char name[FTP_BATCH_NAME_MAX];
+    int used = 0;
+
+    for (int i = 0; i < count; i++) {
+        int64_t size;
+        uint16_t nameLen;
+
+        if (used + ENTRY_HDR_SZ > buff_sz)
+            return -1;
+        memcpy(&size, buff + used, sizeof(size));
+        memcpy(&nameLen, buff + used + sizeof(size), sizeof(nameLen));
+        used += ENTRY_HDR_SZ;
+        if (size < 0 || nameLen >= sizeof(name) || used + nameLen > buff_sz)
+            return -1;
+        memcpy(name, buff + used, nameLen);
+        name[nameLen] = '\0';
+        used += nameLen;
+
+        if (!ftp_batch_name_ok(name) || batch_add(b, name, size) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void batch_path(const ftp_batch *b, char *path, int path_sz) {
+    snprintf(path, path_sz, "%s/%s", b->root, b->entries[b->cur].name);
+}
+
+//a file being received is written beside its name and renamed over it once complete
+static FILE *batch_open(ftp_batch *b, const char *mode) {
+    char path[FTP_BATCH_NAME_MAX * 2];
+    FILE *f;
+
+    batch_path(b, path, sizeof(path));
+    if (mode[0] == 'w')
+        f = make_parent_dirs(path) < 0 ? NULL : open_temp_beside(path, b->tmp, sizeof(b->tmp));
+    else
+        f = fopen(path, mode);
+    if (f == NULL)
+        printf("ERROR:  Cannot open file %s\n", path);
+    return f;
+}
+
+//the writer's current file is complete, put it where its name says
+static int batch_commit(ftp_batch *b) {
+    char path[FTP_BATCH_NAME_MAX * 2];
+
+    batch_path(b, path, sizeof(path));
+    int rc = fclose(b->f) != 0 || rename(b->tmp, path) != 0 ? -1 : 0;
+    if (rc < 0)
+        unlink(b->tmp);
+    b->f = NULL;
+    b->tmp[0] = '\0';
+    return rc;
+}
+
+/*
+ *  Sender side stream: fills buff with the next len bytes of the files in
+ *  manifest order, crossing file boundaries so small files get coalesced.
+ *  Exactly the manifest size is read from every file.  Returns the number
+ *  of bytes read, 0 once every file is done, or -1 if a file went missing
+ *  or shrank since the scan.
+ */
+int ftp_batch_read(void *ctx, char *buff, int len) {
+    ftp_batch *b = ctx;
+    int total = 0;
+
+    while (total < len && b->cur < b->count) {
+        ftp_batch_entry *e = &b->entries[b->cur];
+
+        if (b->f == NULL && e->size > 0 && (b->f = batch_open(b, "rb")) == NULL)
+            return -1;
+
+        long want = e->size - b->cur_done;
+        if (want > len - total)
+            want = len - total;
+        if (want > 0) {
+            size_t got = fread(buff + total, 1, want, b->f);
+            if (got == 0)
+                return -1;
+            total += got;
+            b->cur_done += got;
+        }
+
+        if (b->cur_done == e->size) {
+            if (b->f != NULL)
+                fclose(b->f);
+            b->f = NULL;
+            b->cur++;
+            b->cur_done = 0;
+        }
+    }
+    return total;
+}
+
+/*
+ *  Receiver side stream: writes the next len bytes, switching to the next
+ *  manifest entry whenever the current file is complete.  Empty files are
+ *  created as they are reached.  Returns 0, or -1 on a write error or if
+ *  more data arrives than the manifest accounts for.
+ */
+int ftp_batch_write(ftp_batch *b, const char *data, int len) {
+    while (b->cur < b->count) {
+        ftp_batch_entry *e = &b->entries[b->cur];
+
+        if (b->f == NULL && (b->f = batch_open(b, "wb")) == NULL)
+            return -1;
+
+        long n = e->size - b->cur_done;
+        if (n > len)
+            n = len;
+        if (n > 0 && fwrite(data, 1, n, b->f) != n)
+            return -1;
+        data += n;
+        len -= n;
+        b->cur_done += n;
+
+        if (b->cur_done < e->size)
+            return 0;
+        if (batch_commit(b) < 0)
+            return -1;
+        b->cur++;
+        b->cur_done = 0;
+
+        //keep going while there is data, or to create trailing empty files
+        if (len == 0 && b->cur < b->count && b->entries[b->cur].size > 0)
+            return 0;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+/*
+ *  Called at MSG_DATA_END on the receiver.  Returns 0 if every file in the
+ *  manifest was written in full.
+ */
+int ftp_batch_finish(ftp_batch *b) {
+    if (ftp_batch_write(b, NULL, 0) < 0)
+        return -1;
+    return b->cur == b->count ? 0 : -1;
+}
+
+void ftp_batch_free(ftp_batch *b) {
+    if (b->f != NULL)
+        fclose(b->f);
+    //a file the batch never finished is not left behind
+    if (b->tmp[0] != '\0')
+        unlink(b->tmp);
+    for (int i = 0; i < b->count; i++)
+        free(b->entries[i].name);
+    free(b->entries);
+    memset(b, 0, sizeof(ftp_batch));
+}
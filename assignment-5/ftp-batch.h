@@ -0,0 +1,44 @@
+#ifndef __FTP_BATCH_H__
+#define __FTP_BATCH_H__
+
+#include <stdio.h>
+
+/*
+ * A batch moves a whole directory tree over one du-ftp session.  The file
+ * list goes over first in MSG_MANIFEST messages, then every file's bytes
+ * follow back to back as one stream of MSG_DATA chunks, so small files
+ * share chunks and cost no messages of their own.  The receiver uses the
+ * sizes in the manifest to cut the stream back into files.
+ */
+#define FTP_BATCH_NAME_MAX  1024
+
+typedef struct ftp_batch_entry {
+    char    *name;          //path relative to the root, e.g. "logs/a.txt"
+    long    size;
+} ftp_batch_entry;
+
+typedef struct ftp_batch {
+    char            root[FTP_BATCH_NAME_MAX];
+    ftp_batch_entry *entries;
+    int             count;
+    int             cap;
+    long            total_size;
+
+    //streaming position, used by both the reader and the writer side
+    int             cur;
+    long            cur_done;
+    FILE            *f;
+    char            tmp[FTP_BATCH_NAME_MAX * 2 + 8];      //writer side: where f goes until the file is complete
+} ftp_batch;
+
+void ftp_batch_init(ftp_batch *b, const char *root);
+int  ftp_batch_scan(ftp_batch *b, const char *dir);
+int  ftp_batch_pack(ftp_batch *b, int *next, char *buff, int buff_sz);
+int  ftp_batch_unpack(ftp_batch *b, const char *buff, int buff_sz, int count);
+int  ftp_batch_name_ok(const char *name);
+int  ftp_batch_read(void *ctx, char *buff, int len);
+int  ftp_batch_write(ftp_batch *b, const char *data, int len);
+int  ftp_batch_finish(ftp_batch *b);
+void ftp_batch_free(ftp_batch *b);
+
+#endif
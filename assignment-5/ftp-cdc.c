@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ftp-cdc.h"
+#include "ftp-hash.h"
+#include "utilities.h"
+
+//normalized chunking: a harder cut condition before FTP_CDC_AVG and an easier one after it, the masks from the FastCDC paper
+#define MASK_S          0x0003590703530000ull       //15 bits
+#define MASK_L          0x0000d90003530000ull       //11 bits
+#define GEAR_SEED       0x9e3779b97f4a7c15ull
+#define SCAN_BUF_SZ     (4 * FTP_CDC_MAX)
+#define RECIPE_MAGIC    "DUCDC01"
+
+//a recipe file: this header, then count entries as they go on the wire
+typedef struct cdc_recipe_hdr {
+    char        magic[8];
+    int64_t     count;
+    int64_t     size;
+} cdc_recipe_hdr;
+
+//every client has to cut the same way for chunks to match, so the table comes from a fixed seed
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void gear_init(void) {
+    uint64_t x = GEAR_SEED;
+
+    for (int i = 0; i < 256; i++) {
+        //splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+void ftp_cdc_init(ftp_cdc *c, const char *root) {
+    memset(c, 0, sizeof(ftp_cdc));
+    snprintf(c->root, sizeof(c->root), "%s", root != NULL ? root : "");
+    pthread_once(&gear_once, gear_init);
+}
+
+/*
+ *  Length of the chunk at the start of data, given len bytes of it (all
+ *  that is left of the file when len is under FTP_CDC_MAX).  Nothing under
+ *  FTP_CDC_MIN is looked at, so those bytes cost no hashing at all.
+ */
+int ftp_cdc_cut(const unsigned char *data, int len) {
+    uint64_t fp = 0;
+    int i = FTP_CDC_MIN;
+
+    if (len <= FTP_CDC_MIN)
+        return len;
+    if (len > FTP_CDC_MAX)
+        len = FTP_CDC_MAX;
+    int normal = len < FTP_CDC_AVG ? len : FTP_CDC_AVG;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_S))
+            return i;
+    }
+    for (; i < len; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & MASK_L))
+            return i;
+    }
+    return len;
+}
+
+static int cdc_add(ftp_cdc *c, uint64_t hash, uint32_t len) {
+    if (c->count == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 256;
+        ftp_cdc_ref *grown = realloc(c->refs, cap * sizeof(ftp_cdc_ref));
+        if (grown == NULL)
+            return -1;
+        c->refs = grown;
+        c->cap = cap;
+    }
+    c->refs[c->count].hash = hash;
+    c->refs[c->count].len = len;
+    c->refs[c->count].need = 0;
+    c->count++;
+    c->total_size += len;
+    return 0;
+}
+
+/*
+ *  Client side: cuts the whole file into chunks and names them, and hashes
+ *  the file on the way since the bytes that get sent are no longer all of
+ *  it.  f stays ours to read the chunks the server wants from.  Returns the
+ *  number of chunks or -1.
+ */
+int ftp_cdc_scan(ftp_cdc *c, FILE *f, unsigned long long *file_hash) {
+    unsigned char *buf = malloc(SCAN_BUF_SZ);
+    ftp_hash whole;
+    int pos = 0, have = 0;
+    bool eof = false;
+
+    if (buf == NULL)
+        return -1;
+    c->f = f;
+    ftp_hash_init(&whole);
+
+    while (1) {
+        //keep a whole FTP_CDC_MAX ahead so every cut sees as far as it may go
+        if (have - pos < FTP_CDC_MAX && !eof) {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            size_t n = fread(buf + have, 1, SCAN_BUF_SZ - have, f);
+            if (n == 0 && ferror(f)) {
+                free(buf);
+                return -1;
+            }
+            eof = n == 0;
+            ftp_hash_update(&whole, buf + have, n);
+            have += n;
+            continue;
+        }
+        if (pos == have)
+            break;
+
+        int n = ftp_cdc_cut(buf + pos, have - pos);
+        ftp_hash h;
+        ftp_hash_init(&h);
+        ftp_hash_update(&h, buf + pos, n);
+        if (cdc_add(c, ftp_hash_digest(&h), n) < 0) {
+            free(buf);
+            return -1;
+        }
+        pos += n;
+    }
+
+    free(buf);
+    *file_hash = ftp_hash_digest(&whole);
+    return c->count;
+}
+
+/*
+ *  Packs as many chunk names as fit in buff, starting at *next, and
+ *  advances *next past them.  Returns the number of bytes used.
+ */
+int ftp_cdc_pack(ftp_cdc *c, int *next, char *buff, int buff_sz) {
+    int used = 0;
+
+    while (*next < c->count && used + (int)sizeof(ftp_cdc_ref) <= buff_sz) {
+        ftp_cdc_ref ref = c->refs[*next];
+
+        ref.need = 0;
+        memcpy(buff + used, &ref, sizeof(ref));
+        used += sizeof(ref);
+        (*next)++;
+    }
+    return used;
+}
+
+static void chunk_path(const ftp_cdc *c, const ftp_cdc_ref *ref, char *path, int path_sz) {
+    snprintf(path, path_sz, "%s/%02x/%016llx-%x", c->root, (unsigned)(ref->hash >> 56),
+             (unsigned long long)ref->hash, ref->len);
+}
+
+//slot of the first ref with this name in the seen index, or of the empty slot where it would go
+static int seen_slot(const ftp_cdc *c, const ftp_cdc_ref *ref) {
+    int mask = c->seen_cap - 1;
+    int s = (int)((ref->hash ^ ref->len) & mask);
+
+    while (c->seen[s] != 0) {
+        const ftp_cdc_ref *other = &c->refs[c->seen[s] - 1];
+        if (other->hash == ref->hash && other->len == ref->len)
+            break;
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+//makes room for one more ref in the seen index, kept under half full
+static int seen_grow(ftp_cdc *c) {
+    if ((c->count + 1) * 2 <= c->seen_cap)
+        return 0;
+
+    int cap = c->seen_cap ? c->seen_cap * 2 : 1024;
+    free(c->seen);
+    if ((c->seen = calloc(cap, sizeof(int))) == NULL)
+        return -1;
+    c->seen_cap = cap;
+    for (int i = 0; i < c->count; i++) {
+        int s = seen_slot(c, &c->refs[i]);
+        if (c->seen[s] == 0)
+            c->seen[s] = i + 1;
+    }
+    return 0;
+}
+
+/*
+ *  Server side: appends count chunk names from a MSG_CHUNK_LIST and sets a
+ *  bit in need for every one of them we want sent, the first time a chunk
+ *  shows up in the file and only if the store does not have it.  Returns
+ *  the bytes of need filled in, or -1 if the list is malformed.
+ */
+int ftp_cdc_unpack(ftp_cdc *c, const char *buff, int buff_sz, int count, unsigned char *need) {
+    char path[512];
+
+    if (count < 0 || count > buff_sz / (int)sizeof(ftp_cdc_ref))
+        return -1;
+    memset(need, 0, (count + 7) / 8);
+
+    for (int i = 0; i < count; i++) {
+        ftp_cdc_ref ref;
+
+        memcpy(&ref, buff + i * sizeof(ref), sizeof(ref));
+        if (ref.len == 0 || ref.len > FTP_CDC_MAX || seen_grow(c) < 0)
+            return -1;
+
+        int s = seen_slot(c, &ref);
+        ref.need = 0;
+        if (c->seen[s] == 0) {
+            chunk_path(c, &ref, path, sizeof(path));
+            ref.need = access(path, F_OK) != 0;
+        }
+        if (cdc_add(c, ref.hash, ref.len) < 0)
+            return -1;
+        c->refs[c->count - 1].need = ref.need;
+        if (c->seen[s] == 0)
+            c->seen[s] = c->count;
+        if (ref.need) {
+            need[i / 8] |= 1 << (i % 8);
+            c->new_chunks++;
+            c->new_bytes += ref.len;
+        }
+    }
+    return (count + 7) / 8;
+}
+
+//client side: takes the server's answer to the list entries starting at first
+int ftp_cdc_mark(ftp_cdc *c, int first, int count, const unsigned char *need) {
+    if (first < 0 || count < 0 || first + count > c->count)
+        return -1;
+    for (int i = 0; i < count; i++)
+        c->refs[first + i].need = (need[i / 8] >> (i % 8)) & 1;
+    return 0;
+}
+
+/*
+ *  Sender side stream, an ftp_read_fn: fills buff with the next len bytes
+ *  of the chunks the server asked for, in file order, skipping over the
+ *  rest.  Returns the number of bytes read, 0 once every chunk is done, or
+ *  -1 if the file changed under us.
+ */
+int ftp_cdc_read(void *ctx, char *buff, int len) {
+    ftp_cdc *c = ctx;
+    int total = 0;
+
+    while (total < len && c->cur < c->count) {
+        ftp_cdc_ref *ref = &c->refs[c->cur];
+
+        int n = ref->len - c->cur_done;
+        if (!ref->need) {
+            c->cur_done = ref->len;
+        } else {
+            if (n > len - total)
+                n = len - total;
+            if (pread(fileno(c->f), buff + total, n, c->cur_off + c->cur_done) != n)
+                return -1;
+            total += n;
+            c->cur_done += n;
+        }
+
+        if (c->cur_done == (int)ref->len) {
+            c->cur_off += ref->len;
+            c->cur++;
+            c->cur_done = 0;
+        }
+    }
+    return total;
+}
+
+//puts the chunk in c->buf into the store, under a temporary name first so no reader sees half of it
+static int chunk_put(ftp_cdc *c, const ftp_cdc_ref *ref) {
+    char path[512], tmp[520];
+    ftp_hash h;
+
+    ftp_hash_init(&h);
+    ftp_hash_update(&h, c->buf, ref->len);
+    if (ftp_hash_digest(&h) != ref->hash) {
+        printf("ERROR:  chunk %016llx does not match its name\n", (unsigned long long)ref->hash);
+        return -1;
+    }
+
+    chunk_path(c, ref, path, sizeof(path));
+    //another session may have just put the same one
+    if (access(path, F_OK) == 0)
+        return 0;
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    if (make_parent_dirs(path) < 0)
+        return -1;
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    bool ok = write(fd, c->buf, ref->len) == ref->len;
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Receiver side stream: adds the next len bytes to the chunk being put
+ *  together and stores every chunk that comes out whole.  Returns 0, or -1
+ *  on a store error, a chunk that is not what the list called it, or more
+ *  data than the list asked for.
+ */
+int ftp_cdc_write(ftp_cdc *c, const char *data, int len) {
+    if (c->buf == NULL && (c->buf = malloc(FTP_CDC_MAX)) == NULL)
+        return -1;
+
+    while (len > 0) {
+        while (c->cur < c->count && !c->refs[c->cur].need)
+            c->cur++;
+        if (c->cur == c->count)
+            return -1;
+
+        ftp_cdc_ref *ref = &c->refs[c->cur];
+        int n = ref->len - c->cur_done;
+        if (n > len)
+            n = len;
+        memcpy(c->buf + c->cur_done, data, n);
+        data += n;
+        len -= n;
+        c->cur_done += n;
+
+        if (c->cur_done == (int)ref->len) {
+            if (chunk_put(c, ref) < 0)
+                return -1;
+            c->cur++;
+            c->cur_done = 0;
+        }
+    }
+    return 0;
+}
+
+//copies the chunk ref names out of the store, to out and/or into the hash
+static int chunk_copy(const ftp_cdc *c, const ftp_cdc_ref *ref, char *buf, FILE *out, ftp_hash *h) {
+    char path[512];
+
+    chunk_path(c, ref, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("ERROR:  chunk %s is missing from the store\n", path);
+        return -1;
+    }
+    bool ok = fread(buf, 1, ref->len, f) == ref->len;
+    fclose(f);
+    if (ok && h != NULL)
+        ftp_hash_update(h, buf, ref->len);
+    if (ok && out != NULL)
+        ok = fwrite(buf, 1, ref->len, out) == ref->len;
+    return ok ? 0 : -1;
+}
+
+/*
+ *  Called at MSG_DATA_END on the receiver.  Every chunk the list asked for
+ *  has to have come in, and the file is hashed the way the store will give
+ *  it back, for the caller to check against the client's hash before it
+ *  keeps the recipe with ftp_cdc_save().  Returns 0 or -1.
+ */
+int ftp_cdc_finish(ftp_cdc *c, unsigned long long *file_hash) {
+    ftp_hash whole;
+
+    while (c->cur < c->count && !c->refs[c->cur].need)
+        c->cur++;
+    if (c->cur != c->count || c->cur_done != 0)
+        return -1;
+    if (c->buf == NULL && (c->buf = malloc(FTP_CDC_MAX)) == NULL)
+        return -1;
+
+    ftp_hash_init(&whole);
+    for (int i = 0; i < c->count; i++) {
+        if (chunk_copy(c, &c->refs[i], c->buf, NULL, &whole) < 0)
+            return -1;
+    }
+    *file_hash = ftp_hash_digest(&whole);
+    return 0;
+}
+
+//writes the list of chunks as the recipe for the file, replacing any older one in one rename
+int ftp_cdc_save(ftp_cdc *c, const char *recipe) {
+    char tmp[512];
+    cdc_recipe_hdr hdr = {RECIPE_MAGIC, c->count, c->total_size};
+    int next = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", recipe);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    while (ok && next < c->count) {
+        char buff[64 * sizeof(ftp_cdc_ref)];
+        int used = ftp_cdc_pack(c, &next, buff, sizeof(buff));
+        ok = fwrite(buff, 1, used, f) == (size_t)used;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp, recipe) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Rebuilds the file a recipe stands for from the chunks under root.
+ *  Returns its size, or -1 if the recipe is damaged or a chunk is missing.
+ */
+long ftp_cdc_restore(const char *root, const char *recipe, FILE *out) {
+    cdc_recipe_hdr hdr;
+    ftp_cdc c;
+    ftp_cdc_ref ref;
+    long size = 0;
+
+    FILE *f = fopen(recipe, "rb");
+    if (f == NULL)
+        return -1;
+    ftp_cdc_init(&c, root);
+    char *buf = malloc(FTP_CDC_MAX);
+    bool ok = buf != NULL && fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+              memcmp(hdr.magic, RECIPE_MAGIC, sizeof(hdr.magic)) == 0;
+
+    for (int64_t i = 0; ok && i < hdr.count; i++) {
+        ok = fread(&ref, sizeof(ref), 1, f) == 1 && ref.len <= FTP_CDC_MAX &&
+             chunk_copy(&c, &ref, buf, out, NULL) == 0;
+        size += ref.len;
+    }
+    fclose(f);
+    free(buf);
+    return ok && size == hdr.size ? size : -1;
+}
+
+void ftp_cdc_free(ftp_cdc *c) {
+    free(c->refs);
+    free(c->seen);
+    free(c->buf);
+    memset(c, 0, sizeof(ftp_cdc));
+}
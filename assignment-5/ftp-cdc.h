@@ -0,0 +1,73 @@
+#ifndef __FTP_CDC_H__
+#define __FTP_CDC_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Deduplicating uploads for a server started with -C.  The client cuts the
+ * file into chunks where its content says to (FastCDC: a gear rolling hash
+ * with normalized chunking), so an insert or a delete only moves the cuts
+ * next to it and the chunks after them come out the same.  Every chunk is
+ * named by its XXH64 and length.  The list of names goes over first in
+ * MSG_CHUNK_LIST messages, and the server answers each with a bitmap of the
+ * chunks it has neither in its store nor earlier in the same file.  Only
+ * those chunks' bytes follow, back to back as one stream of MSG_DATA
+ * chunks, and the server uses the lengths in the list to cut the stream
+ * back into chunks.
+ *
+ * The store keeps one file per chunk under root, fanned out by the first
+ * byte of the hash, and a file becomes a recipe: the list of its chunks,
+ * written next to where the file itself would have gone.  The whole-file
+ * hash is still checked at MSG_DATA_END against the chunks in the store, so
+ * two chunks with the same name cannot silently build the wrong file.
+ */
+#define FTP_CDC_MIN         (2 * 1024)
+#define FTP_CDC_AVG         (8 * 1024)
+#define FTP_CDC_MAX         (64 * 1024)
+#define FTP_CDC_DIR         ".chunks"
+#define FTP_CDC_STORE       "./infile/" FTP_CDC_DIR
+#define FTP_CDC_RECIPE      ".recipe"       //suffix of the file a stored upload leaves in ./infile
+
+//a chunk's name, and on the wire a MSG_CHUNK_LIST entry
+typedef struct ftp_cdc_ref {
+    uint64_t    hash;
+    uint32_t    len;
+    uint32_t    need;           //the server does not have it, ignored on the wire
+} ftp_cdc_ref;
+
+typedef struct ftp_cdc {
+    char            root[256];
+    ftp_cdc_ref     *refs;
+    int             count;
+    int             cap;
+    long            total_size;
+    int             *seen;          //open addressed index of refs + 1, for chunks repeated in one file
+    int             seen_cap;
+
+    //streaming position, used by both the reader and the writer side
+    int             cur;
+    int             cur_done;
+    long            cur_off;        //where refs[cur] starts in the file, reader side
+    FILE            *f;
+    char            *buf;           //the chunk being put together, writer side
+
+    //what the server found
+    int             new_chunks;
+    long            new_bytes;
+} ftp_cdc;
+
+void ftp_cdc_init(ftp_cdc *c, const char *root);
+int  ftp_cdc_cut(const unsigned char *data, int len);
+int  ftp_cdc_scan(ftp_cdc *c, FILE *f, unsigned long long *file_hash);
+int  ftp_cdc_pack(ftp_cdc *c, int *next, char *buff, int buff_sz);
+int  ftp_cdc_unpack(ftp_cdc *c, const char *buff, int buff_sz, int count, unsigned char *need);
+int  ftp_cdc_mark(ftp_cdc *c, int first, int count, const unsigned char *need);
+int  ftp_cdc_read(void *ctx, char *buff, int len);
+int  ftp_cdc_write(ftp_cdc *c, const char *data, int len);
+int  ftp_cdc_finish(ftp_cdc *c, unsigned long long *file_hash);
+int  ftp_cdc_save(ftp_cdc *c, const char *recipe);
+long ftp_cdc_restore(const char *root, const char *recipe, FILE *out);
+void ftp_cdc_free(ftp_cdc *c);
+
+#endif
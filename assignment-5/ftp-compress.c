@@ -0,0 +1,274 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "ftp-compress.h"
+
+/*
+ * A small LZ77 codec that produces the LZ4 block layout.  Every sequence is
+ * a token byte (high nibble = literal count, low nibble = match length - 4),
+ * optional 255-run length extensions, the literals, and a 2 byte little
+ * endian back reference offset.  The final sequence is literals only.  It
+ * trades ratio for speed, which is what we want for log/text payloads that
+ * have to keep up with the network.
+ */
+#define LZ_MIN_MATCH        4
+#define LZ_HASH_LOG         10
+#define LZ_LAST_LITERALS    5       //the last 5 bytes are always literals
+#define LZ_MF_LIMIT         12      //no match may start in the last 12 bytes
+#define LZ_MAX_OFFSET       65535
+
+static inline uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/*
+ *  Emits the 255-run extension for a literal or match length that did not
+ *  fit in its nibble.  Returns NULL if it would run past the output buffer.
+ */
+static unsigned char *lz_put_len(unsigned char *op, unsigned char *oend, int len) {
+    while (len >= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+ *  Emits one sequence: literals [anchor, anchor+lit) followed by an optional
+ *  match (off == 0 means a literal-only final sequence).
+ */
+static unsigned char *lz_put_seq(unsigned char *op, unsigned char *oend,
+                                 const unsigned char *anchor, int lit, int off, int mlen) {
+    unsigned char *token;
+
+    if (op >= oend)
+        return NULL;
+    token = op++;
+    *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15 && (op = lz_put_len(op, oend, lit - 15)) == NULL)
+        return NULL;
+    if (lit > oend - op)
+        return NULL;
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (off == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = off & 0xff;
+    *op++ = (off >> 8) & 0xff;
+    *token |= (mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && (op = lz_put_len(op, oend, mlen - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+/*
+ *  Compresses src_sz bytes from src into dst.  Returns the compressed size,
+ *  or -1 if the result does not fit in dst_cap bytes.  Callers pass a
+ *  dst_cap smaller than src_sz so that a -1 means "store this chunk raw".
+ */
+int ftp_lz_compress(const char *src, int src_sz, char *dst, int dst_cap) {
+    uint16_t table[1 << LZ_HASH_LOG];
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + src_sz;
+    const unsigned char *mflimit = iend - LZ_MF_LIMIT;
+    const unsigned char *matchlimit = iend - LZ_LAST_LITERALS;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_cap;
+
+    //positions are kept as 16 bit offsets, so larger inputs are not worth it
+    if (src_sz < 0 || src_sz > LZ_MAX_OFFSET)
+        return -1;
+
+    memset(table, 0, sizeof(table));
+
+    if (src_sz > LZ_MF_LIMIT) {
+        while (ip < mflimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const unsigned char *ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+
+            if (ref >= ip || lz_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            //grow the match backwards over literals we have not emitted yet
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const unsigned char *mp = ip + LZ_MIN_MATCH;
+            const unsigned char *rp = ref + LZ_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, mp - ip - LZ_MIN_MATCH);
+            if (op == NULL)
+                return -1;
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+        return -1;
+    return op - (unsigned char *)dst;
+}
+
+/*
+ *  Decodes an LZ block into dst.  The input comes off the wire so every
+ *  length and offset is bounds checked; returns the decoded size or -1 if
+ *  the block is malformed or would overflow dst_cap.
+ */
+int ftp_lz_decompress(const char *src, int src_sz, char *dst, int dst_cap) {
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_sz;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + dst_cap;
+    unsigned int s;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        long lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                s = *ip++;
+                lit += s;
+            } while (s == 255);
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+
+        //the last sequence carries literals only
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        long off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > op - (unsigned char *)dst)
+            return -1;
+
+        long mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                s = *ip++;
+                mlen += s;
+            } while (s == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > oend - op)
+            return -1;
+
+        const unsigned char *m = op - off;
+        if (off >= mlen) {
+            memcpy(op, m, mlen);
+            op += mlen;
+        } else {
+            //overlapping match, e.g. a run of one repeated byte
+            while (mlen--)
+                *op++ = *m++;
+        }
+    }
+    return op - (unsigned char *)dst;
+}
+
+/*
+ *  True when every byte is zero, 64 bytes per step in 16 byte vector lanes
+ *  ORed together, so zero pages go by at memory speed and real data
+ *  usually bails out on the first step.
+ */
+typedef uint64_t ftp_v16 __attribute__((vector_size(16)));
+typedef ftp_v16 ftp_v16u __attribute__((aligned(1)));   //payloads sit anywhere
+
+int ftp_is_zero(const char *buf, int len) {
+    const char *p = buf;
+    const char *end = buf + len;
+
+    while (end - p >= 64) {
+        const ftp_v16u *v = (const ftp_v16u *)p;
+        ftp_v16 acc = v[0] | v[1] | v[2] | v[3];
+        if ((acc[0] | acc[1]) != 0)
+            return 0;
+        p += 64;
+    }
+    while (p < end) {
+        if (*p++ != 0)
+            return 0;
+    }
+    return 1;
+}
+
+int ftp_codec_supported(int codec) {
+    return codec == FTP_CODEC_STORED || codec == FTP_CODEC_LZ;
+}
+
+/*
+ *  Encodes one MSG_DATA payload from raw_sz file bytes.  With the LZ codec
+ *  negotiated the block is only kept if it comes out smaller, otherwise the
+ *  chunk falls back to stored.  *chunk_codec is set to what was used, and
+ *  the payload size is returned.
+ */
+int ftp_chunk_encode(int codec, const char *raw, int raw_sz, char *dst, int *chunk_codec) {
+    if (codec == FTP_CODEC_LZ) {
+        int lzSz = ftp_lz_compress(raw, raw_sz, dst, raw_sz - 1);
+        if (lzSz > 0) {
+            *chunk_codec = FTP_CODEC_LZ;
+            return lzSz;
+        }
+    }
+    if (dst != raw)
+        memcpy(dst, raw, raw_sz);
+    *chunk_codec = FTP_CODEC_STORED;
+    return raw_sz;
+}
+
+/*
+ *  Turns a received MSG_DATA payload back into file bytes.  Stored chunks
+ *  are used in place, LZ chunks are decoded into dst.  *raw points at the
+ *  file bytes; returns their count, or -1 if the chunk does not decode to
+ *  exactly raw_sz bytes.
+ */
+int ftp_chunk_decode(int chunk_codec, char *payload, int payload_sz, int raw_sz,
+                     char *dst, int dst_cap, char **raw) {
+    int size = payload_sz;
+
+    *raw = payload;
+    if (chunk_codec == FTP_CODEC_LZ) {
+        size = ftp_lz_decompress(payload, payload_sz, dst, dst_cap);
+        *raw = dst;
+    } else if (chunk_codec != FTP_CODEC_STORED) {
+        return -1;
+    }
+    return size == raw_sz ? size : -1;
+}
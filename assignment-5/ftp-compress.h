@@ -0,0 +1,16 @@
+#ifndef __FTP_COMPRESS_H__
+#define __FTP_COMPRESS_H__
+
+//Codecs negotiated in MSG_FILE_REQUEST/MSG_FILE_OK and tagged on every MSG_DATA
+#define FTP_CODEC_STORED    0       //payload is the raw file bytes
+#define FTP_CODEC_LZ        1       //payload is an LZ block (LZ4 block layout)
+
+int ftp_lz_compress(const char *src, int src_sz, char *dst, int dst_cap);
+int ftp_lz_decompress(const char *src, int src_sz, char *dst, int dst_cap);
+int ftp_is_zero(const char *buf, int len);
+int ftp_codec_supported(int codec);
+int ftp_chunk_encode(int codec, const char *raw, int raw_sz, char *dst, int *chunk_codec);
+int ftp_chunk_decode(int chunk_codec, char *payload, int payload_sz, int raw_sz,
+                     char *dst, int dst_cap, char **raw);
+
+#endif
@@ -3,11 +3,10 @@
 #include <stdio.h>
 #include <string.h>
 #include "du-ftp.h"
+#include "ftp-debug.h"
 
-static int _ftpDebugMode = 1;
-
-static const char * ftp_msg_to_string(const ftp_pdu *pdu) {
-    switch (pdu->msg_type) {
+const char *ftp_msg_name(int msg_type) {
+    switch (msg_type) {
         case MSG_FILE_REQUEST: return "FILE_REQUEST";
         case MSG_FILE_OK:      return "FILE_OK";
         case MSG_FILE_ERR:     return "FILE_ERR";
@@ -16,32 +15,31 @@ static const char * ftp_msg_to_string(const ftp_pdu *pdu) {
         case MSG_DATA_END:     return "DATA_END";
         case MSG_CLOSE:        return "CLOSE";
         case MSG_ERROR:        return "ERROR";
+        case MSG_BATCH_REQUEST: return "BATCH_REQUEST";
+        case MSG_MANIFEST:     return "MANIFEST";
+        case MSG_FILE_GET:     return "FILE_GET";
+        case MSG_DATA_HOLE:    return "DATA_HOLE";
+        case MSG_CHUNK_LIST:   return "CHUNK_LIST";
+        case MSG_CHUNK_NEED:   return "CHUNK_NEED";
         default:               return "***UNKNOWN***";
     }
 }
 
-static void print_ftp_pdu_details(const ftp_pdu *pdu) {
-
-    printf("\tMsg Type:     %s (%d)\n", ftp_msg_to_string(pdu), pdu->msg_type);
-    printf("\tFile Size:    %ld\n", (long)pdu->file_size);
-    printf("\tFile Name:    %.*s\n", (int)sizeof(pdu->file_name), pdu->file_name);
-    printf("\tByte Number:  %d\n", pdu->byte_number);
-    printf("\tPayload Size: %d\n", pdu->payload_size);
-    printf("\n");
-}
-
-void print_out_ftp_pdu(const ftp_pdu *pdu) {
-    if (_ftpDebugMode != 1) return;
-    printf("FTP PDU DETAILS ===> [OUT]\n");
-    print_ftp_pdu_details(pdu);
-}
-
-void print_in_ftp_pdu(const ftp_pdu *pdu) {
-    if (_ftpDebugMode != 1) return;
-    printf("FTP PDU DETAILS ===> [IN]\n");
-    print_ftp_pdu_details(pdu);
-}
-
-void ftp_set_debug(int enabled) {
-    _ftpDebugMode = enabled ? 1 : 0;
+/*
+ *  Records an ftp_pdu in the calling thread's trace ring.  Only reached
+ *  through ftp_trace_in()/ftp_trace_out(), which check the level first.
+ */
+void ftp_trace_pdu(int kind, const ftp_pdu *pdu) {
+    ftp_trace_body body;
+
+    memset(&body, 0, sizeof(body));
+    body.msg_type = pdu->msg_type;
+    body.byte_number = pdu->byte_number;
+    body.payload_size = pdu->payload_size;
+    body.raw_size = pdu->raw_size;
+    body.file_size = pdu->file_size;
+    body.file_hash = pdu->file_hash;
+    body.codec = pdu->codec;
+    strncpy(body.file_name, pdu->file_name, sizeof(body.file_name) - 1);
+    dp_trace_emit(kind, &body, sizeof(body));
 }
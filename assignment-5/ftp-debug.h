@@ -1,10 +1,29 @@
 #ifndef __FTP_DEBUG_H__
 #define __FTP_DEBUG_H__
 
+#include <stdint.h>
+
 #include "du-ftp.h"
+#include "dp-trace.h"
+
+//an ftp_pdu squeezed into one trace record body, the file name is cut short
+typedef struct ftp_trace_body {
+    int64_t     file_size;
+    int64_t     byte_number;
+    uint64_t    file_hash;
+    int32_t     msg_type;
+    int32_t     payload_size;
+    int32_t     raw_size;
+    uint8_t     codec;
+    char        file_name[DP_TRACE_BODY_SZ - 37];
+} ftp_trace_body;
+
+#define ftp_trace_out(pdu) \
+    do { if (DP_TRACE_ON(DP_TRACE_MSG)) ftp_trace_pdu(DP_TR_FTP_OUT, (pdu)); } while (0)
+#define ftp_trace_in(pdu) \
+    do { if (DP_TRACE_ON(DP_TRACE_MSG)) ftp_trace_pdu(DP_TR_FTP_IN, (pdu)); } while (0)
 
-void print_out_ftp_pdu(const ftp_pdu *pdu);
-void print_in_ftp_pdu(const ftp_pdu *pdu);
-void ftp_set_debug(int enabled); 
+void ftp_trace_pdu(int kind, const ftp_pdu *pdu);
+const char *ftp_msg_name(int msg_type);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "ftp-hash.h"
+
+#define XXH_P1  11400714785074694791ULL
+#define XXH_P2  14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void ftp_hash_init(ftp_hash *h) {
+    memset(h, 0, sizeof(ftp_hash));
+    h->v[0] = XXH_P1 + XXH_P2;
+    h->v[1] = XXH_P2;
+    h->v[2] = 0;
+    h->v[3] = -XXH_P1;
+}
+
+/*
+ *  Consumes input in 32 byte stripes across the four lanes.  Whatever does
+ *  not fill a stripe is parked in mem until the next call.
+ */
+void ftp_hash_update(ftp_hash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    h->total_len += len;
+
+    if (h->mem_size + len < 32) {
+        memcpy(h->mem + h->mem_size, p, len);
+        h->mem_size += len;
+        return;
+    }
+
+    if (h->mem_size > 0) {
+        int fill = 32 - h->mem_size;
+        memcpy(h->mem + h->mem_size, p, fill);
+        for (int i = 0; i < 4; i++)
+            h->v[i] = xxh_round(h->v[i], read64(h->mem + 8 * i));
+        p += fill;
+        h->mem_size = 0;
+    }
+
+    while (end - p >= 32) {
+        h->v[0] = xxh_round(h->v[0], read64(p));
+        h->v[1] = xxh_round(h->v[1], read64(p + 8));
+        h->v[2] = xxh_round(h->v[2], read64(p + 16));
+        h->v[3] = xxh_round(h->v[3], read64(p + 24));
+        p += 32;
+    }
+
+    if (p < end) {
+        memcpy(h->mem, p, end - p);
+        h->mem_size = end - p;
+    }
+}
+
+//len zero bytes, for the holes a sparse file skips on the wire
+void ftp_hash_zeros(ftp_hash *h, size_t len) {
+    static const unsigned char zeros[4096];
+
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        ftp_hash_update(h, zeros, n);
+        len -= n;
+    }
+}
+
+uint64_t ftp_hash_digest(const ftp_hash *h) {
+    const unsigned char *p = h->mem;
+    const unsigned char *end = p + h->mem_size;
+    uint64_t acc;
+
+    if (h->total_len >= 32) {
+        acc = rotl64(h->v[0], 1) + rotl64(h->v[1], 7) + rotl64(h->v[2], 12) + rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = xxh_merge(acc, h->v[i]);
+    } else {
+        acc = XXH_P5;
+    }
+    acc += h->total_len;
+
+    while (end - p >= 8) {
+        acc ^= xxh_round(0, read64(p));
+        acc = rotl64(acc, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        acc ^= (uint64_t)read32(p) * XXH_P1;
+        acc = rotl64(acc, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        acc ^= (*p++) * XXH_P5;
+        acc = rotl64(acc, 11) * XXH_P1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= XXH_P2;
+    acc ^= acc >> 29;
+    acc *= XXH_P3;
+    acc ^= acc >> 32;
+    return acc;
+}
@@ -0,0 +1,24 @@
+#ifndef __FTP_HASH_H__
+#define __FTP_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming XXH64 used to check that the file the server wrote is the file
+ * the client read.  Feed it the raw (uncompressed) file bytes in order, in
+ * pieces of any size, and take the digest at the end.
+ */
+typedef struct ftp_hash {
+    uint64_t        v[4];
+    uint64_t        total_len;
+    unsigned char   mem[32];
+    int             mem_size;
+} ftp_hash;
+
+void     ftp_hash_init(ftp_hash *h);
+void     ftp_hash_update(ftp_hash *h, const void *data, size_t len);
+void     ftp_hash_zeros(ftp_hash *h, size_t len);
+uint64_t ftp_hash_digest(const ftp_hash *h);
+
+#endif
@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "ftp-mapcache.h"
+#include "ftp-hash.h"
+
+static ftp_map         *_maps = NULL;
+static pthread_mutex_t  _mapsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   _mapsLoaded = PTHREAD_COND_INITIALIZER;
+
+//a cached mapping is only reused for the exact same version of the file
+static int same_version(const ftp_map *map, const struct stat *st) {
+    return map->dev == st->st_dev && map->ino == st->st_ino && map->size == st->st_size &&
+           map->mtime.tv_sec == st->st_mtim.tv_sec && map->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+//takes map off the list, the cache lock is held
+static void map_unlink(ftp_map *map) {
+    for (ftp_map **pp = &_maps; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == map) {
+            *pp = map->next;
+            break;
+        }
+    }
+}
+
+/*
+ *  Waits for the session loading map to finish with it.  Returns map, or
+ *  NULL (dropping our reference) if the load failed.  The cache lock is
+ *  held, and released before returning.
+ */
+static ftp_map *map_wait(ftp_map *map) {
+    while (map->loading)
+        pthread_cond_wait(&_mapsLoaded, &_mapsLock);
+    if (!map->failed) {
+        pthread_mutex_unlock(&_mapsLock);
+        return map;
+    }
+
+    int last = --map->refs == 0;
+    pthread_mutex_unlock(&_mapsLock);
+    if (last)
+        free(map);
+    return NULL;
+}
+
+/*
+ *  Maps a file for serving, or takes another reference on the mapping an
+ *  earlier session already made.  The first open also hashes the file,
+ *  which doubles as read-ahead into the page cache.  That can take a while
+ *  for a big file, so it happens outside the cache lock: the entry goes on
+ *  the list marked loading, and sessions that want the same version wait
+ *  for it while everything else goes ahead.  Returns NULL if the file
+ *  cannot be opened or mapped.
+ */
+ftp_map *ftp_map_open(const char *path) {
+    struct stat st;
+    ftp_map *map;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_mapsLock);
+    for (map = _maps; map != NULL; map = map->next) {
+        if (same_version(map, &st)) {
+            map->refs++;
+            close(fd);
+            return map_wait(map);
+        }
+    }
+
+    map = calloc(1, sizeof(ftp_map));
+    if (map == NULL) {
+        pthread_mutex_unlock(&_mapsLock);
+        close(fd);
+        return NULL;
+    }
+    snprintf(map->path, sizeof(map->path), "%s", path);
+    map->dev = st.st_dev;
+    map->ino = st.st_ino;
+    map->mtime = st.st_mtim;
+    map->size = st.st_size;
+    map->refs = 1;
+    map->loading = 1;
+    map->next = _maps;
+    _maps = map;
+    pthread_mutex_unlock(&_mapsLock);
+
+    if (map->size > 0) {
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("ftp_map_open: mmap failed");
+            map->failed = 1;
+        } else {
+            madvise(data, map->size, MADV_SEQUENTIAL);
+            madvise(data, map->size, MADV_WILLNEED);
+            map->data = data;
+        }
+    }
+    close(fd);
+
+    if (!map->failed) {
+        ftp_hash hash;
+        ftp_hash_init(&hash);
+        ftp_hash_update(&hash, map->data, map->size);
+        map->digest = ftp_hash_digest(&hash);
+    }
+
+    pthread_mutex_lock(&_mapsLock);
+    map->loading = 0;
+    if (map->failed)
+        map_unlink(map);
+    pthread_cond_broadcast(&_mapsLoaded);
+    return map_wait(map);
+}
+
+void ftp_map_close(ftp_map *map) {
+    pthread_mutex_lock(&_mapsLock);
+    if (--map->refs > 0) {
+        pthread_mutex_unlock(&_mapsLock);
+        return;
+    }
+    map_unlink(map);
+    pthread_mutex_unlock(&_mapsLock);
+
+    if (map->data != NULL)
+        munmap((void *)map->data, map->size);
+    free(map);
+}
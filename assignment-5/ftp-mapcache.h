@@ -0,0 +1,30 @@
+#ifndef __FTP_MAPCACHE_H__
+#define __FTP_MAPCACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Read-only mappings of files being served by MSG_FILE_GET.  Sessions that
+ * download the same version of the same file share one mapping (and so one
+ * set of page cache pages) and one precomputed whole-file hash.  A mapping
+ * is dropped when its last session lets go of it.
+ */
+typedef struct ftp_map {
+    char                path[256];
+    dev_t               dev;
+    ino_t               ino;
+    struct timespec     mtime;
+    long                size;
+    const char          *data;          //NULL for an empty file
+    unsigned long long  digest;         //XXH64 of the whole file
+    int                 refs;
+    int                 loading;        //the first opener is still mapping and hashing it
+    int                 failed;         //and could not, the entry is already off the list
+    struct ftp_map      *next;
+} ftp_map;
+
+ftp_map *ftp_map_open(const char *path);
+void     ftp_map_close(ftp_map *map);
+
+#endif
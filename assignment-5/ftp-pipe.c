@@ -0,0 +1,417 @@
+#define _GNU_SOURCE                             //SEEK_DATA, SEEK_HOLE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "ftp-pipe.h"
+#include "ftp-compress.h"
+#include "ftp-spsc.h"
+
+/*
+ * The client side send pipeline.  A producer thread reads the file and
+ * compresses each chunk into one of FTP_PIPE_DEPTH slots while the main
+ * thread is busy pushing the previous chunk through dpsend(), so the codec
+ * overlaps with the network instead of adding to the per-chunk latency.
+ * Slots go round between two SPSC queues: filled ones to the main thread in
+ * order on ready, given back ones to the producer on spare.  A NULL on ready
+ * is the end of the file, a NULL on spare tells the producer to quit.  The
+ * same thread keeps the running hash of the raw file bytes, so the
+ * whole-file digest is ready the moment the last chunk is.
+ *
+ * A single regular file is read with pread() so the producer can also
+ * look for runs of zeros, both the holes the file system reports through
+ * SEEK_DATA/SEEK_HOLE and chunks that simply read back as zeros.  A run
+ * goes out as one MSG_DATA_HOLE with no payload.
+ */
+struct ftp_pipe {
+    ftp_read_fn     read_fn;
+    void            *ctx;
+    int             codec;
+    long            byte_number;
+    int             fd;                         //-1 unless reading a single regular file
+    long            hole_at;                    //no file system hole before this offset
+    int             staged;                     //bytes of the next chunk already in scratch
+    pthread_t       thread;
+    ftp_spsc        ready;
+    ftp_spsc        spare;
+    bool            eof;
+    ftp_hash        hash;
+    unsigned long long read_ns;                 //only the producer touches these until it is done
+    unsigned long long code_ns;
+    ftp_chunk       slots[FTP_PIPE_DEPTH];
+    char            scratch[FTP_CHUNK_SZ];      //raw bytes waiting to be compressed
+};
+
+/*
+ * The server side receive pipeline, the same idea the other way round.
+ * The main thread decodes each chunk into a pooled buffer and queues it,
+ * and a writer thread puts the buffers into the file in order, so the disk
+ * works while the next datagram is on its way.  The writer also feeds the
+ * caller's running hash, so hashing is off the receive thread too.  Write
+ * errors are kept for ftp_sink_finish().
+ */
+typedef struct ftp_sink_slot {
+    char            data[FTP_CHUNK_SZ];         //first, a buffer is its slot
+    int             len;
+    bool            hole;                       //seek len bytes instead of writing
+} ftp_sink_slot;
+
+struct ftp_sink {
+    FILE            *f;
+    ftp_hash        *hash;                      //the caller's, NULL for none
+    pthread_t       thread;
+    ftp_spsc        ready;
+    ftp_spsc        spare;
+    bool            failed;                     //only the writer touches it until the join
+    unsigned long long write_ns;                //same
+    unsigned long long code_ns;                 //same
+    ftp_sink_slot   slots[FTP_PIPE_DEPTH];
+};
+
+unsigned long long ftp_phase_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ *  Length of the run of zeros at byte_number, at most FTP_HOLE_MAX.  Holes
+ *  cost one lseek() each, and SEEK_HOLE tells us how long we can go before
+ *  asking again.  Within data every chunk is checked for zeros anyway; the
+ *  first one that is not stays in scratch for fill_chunk().
+ */
+static long zero_run(ftp_pipe *fp) {
+    long start = fp->byte_number;
+    long limit = start + FTP_HOLE_MAX;
+    long pos = start;
+
+    while (pos < limit) {
+        if (pos >= fp->hole_at) {
+            off_t data = lseek(fp->fd, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) {
+                // a hole up to the end of the file, or already past it
+                struct stat st;
+                if (fstat(fp->fd, &st) == 0 && st.st_size > pos)
+                    pos = st.st_size;
+                break;
+            }
+            if (data > pos) {
+                pos = data;
+                continue;
+            }
+            // no SEEK_DATA on this file system means it is all data
+            fp->hole_at = data < 0 ? LONG_MAX : lseek(fp->fd, pos, SEEK_HOLE);
+            if (fp->hole_at < 0)
+                fp->hole_at = LONG_MAX;
+        }
+
+        ssize_t n = pread(fp->fd, fp->scratch, sizeof(fp->scratch), pos);
+        if (n <= 0)
+            break;
+        if (!ftp_is_zero(fp->scratch, n)) {
+            if (pos == start)
+                fp->staged = n;
+            break;
+        }
+        pos += n;
+    }
+    return (pos < limit ? pos : limit) - start;
+}
+
+//the next raw bytes of the file, 0 at the end and -1 on error
+static int read_raw(ftp_pipe *fp, char *buff, int len) {
+    if (fp->staged > 0) {
+        int n = fp->staged;
+        if (buff != fp->scratch)
+            memcpy(buff, fp->scratch, n);
+        fp->staged = 0;
+        return n;
+    }
+
+    unsigned long long start = ftp_phase_ns();
+    int n = fp->fd < 0 ? fp->read_fn(fp->ctx, buff, len) : pread(fp->fd, buff, len, fp->byte_number);
+    fp->read_ns += ftp_phase_ns() - start;
+    return n;
+}
+
+/*
+ *  Fills one slot with the next chunk of the file.  When compression was
+ *  negotiated the raw bytes are staged in a scratch buffer and only kept if
+ *  the LZ block comes out smaller, otherwise the chunk is sent stored.
+ *  Returns the number of raw file bytes consumed, 0 at end of file and -1
+ *  if the read failed.
+ */
+static int fill_chunk(ftp_pipe *fp, ftp_chunk *chunk) {
+    char *raw = fp->scratch;
+    int bytes;
+
+    memset(&chunk->pdu, 0, sizeof(ftp_pdu));
+    chunk->pdu.msg_type = MSG_DATA;
+    chunk->pdu.byte_number = fp->byte_number;
+    chunk->pdu.codec = FTP_CODEC_STORED;
+
+    if (fp->fd >= 0) {
+        // looking for zeros reads the next chunk too, so it counts as reading
+        unsigned long long start = ftp_phase_ns();
+        long hole = zero_run(fp);
+        fp->read_ns += ftp_phase_ns() - start;
+        if (hole > 0) {
+            // the server recreates it by seeking, the hash still covers it
+            chunk->pdu.msg_type = MSG_DATA_HOLE;
+            chunk->pdu.raw_size = hole;
+            ftp_hash_zeros(&fp->hash, hole);
+            fp->byte_number += hole;
+            return hole;
+        }
+    }
+
+    if (fp->codec == FTP_CODEC_LZ) {
+        bytes = read_raw(fp, raw, sizeof(fp->scratch));
+        if (bytes <= 0)
+            return bytes < 0 ? -1 : 0;
+        unsigned long long start = ftp_phase_ns();
+        ftp_hash_update(&fp->hash, raw, bytes);
+        chunk->pdu.payload_size = ftp_chunk_encode(fp->codec, raw, bytes, chunk->payload, &chunk->pdu.codec);
+        fp->code_ns += ftp_phase_ns() - start;
+    } else {
+        bytes = read_raw(fp, chunk->payload, sizeof(chunk->payload));
+        if (bytes <= 0)
+            return bytes < 0 ? -1 : 0;
+        unsigned long long start = ftp_phase_ns();
+        ftp_hash_update(&fp->hash, chunk->payload, bytes);
+        chunk->pdu.payload_size = bytes;
+        fp->code_ns += ftp_phase_ns() - start;
+    }
+
+    chunk->pdu.raw_size = bytes;
+    fp->byte_number += bytes;
+    return bytes;
+}
+
+static void *producer(void *arg) {
+    ftp_pipe *fp = arg;
+    ftp_chunk *chunk;
+
+    while ((chunk = ftp_spsc_pop(&fp->spare)) != NULL) {
+        // a read error ends the file early, the caller sees fewer bytes than it expected
+        int rc = fill_chunk(fp, chunk);
+        if (rc < 0) {
+            perror("ftp_pipe: could not read the file");
+        }
+        if (rc <= 0) {
+            ftp_spsc_push(&fp->ready, NULL);
+            break;
+        }
+        ftp_spsc_push(&fp->ready, chunk);
+    }
+    return NULL;
+}
+
+//ftp_read_fn for a single already opened FILE
+int ftp_pipe_read_file(void *ctx, char *buff, int len) {
+    return fread(buff, 1, len, (FILE *)ctx);
+}
+
+void ftp_synth_init(ftp_synth *s, long size) {
+    s->left = size;
+    s->state = 0x9e3779b97f4a7c15ull;
+}
+
+/*
+ *  ftp_read_fn that makes the data up, for timing the network without the
+ *  disk.  xorshift64 is far faster than any disk or link and its output
+ *  neither compresses nor looks like a hole, so every byte is sent.
+ */
+int ftp_pipe_read_synth(void *ctx, char *buff, int len) {
+    ftp_synth *s = ctx;
+
+    if (len > s->left)
+        len = s->left;
+    for (int i = 0; i < len; i += sizeof(s->state)) {
+        s->state ^= s->state << 13;
+        s->state ^= s->state >> 7;
+        s->state ^= s->state << 17;
+        memcpy(buff + i, &s->state, len - i < (int)sizeof(s->state) ? len - i : (int)sizeof(s->state));
+    }
+    s->left -= len;
+    return len;
+}
+
+/*
+ *  Starts the producer thread over a byte source, either one file through
+ *  ftp_pipe_read_file() or a whole batch through ftp_batch_read().  codec
+ *  is the value the server agreed to in MSG_FILE_OK.
+ */
+ftp_pipe *ftp_pipe_start(ftp_read_fn read_fn, void *ctx, int codec) {
+    ftp_pipe *fp = calloc(1, sizeof(ftp_pipe));
+    if (fp == NULL)
+        return NULL;
+    fp->read_fn = read_fn;
+    fp->ctx = ctx;
+    fp->codec = codec;
+    fp->fd = -1;
+    ftp_hash_init(&fp->hash);
+
+    struct stat st;
+    if (read_fn == ftp_pipe_read_file && fstat(fileno((FILE *)ctx), &st) == 0 && S_ISREG(st.st_mode)) {
+        fp->fd = fileno((FILE *)ctx);
+    }
+    ftp_spsc_init(&fp->ready);
+    ftp_spsc_init(&fp->spare);
+    for (int i = 0; i < FTP_PIPE_DEPTH; i++) {
+        ftp_spsc_push(&fp->spare, &fp->slots[i]);
+    }
+
+    if (pthread_create(&fp->thread, NULL, producer, fp) != 0) {
+        perror("ftp_pipe_start: could not start producer thread");
+        free(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/*
+ *  Blocks until the next chunk is ready and returns it, or NULL once the
+ *  whole file has been handed out.  The chunk stays valid until it is
+ *  given back with ftp_pipe_release().
+ */
+ftp_chunk *ftp_pipe_next(ftp_pipe *fp) {
+    if (fp->eof)
+        return NULL;
+
+    ftp_chunk *chunk = ftp_spsc_pop(&fp->ready);
+    if (chunk == NULL)
+        fp->eof = true;
+    return chunk;
+}
+
+void ftp_pipe_release(ftp_pipe *fp, ftp_chunk *chunk) {
+    ftp_spsc_push(&fp->spare, chunk);
+}
+
+/*
+ *  Digest of every byte read from the file.  Only meaningful once
+ *  ftp_pipe_next() has returned NULL, the producer is done with it then.
+ */
+unsigned long long ftp_pipe_digest(ftp_pipe *fp) {
+    return ftp_hash_digest(&fp->hash);
+}
+
+//adds the producer's read and code times to ph, with the same proviso
+void ftp_pipe_phases(ftp_pipe *fp, ftp_phases *ph) {
+    ph->read_ns += fp->read_ns;
+    ph->code_ns += fp->code_ns;
+}
+
+void ftp_pipe_stop(ftp_pipe *fp) {
+    ftp_spsc_push(&fp->spare, NULL);
+    pthread_join(fp->thread, NULL);
+    free(fp);
+}
+
+static void *writer(void *arg) {
+    ftp_sink *fs = arg;
+    ftp_sink_slot *slot;
+
+    while ((slot = ftp_spsc_pop(&fs->ready)) != NULL) {
+        if (fs->hash != NULL) {
+            unsigned long long start = ftp_phase_ns();
+            if (slot->hole) {
+                ftp_hash_zeros(fs->hash, slot->len);
+            } else {
+                ftp_hash_update(fs->hash, slot->data, slot->len);
+            }
+            fs->code_ns += ftp_phase_ns() - start;
+        }
+        // after a failure keep taking buffers so the main thread never blocks
+        if (!fs->failed) {
+            unsigned long long start = ftp_phase_ns();
+            fs->failed = slot->hole ? fseeko(fs->f, slot->len, SEEK_CUR) != 0
+                                    : fwrite(slot->data, 1, slot->len, fs->f) != (size_t)slot->len;
+            fs->write_ns += ftp_phase_ns() - start;
+        }
+        ftp_spsc_push(&fs->spare, slot);
+    }
+    unsigned long long start = ftp_phase_ns();
+    if (fflush(fs->f) != 0) {
+        fs->failed = true;
+    }
+    fs->write_ns += ftp_phase_ns() - start;
+    return NULL;
+}
+
+/*
+ *  Starts the writer thread on an open file, from its current position.
+ *  Every byte that goes through the sink, holes as zeros, is added to hash
+ *  if there is one.  Until ftp_sink_finish() the file and the hash belong
+ *  to the writer.
+ */
+ftp_sink *ftp_sink_start(FILE *f, ftp_hash *hash) {
+    ftp_sink *fs = calloc(1, sizeof(ftp_sink));
+    if (fs == NULL)
+        return NULL;
+    fs->f = f;
+    fs->hash = hash;
+    ftp_spsc_init(&fs->ready);
+    ftp_spsc_init(&fs->spare);
+    for (int i = 0; i < FTP_PIPE_DEPTH; i++) {
+        ftp_spsc_push(&fs->spare, &fs->slots[i]);
+    }
+
+    if (pthread_create(&fs->thread, NULL, writer, fs) != 0) {
+        perror("ftp_sink_start: could not start writer thread");
+        free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+//a FTP_CHUNK_SZ buffer to fill, blocks while the writer has them all
+char *ftp_sink_buf(ftp_sink *fs) {
+    return ((ftp_sink_slot *)ftp_spsc_pop(&fs->spare))->data;
+}
+
+//hands a buffer from ftp_sink_buf() to the writer, len may be 0
+void ftp_sink_write(ftp_sink *fs, char *buf, int len) {
+    ftp_sink_slot *slot = (ftp_sink_slot *)buf;
+
+    slot->len = len;
+    slot->hole = false;
+    ftp_spsc_push(&fs->ready, slot);
+}
+
+//leaves len bytes of hole in the file, in order with the writes around it
+void ftp_sink_skip(ftp_sink *fs, int len) {
+    ftp_sink_slot *slot = ftp_spsc_pop(&fs->spare);
+
+    slot->len = len;
+    slot->hole = true;
+    ftp_spsc_push(&fs->ready, slot);
+}
+
+/*
+ *  Waits for everything queued to reach the file and stops the writer,
+ *  adding its write and hash times to ph if there is one.  The hash is the
+ *  caller's again once this returns.  Returns -1 if any write failed, 0
+ *  otherwise, and 0 for no sink at all.
+ */
+int ftp_sink_finish(ftp_sink *fs, ftp_phases *ph) {
+    if (fs == NULL)
+        return 0;
+
+    ftp_spsc_push(&fs->ready, NULL);
+    pthread_join(fs->thread, NULL);
+    if (ph != NULL) {
+        ph->write_ns += fs->write_ns;
+        ph->code_ns += fs->code_ns;
+    }
+    int rc = fs->failed ? -1 : 0;
+    free(fs);
+    return rc;
+}
@@ -0,0 +1,66 @@
+#ifndef __FTP_PIPE_H__
+#define __FTP_PIPE_H__
+
+#include <stdio.h>
+
+#include "du-ftp.h"
+#include "du-proto.h"
+#include "ftp-hash.h"
+
+//A chunk is laid out exactly as it goes on the wire: [ftp_pdu][payload]
+#define FTP_CHUNK_SZ    (3 * DP_MAX_DGRAM_SZ - sizeof(ftp_pdu))
+#define FTP_PIPE_DEPTH  8
+#define FTP_HOLE_MAX    (1 << 30)       //longest zero run in one MSG_DATA_HOLE
+
+typedef struct ftp_chunk {
+    ftp_pdu     pdu;
+    char        payload[FTP_CHUNK_SZ];
+} ftp_chunk;
+
+typedef struct ftp_pipe ftp_pipe;
+typedef struct ftp_sink ftp_sink;
+
+/*
+ * Where one side of a transfer spent its time, in nanoseconds.  The stages
+ * overlap, read and code on the producer thread and write on the writer
+ * thread run while the main thread sends and waits, so the largest one is
+ * the bottleneck and they do not add up to the elapsed time.
+ */
+typedef struct ftp_phases {
+    unsigned long long  read_ns;        //getting raw bytes from the file or the synthetic source
+    unsigned long long  code_ns;        //hashing and compressing, or decompressing and hashing
+    unsigned long long  stall_ns;       //the main thread waiting on the producer or for a writer buffer
+    unsigned long long  send_ns;        //in dpsend()
+    unsigned long long  wait_ns;        //in dprecv(), for the ACK when sending, for the next chunk when receiving
+    unsigned long long  write_ns;       //putting bytes in the file
+    unsigned long long  start_ns;
+    long                bytes;
+} ftp_phases;
+
+//an endless stream of pseudo random bytes, cut off after size
+typedef struct ftp_synth {
+    long                left;
+    unsigned long long  state;
+} ftp_synth;
+
+//where the pipe pulls raw bytes from; returns bytes read, 0 at the end, -1 on error
+typedef int (*ftp_read_fn)(void *ctx, char *buff, int len);
+
+unsigned long long ftp_phase_ns(void);
+int        ftp_pipe_read_file(void *ctx, char *buff, int len);
+void       ftp_synth_init(ftp_synth *s, long size);
+int        ftp_pipe_read_synth(void *ctx, char *buff, int len);
+ftp_pipe  *ftp_pipe_start(ftp_read_fn read_fn, void *ctx, int codec);
+ftp_chunk *ftp_pipe_next(ftp_pipe *fp);
+void       ftp_pipe_release(ftp_pipe *fp, ftp_chunk *chunk);
+unsigned long long ftp_pipe_digest(ftp_pipe *fp);
+void       ftp_pipe_phases(ftp_pipe *fp, ftp_phases *ph);
+void       ftp_pipe_stop(ftp_pipe *fp);
+
+ftp_sink  *ftp_sink_start(FILE *f, ftp_hash *hash);
+char      *ftp_sink_buf(ftp_sink *fs);
+void       ftp_sink_write(ftp_sink *fs, char *buf, int len);
+void       ftp_sink_skip(ftp_sink *fs, int len);
+int        ftp_sink_finish(ftp_sink *fs, ftp_phases *ph);
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ftp-spsc.h"
+
+static void futex_wait(int *word, int val) {
+    syscall(SYS_futex, word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ *  Note the sequence number, say we are waiting, look at the other side's
+ *  index once more and only then sleep.  The other side moves its index
+ *  before it looks at the waiting flag, so either we see the move or it
+ *  sees the flag and bumps the sequence number under us.
+ */
+static void spsc_wait(int *seq, int *waiting, const unsigned int *pos, unsigned int seen) {
+    int val = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) == seen)
+        futex_wait(seq, val);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void spsc_kick(int *seq, int *waiting) {
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(seq);
+    }
+}
+
+void ftp_spsc_init(ftp_spsc *q) {
+    memset(q, 0, sizeof(*q));
+}
+
+//blocks while the queue is full; the item can be anything, NULL included
+void ftp_spsc_push(ftp_spsc *q, void *item) {
+    unsigned int head = q->head;
+    unsigned int tail;
+
+    while (head - (tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) == FTP_SPSC_SLOTS)
+        spsc_wait(&q->spaceSeq, &q->spaceWait, &q->tail, tail);
+
+    q->slot[head & (FTP_SPSC_SLOTS - 1)] = item;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+    spsc_kick(&q->dataSeq, &q->dataWait);
+}
+
+//blocks while the queue is empty
+void *ftp_spsc_pop(ftp_spsc *q) {
+    unsigned int tail = q->tail;
+
+    while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+        spsc_wait(&q->dataSeq, &q->dataWait, &q->head, tail);
+
+    void *item = q->slot[tail & (FTP_SPSC_SLOTS - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+    spsc_kick(&q->spaceSeq, &q->spaceWait);
+    return item;
+}
@@ -0,0 +1,29 @@
+#ifndef __FTP_SPSC_H__
+#define __FTP_SPSC_H__
+
+/*
+ * Bounded single producer, single consumer queue of pointers, for handing
+ * pooled buffers between a transfer's network thread and its disk thread.
+ * head is only written by the producer and tail only by the consumer, so
+ * a push or pop is a load of the other side's index and a store of our
+ * own, with no lock.  A side that finds the queue full or empty sleeps on
+ * a futex the same way the shared memory rings do (dp-shm.c), and the
+ * other side only makes the wake up call when someone is asleep.
+ */
+#define FTP_SPSC_SLOTS      16              //a power of 2
+
+typedef struct ftp_spsc {
+    void               *slot[FTP_SPSC_SLOTS];
+    unsigned int        head __attribute__((aligned(64)));
+    unsigned int        tail __attribute__((aligned(64)));
+    int                 dataSeq __attribute__((aligned(64)));  //bumped to wake a waiting consumer
+    int                 dataWait;
+    int                 spaceSeq;       //bumped to wake a producer waiting for room
+    int                 spaceWait;
+} ftp_spsc;
+
+void  ftp_spsc_init(ftp_spsc *q);
+void  ftp_spsc_push(ftp_spsc *q, void *item);
+void *ftp_spsc_pop(ftp_spsc *q);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * trace-decode turns a dump written by du-ftp -v into readable PDU traces.
+ * Records from every thread are merged by timestamp and printed one per
+ * line, relative to the first record:
+ *
+ *      ./trace-decode du-ftp.trace
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "dp-trace.h"
+#include "du-proto.h"
+#include "ftp-debug.h"
+#include "ftp-compress.h"
+
+static int by_time(const void *a, const void *b) {
+    const dp_trace_rec *ra = a, *rb = b;
+    if (ra->ts_ns != rb->ts_ns)
+        return ra->ts_ns < rb->ts_ns ? -1 : 1;
+    return 0;
+}
+
+static void print_dp(const dp_trace_rec *rec) {
+    dp_pdu pdu;
+
+    memcpy(&pdu, rec->body, sizeof(pdu));
+    printf("%-3s dp  %-12s%s seq=%d sz=%d crc=%08x\n",
+           rec->kind == DP_TR_PDU_IN ? "IN" : "OUT",
+           dp_trace_mtype_name(pdu.mtype), pdu.mtype & DP_MT_FRAGMENT ? "+FRAG" : "     ",
+           pdu.seqnum, pdu.dgram_sz, pdu.checksum);
+}
+
+static void print_ftp(const dp_trace_rec *rec) {
+    ftp_trace_body b;
+
+    memcpy(&b, rec->body, sizeof(b));
+    printf("%-3s ftp %-13s file=%.*s size=%lld byte=%lld payload=%d raw=%d codec=%s",
+           rec->kind == DP_TR_FTP_IN ? "IN" : "OUT", ftp_msg_name(b.msg_type),
+           (int)sizeof(b.file_name), b.file_name, (long long)b.file_size,
+           (long long)b.byte_number, b.payload_size, b.raw_size, b.codec == FTP_CODEC_LZ ? "LZ" : "STORED");
+    if (b.file_hash != 0)
+        printf(" hash=%016llx", (unsigned long long)b.file_hash);
+    printf("\n");
+}
+
+static void print_data(const dp_trace_rec *rec) {
+    printf("    data \"");
+    for (int i = 0; i < rec->len; i++) {
+        unsigned char c = rec->body[i];
+        if (isprint(c) && c != '"' && c != '\\')
+            putchar(c);
+        else
+            printf("\\x%02x", c);
+    }
+    printf("\"\n");
+}
+
+int main(int argc, char *argv[]) {
+    dp_trace_file_hdr hdr;
+
+    if (argc != 2) {
+        printf("USAGE: %s tracefile\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        perror("Cannot open trace file");
+        return 1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != DP_TRACE_MAGIC ||
+        hdr.version != DP_TRACE_VERSION || hdr.rec_size != sizeof(dp_trace_rec)) {
+        printf("ERROR:  %s is not a version %d trace\n", argv[1], DP_TRACE_VERSION);
+        fclose(f);
+        return 1;
+    }
+
+    long count = 0, cap = 0;
+    dp_trace_rec *recs = NULL;
+    while (1) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            recs = realloc(recs, cap * sizeof(dp_trace_rec));
+            if (recs == NULL) {
+                perror("Out of memory");
+                return 1;
+            }
+        }
+        if (fread(&recs[count], sizeof(dp_trace_rec), 1, f) != 1)
+            break;
+        count++;
+    }
+    fclose(f);
+
+    qsort(recs, count, sizeof(dp_trace_rec), by_time);
+
+    for (long i = 0; i < count; i++) {
+        const dp_trace_rec *rec = &recs[i];
+
+        printf("%12.6f [%u] ", (rec->ts_ns - recs[0].ts_ns) / 1e9, rec->tid);
+        switch (rec->kind) {
+            case DP_TR_PDU_IN:
+            case DP_TR_PDU_OUT:
+                print_dp(rec);
+                break;
+            case DP_TR_FTP_IN:
+            case DP_TR_FTP_OUT:
+                print_ftp(rec);
+                break;
+            case DP_TR_DATA:
+                print_data(rec);
+                break;
+            default:
+                printf("??? kind %d\n", rec->kind);
+                break;
+        }
+    }
+    free(recs);
+    return 0;
+}
@@ -1,4 +1,8 @@
+#include <stdlib.h>
 #include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include "utilities.h"
 
 long get_file_size(const char *filename) {
@@ -8,4 +12,48 @@ long get_file_size(const char *filename) {
         return st.st_size;
 
     return -1; 
-}
\ No newline at end of file
+}
+/*
+ *  Creates every missing directory leading up to the last component of
+ *  path, like "mkdir -p $(dirname path)".
+ */
+int make_parent_dirs(const char *path) {
+    char tmp[4096];
+
+    if (strlen(path) >= sizeof(tmp))
+        return -1;
+    strcpy(tmp, path);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *p = '/';
+    }
+    return 0;
+}
+
+/*
+ *  Opens a new file next to path, named path.XXXXXX (the name goes in tmp),
+ *  for writing what will replace path.  Once it is complete, rename() puts
+ *  it in place in one step, and readers that still have the old file open
+ *  or mapped keep the old inode.
+ */
+FILE *open_temp_beside(const char *path, char *tmp, int tmp_sz) {
+    if (snprintf(tmp, tmp_sz, "%s.XXXXXX", path) >= tmp_sz)
+        return NULL;
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return NULL;
+
+    //mkstemp() makes the file private, the one it replaces was not
+    fchmod(fd, 0644);
+    FILE *f = fdopen(fd, "wb+");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp);
+    }
+    return f;
+}
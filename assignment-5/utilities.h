@@ -2,6 +2,10 @@
 #ifndef __UTILITIES_H__
 #define __UTILITIES_H__
 
+#include <stdio.h>
+
 long get_file_size(const char *filename);
+int make_parent_dirs(const char *path);
+FILE *open_temp_beside(const char *path, char *tmp, int tmp_sz);
 
 #endif
\ No newline at end of file